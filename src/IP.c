@@ -70,3 +70,38 @@ void hostname_to_ip(const char *hostname, char *ipstr, size_t ipstr_len) {
 
     strncpy(ipstr, str, ipstr_len);
 }
+
+/**
+ * @brief Split a comma-separated list of host:port
+ *
+ * @param list List
+ * @param what What the hosts are, for errors (e.g. "Parent")
+ * @param add Called with each host and port, returns 0 to go on or -1 to
+ * fail (after printing why)
+ * @param arg Passed to add
+ * @return int 0 on success, -1 on failure
+ */
+int parse_host_list(const char *list, const char *what,
+                    int (*add)(const char *host, int port, void *arg),
+                    void *arg) {
+    char *copy = strdup(list);
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    char *saveptr;
+    int   rv = 0;
+    for (char *addr = strtok_r(copy, ",", &saveptr); addr != NULL && rv == 0;
+         addr       = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strrchr(addr, ':');
+        if (colon == NULL || atoi(colon + 1) < 1 || atoi(colon + 1) > 65535) {
+            fprintf(stderr, "Error: %s %s has no port\n", what, addr);
+            rv = -1;
+            break;
+        }
+        *colon = '\0';
+        rv     = add(addr, atoi(colon + 1), arg);
+    }
+    free(copy);
+    return rv;
+}
@@ -25,4 +25,19 @@
  */
 void hostname_to_ip(const char *host, char *ipstr, size_t ipstr_len);
 
+/**
+ * @brief Split a comma-separated list of host:port (the -U parents and -s
+ * siblings)
+ *
+ * @param list List
+ * @param what What the hosts are, for errors (e.g. "Parent")
+ * @param add Called with each host and port, returns 0 to go on or -1 to
+ * fail (after printing why)
+ * @param arg Passed to add
+ * @return int 0 on success, -1 on failure
+ */
+int parse_host_list(const char *list, const char *what,
+                    int (*add)(const char *host, int port, void *arg),
+                    void *arg);
+
 #endif
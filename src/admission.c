@@ -0,0 +1,154 @@
+/**
+ * @file admission.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of admission.h
+ * @details The queue delay is measured as connections leave the queue. At
+ * the end of every ADMISSION_INTERVAL_MS window the shortest delay seen in it
+ * decides whether the next window is overloaded. A queue that runs empty has
+ * no standing delay, so the window's minimum drops to zero.
+ *
+ * @version 0.1
+ * @date 2023-05-10
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "admission.h"
+
+#include <stdlib.h>
+
+// Private functions
+void admission_roll(admission_t *admission, uint64_t now_ms);
+
+/**
+ * @brief Create an empty admission queue
+ *
+ * @return admission_t* Queue, NULL on failure
+ */
+admission_t *admission_create() {
+    admission_t *admission = calloc(1, sizeof(admission_t));
+    if (admission == NULL) {
+        return NULL;
+    }
+    admission->min_delay = UINT64_MAX;
+    return admission;
+}
+
+/**
+ * @brief Queue a connection
+ *
+ * @param admission Queue
+ * @param fd Client socket
+ * @param now_ms Current time (timer_now_ms())
+ * @return int 0 on success, -1 if the queue is full
+ */
+int admission_push(admission_t *admission, int fd, uint64_t now_ms) {
+    if (admission->len == ADMISSION_QUEUE_SIZE) {
+        return -1;
+    }
+    if (admission->len == 0) {
+        admission->min_delay = 0;
+    }
+    size_t tail = (admission->head + admission->len) % ADMISSION_QUEUE_SIZE;
+    admission->entries[tail].fd        = fd;
+    admission->entries[tail].queued_ms = now_ms;
+    admission->len++;
+    return 0;
+}
+
+/**
+ * @brief Look at the connection that has waited longest
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ * @param fd Client socket (output)
+ * @return int 1 if late, 0 if not, -1 if the queue is empty
+ */
+int admission_head(admission_t *admission, uint64_t now_ms, int *fd) {
+    if (admission->len == 0) {
+        return -1;
+    }
+    admission_roll(admission, now_ms);
+    admission_entry_t *entry = &admission->entries[admission->head];
+    uint64_t timeout =
+        admission->overloaded ? ADMISSION_TARGET_MS : ADMISSION_INTERVAL_MS;
+    *fd = entry->fd;
+    return now_ms - entry->queued_ms > timeout;
+}
+
+/**
+ * @brief Get how long until the connection at the head turns late
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ * @return int Milliseconds (0 if it already is late), -1 if empty
+ */
+int admission_wait_ms(admission_t *admission, uint64_t now_ms) {
+    if (admission->len == 0) {
+        return -1;
+    }
+    admission_roll(admission, now_ms);
+    uint64_t timeout =
+        admission->overloaded ? ADMISSION_TARGET_MS : ADMISSION_INTERVAL_MS;
+    uint64_t late_ms = admission->entries[admission->head].queued_ms + timeout;
+    // The window may end first and turn the target on
+    if (admission->interval_end < late_ms) {
+        late_ms = admission->interval_end;
+    }
+    return late_ms > now_ms ? late_ms - now_ms + 1 : 0;
+}
+
+/**
+ * @brief Remove the connection returned by admission_head()
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ */
+void admission_pop(admission_t *admission, uint64_t now_ms) {
+    if (admission->len == 0) {
+        return;
+    }
+    uint64_t delay = now_ms - admission->entries[admission->head].queued_ms;
+    if (delay < admission->min_delay) {
+        admission->min_delay = delay;
+    }
+    admission->head = (admission->head + 1) % ADMISSION_QUEUE_SIZE;
+    admission->len--;
+}
+
+/**
+ * @brief Get the number of waiting connections
+ *
+ * @param admission Queue
+ * @return size_t Number of connections
+ */
+size_t admission_len(admission_t *admission) { return admission->len; }
+
+/**
+ * @brief Free the queue
+ *
+ * @param admission Queue
+ */
+void admission_free(admission_t *admission) { free(admission); }
+
+// Private function definitions
+
+/**
+ * @brief Start a new window once the current one is over
+ */
+void admission_roll(admission_t *admission, uint64_t now_ms) {
+    if (now_ms < admission->interval_end) {
+        return;
+    }
+    // Nothing left the queue: it is stalled if anything is waiting in it
+    uint64_t min_delay = admission->min_delay;
+    if (min_delay == UINT64_MAX && admission->len > 0) {
+        min_delay = now_ms - admission->entries[admission->head].queued_ms;
+    }
+    admission->overloaded =
+        min_delay != UINT64_MAX && min_delay > ADMISSION_TARGET_MS;
+    admission->min_delay    = UINT64_MAX;
+    admission->interval_end = now_ms + ADMISSION_INTERVAL_MS;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file admission.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Admission queue for accepted connections waiting for a free slot,
+ * with CoDel-style shedding: while the queue drains normally a connection may
+ * wait up to ADMISSION_INTERVAL_MS, but once the shortest wait over a whole
+ * interval stayed above ADMISSION_TARGET_MS (a standing queue, the server is
+ * overloaded) anything waiting longer than the target is late and should be
+ * turned away rather than served slowly.
+ * @version 0.1
+ * @date 2023-05-10
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADMISSION_QUEUE_SIZE  1024 // Connections waiting for a slot
+#define ADMISSION_TARGET_MS   5    // Acceptable standing queue delay
+#define ADMISSION_INTERVAL_MS 100  // Window the delay has to stay above target
+#define ADMISSION_RETRY_AFTER "1"  // Retry-After of shed requests (seconds)
+
+/**
+ * @brief Waiting connection
+ */
+typedef struct admission_entry {
+    int      fd;
+    uint64_t queued_ms; // When it joined the queue
+} admission_entry_t;
+
+/**
+ * @brief Admission queue (FIFO)
+ */
+typedef struct admission {
+    admission_entry_t entries[ADMISSION_QUEUE_SIZE];
+    size_t            head;
+    size_t            len;
+    uint64_t          interval_end; // End of the current window
+    uint64_t          min_delay;    // Shortest wait in the current window
+    int               overloaded;   // The last window had a standing queue
+} admission_t;
+
+/**
+ * @brief Create an empty admission queue
+ *
+ * @return admission_t* Queue, NULL on failure
+ */
+admission_t *admission_create();
+
+/**
+ * @brief Queue a connection
+ *
+ * @param admission Queue
+ * @param fd Client socket
+ * @param now_ms Current time (timer_now_ms())
+ * @return int 0 on success, -1 if the queue is full
+ */
+int admission_push(admission_t *admission, int fd, uint64_t now_ms);
+
+/**
+ * @brief Look at the connection that has waited longest, without removing
+ * it
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ * @param fd Client socket (output)
+ * @return int 1 if it is late and should be shed, 0 if not, -1 if the queue
+ * is empty
+ */
+int admission_head(admission_t *admission, uint64_t now_ms, int *fd);
+
+/**
+ * @brief Get how long until the connection at the head turns late, to bound
+ * the wait of the accept loop
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ * @return int Milliseconds (0 if it already is late), -1 if the queue is
+ * empty
+ */
+int admission_wait_ms(admission_t *admission, uint64_t now_ms);
+
+/**
+ * @brief Remove the connection returned by admission_head(), once it has
+ * been served or shed
+ *
+ * @param admission Queue
+ * @param now_ms Current time (timer_now_ms())
+ */
+void admission_pop(admission_t *admission, uint64_t now_ms);
+
+/**
+ * @brief Get the number of waiting connections
+ *
+ * @param admission Queue
+ * @return size_t Number of connections
+ */
+size_t admission_len(admission_t *admission);
+
+/**
+ * @brief Free the queue (the connections in it are not closed)
+ *
+ * @param admission Queue
+ */
+void admission_free(admission_t *admission);
+
+#endif
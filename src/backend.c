@@ -0,0 +1,344 @@
+/**
+ * @file backend.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of backend.h
+ * @details The latency average jumps up to any sample above it and decays
+ * toward lower samples by 1/BACKEND_EWMA_WEIGHT per sample, so a backend
+ * that slows down is avoided at once and trusted again gradually. A backend
+ * costs (latency + 1 ms) * (outstanding + 1). The scan starts at a rotating
+ * index so backends with equal costs share the load.
+ *
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // pipe2()
+
+#include "backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "shm.h"
+
+/**
+ * @brief Backends serving one Host
+ */
+typedef struct backend_group {
+    char host[BACKEND_HOST_MAX];
+    int  first; // Index of the first backend
+    int  count;
+} backend_group_t;
+
+/**
+ * @brief Shared state of every group and backend
+ */
+typedef struct backend_table {
+    backend_group_t      groups[BACKEND_GROUPS_MAX];
+    int                  num_groups;
+    backend_t            backends[BACKEND_MAX];
+    int                  num_backends;
+    _Atomic unsigned int next; // Start of the next scan
+} backend_table_t;
+
+static backend_table_t *table;
+
+// Private functions
+backend_group_t *backend_group(const char *host);
+int              backend_check(backend_t *backend);
+void             backend_set_health(backend_t *backend, int healthy);
+void             backend_restore(backend_table_t *previous);
+
+/**
+ * @brief Load the backend groups into shared memory. Call before forking.
+ *
+ * @param path Backends file
+ * @return int 0 on success, -1 on failure
+ */
+int backend_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    // The groups may have changed since the previous generation, whose table
+    // is only copied from
+    backend_table_t *previous =
+        shm_previous("backends", sizeof(backend_table_t));
+    table = shm_map("backends", sizeof(backend_table_t));
+    if (table == NULL) {
+        if (previous != NULL) {
+            munmap(previous, sizeof(backend_table_t));
+        }
+        fclose(f);
+        return -1;
+    }
+
+    char line[4096];
+    int  rv = 0;
+    while (rv == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char *saveptr;
+        char *host = strtok_r(line, " \t\r\n", &saveptr);
+        if (host == NULL || host[0] == '#') {
+            continue;
+        }
+        if (table->num_groups == BACKEND_GROUPS_MAX ||
+            strlen(host) >= BACKEND_HOST_MAX) {
+            fprintf(stderr, "Error: Too many backend groups\n");
+            rv = -1;
+            break;
+        }
+        backend_group_t *group = &table->groups[table->num_groups++];
+        strcpy(group->host, host);
+        group->first = table->num_backends;
+        for (char *addr = strtok_r(NULL, " \t\r\n", &saveptr); addr != NULL;
+             addr       = strtok_r(NULL, " \t\r\n", &saveptr)) {
+            char *colon = strrchr(addr, ':');
+            if (table->num_backends == BACKEND_MAX ||
+                strlen(addr) >= BACKEND_HOST_MAX) {
+                fprintf(stderr, "Error: Too many backends\n");
+                rv = -1;
+                break;
+            }
+            backend_t *backend = &table->backends[table->num_backends++];
+            backend->port      = 80;
+            if (colon != NULL) {
+                backend->port = atoi(colon + 1);
+                *colon        = '\0';
+            }
+            strcpy(backend->host, addr);
+            backend->healthy = 1;
+            group->count++;
+        }
+        if (rv == 0 && group->count == 0) {
+            fprintf(stderr, "Error: No backends for %s\n", group->host);
+            rv = -1;
+        }
+    }
+    fclose(f);
+    if (previous != NULL) {
+        if (rv == 0) {
+            backend_restore(previous);
+        }
+        munmap(previous, sizeof(backend_table_t));
+    }
+    if (rv != 0) {
+        munmap(table, sizeof(backend_table_t));
+        table = NULL;
+        return -1;
+    }
+    printf("Loaded %d backends in %d groups\n", table->num_backends,
+           table->num_groups);
+    return 0;
+}
+
+/**
+ * @brief Check if a Host is served by a group
+ *
+ * @param host Host of the request (without port)
+ * @return int 1 if it is, 0 otherwise
+ */
+int backend_has_group(const char *host) { return backend_group(host) != NULL; }
+
+/**
+ * @brief Pick the backend for a request and count it as outstanding
+ *
+ * @param host Host of the request (without port)
+ * @return backend_t* Backend, NULL if the group has no healthy backend
+ */
+backend_t *backend_select(const char *host) {
+    backend_group_t *group = backend_group(host);
+    if (group == NULL) {
+        return NULL;
+    }
+    backend_t *best      = NULL;
+    long       best_cost = 0;
+    unsigned   start     = atomic_fetch_add(&table->next, 1);
+    for (int i = 0; i < group->count; i++) {
+        backend_t *backend =
+            &table->backends[group->first + (start + i) % group->count];
+        if (!atomic_load(&backend->healthy)) {
+            continue;
+        }
+        long cost = (long)(atomic_load(&backend->latency) + 16) *
+                    (atomic_load(&backend->outstanding) + 1);
+        if (best == NULL || cost < best_cost) {
+            best      = backend;
+            best_cost = cost;
+        }
+    }
+    if (best != NULL) {
+        atomic_fetch_add(&best->outstanding, 1);
+    }
+    return best;
+}
+
+/**
+ * @brief Record the outcome of a request sent to a backend
+ *
+ * @param backend Backend from backend_select()
+ * @param latency_ms Duration of the request
+ * @param ok Whether the backend answered (below 500)
+ */
+void backend_release(backend_t *backend, int latency_ms, int ok) {
+    atomic_fetch_sub(&backend->outstanding, 1);
+    int sample  = latency_ms * 16;
+    int average = atomic_load(&backend->latency);
+    if (sample > average) {
+        atomic_store(&backend->latency, sample);
+    } else {
+        atomic_store(&backend->latency,
+                     average - (average - sample) / BACKEND_EWMA_WEIGHT);
+    }
+    if (ok) {
+        atomic_store(&backend->failures, 0);
+    } else if (atomic_fetch_add(&backend->failures, 1) + 1 >=
+               BACKEND_FAILURES_MAX) {
+        backend_set_health(backend, 0);
+    }
+}
+
+/**
+ * @brief Fork the process that checks the backends
+ *
+ * @param checker_fd Descriptor keeping the checker running (output)
+ * @return pid_t Checker process id, -1 on failure
+ */
+pid_t backend_checker_start(int *checker_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    // The child exits through exit(), keep it from flushing our output again
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        // Like the tunnel relay, stop only once the proxy is gone
+        signal(SIGINT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+        connection_set_connect_timeout(BACKEND_CHECK_TIMEOUT_MS);
+        struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+        for (;;) {
+            int rv = poll(&pfd, 1, BACKEND_CHECK_INTERVAL_MS);
+            if (rv > 0 || (rv < 0 && errno != EINTR)) {
+                break; // Every writer closed the pipe
+            }
+            for (int i = 0; i < table->num_backends; i++) {
+                backend_t *backend = &table->backends[i];
+                backend_set_health(backend, backend_check(backend) == 0);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+    close(fds[0]);
+    *checker_fd = fds[1];
+    return pid;
+}
+
+// Private function definitions
+
+/**
+ * @brief Find the group serving a Host, falling back to the default group
+ *
+ * @return backend_group_t* Group, NULL if there is none
+ */
+backend_group_t *backend_group(const char *host) {
+    if (table == NULL || host == NULL) {
+        return NULL;
+    }
+    backend_group_t *fallback = NULL;
+    for (int i = 0; i < table->num_groups; i++) {
+        if (strcasecmp(table->groups[i].host, host) == 0) {
+            return &table->groups[i];
+        }
+        if (strcmp(table->groups[i].host, BACKEND_DEFAULT_GROUP) == 0) {
+            fallback = &table->groups[i];
+        }
+    }
+    return fallback;
+}
+
+/**
+ * @brief Request BACKEND_CHECK_PATH from a backend
+ *
+ * @return int 0 if it answered below 500, -1 otherwise
+ */
+int backend_check(backend_t *backend) {
+    connection_t connection = {0};
+    if (connect_to_hostname(backend->host, backend->port, &connection) != 0) {
+        return -1;
+    }
+    connection_set_deadline(&connection, BACKEND_CHECK_TIMEOUT_MS);
+    char request[BACKEND_HOST_MAX + 128];
+    int  len = snprintf(request, sizeof(request),
+                        "GET " BACKEND_CHECK_PATH " HTTP/1.1\r\nHost: %s:%d\r\n"
+                        "Connection: close\r\n\r\n",
+                        backend->host, backend->port);
+    char status_line[256];
+    int  status = 0;
+    if (send_to_connection(&connection, request, len) == len &&
+        recv_line_from_connection(&connection, status_line,
+                                  sizeof(status_line)) > 0) {
+        sscanf(status_line, "HTTP/%*s %d", &status);
+    }
+    close_connection(&connection);
+    return status > 0 && status < 500 ? 0 : -1;
+}
+
+/**
+ * @brief Put a backend in or out of the rotation, logging the change
+ */
+void backend_set_health(backend_t *backend, int healthy) {
+    if (atomic_exchange(&backend->healthy, healthy) == healthy) {
+        return;
+    }
+    if (healthy) {
+        atomic_store(&backend->failures, 0);
+    }
+    fprintf(stderr, "Backend %s:%d is %s\n", backend->host, backend->port,
+            healthy ? "back up" : "down");
+}
+
+/**
+ * @brief Take the health and latency of the backends still listed from the
+ * previous generation's table. Its outstanding requests stay its own.
+ *
+ * @param previous Table of the previous generation
+ */
+void backend_restore(backend_table_t *previous) {
+    for (int i = 0; i < table->num_backends; i++) {
+        backend_t *backend = &table->backends[i];
+        for (int j = 0; j < previous->num_backends; j++) {
+            backend_t *old = &previous->backends[j];
+            if (old->port == backend->port &&
+                strcmp(old->host, backend->host) == 0) {
+                backend->latency  = old->latency;
+                backend->healthy  = old->healthy;
+                backend->failures = old->failures;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * @file backend.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Backend groups for reverse-proxy (accelerator) mode. The Host of a
+ * request picks a group, and the group's backend with the lowest peak-EWMA
+ * latency times outstanding requests serves it. A backend is taken out
+ * after BACKEND_FAILURES_MAX failed requests in a row, or when an active
+ * check from the checker process fails, and comes back once a check
+ * succeeds. The state is in shared memory so every forked child and worker
+ * sees it.
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define BACKEND_MAX               64   // Backends over all groups
+#define BACKEND_GROUPS_MAX        32   // Groups
+#define BACKEND_HOST_MAX          256  // Host name length
+#define BACKEND_DEFAULT_GROUP     "*"  // Group for hosts not listed
+#define BACKEND_FAILURES_MAX      3    // Failed requests in a row to take out
+#define BACKEND_EWMA_WEIGHT       8    // Weight of the average over a sample
+#define BACKEND_CHECK_INTERVAL_MS 2000 // Between active checks
+#define BACKEND_CHECK_TIMEOUT_MS  1000 // For one active check
+#define BACKEND_CHECK_PATH        "/"  // Requested by active checks
+
+/**
+ * @brief Backend server
+ */
+typedef struct backend {
+    char        host[BACKEND_HOST_MAX];
+    int         port;
+    _Atomic int outstanding; // Requests in flight
+    _Atomic int latency;     // Peak-EWMA latency (1/16 ms)
+    _Atomic int healthy;     // In the rotation
+    _Atomic int failures;    // Failed requests in a row
+} backend_t;
+
+/**
+ * @brief Load the backend groups into shared memory. Call before forking.
+ * @details One group per line: the Host it serves (BACKEND_DEFAULT_GROUP for
+ * any other Host), then its backends as host[:port]. Blank lines and lines
+ * starting with '#' are skipped.
+ *
+ * @param path Backends file
+ * @return int 0 on success, -1 on failure
+ */
+int backend_load(const char *path);
+
+/**
+ * @brief Check if a Host is served by a group
+ *
+ * @param host Host of the request (without port)
+ * @return int 1 if it is, 0 otherwise
+ */
+int backend_has_group(const char *host);
+
+/**
+ * @brief Pick the backend for a request and count it as outstanding
+ *
+ * @param host Host of the request (without port)
+ * @return backend_t* Backend, NULL if the group has no healthy backend
+ */
+backend_t *backend_select(const char *host);
+
+/**
+ * @brief Record the outcome of a request sent to a backend
+ *
+ * @param backend Backend from backend_select()
+ * @param latency_ms Duration of the request
+ * @param ok Whether the backend answered (below 500)
+ */
+void backend_release(backend_t *backend, int latency_ms, int ok);
+
+/**
+ * @brief Fork the process that checks the backends every
+ * BACKEND_CHECK_INTERVAL_MS. It exits once every copy of the returned
+ * descriptor is closed.
+ *
+ * @param checker_fd Descriptor keeping the checker running (output)
+ * @return pid_t Checker process id, -1 on failure
+ */
+pid_t backend_checker_start(int *checker_fd);
+
+#endif
@@ -0,0 +1,201 @@
+/**
+ * @file breaker.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of breaker.h
+ * @details Origins live in an open-addressed table (hash_slot()) in a
+ * shared anonymous mapping, keyed by a hash of host and port. A full table
+ * leaves new origins untracked (always allowed). A fetch in flight holds one
+ * of the origin's holder slots, stamped with the pid of its process; when all
+ * are taken, the slot of a process that died without releasing it (e.g. a
+ * killed worker) is taken over, so the limit does not shrink for good. The
+ * state moves CLOSED -> OPEN on failures, OPEN -> HALF_OPEN for the one
+ * caller that wins the swap of opened_ms once BREAKER_OPEN_MS passed, and
+ * HALF_OPEN -> CLOSED or OPEN with the outcome of that probe. The swap also
+ * restarts the clock, so a probe lost with its process is replaced by the
+ * next caller after another BREAKER_OPEN_MS.
+ *
+ * @version 0.1
+ * @date 2023-05-11
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "breaker.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "shm.h"
+
+static breaker_origin_t *origins;
+static int               origin_max_inflight;
+
+// Private functions
+int  breaker_claim(breaker_origin_t *origin);
+void breaker_reset(breaker_origin_t *origin, uint64_t now_ms);
+
+/**
+ * @brief Set up the shared table. Call before forking.
+ *
+ * @param max_inflight Fetches allowed in flight per origin (at most
+ * BREAKER_MAX_INFLIGHT)
+ * @return int 0 on success, -1 on failure
+ */
+int breaker_init(int max_inflight) {
+    if (max_inflight < 1 || max_inflight > BREAKER_MAX_INFLIGHT) {
+        fprintf(stderr, "Error: At most %d fetches per origin\n",
+                BREAKER_MAX_INFLIGHT);
+        return -1;
+    }
+    origins = shm_map("breaker", BREAKER_ORIGINS * sizeof(breaker_origin_t));
+    if (origins == NULL) {
+        return -1;
+    }
+    origin_max_inflight = max_inflight;
+    return 0;
+}
+
+/**
+ * @brief Ask to fetch from an origin
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @param now_ms Current time (timer_now_ms())
+ * @param ticket Ticket to release once the fetch is over (output)
+ * @return int BREAKER_OK, BREAKER_BUSY or BREAKER_OPEN
+ */
+int breaker_acquire(const char *host, int port, uint64_t now_ms,
+                    breaker_ticket_t *ticket) {
+    breaker_origin_t *origin =
+        hash_slot(origins, BREAKER_ORIGINS, sizeof(breaker_origin_t),
+                  hash_origin(host, port));
+    ticket->origin = origin;
+    ticket->probe  = 0;
+    ticket->holder = -1;
+    if (origin == NULL) {
+        return BREAKER_OK;
+    }
+
+    if (atomic_load(&origin->state) != BREAKER_STATE_CLOSED) {
+        // Open, or half-open with the probe still out
+        uint64_t opened_ms = atomic_load(&origin->opened_ms);
+        if (now_ms - opened_ms < BREAKER_OPEN_MS) {
+            return BREAKER_OPEN;
+        }
+        // Only one caller gets to probe
+        if (!atomic_compare_exchange_strong(&origin->opened_ms, &opened_ms,
+                                            now_ms)) {
+            return BREAKER_OPEN;
+        }
+        atomic_store(&origin->state, BREAKER_STATE_HALF_OPEN);
+        ticket->probe = 1;
+        return BREAKER_OK;
+    }
+
+    ticket->holder = breaker_claim(origin);
+    if (ticket->holder == -1) {
+        ticket->origin = NULL;
+        return BREAKER_BUSY;
+    }
+    return BREAKER_OK;
+}
+
+/**
+ * @brief Record the outcome of a fetch
+ *
+ * @param ticket Ticket from breaker_acquire()
+ * @param ok Whether the origin answered (below 500)
+ * @param now_ms Current time (timer_now_ms())
+ * @return int BREAKER_OPENED, BREAKER_CLOSED or 0
+ */
+int breaker_release(breaker_ticket_t *ticket, int ok, uint64_t now_ms) {
+    breaker_origin_t *origin = ticket->origin;
+    if (origin == NULL) {
+        return 0;
+    }
+    ticket->origin = NULL;
+    if (ticket->holder != -1) {
+        atomic_store(&origin->holders[ticket->holder], 0);
+    }
+
+    if (ticket->probe) {
+        if (ok) {
+            breaker_reset(origin, now_ms);
+            atomic_store(&origin->state, BREAKER_STATE_CLOSED);
+            return BREAKER_CLOSED;
+        }
+        atomic_store(&origin->opened_ms, now_ms);
+        atomic_store(&origin->state, BREAKER_STATE_OPEN);
+        return BREAKER_OPENED;
+    }
+
+    if (now_ms - atomic_load(&origin->window_start) >= BREAKER_WINDOW_MS) {
+        breaker_reset(origin, now_ms);
+    }
+    int fetches  = atomic_fetch_add(&origin->fetches, 1) + 1;
+    int failures = atomic_load(&origin->failures);
+    int consecutive;
+    if (ok) {
+        atomic_store(&origin->consecutive, 0);
+        return 0;
+    }
+    failures++;
+    atomic_fetch_add(&origin->failures, 1);
+    consecutive = atomic_fetch_add(&origin->consecutive, 1) + 1;
+
+    if (consecutive < BREAKER_CONSECUTIVE &&
+        (fetches < BREAKER_MIN_FETCHES ||
+         failures * 100 < fetches * BREAKER_FAILURE_PCT)) {
+        return 0;
+    }
+    int closed = BREAKER_STATE_CLOSED;
+    atomic_store(&origin->opened_ms, now_ms);
+    if (!atomic_compare_exchange_strong(&origin->state, &closed,
+                                        BREAKER_STATE_OPEN)) {
+        return 0; // Another fetch opened it already
+    }
+    return BREAKER_OPENED;
+}
+
+// Private function definitions
+
+/**
+ * @brief Claim a holder slot of an origin for this process
+ *
+ * @return int Slot, -1 if every slot is held by a live process
+ */
+int breaker_claim(breaker_origin_t *origin) {
+    pid_t pid = getpid();
+    for (int i = 0; i < origin_max_inflight; i++) {
+        pid_t holder = 0;
+        if (atomic_compare_exchange_strong(&origin->holders[i], &holder,
+                                           pid)) {
+            return i;
+        }
+    }
+    // All taken: take over the slot of a process that died holding it
+    for (int i = 0; i < origin_max_inflight; i++) {
+        pid_t holder = atomic_load(&origin->holders[i]);
+        if (holder != 0 && kill(holder, 0) == -1 && errno == ESRCH &&
+            atomic_compare_exchange_strong(&origin->holders[i], &holder,
+                                           pid)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Start a new failure rate window
+ */
+void breaker_reset(breaker_origin_t *origin, uint64_t now_ms) {
+    atomic_store(&origin->window_start, now_ms);
+    atomic_store(&origin->fetches, 0);
+    atomic_store(&origin->failures, 0);
+    atomic_store(&origin->consecutive, 0);
+}
@@ -0,0 +1,104 @@
+/**
+ * @file breaker.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Per-origin limit on in-flight fetches and a circuit breaker, kept in
+ * shared memory so every forked child and worker sees the same counts. The
+ * circuit to an origin opens when too many of its recent fetches failed or
+ * timed out. While open, fetches are refused at once. After
+ * BREAKER_OPEN_MS a single probe is let through (half-open), and its outcome
+ * closes the circuit or opens it again. A probe that has not come back after
+ * another BREAKER_OPEN_MS is given up on and a new one is let through.
+ * @version 0.1
+ * @date 2023-05-11
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BREAKER_ORIGINS      256   // Origins tracked (hash table slots)
+#define BREAKER_WINDOW_MS    10000 // Window of the failure rate
+#define BREAKER_MIN_FETCHES  10    // Fetches in a window before the rate counts
+#define BREAKER_FAILURE_PCT  50    // Failure rate that opens the circuit
+#define BREAKER_CONSECUTIVE  5     // Failures in a row that open the circuit
+#define BREAKER_OPEN_MS      5000  // Time before a probe is let through
+#define BREAKER_MAX_INFLIGHT 64    // Highest per-origin in-flight limit
+
+// breaker_acquire() results
+#define BREAKER_OK   0 // Fetch allowed
+#define BREAKER_BUSY 1 // Too many fetches in flight to the origin
+#define BREAKER_OPEN 2 // The circuit is open
+
+// breaker_release() results
+#define BREAKER_OPENED 1 // This outcome opened the circuit
+#define BREAKER_CLOSED 2 // This probe closed the circuit
+
+// Circuit states
+#define BREAKER_STATE_CLOSED    0
+#define BREAKER_STATE_OPEN      1
+#define BREAKER_STATE_HALF_OPEN 2
+
+/**
+ * @brief Origin state
+ */
+typedef struct breaker_origin {
+    _Atomic uint64_t key;          // Hash of host:port, 0 for a free slot
+    _Atomic int      state;        // BREAKER_STATE_*
+    _Atomic uint64_t opened_ms;    // When the circuit opened or the probe left
+    _Atomic uint64_t window_start; // Start of the failure rate window
+    _Atomic int      fetches;      // Fetches finished in the window
+    _Atomic int      failures;     // Of which failed
+    _Atomic int      consecutive;  // Failures in a row
+    // Processes with a fetch in flight, 0 for a free slot
+    _Atomic pid_t holders[BREAKER_MAX_INFLIGHT];
+} breaker_origin_t;
+
+/**
+ * @brief Permission to fetch, handed back with breaker_release()
+ */
+typedef struct breaker_ticket {
+    breaker_origin_t *origin; // NULL if the origin is not tracked
+    int               probe;  // The half-open probe
+    int               holder; // Slot in origin->holders, -1 for the probe
+} breaker_ticket_t;
+
+/**
+ * @brief Set up the shared table. Call before forking.
+ *
+ * @param max_inflight Fetches allowed in flight per origin (at most
+ * BREAKER_MAX_INFLIGHT)
+ * @return int 0 on success, -1 on failure
+ */
+int breaker_init(int max_inflight);
+
+/**
+ * @brief Ask to fetch from an origin
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @param now_ms Current time (timer_now_ms())
+ * @param ticket Ticket to release once the fetch is over (output, only with
+ * BREAKER_OK)
+ * @return int BREAKER_OK, BREAKER_BUSY or BREAKER_OPEN
+ */
+int breaker_acquire(const char *host, int port, uint64_t now_ms,
+                    breaker_ticket_t *ticket);
+
+/**
+ * @brief Record the outcome of a fetch
+ *
+ * @param ticket Ticket from breaker_acquire()
+ * @param ok Whether the origin answered (below 500)
+ * @param now_ms Current time (timer_now_ms())
+ * @return int BREAKER_OPENED or BREAKER_CLOSED if the circuit changed state,
+ * 0 otherwise
+ */
+int breaker_release(breaker_ticket_t *ticket, int ok, uint64_t now_ms);
+
+#endif
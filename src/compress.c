@@ -0,0 +1,400 @@
+/**
+ * @file compress.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of compress.h
+ * @details The body is run through deflate() in HTTP_STREAM_BUFFER_SIZE
+ * steps so the output buffer only grows as far as the compressed size. The
+ * result replaces the body of the response, which can then be cached like
+ * any other response. Cache entries can also keep the original headers with
+ * a body compressed at a fast level; such a body is either inflated on read
+ * or sent unchanged to a client that accepts its coding.
+ *
+ * @version 0.1
+ * @date 2023-05-05
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // strcasestr()
+
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+// Private functions
+void   compress_set_headers(response_t *response, const char *name);
+int    compress_is_type(const char *content_type);
+double compress_qvalue(const char *accept, const char *coding);
+
+/**
+ * @brief Pick a content coding from the Accept-Encoding header of a request
+ *
+ * @param request Request
+ * @return int COMPRESS_GZIP, COMPRESS_DEFLATE or COMPRESS_NONE
+ */
+int compress_negotiate(request_t *request) {
+    char *accept = http_message_header_get(request->message, "Accept-Encoding");
+    if (accept == NULL) {
+        return COMPRESS_NONE;
+    }
+    double gzip    = compress_qvalue(accept, "gzip");
+    double deflate = compress_qvalue(accept, "deflate");
+    // gzip wins ties, it is the better supported of the two
+    if (gzip > 0 && gzip >= deflate) {
+        return COMPRESS_GZIP;
+    }
+    if (deflate > 0) {
+        return COMPRESS_DEFLATE;
+    }
+    return COMPRESS_NONE;
+}
+
+/**
+ * @brief Get the Content-Encoding token of a coding
+ *
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return const char* Token, NULL for COMPRESS_NONE
+ */
+const char *compress_encoding_name(int encoding) {
+    switch (encoding) {
+    case COMPRESS_GZIP:
+        return "gzip";
+    case COMPRESS_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Get the coding named by a Content-Encoding token
+ *
+ * @param name Token
+ * @return int COMPRESS_GZIP, COMPRESS_DEFLATE, COMPRESS_NONE for "identity",
+ * -1 if unknown
+ */
+int compress_encoding_parse(const char *name) {
+    if (strcasecmp(name, "gzip") == 0) {
+        return COMPRESS_GZIP;
+    }
+    if (strcasecmp(name, "deflate") == 0) {
+        return COMPRESS_DEFLATE;
+    }
+    if (strcasecmp(name, "identity") == 0) {
+        return COMPRESS_NONE;
+    }
+    return -1;
+}
+
+/**
+ * @brief Check if a response may be compressed
+ *
+ * @param response Response
+ * @return int 1 if the response may be compressed, 0 otherwise
+ */
+int compress_is_eligible(response_t *response) {
+    http_message_t *message = response->message;
+    if (response->status_code != 200 ||
+        http_message_get_body_len(message) < COMPRESS_MIN_SIZE) {
+        return 0;
+    }
+    char *encoding = http_message_header_get(message, "Content-Encoding");
+    if (encoding != NULL && strcasecmp(encoding, "identity") != 0) {
+        return 0;
+    }
+    char *cache_control = http_message_header_get(message, "Cache-Control");
+    if (cache_control != NULL && strcasestr(cache_control, "no-transform")) {
+        return 0;
+    }
+    char *content_type = http_message_header_get(message, "Content-Type");
+    return content_type != NULL && compress_is_type(content_type);
+}
+
+/**
+ * @brief Compress the body of a response in place
+ *
+ * @param response Response (see compress_is_eligible())
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return int 0 on success, -1 on failure (the response is unchanged)
+ */
+int compress_response(response_t *response, int encoding) {
+    const char *name = compress_encoding_name(encoding);
+    if (name == NULL) {
+        return -1;
+    }
+    http_message_t *message = response->message;
+    z_stream        stream;
+    memset(&stream, 0, sizeof(stream));
+    // Window bits + 16 selects the gzip wrapper, plain is the zlib wrapper
+    // that HTTP calls "deflate"
+    int window_bits = encoding == COMPRESS_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error: deflateInit2 failed\n");
+        return -1;
+    }
+    stream.next_in  = (Bytef *)http_message_get_body(message);
+    stream.avail_in = http_message_get_body_len(message);
+
+    size_t size = 0, len = 0;
+    char  *out  = NULL;
+    int    rv;
+    do {
+        if (size - len < HTTP_STREAM_BUFFER_SIZE) {
+            size += HTTP_STREAM_BUFFER_SIZE;
+            char *grown = realloc(out, size);
+            if (grown == NULL) {
+                perror("realloc");
+                rv = Z_MEM_ERROR;
+                break;
+            }
+            out = grown;
+        }
+        stream.next_out  = (Bytef *)out + len;
+        stream.avail_out = size - len;
+        rv               = deflate(&stream, Z_FINISH);
+        len              = size - stream.avail_out;
+    } while (rv == Z_OK || rv == Z_BUF_ERROR);
+    deflateEnd(&stream);
+    if (rv != Z_STREAM_END) {
+        fprintf(stderr, "Error: deflate failed (%d)\n", rv);
+        free(out);
+        return -1;
+    }
+
+    fprintf(stderr, "Compressed %zu -> %zu bytes (%s)\n",
+            http_message_get_body_len(message), len, name);
+    compress_set_headers(response, name);
+    http_message_reframe(message, out, len);
+    return 0;
+}
+
+/**
+ * @brief Write the body of a response to a file, compressed with a fast
+ * compression level
+ *
+ * @param response Response
+ * @param f File
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return int 0 on success, -1 on failure
+ */
+int compress_write_body(response_t *response, FILE *f, int encoding) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int window_bits = encoding == COMPRESS_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, COMPRESS_LEVEL_STORAGE, Z_DEFLATED, window_bits,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error: deflateInit2 failed\n");
+        return -1;
+    }
+    stream.next_in  = (Bytef *)http_message_get_body(response->message);
+    stream.avail_in = http_message_get_body_len(response->message);
+
+    char out[HTTP_STREAM_BUFFER_SIZE];
+    int  rv;
+    do {
+        stream.next_out  = (Bytef *)out;
+        stream.avail_out = sizeof(out);
+        rv               = deflate(&stream, Z_FINISH);
+        size_t n         = sizeof(out) - stream.avail_out;
+        if (n > 0 && fwrite(out, 1, n, f) != n) {
+            perror("Failed to write file");
+            rv = Z_ERRNO;
+            break;
+        }
+    } while (rv == Z_OK || rv == Z_BUF_ERROR);
+    deflateEnd(&stream);
+    return rv == Z_STREAM_END ? 0 : -1;
+}
+
+/**
+ * @brief Mark a response whose body is already encoded (read from a
+ * compressed cache entry) so it can be sent as is
+ *
+ * @param response Response with the headers of the uncompressed response
+ * @param encoding Coding of the body
+ * @return int 0 on success, -1 on failure
+ */
+int compress_mark_encoded(response_t *response, int encoding) {
+    const char *name = compress_encoding_name(encoding);
+    if (name == NULL) {
+        return -1;
+    }
+    http_message_t *message = response->message;
+    size_t          len     = http_message_get_body_len(message);
+    char           *body    = malloc(len > 0 ? len : 1);
+    if (body == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(body, http_message_get_body(message), len);
+    compress_set_headers(response, name);
+    http_message_reframe(message, body, len);
+    return 0;
+}
+
+/**
+ * @brief Decompress the body of a response read from a compressed cache
+ * entry
+ *
+ * @param response Response with the headers of the uncompressed response
+ * @param encoding Coding of the body
+ * @return int 0 on success, -1 on failure
+ */
+int compress_decode_body(response_t *response, int encoding) {
+    http_message_t *message = response->message;
+    z_stream        stream;
+    memset(&stream, 0, sizeof(stream));
+    int window_bits = encoding == COMPRESS_GZIP ? 15 + 16 : 15;
+    if (compress_encoding_name(encoding) == NULL ||
+        inflateInit2(&stream, window_bits) != Z_OK) {
+        fprintf(stderr, "Error: inflateInit2 failed\n");
+        return -1;
+    }
+    stream.next_in  = (Bytef *)http_message_get_body(message);
+    stream.avail_in = http_message_get_body_len(message);
+
+    // The stored headers still carry the uncompressed length
+    char  *length = http_message_header_get(message, "Content-Length");
+    size_t size   = length != NULL ? strtoull(length, NULL, 10) : 0;
+    size_t len    = 0;
+    char  *out    = NULL;
+    int    rv;
+    do {
+        if (size - len < HTTP_STREAM_BUFFER_SIZE) {
+            size += HTTP_STREAM_BUFFER_SIZE;
+        }
+        char *grown = realloc(out, size);
+        if (grown == NULL) {
+            perror("realloc");
+            rv = Z_MEM_ERROR;
+            break;
+        }
+        out              = grown;
+        stream.next_out  = (Bytef *)out + len;
+        stream.avail_out = size - len;
+        rv               = inflate(&stream, Z_NO_FLUSH);
+        len              = size - stream.avail_out;
+    } while (rv == Z_OK);
+    inflateEnd(&stream);
+    if (rv != Z_STREAM_END) {
+        fprintf(stderr, "Error: inflate failed (%d)\n", rv);
+        free(out);
+        return -1;
+    }
+    http_message_reframe(message, out, len);
+    return 0;
+}
+
+/**
+ * @brief Add Accept-Encoding to the Vary header of a response
+ *
+ * @param response Response
+ */
+void compress_add_vary(response_t *response) {
+    char *vary = http_message_header_get(response->message, "Vary");
+    if (vary == NULL) {
+        http_message_header_set(response->message, "Vary", "Accept-Encoding");
+    } else if (strcmp(vary, "*") != 0 &&
+               strcasestr(vary, "Accept-Encoding") == NULL) {
+        char value[1024];
+        snprintf(value, sizeof(value), "%s, Accept-Encoding", vary);
+        http_message_header_set(response->message, "Vary", value);
+    }
+}
+
+// Private function definitions
+
+/**
+ * @brief Update the headers of a response whose body is now encoded
+ */
+void compress_set_headers(response_t *response, const char *name) {
+    http_message_t *message = response->message;
+    http_message_header_set(message, "Content-Encoding", (char *)name);
+    // The encoded bytes differ from the original, so only a weak validator
+    // still holds
+    char *etag = http_message_header_get(message, "ETag");
+    if (etag != NULL && strncmp(etag, "W/", 2) != 0) {
+        char weak[1024];
+        snprintf(weak, sizeof(weak), "W/%s", etag);
+        http_message_header_set(message, "ETag", weak);
+    }
+    compress_add_vary(response);
+}
+
+/**
+ * @brief Check if a content type is worth compressing (text and text-like
+ * application types)
+ */
+int compress_is_type(const char *content_type) {
+    static const char *types[] = {
+        "text/",         "application/json", "application/javascript",
+        "application/xml", "application/xhtml+xml", "image/svg+xml",
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strncasecmp(content_type, types[i], strlen(types[i])) == 0) {
+            return 1;
+        }
+    }
+    // Structured syntax suffixes (application/ld+json, application/rss+xml)
+    const char *end = strchr(content_type, ';');
+    size_t      len = end != NULL ? (size_t)(end - content_type)
+                                  : strlen(content_type);
+    return (len > 5 && strncasecmp(content_type + len - 5, "+json", 5) == 0) ||
+           (len > 4 && strncasecmp(content_type + len - 4, "+xml", 4) == 0);
+}
+
+/**
+ * @brief Get the q-value an Accept-Encoding header gives a coding. A "*"
+ * entry applies to codings that are not listed.
+ *
+ * @return double q-value, 0 if the coding is not acceptable
+ */
+double compress_qvalue(const char *accept, const char *coding) {
+    double      any = 0, q = -1;
+    const char *p   = accept;
+    while (*p != '\0') {
+        // Token
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        const char *token = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        size_t len = p - token;
+        // Parameters, only q matters
+        double value = 1;
+        while (*p != '\0' && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ') {
+                    p++;
+                }
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    value = strtod(p + 2, NULL);
+                }
+                continue;
+            }
+            p++;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (len == 1 && *token == '*') {
+            any = value;
+        } else if ((len == strlen(coding) &&
+                    strncasecmp(token, coding, len) == 0) ||
+                   (strcmp(coding, "gzip") == 0 && len == 6 &&
+                    strncasecmp(token, "x-gzip", 6) == 0)) {
+            q = value;
+        }
+    }
+    return q >= 0 ? q : any;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file compress.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief On-the-fly gzip/deflate compression of responses (zlib). Only
+ * compressible content the origin sent uncompressed is encoded, and only for
+ * clients that accept it.
+ * @version 0.1
+ * @date 2023-05-05
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "request.h"
+#include "response.h"
+
+#define COMPRESS_NONE          0
+#define COMPRESS_GZIP          1
+#define COMPRESS_DEFLATE       2
+#define COMPRESS_MIN_SIZE      1024 // Smaller bodies are not worth encoding
+#define COMPRESS_LEVEL         6    // zlib compression level
+#define COMPRESS_LEVEL_STORAGE 1    // Level for cache storage (speed first)
+
+/**
+ * @brief Pick a content coding from the Accept-Encoding header of a request
+ *
+ * @param request Request
+ * @return int COMPRESS_GZIP, COMPRESS_DEFLATE or COMPRESS_NONE
+ */
+int compress_negotiate(request_t *request);
+
+/**
+ * @brief Get the Content-Encoding token of a coding
+ *
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return const char* Token, NULL for COMPRESS_NONE
+ */
+const char *compress_encoding_name(int encoding);
+
+/**
+ * @brief Get the coding named by a Content-Encoding token
+ *
+ * @param name Token
+ * @return int COMPRESS_GZIP, COMPRESS_DEFLATE, COMPRESS_NONE for "identity",
+ * -1 if unknown
+ */
+int compress_encoding_parse(const char *name);
+
+/**
+ * @brief Check if a response may be compressed: a 200 with a compressible
+ * content type, a body of at least COMPRESS_MIN_SIZE, no Content-Encoding and
+ * no Cache-Control: no-transform
+ *
+ * @param response Response
+ * @return int 1 if the response may be compressed, 0 otherwise
+ */
+int compress_is_eligible(response_t *response);
+
+/**
+ * @brief Compress the body of a response in place. Content-Encoding,
+ * Content-Length and Vary are updated and a strong ETag is made weak.
+ *
+ * @param response Response (see compress_is_eligible())
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return int 0 on success, -1 on failure (the response is unchanged)
+ */
+int compress_response(response_t *response, int encoding);
+
+/**
+ * @brief Write the body of a response to a file, compressed with
+ * COMPRESS_LEVEL_STORAGE. The response is unchanged.
+ *
+ * @param response Response
+ * @param f File
+ * @param encoding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @return int 0 on success, -1 on failure
+ */
+int compress_write_body(response_t *response, FILE *f, int encoding);
+
+/**
+ * @brief Mark a response whose body is already encoded (read from a
+ * compressed cache entry) so it can be sent as is. Headers are updated as
+ * in compress_response().
+ *
+ * @param response Response with the headers of the uncompressed response
+ * @param encoding Coding of the body
+ * @return int 0 on success, -1 on failure
+ */
+int compress_mark_encoded(response_t *response, int encoding);
+
+/**
+ * @brief Decompress the body of a response read from a compressed cache
+ * entry
+ *
+ * @param response Response with the headers of the uncompressed response
+ * @param encoding Coding of the body
+ * @return int 0 on success, -1 on failure
+ */
+int compress_decode_body(response_t *response, int encoding);
+
+/**
+ * @brief Add Accept-Encoding to the Vary header of a response
+ *
+ * @param response Response
+ */
+void compress_add_vary(response_t *response);
+
+#endif
@@ -8,17 +8,60 @@
 #include "connection.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+// Private structs
+
+/**
+ * @brief Resolved host
+ */
+typedef struct dns_entry {
+    char             host[256]; // Host name
+    int              port;      // Port
+    struct addrinfo *res;       // Addresses (owned by the cache)
+    time_t           expires;   // When the addresses are looked up again
+} dns_entry_t;
+
+// Private variables
+static int                    connect_timeout_ms = CONNECTION_CONNECT_TIMEOUT_MS;
+static __thread timer_wheel_t deadlines; // Phase deadlines of this thread
+static __thread int           deadlines_initialized = 0;
+static __thread dns_entry_t   dns_cache[CONNECTION_DNS_CACHE_SIZE];
+
+// Private functions
+void connection_deadline_expired(timer_node_t *timer, void *arg);
+void connection_set_timeouts(connection_t *connection, int timeout_ms);
+int  connection_ssl_retry(connection_t *connection, int rv);
+int  connection_resolve(char *host, int port, struct addrinfo **res);
+
+/**
+ * @brief Set the deadline for connect_to_hostname()
+ *
+ * @param timeout_ms Deadline in milliseconds for the whole connect attempt
+ */
+void connection_set_connect_timeout(int timeout_ms) {
+    connect_timeout_ms = timeout_ms;
+}
+
 /**
  * @brief Initialize a connection
+ * @details Every address of the host is tried, IPv6 and IPv4 interleaved
+ * (RFC 8305). The next address is started when the previous one fails or
+ * has not connected within CONNECTION_ATTEMPT_DELAY_MS, and the first socket
+ * to connect wins. The whole attempt is bounded by the connect timeout, and
+ * the remaining time stays armed as the deadline of the connection.
  *
  * @param host Client host information
  * @param port Client port
@@ -26,54 +69,135 @@
  * @return int 0 on success, -1 on error
  */
 int connect_to_hostname(char *host, int port, connection_t *connection) {
-    int             status;
-    char            port_str[6] = {0};
-    struct addrinfo hints, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
 
     // Get the address of the host
-
-    sprintf(port_str, "%d", port == -1 ? 80 : port);
-    status = getaddrinfo(host, port_str, &hints, &res);
-    if (status != 0) {
-        fprintf(stderr, "Error: Failed to get address info for %s: %s\n", host,
-                gai_strerror(status));
-        free(connection);
+    if (connection_resolve(host, port == -1 ? 80 : port, &res) != 0) {
         return -1;
     }
 
-    // Copy the ip string into the connection struct
-    struct sockaddr_in *ipv4 = (struct sockaddr_in *)res->ai_addr;
-    void               *addr = &(ipv4->sin_addr);
-    inet_ntop(res->ai_family, addr, connection->ip, INET_ADDRSTRLEN);
-
-    // Create a socket for the client
-    connection->fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (connection->fd < 0) {
-        fprintf(stderr, "Error: Failed to create socket for %s\n", host);
-        free(connection);
-        return -1;
+    // Interleave the address families, starting with the first one returned
+    struct addrinfo *addrs[CONNECTION_MAX_ADDRS];
+    int              naddrs = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        int first = -1;
+        for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+            first = first == -1 ? ai->ai_family : first;
+            if ((ai->ai_family == first) == (pass == 0) &&
+                naddrs < CONNECTION_MAX_ADDRS) {
+                addrs[naddrs++] = ai;
+            }
+        }
+    }
+    struct addrinfo *ordered[CONNECTION_MAX_ADDRS];
+    int              nfirst = 0;
+    while (nfirst < naddrs && addrs[nfirst]->ai_family == res->ai_family) {
+        nfirst++;
+    }
+    for (int i = 0, a = 0, b = nfirst; i < naddrs; i++) {
+        if ((i % 2 == 0 && a < nfirst) || b == naddrs) {
+            ordered[i] = addrs[a++];
+        } else {
+            ordered[i] = addrs[b++];
+        }
     }
-    // fprintf(stderr, "Created socket %d\n", connection->fd);
 
-    // Connect to the server
-    status = connect(connection->fd, (struct sockaddr *)res->ai_addr,
-                     res->ai_addrlen);
-    if (status != 0) {
-        perror("Error: Failed to connect to server");
-        fprintf(stderr, "Error: Failed to connect to %s\n", connection->ip);
-        freeaddrinfo(res);
-        close(connection->fd);
-        free(connection);
+    // Race the addresses
+    struct pollfd pfds[CONNECTION_MAX_ADDRS];
+    int           owner[CONNECTION_MAX_ADDRS]; // Address of each attempt
+    int           nattempts = 0, next = 0, winner = -1;
+    long          deadline  = timer_now_ms() + connect_timeout_ms;
+    long          next_at   = 0; // When the next address may be started
+    while (winner == -1) {
+        long now = timer_now_ms();
+        if (now >= deadline) {
+            fprintf(stderr, "Error: Timed out connecting to %s\n", host);
+            break;
+        }
+        // Start the next address when it is due
+        while (next < naddrs && now >= next_at) {
+            struct addrinfo *ai = ordered[next++];
+            int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+                errno == EINPROGRESS) {
+                pfds[nattempts].fd     = fd;
+                pfds[nattempts].events = POLLOUT;
+                owner[nattempts++]     = next - 1;
+                next_at                = now + CONNECTION_ATTEMPT_DELAY_MS;
+                break;
+            }
+            close(fd);
+        }
+        // Count the attempts still in flight
+        int active = 0;
+        for (int i = 0; i < nattempts; i++) {
+            active += pfds[i].fd >= 0;
+        }
+        if (active == 0) {
+            if (next < naddrs) {
+                next_at = 0;
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to connect to %s\n", host);
+            break;
+        }
+        // Wait for an attempt to finish, or for the next one to be due
+        long wait = deadline - now;
+        if (next < naddrs && next_at - now < wait) {
+            wait = next_at - now;
+        }
+        if (poll(pfds, nattempts, wait) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < nattempts && winner == -1; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) {
+                continue;
+            }
+            int       err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                winner = i;
+            } else {
+                // Failed, fall back to the next address right away
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                next_at    = 0;
+            }
+        }
+    }
+
+    // Keep the winner, close the rest
+    for (int i = 0; i < nattempts; i++) {
+        if (i != winner && pfds[i].fd >= 0) {
+            close(pfds[i].fd);
+        }
+    }
+    if (winner == -1) {
         return -1;
+    }
+    connection->fd = pfds[winner].fd;
+    fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) & ~O_NONBLOCK);
+
+    // Copy the ip string into the connection struct
+    struct addrinfo *ai = ordered[owner[winner]];
+    if (ai->ai_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr,
+                  connection->ip, sizeof(connection->ip));
     } else {
-        printf("Connected to %s\n", connection->ip);
+        inet_ntop(AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+                  connection->ip, sizeof(connection->ip));
     }
+    printf("Connected to %s\n", connection->ip);
 
-    freeaddrinfo(res);
+    // Whatever is left of the connect deadline also bounds a TLS handshake.
+    // At least 1 ms, as 0 would leave the socket without a timeout
+    long left = deadline - timer_now_ms();
+    connection_set_deadline(connection, left > 1 ? left : 1);
 
     return 0;
 }
@@ -104,8 +228,20 @@ ssize_t send_to_connection(connection_t *connection, char *msg,
     ssize_t bytes_sent = 0;
     while (bytes_sent < msg_len) {
         // fprintf(stderr, "Sending %ld bytes\n", msg_len - bytes_sent);
-        ssize_t sent =
-            send(connection->fd, msg + bytes_sent, msg_len - bytes_sent, 0);
+        ssize_t sent;
+        if (connection->ssl != NULL) {
+            do {
+                errno = 0;
+                sent  = SSL_write(connection->ssl, msg + bytes_sent,
+                                  msg_len - bytes_sent);
+            } while (sent <= 0 && connection_ssl_retry(connection, sent));
+            if (sent <= 0) {
+                sent = -1;
+            }
+        } else {
+            sent = send(connection->fd, msg + bytes_sent, msg_len - bytes_sent,
+                        0);
+        }
         if (sent < 0) {
             fprintf(stderr, "Error: Failed to send message\n");
             return -1;
@@ -155,6 +291,23 @@ ssize_t send_to_connection_f(connection_t *connection, FILE *file,
     off_t off = lseek(fd, 0, SEEK_SET);
     fseek(file, 0, SEEK_SET);
     ssize_t bytes_sent = 0;
+    if (connection->ssl != NULL) {
+        // sendfile() bypasses TLS, copy through a buffer instead
+        char buffer[16384];
+        while (bytes_sent < msg_len) {
+            size_t want = msg_len - bytes_sent;
+            ssize_t n   = pread(fd, buffer,
+                                want < sizeof(buffer) ? want : sizeof(buffer),
+                                off);
+            if (n <= 0 || send_to_connection(connection, buffer, n) != n) {
+                fprintf(stderr, "Error: Failed to send message_f\n");
+                return -1;
+            }
+            off += n;
+            bytes_sent += n;
+        }
+        return bytes_sent;
+    }
     while (bytes_sent < msg_len) {
         ssize_t sent = sendfile(connection->fd, fd, &off, msg_len - bytes_sent);
         if (sent < 0) {
@@ -173,7 +326,454 @@ ssize_t send_to_connection_f(connection_t *connection, FILE *file,
     return bytes_sent;
 }
 
+/**
+ * @brief Receive bytes from a connection. Bytes pushed back with
+ * connection_unread() are returned before reading from the socket.
+ *
+ * @param connection Connection
+ * @param buf Buffer to read into
+ * @param len Size of buffer
+ *
+ * @return ssize_t Number of bytes read, 0 on EOF or -1 on error
+ */
+ssize_t recv_from_connection(connection_t *connection, char *buf, size_t len) {
+    if (connection->pending_len > 0) {
+        size_t n = connection->pending_len < len ? connection->pending_len : len;
+        memcpy(buf, connection->pending, n);
+        connection->pending_len -= n;
+        memmove(connection->pending, connection->pending + n,
+                connection->pending_len);
+        if (connection->pending_len == 0) {
+            free(connection->pending);
+            connection->pending = NULL;
+        }
+        return n;
+    }
+    ssize_t n;
+    if (connection->ssl != NULL) {
+        for (;;) {
+            errno = 0;
+            n     = SSL_read(connection->ssl, buf, len);
+            if (n > 0) {
+                return n;
+            }
+            if (connection_ssl_retry(connection, n)) {
+                continue;
+            }
+            switch (SSL_get_error(connection->ssl, n)) {
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_SYSCALL:
+                // Peer closed without close_notify
+                return errno == 0 ? 0 : -1;
+            default:
+                return -1;
+            }
+        }
+    }
+    do {
+        n = recv(connection->fd, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * @brief Receive one line (up to and including the newline)
+ *
+ * @param connection Connection
+ * @param buf Buffer to read into
+ * @param len Size of buffer
+ *
+ * @return ssize_t Length of the line, 0 on EOF or -1 on error / overlong line
+ */
+ssize_t recv_line_from_connection(connection_t *connection, char *buf,
+                                  size_t len) {
+    size_t have = 0;
+    while (have < len) {
+        ssize_t n = recv_from_connection(connection, buf + have, len - have);
+        if (n <= 0) {
+            return n;
+        }
+        char *nl = memchr(buf + have, '\n', n);
+        have += n;
+        if (nl != NULL) {
+            size_t line_len = nl + 1 - buf;
+            // Keep whatever follows the line for the next read
+            if (connection_unread(connection, nl + 1, have - line_len) != 0) {
+                return -1;
+            }
+            return line_len;
+        }
+    }
+    fprintf(stderr, "Error: Line too long\n");
+    return -1;
+}
+
+/**
+ * @brief Push bytes back onto a connection so the next read returns them
+ * first. Used to retain the start of a pipelined message.
+ *
+ * @param connection Connection
+ * @param buf Bytes to push back
+ * @param len Number of bytes
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int connection_unread(connection_t *connection, char *buf, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    char *pending = malloc(connection->pending_len + len);
+    if (pending == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(pending, buf, len);
+    if (connection->pending != NULL) {
+        memcpy(pending + len, connection->pending, connection->pending_len);
+        free(connection->pending);
+    }
+    connection->pending = pending;
+    connection->pending_len += len;
+    return 0;
+}
+
+/**
+ * @brief Wait for a connection to become readable, at most until the
+ * deadline of the connection. Expired deadlines of other connections are
+ * handled along the way.
+ *
+ * @param connection Connection
+ * @param timeout_ms Timeout in milliseconds (-1 to block)
+ *
+ * @return int 1 if readable (or bytes are pending), 0 on timeout, -1 on error
+ */
+int connection_poll(connection_t *connection, int timeout_ms) {
+    int ready;
+    return connection_poll_any(&connection, 1, timeout_ms, &ready);
+}
+
+/**
+ * @brief Wait for the first of several connections to become readable, each
+ * at most until its own deadline
+ *
+ * @param connections Connections
+ * @param n Number of connections
+ * @param timeout_ms Timeout in milliseconds (-1 to block)
+ * @param ready Index of the readable connection (output)
+ *
+ * @return int 1 if one is readable, 0 on timeout or once every deadline
+ * passed, -1 on error
+ */
+int connection_poll_any(connection_t **connections, int n, int timeout_ms,
+                        int *ready) {
+    struct pollfd fds[n];
+    for (int i = 0; i < n; i++) {
+        connection_t *connection = connections[i];
+        *ready                   = i;
+        if (connection->pending_len > 0) {
+            return 1;
+        }
+        // Decrypted bytes may already be buffered inside the TLS session
+        if (connection->ssl != NULL && SSL_pending(connection->ssl) > 0) {
+            return 1;
+        }
+        fds[i].fd     = connection->fd;
+        fds[i].events = POLLIN;
+    }
+    uint64_t end = timer_now_ms() + timeout_ms;
+    int      rv;
+    for (;;) {
+        // Expired connections are not waited for
+        int active = 0;
+        for (int i = 0; i < n; i++) {
+            if (connections[i]->expired) {
+                fds[i].fd = -1;
+            }
+            active += fds[i].fd >= 0;
+        }
+        if (active == 0) {
+            return 0;
+        }
+        // Sleep until the timeout or the next timer, whichever is first
+        uint64_t now  = timer_now_ms();
+        int      wait = timeout_ms;
+        if (timeout_ms >= 0) {
+            wait = end > now ? end - now : 0;
+        }
+        int timers = deadlines_initialized
+                         ? timer_wheel_timeout(&deadlines, now)
+                         : -1;
+        if (timers >= 0 && (wait < 0 || timers < wait)) {
+            wait = timers;
+        }
+        rv = poll(fds, n, wait);
+        if (deadlines_initialized) {
+            timer_wheel_advance(&deadlines, timer_now_ms());
+        }
+        if (rv < 0 && errno != EINTR) {
+            return -1;
+        }
+        for (int i = 0; rv > 0 && i < n; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0 &&
+                !connections[i]->expired) {
+                *ready = i;
+                return 1;
+            }
+        }
+        if (timeout_ms >= 0 && timer_now_ms() >= end) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Start a new phase with its own deadline
+ *
+ * @param connection Connection
+ * @param timeout_ms Time allowed for the phase, -1 to clear the deadline
+ */
+void connection_set_deadline(connection_t *connection, int timeout_ms) {
+    if (!deadlines_initialized) {
+        timer_wheel_init(&deadlines, timer_now_ms());
+        deadlines_initialized = 1;
+    }
+    connection->expired = 0;
+    if (timeout_ms < 0) {
+        timer_cancel(&deadlines, &connection->deadline);
+    } else {
+        timer_arm(&deadlines, &connection->deadline,
+                  timer_now_ms() + timeout_ms, connection_deadline_expired,
+                  connection);
+    }
+    connection_set_timeouts(connection, timeout_ms);
+}
+
+/**
+ * @brief Check if the deadline of the current phase has passed
+ *
+ * @param connection Connection
+ * @return int 1 if expired, 0 otherwise
+ */
+int connection_expired(connection_t *connection) {
+    if (deadlines_initialized && timer_is_armed(&connection->deadline)) {
+        timer_wheel_advance(&deadlines, timer_now_ms());
+    }
+    return connection->expired;
+}
+
+/**
+ * @brief Send file descriptors (and optional data) over a Unix socket
+ *
+ * @param sock Unix domain socket
+ * @param fds File descriptors to send
+ * @param nfds Number of file descriptors
+ * @param data Data sent along with the descriptors (may be NULL)
+ * @param len Length of data
+ *
+ * @return int 0 on success, -1 on error
+ */
+int connection_send_fds(int sock, int *fds, int nfds, void *data, size_t len) {
+    char          byte = 0;
+    struct iovec  iov  = {.iov_base = data, .iov_len = len};
+    struct msghdr msg  = {0};
+    char          control[CMSG_SPACE(sizeof(int) * CONNECTION_MAX_FDS)];
+    if (nfds > CONNECTION_MAX_FDS) {
+        fprintf(stderr, "Error: Too many file descriptors to send\n");
+        return -1;
+    }
+    // At least one byte of data has to be sent with the descriptors
+    if (data == NULL || len == 0) {
+        iov.iov_base = &byte;
+        iov.iov_len  = 1;
+    }
+    memset(control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive file descriptors (and optional data) from a Unix socket
+ *
+ * @param sock Unix domain socket
+ * @param fds File descriptors (output)
+ * @param nfds Number of file descriptors expected
+ * @param data Buffer for the data sent along with the descriptors (or NULL)
+ * @param len Size of data buffer
+ *
+ * @return ssize_t Bytes of data received, 0 if the socket closed, -1 on error
+ */
+ssize_t connection_recv_fds(int sock, int *fds, int nfds, void *data,
+                            size_t len) {
+    char          byte;
+    struct iovec  iov = {.iov_base = data, .iov_len = len};
+    struct msghdr msg = {0};
+    char          control[CMSG_SPACE(sizeof(int) * CONNECTION_MAX_FDS)];
+    if (data == NULL || len == 0) {
+        iov.iov_base = &byte;
+        iov.iov_len  = 1;
+    }
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+        fprintf(stderr, "Error: Expected %d file descriptors\n", nfds);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    return (data == NULL || len == 0) ? 1 : n;
+}
+
 /**
  * @brief Close a connection
  */
-void close_connection(connection_t *connection) { close(connection->fd); }
+void close_connection(connection_t *connection) {
+    if (deadlines_initialized) {
+        timer_cancel(&deadlines, &connection->deadline);
+    }
+    if (connection->ssl != NULL) {
+        SSL_shutdown(connection->ssl);
+        SSL_free(connection->ssl);
+        connection->ssl = NULL;
+    }
+    close(connection->fd);
+    free(connection->pending);
+    connection->pending     = NULL;
+    connection->pending_len = 0;
+}
+
+// Private function definitions
+
+/**
+ * @brief Resolve a host through the DNS cache of this thread, so lookups
+ * never contend. With -w the threads of a per-core worker live as long as
+ * the worker; in fork mode the cache lives as long as one client connection.
+ *
+ * @param host Host name
+ * @param port Port
+ * @param res Addresses (output, owned by the cache)
+ * @return int 0 on success, -1 on failure
+ */
+int connection_resolve(char *host, int port, struct addrinfo **res) {
+    time_t       now    = time(NULL);
+    dns_entry_t *victim = &dns_cache[0];
+    for (int i = 0; i < CONNECTION_DNS_CACHE_SIZE; i++) {
+        dns_entry_t *entry = &dns_cache[i];
+        if (entry->res != NULL && entry->port == port &&
+            strcmp(entry->host, host) == 0) {
+            if (entry->expires > now) {
+                *res = entry->res;
+                return 0;
+            }
+            victim = entry;
+            break;
+        }
+        // Replace a free slot, or else the one that expires first
+        if (victim->res != NULL &&
+            (entry->res == NULL || entry->expires < victim->expires)) {
+            victim = entry;
+        }
+    }
+
+    char            port_str[6];
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_ADDRCONFIG;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    int status = getaddrinfo(host, port_str, &hints, res);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to get address info for %s: %s\n", host,
+                gai_strerror(status));
+        return -1;
+    }
+    if (strlen(host) >= sizeof(victim->host)) {
+        // Too long to cache, keep it in the last slot until it is replaced
+        victim = &dns_cache[CONNECTION_DNS_CACHE_SIZE - 1];
+    }
+    if (victim->res != NULL) {
+        freeaddrinfo(victim->res);
+    }
+    snprintf(victim->host, sizeof(victim->host), "%s", host);
+    victim->port    = port;
+    victim->res     = *res;
+    victim->expires = now + CONNECTION_DNS_TTL_S;
+    return 0;
+}
+
+/**
+ * @brief Mark a connection whose phase deadline has passed
+ */
+void connection_deadline_expired(timer_node_t *timer, void *arg) {
+    connection_t *connection = arg;
+    fprintf(stderr, "Deadline expired on connection to %s\n", connection->ip);
+    connection->expired = 1;
+}
+
+/**
+ * @brief Bound single blocking sends and receives (which do not go through
+ * connection_poll(), e.g. inside OpenSSL) by the phase timeout
+ */
+void connection_set_timeouts(connection_t *connection, int timeout_ms) {
+    struct timeval tv = {0, 0};
+    if (timeout_ms > 0) {
+        tv.tv_sec  = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    }
+    setsockopt(connection->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(connection->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * @brief Check if a failed SSL_read() or SSL_write() should be retried. The
+ * socket blocks for at most the phase timeout (connection_set_timeouts()),
+ * so WANT_READ or WANT_WRITE with EAGAIN means the peer stalled past it:
+ * the connection is marked expired instead of waiting again.
+ *
+ * @param connection Connection
+ * @param rv Return value of the failed call (errno cleared before it)
+ * @return int 1 to retry, 0 otherwise
+ */
+int connection_ssl_retry(connection_t *connection, int rv) {
+    int error = SSL_get_error(connection->ssl, rv);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        return 0;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        fprintf(stderr, "TLS timeout on connection to %s\n", connection->ip);
+        connection->expired = 1;
+        return 0;
+    }
+    return 1;
+}
@@ -12,6 +12,15 @@
 #include <netinet/in.h>
 #include <stdio.h>
 
+#include "timer.h"
+
+#define CONNECTION_MAX_FDS            4    // Max descriptors passed at once
+#define CONNECTION_MAX_ADDRS          16   // Addresses tried per connect
+#define CONNECTION_CONNECT_TIMEOUT_MS 5000 // Default connect deadline
+#define CONNECTION_ATTEMPT_DELAY_MS   250  // Head start of each address
+#define CONNECTION_DNS_CACHE_SIZE     32   // Resolved hosts kept per thread
+#define CONNECTION_DNS_TTL_S          30   // How long a resolved host is reused
+
 /**
  * @brief Connection structure
  *
@@ -19,19 +28,38 @@
  *
  * @param fd Client file descriptor
  * @param ip Client IP address
- * @param host Client host information
+ * @param pending Bytes read past the end of the last message (pipelining)
+ * @param pending_len Number of pending bytes
+ * @param ssl TLS session (NULL for plaintext connections)
+ * @param deadline Deadline of the current phase (see
+ * connection_set_deadline())
+ * @param expired Set once the deadline has passed
  */
 typedef struct connection {
-    int  fd;
-    char ip[INET_ADDRSTRLEN];
+    int            fd;
+    char           ip[INET6_ADDRSTRLEN];
+    char          *pending;
+    size_t         pending_len;
+    struct ssl_st *ssl;
+    timer_node_t   deadline;
+    int            expired;
 } connection_t;
 
 /**
- * @brief Initialize a connection
+ * @brief Set the deadline for connect_to_hostname()
+ *
+ * @param timeout_ms Deadline in milliseconds for the whole connect attempt
+ */
+void connection_set_connect_timeout(int timeout_ms);
+
+/**
+ * @brief Initialize a connection. Every address of the host is tried,
+ * racing IPv6 and IPv4 (Happy Eyeballs), within the connect timeout. The
+ * rest of the connect timeout is left armed as the connection deadline.
  *
  * @param host Client host information
  * @param port Client port
- * @param connection Connection (output)
+ * @param connection Connection (output, zeroed by the caller)
  * @return int 0 on success, -1 on error
  */
 int connect_to_hostname(char *host, int port, connection_t *connection);
@@ -58,6 +86,114 @@ ssize_t send_to_connection(connection_t *connection, char *msg, size_t msg_len);
 ssize_t send_to_connection_f(connection_t *connection, FILE *file,
                              size_t msg_len);
 
+/**
+ * @brief Receive bytes from a connection. Bytes pushed back with
+ * connection_unread() are returned before reading from the socket.
+ *
+ * @param connection Connection
+ * @param buf Buffer to read into
+ * @param len Size of buffer
+ *
+ * @return ssize_t Number of bytes read, 0 on EOF or -1 on error
+ */
+ssize_t recv_from_connection(connection_t *connection, char *buf, size_t len);
+
+/**
+ * @brief Receive one line (up to and including the newline)
+ *
+ * @param connection Connection
+ * @param buf Buffer to read into
+ * @param len Size of buffer
+ *
+ * @return ssize_t Length of the line, 0 on EOF or -1 on error / overlong line
+ */
+ssize_t recv_line_from_connection(connection_t *connection, char *buf,
+                                  size_t len);
+
+/**
+ * @brief Push bytes back onto a connection so the next read returns them
+ * first. Used to retain the start of a pipelined message.
+ *
+ * @param connection Connection
+ * @param buf Bytes to push back
+ * @param len Number of bytes
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int connection_unread(connection_t *connection, char *buf, size_t len);
+
+/**
+ * @brief Wait for a connection to become readable, at most until the
+ * deadline of the connection
+ *
+ * @param connection Connection
+ * @param timeout_ms Timeout in milliseconds (-1 to block)
+ *
+ * @return int 1 if readable (or bytes are pending), 0 on timeout, -1 on error
+ */
+int connection_poll(connection_t *connection, int timeout_ms);
+
+/**
+ * @brief Wait for the first of several connections to become readable, each
+ * at most until its own deadline
+ *
+ * @param connections Connections
+ * @param n Number of connections
+ * @param timeout_ms Timeout in milliseconds (-1 to block)
+ * @param ready Index of the readable connection (output)
+ *
+ * @return int 1 if one is readable, 0 on timeout or once every deadline
+ * passed, -1 on error
+ */
+int connection_poll_any(connection_t **connections, int n, int timeout_ms,
+                        int *ready);
+
+/**
+ * @brief Start a new phase with its own deadline. Once the deadline passes,
+ * connection_poll() reports a timeout and blocking sends and receives fail.
+ * The deadline must be cleared before the connection_t is copied or goes out
+ * of scope without close_connection().
+ *
+ * @param connection Connection
+ * @param timeout_ms Time allowed for the phase, -1 to clear the deadline
+ */
+void connection_set_deadline(connection_t *connection, int timeout_ms);
+
+/**
+ * @brief Check if the deadline of the current phase has passed
+ *
+ * @param connection Connection
+ * @return int 1 if expired, 0 otherwise
+ */
+int connection_expired(connection_t *connection);
+
+/**
+ * @brief Send file descriptors (and optional data) over a Unix socket
+ *
+ * @param sock Unix domain socket
+ * @param fds File descriptors to send
+ * @param nfds Number of file descriptors
+ * @param data Data sent along with the descriptors (may be NULL)
+ * @param len Length of data
+ *
+ * @return int 0 on success, -1 on error
+ */
+int connection_send_fds(int sock, int *fds, int nfds, void *data, size_t len);
+
+/**
+ * @brief Receive file descriptors (and optional data) from a Unix socket
+ *
+ * @param sock Unix domain socket
+ * @param fds File descriptors (output)
+ * @param nfds Number of file descriptors expected
+ * @param data Buffer for the data sent along with the descriptors (or NULL)
+ * @param len Size of data buffer
+ *
+ * @return ssize_t Bytes of data received, 0 if the socket closed, -1 on error
+ */
+ssize_t connection_recv_fds(int sock, int *fds, int nfds, void *data,
+                            size_t len);
+
 /**
  * @brief Close a connection and free the memory
  */
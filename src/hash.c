@@ -0,0 +1,88 @@
+/**
+ * @file hash.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of hash.h
+ * @details Keys are probed linearly from their hash. A full table leaves new
+ * keys out, which callers treat as untracked.
+ *
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "hash.h"
+
+#include <stdatomic.h>
+
+#define HASH_FNV_OFFSET 14695981039346656037ULL
+#define HASH_FNV_PRIME  1099511628211ULL
+
+// Private functions
+uint64_t hash_fnv1a(uint64_t hash, const char *s);
+
+/**
+ * @brief Hash a string
+ *
+ * @param s String
+ * @return uint64_t Hash, never 0
+ */
+uint64_t hash_string(const char *s) {
+    uint64_t hash = hash_fnv1a(HASH_FNV_OFFSET, s);
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Hash an origin
+ *
+ * @param host Host
+ * @param port Port
+ * @return uint64_t Hash, never 0
+ */
+uint64_t hash_origin(const char *host, int port) {
+    uint64_t hash = hash_fnv1a(HASH_FNV_OFFSET, host);
+    hash          = (hash ^ (uint64_t)port) * HASH_FNV_PRIME;
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Find or claim the slot of a key in an open-addressed table whose
+ * entries start with an _Atomic uint64_t key (0 for a free slot)
+ *
+ * @param table First entry, NULL if the table is not set up
+ * @param slots Entries in the table
+ * @param size Size of an entry
+ * @param key Key (from hash_string() or hash_origin())
+ * @return void* Entry, NULL if the table is not set up or full
+ */
+void *hash_slot(void *table, size_t slots, size_t size, uint64_t key) {
+    if (table == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        char             *entry = (char *)table + (key + i) % slots * size;
+        _Atomic uint64_t *slot  = (_Atomic uint64_t *)entry;
+        uint64_t          found = atomic_load(slot);
+        if (found == 0 && atomic_compare_exchange_strong(slot, &found, key)) {
+            return entry;
+        }
+        if (found == key) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Private function definitions
+
+/**
+ * @brief Fold a string into an FNV-1a hash
+ */
+uint64_t hash_fnv1a(uint64_t hash, const char *s) {
+    for (; *s != '\0'; s++) {
+        hash = (hash ^ (unsigned char)*s) * HASH_FNV_PRIME;
+    }
+    return hash;
+}
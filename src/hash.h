@@ -0,0 +1,50 @@
+/**
+ * @file hash.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Hashing of URLs, clients and origins (64-bit FNV-1a), and the
+ * open-addressed tables in shared memory that the per-origin state lives in.
+ * Hashes are never 0, so 0 can mark a free slot.
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Hash a string
+ *
+ * @param s String
+ * @return uint64_t Hash, never 0
+ */
+uint64_t hash_string(const char *s);
+
+/**
+ * @brief Hash an origin
+ *
+ * @param host Host
+ * @param port Port
+ * @return uint64_t Hash, never 0
+ */
+uint64_t hash_origin(const char *host, int port);
+
+/**
+ * @brief Find or claim the slot of a key in an open-addressed table whose
+ * entries start with an _Atomic uint64_t key (0 for a free slot). A slot is
+ * claimed with a compare-and-swap on its key and never released.
+ *
+ * @param table First entry, NULL if the table is not set up
+ * @param slots Entries in the table
+ * @param size Size of an entry
+ * @param key Key (from hash_string() or hash_origin())
+ * @return void* Entry, NULL if the table is not set up or full
+ */
+void *hash_slot(void *table, size_t slots, size_t size, uint64_t key);
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * @file hedge.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of hedge.h
+ * @details Latencies go in log-linear buckets: below 4 ms one per
+ * millisecond, above that four per doubling, so the percentile is off by at
+ * most a quarter. Once an origin has HEDGE_WINDOW samples every bucket is
+ * halved, which lets the percentile follow an origin whose latency changes.
+ * The budget counts fetches and hedges across all processes and is halved
+ * the same way.
+ *
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "hedge.h"
+
+#include <stdio.h>
+
+#include "hash.h"
+#include "shm.h"
+
+/**
+ * @brief Fetches and hedges of every process
+ */
+typedef struct hedge_budget {
+    _Atomic long fetches;
+    _Atomic long hedges;
+} hedge_budget_t;
+
+static hedge_origin_t *origins;
+static hedge_budget_t *budget;
+static int             hedge_budget_pct;
+
+// Private functions
+hedge_origin_t *hedge_lookup(const char *host, int port);
+int             hedge_bucket(uint64_t latency_ms);
+int             hedge_bucket_end(int bucket);
+
+/**
+ * @brief Set up the shared tables. Call before forking.
+ *
+ * @param budget_pct Hedges allowed, in percent of all fetches
+ * @return int 0 on success, -1 on failure
+ */
+int hedge_init(int budget_pct) {
+    size_t size =
+        HEDGE_ORIGINS * sizeof(hedge_origin_t) + sizeof(hedge_budget_t);
+    void *map = shm_map("hedge", size);
+    if (map == NULL) {
+        return -1;
+    }
+    origins          = map;
+    budget           = (hedge_budget_t *)(origins + HEDGE_ORIGINS);
+    hedge_budget_pct = budget_pct;
+    return 0;
+}
+
+/**
+ * @brief Get how long to wait for the first byte before hedging a request
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @return int Delay in milliseconds, -1 not to hedge
+ */
+int hedge_delay_ms(const char *host, int port) {
+    hedge_origin_t *origin = hedge_lookup(host, port);
+    if (origin == NULL) {
+        return -1;
+    }
+    int samples = atomic_load(&origin->samples);
+    if (samples < HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+    // Walk the histogram up to the percentile
+    int rank = (samples * HEDGE_PERCENTILE + 99) / 100;
+    int seen = 0;
+    for (int bucket = 0; bucket < HEDGE_BUCKETS; bucket++) {
+        seen += atomic_load(&origin->buckets[bucket]);
+        if (seen >= rank) {
+            return hedge_bucket_end(bucket);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Record the first-byte latency of a fetch
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @param latency_ms Time from sending the request to the first byte
+ */
+void hedge_record(const char *host, int port, uint64_t latency_ms) {
+    hedge_origin_t *origin = hedge_lookup(host, port);
+    if (origin == NULL) {
+        return;
+    }
+    atomic_fetch_add(&origin->buckets[hedge_bucket(latency_ms)], 1);
+    if (atomic_fetch_add(&origin->samples, 1) + 1 >= HEDGE_WINDOW) {
+        // Age the histogram (races only make it a little less exact)
+        int samples = 0;
+        for (int bucket = 0; bucket < HEDGE_BUCKETS; bucket++) {
+            int count = atomic_load(&origin->buckets[bucket]) / 2;
+            atomic_store(&origin->buckets[bucket], count);
+            samples += count;
+        }
+        atomic_store(&origin->samples, samples);
+    }
+    if (atomic_fetch_add(&budget->fetches, 1) + 1 >= HEDGE_BUDGET_BASE) {
+        atomic_store(&budget->fetches, HEDGE_BUDGET_BASE / 2);
+        atomic_store(&budget->hedges, atomic_load(&budget->hedges) / 2);
+    }
+}
+
+/**
+ * @brief Take a hedge from the budget
+ *
+ * @return int 1 if the request may be hedged, 0 if the budget is spent
+ */
+int hedge_take() {
+    if (budget == NULL) {
+        return 0;
+    }
+    long fetches = atomic_load(&budget->fetches);
+    long hedges  = atomic_fetch_add(&budget->hedges, 1);
+    if (hedges * 100 >= fetches * hedge_budget_pct) {
+        atomic_fetch_sub(&budget->hedges, 1);
+        return 0;
+    }
+    return 1;
+}
+
+// Private function definitions
+
+/**
+ * @brief Find or claim the slot of an origin
+ *
+ * @return hedge_origin_t* Slot, NULL if hedging is off or the table is full
+ */
+hedge_origin_t *hedge_lookup(const char *host, int port) {
+    return hash_slot(origins, HEDGE_ORIGINS, sizeof(hedge_origin_t),
+                     hash_origin(host, port));
+}
+
+/**
+ * @brief Get the histogram bucket of a latency
+ */
+int hedge_bucket(uint64_t latency_ms) {
+    if (latency_ms < 4) {
+        return latency_ms;
+    }
+    int octave = 63 - __builtin_clzll(latency_ms);
+    int bucket = 4 * (octave - 1) + ((latency_ms >> (octave - 2)) & 3);
+    return bucket < HEDGE_BUCKETS ? bucket : HEDGE_BUCKETS - 1;
+}
+
+/**
+ * @brief Get the end of a histogram bucket (the first latency past it)
+ */
+int hedge_bucket_end(int bucket) {
+    if (bucket < 4) {
+        return bucket + 1;
+    }
+    return (4 + bucket % 4 + 1) << (bucket / 4 - 1);
+}
@@ -0,0 +1,71 @@
+/**
+ * @file hedge.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Hedged origin fetches: first-byte latencies are tracked per origin
+ * in shared memory, and a replayable request still unanswered after the
+ * origin's 95th percentile is sent a second time. Hedges are capped to a
+ * percentage of all fetches so they add only a little load.
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define HEDGE_ORIGINS     256   // Origins tracked (hash table slots)
+#define HEDGE_BUCKETS     68    // Latency buckets, 4 per doubling, up to ~2 min
+#define HEDGE_PERCENTILE  95    // Latency after which a request is hedged
+#define HEDGE_MIN_SAMPLES 20    // Fetches seen before an origin is hedged
+#define HEDGE_WINDOW      512   // Samples after which older ones count half
+#define HEDGE_BUDGET_BASE 10000 // Fetches after which the budget count halves
+
+/**
+ * @brief First-byte latencies of an origin
+ */
+typedef struct hedge_origin {
+    _Atomic uint64_t key;                    // Hash of host:port, 0 if free
+    _Atomic int      samples;                // Sum of the buckets
+    _Atomic int      buckets[HEDGE_BUCKETS]; // Latency histogram
+} hedge_origin_t;
+
+/**
+ * @brief Set up the shared tables. Call before forking.
+ *
+ * @param budget_pct Hedges allowed, in percent of all fetches
+ * @return int 0 on success, -1 on failure
+ */
+int hedge_init(int budget_pct);
+
+/**
+ * @brief Get how long to wait for the first byte before hedging a request
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @return int Delay in milliseconds, -1 not to hedge (hedging is off or too
+ * little is known about the origin)
+ */
+int hedge_delay_ms(const char *host, int port);
+
+/**
+ * @brief Record the first-byte latency of a fetch
+ *
+ * @param host Origin host
+ * @param port Origin port
+ * @param latency_ms Time from sending the request to the first byte
+ */
+void hedge_record(const char *host, int port, uint64_t latency_ms);
+
+/**
+ * @brief Take a hedge from the budget
+ *
+ * @return int 1 if the request may be hedged, 0 if the budget is spent
+ */
+int hedge_take();
+
+#endif
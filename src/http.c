@@ -5,14 +5,16 @@
  * @version 0.1
  */
 
+#define _GNU_SOURCE // memmem()
+
 #include "http.h"
 
 #include <ctype.h>
-#include <poll.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/sendfile.h>
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -63,6 +65,10 @@ void http_message_header_set_(http_message_t *message, char *key, char *value,
                               int search);
 http_header_t *http_message_header_search(http_message_t *message,
                                           const char *key, int *index);
+int  http_message_recv_chunked(http_message_t *message,
+                               connection_t   *connection);
+int  http_message_parse_length(http_message_t *message);
+int  http_chunk_size_parse(const char *line, size_t len, size_t *size);
 
 /**
  * @brief Parse HTTP host (i.e http://localhost:8080)
@@ -79,9 +85,9 @@ http_header_t *http_message_header_search(http_message_t *message,
  */
 int http_parse_host(char *host, char **hostname, int *port, char **uri,
                     int *https) {
-    static int     regex_initialized = 0;
-    static int     regex_error       = 0;
-    static regex_t regex;
+    static __thread int     regex_initialized = 0;
+    static __thread int     regex_error       = 0;
+    static __thread regex_t regex;
     if (!regex_initialized) {
         if ((regex_error = regcomp(&regex, HTTP_HOST_REGEX, REG_EXTENDED))) {
             char *error = malloc(256);
@@ -185,55 +191,42 @@ http_message_t *http_message_create_from_buffer(char *buffer, int buffer_size) {
     return message;
 }
 
-http_message_t *http_message_recv(connection_t *connection) {
+/**
+ * @brief Recv the header of an HTTP message from a connection
+ * @details Any bytes received past the end of the header (the body, or the
+ * next pipelined message) are pushed back onto the connection.
+ *
+ * @param connection Connection
+ * @return http_message_t* HTTP message with an empty body
+ */
+http_message_t *http_message_recv_header(connection_t *connection) {
     http_message_t *message = http_message_create();
 
     // Read the message into the message buffer
     ssize_t bytes_read;
     int     header_complete = 0;
-    // Poll vars
-    short         revents;
-    struct pollfd fds;
-    int           rv;
-    // Use sendfile to copy the message into the stream
+    int     rv;
     while (!header_complete) {
-        if (message->message_size > HTTP_MESSAGE_MAX_HEADER_SIZE) {
+        if (message->message_len > HTTP_MESSAGE_MAX_HEADER_SIZE) {
             // Message is too large, close the connection
             fprintf(stderr, "Message is too large, closing connection\n");
             http_message_free(message);
             return NULL;
         }
-        // fprintf(stderr, "message->message_len: %ld\n",
-        // message->message_size);
-        message->message_size += MESSAGE_CHUNK_SIZE;
-        // fprintf(stderr, "message->message_len: %ld\n",
-        // message->message_size);
-        if (message->message == NULL)
-            message->message = malloc(message->message_size);
-        else
-            message->message = realloc(message->message, message->message_size);
-        // fprintf(stderr, "Waiting for data...\n");
-        // Set up a poll to timeout if we don't get any data
-        // Poll the socket for data until we get something or a
-        // timeout is recieved
-        revents     = 0;
-        fds.fd      = connection->fd;
-        fds.events  = POLLIN;
-        fds.revents = revents;
-        rv          = poll(&fds, 1, KEEP_ALIVE_TIMEOUT_MS);
+        // Grow by what was actually received, not per read, so a header
+        // that trickles in is judged by its size
+        if (message->message_size < message->message_len + MESSAGE_CHUNK_SIZE) {
+            message->message_size += MESSAGE_CHUNK_SIZE;
+            message->message =
+                realloc(message->message, message->message_size);
+        }
+        // Poll the socket for data until we get something or a timeout is
+        // recieved (returns immediately if pipelined bytes are pending)
+        rv = connection_poll(connection, KEEP_ALIVE_TIMEOUT_MS);
         if (rv < 0) {
-            // This will fail if the parent recieves a SIGINT
-            // This is fine, check if nread is 0 to see if we have
-            // received any data If we have received data, continue
-            // processing the message If we have not received any
-            // data, exit the child process
-            if (bytes_read == 0) {
-                fprintf(stderr, "Poll failed, exiting child process\n");
-                http_message_free(message);
-                return NULL;
-            } else {
-                fprintf(stderr, "Poll failed, but we have received data\n");
-            }
+            fprintf(stderr, "Poll failed in http_message_recv()\n");
+            http_message_free(message);
+            return NULL;
         } else if (rv == 0) {
             // Timeout -> close connection
             fprintf(stderr, "Timeout occured in http_message_recv()\n");
@@ -241,10 +234,9 @@ http_message_t *http_message_recv(connection_t *connection) {
             return NULL;
         }
         // We got data before the timeout, read it
-        bytes_read =
-            recv(connection->fd, message->message + message->message_len,
-                 MESSAGE_CHUNK_SIZE, 0);
-        // fprintf(stderr, "Read %ld bytes from client socket.\n", bytes_read);
+        bytes_read = recv_from_connection(
+            connection, message->message + message->message_len,
+            MESSAGE_CHUNK_SIZE);
         if (bytes_read == 0) {
             // client socket closed
             fprintf(stderr, "Client socket closed.\n");
@@ -256,123 +248,375 @@ http_message_t *http_message_recv(connection_t *connection) {
             http_message_free(message);
             return NULL;
         }
+        // Only search the new bytes (and the 3 before them in case the
+        // terminator straddles two reads)
+        size_t search_start =
+            message->message_len > 3 ? message->message_len - 3 : 0;
         message->message_len += bytes_read;
-        // fprintf(stderr, "Writing %ld bytes to stream.\n", bytes_read);
-        // fwrite(recv_buffer, sizeof(char), bytes_read, message->fp) c;
-        // fprintf(stderr, "Checking if header is complete.\n");
-
-        // Slight optimization causes the strstr to only search the last 4 bytes
-        // before
-        // size_t search_start = max(0, message->message_len - 4);
-        size_t search_start = 0;
-        message->body = strstr(message->message + search_start, "\r\n\r\n");
-        // fprintf(stderr, "strstr \\r\\n\\r\\n RV: %p\n", rv);
-        if (message->body != NULL) {
-            // We actually have to set this again after all calls to
-            // realloc.....
-            message->body += 4;
-            message->header_len = message->body - message->message;
-            // Exit the loop
-            header_complete = 1;
-        }
-    }
-    // At this point, we have recieved the entire header and a partial body.
-    // We need to parse the header to get the content length, and then read
-    // the rest of the body.
+        char *end = memmem(message->message + search_start,
+                           message->message_len - search_start, "\r\n\r\n", 4);
+        if (end != NULL) {
+            message->header_len = end + 4 - message->message;
+            header_complete     = 1;
+        }
+    }
+    // Anything past the header is left on the connection
+    if (connection_unread(connection, message->message + message->header_len,
+                          message->message_len - message->header_len) != 0) {
+        http_message_free(message);
+        return NULL;
+    }
+    message->message_len = message->header_len;
+
     // Parse the message
     http_headers_parse(message);
     if (message->headers == NULL) {
         fprintf(stderr, "Error parsing message header.\n");
-        // Send a 400 Bad message response
-        // response_send(connection->fd, 400, "Bad message", NULL, 0);
         http_message_free(message);
         return NULL;
     }
 
     // Get the body length
-    char *body_length = http_message_header_get(message, "Content-Length");
-    // fprintf(stderr, "Body length: %s\n", body_length);
-    if (body_length != NULL) {
-        message->body_len = atoi(body_length);
-    } else {
-        message->body_len = 0;
-        http_message_header_set(message, "Content-Length", "0");
+    if (http_message_parse_length(message) == -1) {
+        http_message_free(message);
+        return NULL;
     }
-    // fprintf(stderr, "Header length: %lu, Body length: %lu, (a+b)(%lu),
-    // Message "
-    //             "len: %lu, Message size: %lu\n",
-    //             message->header_len, message->body_len,
-    //             message->header_len + message->body_len,
-    //             message->message_len, message->message_size);
-    // TODO: Check if the body is too long
-    // if (message->body_len > HTTP_MAX_BODY_LEN) {
-    //     fprintf(stderr, "Body is too long.\n");
-    //     // Send a 400 Bad message response
-    //     // response_send(connection->fd, 400, "Bad message", NULL, 0);
-    //     http_message_free(message);
-    //     return NULL;
-    // }
+    return message;
+}
+
+/**
+ * @brief Recv the body of an HTTP message into the message buffer
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_recv_body(http_message_t *message, connection_t *connection) {
+    if (http_message_is_chunked(message)) {
+        return http_message_recv_chunked(message, connection);
+    }
+    size_t  message_total = message->header_len + message->body_len;
+    ssize_t bytes_read;
+
     // Allocate space for the body
     if (message->body_len > 0) {
-        // message->message_size +=
-        //     ((message->header_len + message->body_len) / MESSAGE_CHUNK_SIZE)
-        //     * MESSAGE_CHUNK_SIZE;
-        // fprintf(stderr, "message->message_size: %ld\n",
-        // message->message_size); message->message = realloc(message->message,
-        // message->message_size);
-        message->message =
-            realloc(message->message, message->header_len + message->body_len);
-        // memset(message->message + message->message_len, 0,
-        //        message->message_size - message->message_len);
+        message->message = realloc(message->message, message_total);
+        if (message->message == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        message->message_size = message_total;
     }
 
-    if (message->body_len > 0) {
-        int read_remaining =
-            message->body_len + message->header_len - message->message_len;
-        if (read_remaining < 0) {
-            fprintf(stderr, "Body is longer than content length.\n");
-            http_message_free(message);
-            return NULL;
+    while (message->message_len < message_total) {
+        size_t recv_len =
+            min(MESSAGE_CHUNK_SIZE, message_total - message->message_len);
+        if (connection_poll(connection, KEEP_ALIVE_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "Timeout occured in http_message_recv_body()\n");
+            return -1;
         }
-        // if (read_remaining < message->body_len) {
-        //     fprintf(stderr, "Reading the rest of the body.\n");
-        // } else if (read_remaining > message->body_len) {
-        //     fprintf(stderr, "Body is longer than content length.\n");
-        // }
-        while (read_remaining) {
-            // fprintf(stderr, "Reading %d bytes from socket.\n",
-            // read_remaining); Use recv to copy the message into the stream
-            size_t recv_len = min(MESSAGE_CHUNK_SIZE, read_remaining);
-            // fprintf(stderr, "Reading %ld bytes from socket.\n", recv_len);
-            bytes_read =
-                recv(connection->fd, message->message + message->message_len,
-                     recv_len, 0);
-            // fprintf(stderr, "Read %ld bytes from client socket.\n",
-            // bytes_read);
-            if (bytes_read == 0) {
-                fprintf(stderr, "Client socket closed.\n");
-                http_message_free(message);
-                return NULL;
-            } else if (bytes_read < 0) {
-                fprintf(stderr, "Error reading from client socket.\n");
-                http_message_free(message);
-                return NULL;
-            }
-            message->message_len += bytes_read;
-            read_remaining -= bytes_read;
+        bytes_read = recv_from_connection(
+            connection, message->message + message->message_len, recv_len);
+        if (bytes_read == 0) {
+            fprintf(stderr, "Client socket closed.\n");
+            return -1;
+        } else if (bytes_read < 0) {
+            fprintf(stderr, "Error reading from client socket.\n");
+            return -1;
         }
-        // fflush(message->fp);
+        message->message_len += bytes_read;
     }
 
     // Move the body pointer to the correct location
     message->body = message->message + message->header_len;
+    return 0;
+}
+
+/**
+ * @brief Replace the body of a received message and rebuild the message
+ * buffer so it holds a plain Content-Length framed message
+ *
+ * @param message HTTP message
+ * @param body Body (ownership moves to the message)
+ * @param body_len Length of body
+ */
+void http_message_reframe(http_message_t *message, char *body,
+                          size_t body_len) {
+    char length[32];
+    snprintf(length, sizeof(length), "%zu", body_len);
+    http_message_header_remove(message, "Transfer-Encoding");
+    http_message_header_set(message, "Content-Length", length);
 
-    // fprintf(stderr, "\n\nRead body (%lu):\n", message->body_len);
-    // fprintf(stderr, "%s\n\n", message->body);
+    // Header line, headers, blank line, then the body
+    http_headers_t *headers = message->headers;
+    size_t          size    = strlen(message->header_line) + 4 + body_len;
+    for (int i = 0; i < headers->count; i++) {
+        size += strlen(headers->headers[i].key) +
+                strlen(headers->headers[i].value) + 4;
+    }
+    char  *buffer = malloc(size + 1);
+    size_t len    = sprintf(buffer, "%s\r\n", message->header_line);
+    for (int i = 0; i < headers->count; i++) {
+        len += sprintf(buffer + len, "%s: %s\r\n", headers->headers[i].key,
+                       headers->headers[i].value);
+    }
+    len += sprintf(buffer + len, "\r\n");
+    message->header_len = len;
+    if (body_len > 0) {
+        memcpy(buffer + len, body, body_len);
+    }
+    free(body);
+    free(message->message);
+    message->message      = buffer;
+    message->message_size = size + 1;
+    message->message_len  = len + body_len;
+    message->body         = buffer + message->header_len;
+    message->body_len     = body_len;
+}
 
+/**
+ * @brief Recv a chunked body and store it de-chunked
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_recv_chunked(http_message_t *message,
+                              connection_t   *connection) {
+    char   line[HTTP_CHUNK_LINE_MAX];
+    char  *body = NULL;
+    size_t len = 0, size = 0;
+    for (;;) {
+        ssize_t line_len;
+        if (connection_poll(connection, KEEP_ALIVE_TIMEOUT_MS) <= 0 ||
+            (line_len = recv_line_from_connection(connection, line,
+                                                  sizeof(line))) <= 0) {
+            free(body);
+            return -1;
+        }
+        size_t chunk;
+        if (http_chunk_size_parse(line, line_len, &chunk) != 0) {
+            free(body);
+            return -1;
+        }
+        if (chunk == 0) {
+            break;
+        }
+        if (chunk > HTTP_MESSAGE_MAX_BODY_SIZE - len) {
+            fprintf(stderr, "Body is too long.\n");
+            free(body);
+            return -1;
+        }
+        // Chunk data plus its CRLF
+        if (len + chunk + 2 > size) {
+            size        = max(size * 2, len + chunk + 2);
+            char *grown = realloc(body, size);
+            if (grown == NULL) {
+                perror("realloc");
+                free(body);
+                return -1;
+            }
+            body = grown;
+        }
+        size_t want = chunk + 2;
+        while (want > 0) {
+            if (connection_poll(connection, KEEP_ALIVE_TIMEOUT_MS) <= 0) {
+                free(body);
+                return -1;
+            }
+            ssize_t n = recv_from_connection(connection, body + len, want);
+            if (n <= 0) {
+                free(body);
+                return -1;
+            }
+            len += n;
+            want -= n;
+        }
+        len -= 2;
+        if (body[len] != '\r' || body[len + 1] != '\n') {
+            fprintf(stderr, "Bad chunk.\n");
+            free(body);
+            return -1;
+        }
+    }
+    // Skip the trailers
+    ssize_t n;
+    do {
+        n = recv_line_from_connection(connection, line, sizeof(line));
+    } while (n > 2);
+    if (n <= 0) {
+        free(body);
+        return -1;
+    }
+    http_message_reframe(message, body, len);
+    return 0;
+}
+
+/**
+ * @brief Recv a body that is delimited by the connection closing
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_recv_until_close(http_message_t *message,
+                                  connection_t   *connection) {
+    char   *body = NULL;
+    size_t  len = 0, size = 0;
+    ssize_t n;
+    do {
+        if (len + MESSAGE_CHUNK_SIZE > size) {
+            size = max(size * 2, MESSAGE_CHUNK_SIZE * 4);
+            if (size > HTTP_MESSAGE_MAX_BODY_SIZE) {
+                fprintf(stderr, "Body is too long.\n");
+                free(body);
+                return -1;
+            }
+            body = realloc(body, size);
+        }
+        if (connection_poll(connection, KEEP_ALIVE_TIMEOUT_MS) <= 0) {
+            free(body);
+            return -1;
+        }
+        n = recv_from_connection(connection, body + len, size - len);
+        if (n < 0) {
+            free(body);
+            return -1;
+        }
+        len += n;
+    } while (n > 0);
+    http_message_reframe(message, body, len);
+    return 0;
+}
+
+/**
+ * @brief Recv an HTTP message from a connection
+ * @details Reads exactly one message. Any bytes received past the end of the
+ * message belong to the next (pipelined) message and are left on the
+ * connection.
+ *
+ * @param connection Connection
+ * @return http_message_t* HTTP message
+ */
+http_message_t *http_message_recv(connection_t *connection) {
+    http_message_t *message = http_message_recv_header(connection);
+    if (message == NULL) {
+        return NULL;
+    }
+    if (http_message_recv_body(message, connection) != 0) {
+        http_message_free(message);
+        return NULL;
+    }
     return message;
 }
 
+/**
+ * @brief Copy exactly len bytes from one connection to another through a
+ * fixed size buffer
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int http_stream_bytes(connection_t *from, connection_t *to, size_t len) {
+    char    buffer[HTTP_STREAM_BUFFER_SIZE];
+    ssize_t n;
+    while (len > 0) {
+        if (connection_poll(from, KEEP_ALIVE_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "Timeout occured while streaming a body\n");
+            return -1;
+        }
+        n = recv_from_connection(from, buffer, min(sizeof(buffer), len));
+        if (n <= 0) {
+            fprintf(stderr, "Connection closed while streaming a body\n");
+            return -1;
+        }
+        if (send_to_connection(to, buffer, n) != n) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy a chunked body verbatim, including the chunk framing and any
+ * trailers. A malformed size line or a chunk not followed by its CRLF fails
+ * the copy, instead of leaving the rest of the body to be read as the next
+ * message.
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int http_stream_chunked(connection_t *from, connection_t *to) {
+    char    line[HTTP_CHUNK_LINE_MAX];
+    ssize_t n;
+    for (;;) {
+        // Chunk size line
+        size_t size;
+        n = recv_line_from_connection(from, line, sizeof(line));
+        if (n <= 0 || http_chunk_size_parse(line, n, &size) != 0 ||
+            send_to_connection(to, line, n) != n) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        // Chunk data and its CRLF
+        if (http_stream_bytes(from, to, size) != 0) {
+            return -1;
+        }
+        n = recv_line_from_connection(from, line, sizeof(line));
+        if (n != 2 || memcmp(line, "\r\n", 2) != 0 ||
+            send_to_connection(to, line, 2) != 2) {
+            fprintf(stderr, "Bad chunk.\n");
+            return -1;
+        }
+    }
+    // Trailers, up to the empty line
+    do {
+        n = recv_line_from_connection(from, line, sizeof(line));
+        if (n <= 0 || send_to_connection(to, line, n) != n) {
+            return -1;
+        }
+    } while (n > 2);
+    return 0;
+}
+
+/**
+ * @brief Stream the body of a message from one connection to another
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param from Connection the body is read from
+ * @param to Connection the body is written to
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_stream_body(http_message_t *message, connection_t *from,
+                             connection_t *to) {
+    if (http_message_is_chunked(message)) {
+        return http_stream_chunked(from, to);
+    }
+    return http_stream_bytes(from, to, message->body_len);
+}
+
+/**
+ * @brief Check if a message body uses chunked transfer encoding
+ *
+ * @param message HTTP message
+ * @return int 1 if chunked, 0 otherwise
+ */
+int http_message_is_chunked(http_message_t *message) {
+    char *encoding = http_message_header_get(message, "Transfer-Encoding");
+    return encoding != NULL && strcasestr(encoding, "chunked") != NULL;
+}
+
+/**
+ * @brief Check if a message carries a body
+ *
+ * @param message HTTP message
+ * @return int 1 if the message has a body, 0 otherwise
+ */
+int http_message_has_body(http_message_t *message) {
+    return message->body_len > 0 || http_message_is_chunked(message);
+}
+
 /**
  * @brief Send an http message to the socket including the header line, headers,
  * and body. This will reconstruct the message from the headers and body.
@@ -385,12 +629,11 @@ int http_message_send(http_message_t *message, connection_t *connection) {
     }
 
     // Get the body length
-    char *body_length = http_message_header_get(message, "Content-Length");
-    // fprintf(stderr, "Body length: %s\n", body_length);
-    if (body_length != NULL) {
-        message->body_len = atoi(body_length);
-    } else {
-        message->body_len = 0;
+    int has_length = http_message_parse_length(message);
+    if (has_length == -1) {
+        return -1;
+    }
+    if (has_length == 0 && !http_message_is_chunked(message)) {
         http_message_header_set(message, "Content-Length", "0");
     }
 
@@ -399,7 +642,8 @@ int http_message_send(http_message_t *message, connection_t *connection) {
                        strlen(message->header_line));
     // Send the headers
     http_headers_send(message->headers, connection);
-    // Send the body
+    // Send the body (a body still pending on another connection is streamed
+    // by the caller)
     if (message->body_len > 0) {
         if (message->body_f != NULL) {
             // Send the body from a file
@@ -413,6 +657,25 @@ int http_message_send(http_message_t *message, connection_t *connection) {
     return 0;
 }
 
+/**
+ * @brief Send the header line and headers of a message without the body
+ *
+ * @param message The message to send
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_send_header(http_message_t *message,
+                             connection_t   *connection) {
+    if (message == NULL || message->headers == NULL) {
+        return -1;
+    }
+    if (send_to_connection(connection, message->header_line,
+                           strlen(message->header_line)) < 0) {
+        return -1;
+    }
+    return http_headers_send(message->headers, connection) < 0 ? -1 : 0;
+}
+
 /**
  * @brief Send an HTTP message to a connection
  *
@@ -564,6 +827,16 @@ void http_message_set_body_f(http_message_t *message, FILE *f) {
  */
 char *http_message_get_body(http_message_t *message) { return message->body; }
 
+/**
+ * @brief Get the length of the body of an HTTP message
+ *
+ * @param message HTTP message
+ * @return size_t Body length
+ */
+size_t http_message_get_body_len(http_message_t *message) {
+    return message->body_len;
+}
+
 /**
  * @brief Get a header value from a list of headers
  *
@@ -573,10 +846,10 @@ char *http_message_get_body(http_message_t *message) { return message->body; }
  */
 char *http_message_header_get(http_message_t *message, char *key) {
     // TODO: Use a hash table for faster lookup
-    // TODO: Convert to lowercase for case-insensitive comparison
+    // Header names are case-insensitive
     http_headers_t *headers = message->headers;
     for (int i = 0; i < headers->count; i++) {
-        if (strcmp(headers->headers[i].key, key) == 0) {
+        if (strcasecmp(headers->headers[i].key, key) == 0) {
             return headers->headers[i].value;
         }
     }
@@ -687,7 +960,7 @@ http_header_t *http_message_header_search(http_message_t *message,
         }
         // fprintf(stderr, "Comparing (%d) %s to %s\n", headers->count,
         // headers->headers[i].key, key);
-        if (strcmp(headers->headers[i].key, key) == 0) {
+        if (strcasecmp(headers->headers[i].key, key) == 0) {
             if (index != NULL)
                 *index = i;
             // fprintf(stderr, "Found header at %d\n", i);
@@ -772,3 +1045,74 @@ void http_get_message_buffer(http_message_t *message, char **data,
     *data = message->message;
     *size = message->message_len;
 }
+
+/**
+ * @brief Set the body length of a message from its Content-Length header
+ * (0 without one)
+ *
+ * @param message HTTP message
+ * @return int 1 if the header is set, 0 if not, -1 if it is invalid or over
+ * HTTP_MESSAGE_MAX_BODY_SIZE
+ */
+int http_message_parse_length(http_message_t *message) {
+    char *body_length = http_message_header_get(message, "Content-Length");
+    message->body_len = 0;
+    if (body_length == NULL) {
+        return 0;
+    }
+    char              *end;
+    unsigned long long len = strtoull(body_length, &end, 10);
+    if (end == body_length) {
+        fprintf(stderr, "Bad Content-Length.\n");
+        return -1;
+    }
+    if (len > HTTP_MESSAGE_MAX_BODY_SIZE) {
+        fprintf(stderr, "Body is too long.\n");
+        return -1;
+    }
+    message->body_len = len;
+    return 1;
+}
+
+/**
+ * @brief Parse the size line of a chunk: hex digits, then optional chunk
+ * extensions after a ';'
+ *
+ * @param line Size line, with its line ending (not NUL-terminated)
+ * @param len Length of line
+ * @param size Chunk size (output)
+ * @return int 0 on success, -1 if the line is malformed or the size is over
+ * HTTP_MESSAGE_MAX_BODY_SIZE
+ */
+int http_chunk_size_parse(const char *line, size_t len, size_t *size) {
+    static const char digits[] = "0123456789abcdef";
+    const char       *c = line, *end = line + len;
+    size_t            value = 0;
+    // Stops growing once over the limit, so a long line can not wrap it
+    for (; c < end && isxdigit((unsigned char)*c) &&
+           value <= HTTP_MESSAGE_MAX_BODY_SIZE;
+         c++) {
+        value = value * 16 + (strchr(digits, tolower((unsigned char)*c)) -
+                              digits);
+    }
+    if (c == line) {
+        fprintf(stderr, "Bad chunk size.\n");
+        return -1;
+    }
+    if (value > HTTP_MESSAGE_MAX_BODY_SIZE) {
+        fprintf(stderr, "Body is too long.\n");
+        return -1;
+    }
+    while (c < end && (*c == ' ' || *c == '\t')) {
+        c++;
+    }
+    if (c < end && *c == '\r') {
+        c++;
+    }
+    if (c == end || (*c != ';' && (*c != '\n' || c + 1 != end))) {
+        fprintf(stderr, "Bad chunk size.\n");
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
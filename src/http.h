@@ -19,9 +19,14 @@
 #define HTTP_VERSION                 "HTTP/1.1"
 #define HTTP_HEADER_COUNT_DEFAULT    16
 #define MESSAGE_CHUNK_SIZE           1024
-#define KEEP_ALIVE_TIMEOUT_MS        10000
+#define KEEP_ALIVE_TIMEOUT_MS        10000  // Client idle / max gap between reads
+#define HTTP_HEADER_TIMEOUT_MS       10000  // Whole request header
+#define HTTP_FIRST_BYTE_TIMEOUT_MS   30000  // Request sent to first response byte
+#define HTTP_TRANSFER_TIMEOUT_MS     300000 // Whole request or response transfer
 #define HTTP_MESSAGE_MAX_HEADER_SIZE 8192
-#define HTTP_MESSAGE_MAX_BODY_SIZE   (4 * 1024 * 1024 * 1024) // 4 GB
+#define HTTP_MESSAGE_MAX_BODY_SIZE   (4ULL * 1024 * 1024 * 1024) // 4 GB
+#define HTTP_STREAM_BUFFER_SIZE      16384 // Buffer for streamed bodies
+#define HTTP_CHUNK_LINE_MAX          1024  // Longest chunk size / trailer line
 #define HTTP_HOST_REGEX              "(http[s]?://)?([^/:]+)?(:([0-9]+))?([^ ]*)?"
 
 typedef struct http_message http_message_t;
@@ -67,6 +72,76 @@ http_message_t *http_message_create_from_buffer(char *buffer, int buffer_size);
  */
 http_message_t *http_message_recv(connection_t *connection);
 
+/**
+ * @brief Recv the header of an HTTP message from a connection. The body (if
+ * any) is left on the connection.
+ *
+ * @param connection Connection
+ * @return http_message_t* HTTP message with an empty body
+ */
+http_message_t *http_message_recv_header(connection_t *connection);
+
+/**
+ * @brief Recv the body of an HTTP message into the message buffer. Chunked
+ * bodies are de-chunked and the message is rebuilt with a Content-Length
+ * header.
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_recv_body(http_message_t *message, connection_t *connection);
+
+/**
+ * @brief Recv a body that is delimited by the connection closing. The message
+ * is rebuilt with a Content-Length header.
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_recv_until_close(http_message_t *message,
+                                  connection_t   *connection);
+
+/**
+ * @brief Replace the body of a received message and rebuild the message
+ * buffer so it holds a plain Content-Length framed message
+ *
+ * @param message HTTP message
+ * @param body Body (ownership moves to the message)
+ * @param body_len Length of body
+ */
+void http_message_reframe(http_message_t *message, char *body,
+                          size_t body_len);
+
+/**
+ * @brief Stream the body of a message from one connection to another
+ * through a fixed size buffer
+ *
+ * @param message Message returned by http_message_recv_header()
+ * @param from Connection the body is read from
+ * @param to Connection the body is written to
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_stream_body(http_message_t *message, connection_t *from,
+                             connection_t *to);
+
+/**
+ * @brief Check if a message body uses chunked transfer encoding
+ *
+ * @param message HTTP message
+ * @return int 1 if chunked, 0 otherwise
+ */
+int http_message_is_chunked(http_message_t *message);
+
+/**
+ * @brief Check if a message carries a body
+ *
+ * @param message HTTP message
+ * @return int 1 if the message has a body, 0 otherwise
+ */
+int http_message_has_body(http_message_t *message);
+
 /**
  * @brief Send an http message to the socket including the header line, headers,
  * and body. This will reconstruct the message from the headers and body.
@@ -75,6 +150,15 @@ http_message_t *http_message_recv(connection_t *connection);
  */
 int http_message_send(http_message_t *message, connection_t *connection);
 
+/**
+ * @brief Send the header line and headers of a message without the body
+ *
+ * @param message The message to send
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int http_message_send_header(http_message_t *message, connection_t *connection);
+
 /**
  * @brief Free an HTTP message
  *
@@ -124,6 +208,14 @@ void http_message_set_body_f(http_message_t *message, FILE *f);
  */
 char *http_message_get_body(http_message_t *message);
 
+/**
+ * @brief Get the length of the body of an HTTP message
+ *
+ * @param message HTTP message
+ * @return size_t Body length
+ */
+size_t http_message_get_body_len(http_message_t *message);
+
 /**
  * @brief Get a header value from a message
  *
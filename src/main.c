@@ -9,51 +9,253 @@
  *
  */
 
+#define _GNU_SOURCE // sched_setaffinity()
+
 #include <arpa/inet.h> // inet_ntoa()
 #include <errno.h>     // errno
 #include <fcntl.h>
+#include <linux/filter.h>     // struct sock_filter
+#include <linux/mempolicy.h> // MPOL_LOCAL
 #include <netdb.h>      // gethostbyname()
 #include <netinet/in.h> // struct sockaddr_in
-#include <signal.h>     // signal()
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h> // sched_setaffinity()
+#include <signal.h> // signal()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/socket.h> // socket(), bind(), listen(), accept()
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h> // waitpid()
 #include <time.h>
 #include <unistd.h>
 #include <wait.h> // waitpid()
 
+#include "admission.h"
+#include "backend.h"
 #include "blocklist.h"
+#include "breaker.h"
+#include "compress.h"
 #include "connection.h"
+#include "hedge.h"
 #include "md5.h"
+#include "peer.h"
+#include "pool.h"
+#include "predict.h"
+#include "prefetch.h"
+#include "queue.h"
 #include "request.h"
 #include "response.h"
+#include "ring.h"
+#include "shm.h"
+#include "snapshot.h"
+#include "tls.h"
+#include "tunnel.h"
+#include "uring.h"
+#include "workpool.h"
 
 // Constants
+#define PIPELINE_DEPTH_MAX    8     // Max in-flight pipelined requests
+#define PIPELINE_RELAY_BUFFER 16384 // Relay buffer size
+#define CONNECT_DEFAULT_PORT  443   // Port for CONNECT without a port
+#define ACCEPT_QUEUE_SIZE     1024  // Accepted sockets waiting for a thread
+#define THREADS_MAX           256   // Max worker threads
+#define ACCEPT_BATCH          64    // Sockets taken per accept loop iteration
+#define CORES_MAX             256   // Max per-core workers
+#define LISTEN_BACKLOG        128   // Pending connections per listener
+#define HANDOFF_MAX           65536 // Bytes read ahead that go with a handoff
+#define HANDOFF_TAG           1     // user_data of handoff poll completions
+#define WAKE_TAG              2     // user_data of admission wake-ups
+#define TIMER_TAG             3     // user_data of admission timeouts
+#define UPGRADE_LISTEN_ENV    "PROXY_LISTEN_FDS" // Listeners passed on exec
+#define UPGRADE_READY_ENV     "PROXY_READY_FD"   // New generation is serving
 
 // Global variables
 volatile int running        = 1;
 volatile int parent         = 1;
 volatile int num_children   = 0;
+volatile int upgrading      = 0; // SIGUSR2: hand the listeners to a new binary
+char       **exec_argv      = NULL; // Command line the new binary is run with
 int          port           = 8080;
 int          cache_timeout  = 60;
 char        *blocklist_path = "blocklist";
 char        *cache_path     = "cache";
+char        *tls_ca_file    = NULL; // Extra CAs trusted for origin TLS
+int          cache_codec    = COMPRESS_NONE; // Storage codec of cache entries
 blocklist_t *blocklist      = NULL;
+int          tunnel_fd      = -1; // Socket for handing tunnels to the relay
+pid_t        tunnel_pid     = -1; // Tunnel relay process
+char        *backends_path  = NULL; // Backend groups (reverse-proxy mode)
+int          checker_fd     = -1; // Keeps the backend checker running
+pid_t        checker_pid    = -1; // Backend checker process
+char        *siblings       = NULL; // Sibling proxies asked on cache misses
+char        *parents        = NULL; // Parent proxies cache misses go to
+long         export_mb      = 0; // Write a snapshot of this much and exit
+int          import_only    = 0; // Read a snapshot and exit
+int          responder_fd   = -1; // Keeps the sibling query responder running
+pid_t        responder_pid  = -1; // Sibling query responder process
+int          num_threads    = 0; // Worker threads (0 forks per connection)
+queue_t     *accept_queue   = NULL; // Accepted sockets for the worker threads
+workpool_t  *fetch_pool     = NULL; // Runs the requests in thread mode
+int          use_uring      = 0; // io_uring accept loop and cache file I/O
+int          num_cores      = 0; // Per-core workers (0 serves from one process)
+int          core_steering  = 0; // Steer connections to the receiving CPU
+int          core_index     = -1; // Index of this per-core worker
+long         core_local     = 0; // Accepted on the CPU that received them
+long         core_accepted  = 0; // Accepted by this per-core worker
+int          core_affinity  = 0; // Hand requests to the worker owning the key
+int          handoff_rx     = -1; // Connections handed to this worker
+int          handoff_tx[CORES_MAX]; // Handoff socket of every per-core worker
+int          handoff_ready  = 0; // Handed connections may be waiting
+long         handoff_in     = 0; // Connections taken from other workers
+int          max_active     = 0; // Connections served at once (0: no limit)
+admission_t *admission      = NULL; // Connections waiting for a slot
+int          admission_wake = -1; // eventfd written when a slot frees up
+_Atomic int  threads_active = 0; // Connections held by worker threads
+long         admission_shed = 0; // Late connections turned away
+long         admission_kept = 0; // Late connections kept as cache hits
+int          max_per_origin = 0; // Fetches in flight per origin (0: no limit)
+int          hedge_pct      = 0; // Extra fetches allowed for hedging (percent)
+int          upstream_pipelining = 0; // Pipeline cache misses to the origin
+int          prefetch_jobs  = 0; // Prefetch jobs at once (0: no prefetching)
+long         predict_budget = 0; // Bytes/s prefetched on predictions (0: off)
+uring_t      accept_ring    = {.fd = -1}; // Multishot accept
+__thread uring_t *cache_ring = NULL; // Cache file I/O ring of this thread
+__thread int origin_unavailable = 0; // The last fetch was refused (breaker)
 
 // Function prototypes
-void handle_request(connection_t *connection);
+void handle_connection(connection_t *connection);
+int  handle_request(connection_t *connection, request_t *request,
+                    int keep_alive);
+void handle_tunnel(connection_t *connection, request_t *request);
+int   listen_socket();
+void  listen_sockets(int *fds, int n);
+void  serve(int server_fd);
+void  serve_cores(int *listeners);
+int   upgrade(int *fds, int n);
+void  upgrade_ready();
+void  serve_client(int server_fd, int fd, int *rest, int nrest);
+void  admission_run(int server_fd);
+void  admission_reject(int fd);
+int   cache_probe(int fd);
+void  cache_hash(char *entry_key, char *hash_str);
+int   cache_is_fresh(char *key);
+response_t *cache_read(FILE *f, int fd, size_t size, int encoding);
+int         cache_store(FILE *f, response_t *response, int codec,
+                        char *meta_path, char *entry_key);
+void        cache_fill(connection_t *connection, request_t **burst, int n,
+                       int min_misses);
+void        cache_prefetch(connection_t *connection, request_t *request,
+                           response_t *response);
+void        cache_predict(connection_t *connection, request_t *request,
+                          response_t *response);
+void        prefetch_start(connection_t *connection, void *job);
+void        prefetch_run(void *arg);
+void        request_url(request_t *request, char *url, size_t size);
+void        request_prepare(connection_t *connection, request_t *request);
+response_t *origin_fetch(request_t *request);
+response_t *sibling_fetch(request_t *request, char *key);
+ring_parent_t *parent_route(request_t *request);
+void origin_fetch_many(request_t **requests, response_t **responses, int n);
+int         origin_send_unavailable(connection_t *connection, int keep_alive);
+void *worker_thread(void *arg);
+int   accept_batch(int server_fd, int *fds, int max);
+int   peer_ip(int fd, char *ip);
+void  core_count(int fd);
+int   core_owner(connection_t *connection, request_t *request);
+int   handoff_send(connection_t *connection, request_t *request, int owner);
+int   handoff_take(int *fds, int max);
+void  handoff_claim(int fd, connection_t *connection);
+
+/**
+ * @brief Connection handed over by another per-core worker, waiting to be
+ * picked up by the process or thread that serves it
+ */
+typedef struct handoff {
+    int             fd;   // Client socket
+    char           *data; // Request header and bytes read past it
+    size_t          len;  // Length of data
+    struct handoff *next;
+} handoff_t;
+
+handoff_t      *handoffs      = NULL;
+pthread_mutex_t handoffs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Request handed to the fetch pool
+ */
+typedef struct pipeline_job {
+    connection_t worker;     // Write end of the response socket
+    request_t   *request;    // Parsed request
+    int          keep_alive; // Whether the client connection stays open
+} pipeline_job_t;
+
+/**
+ * @brief Links of one origin to prefetch into the cache
+ */
+typedef struct prefetch_job {
+    connection_t client;                              // Client the page was for
+    char         urls[PREFETCH_LINKS_MAX][PREFETCH_URL_MAX]; // Absolute URLs
+    int          n;                                   // Number of URLs
+} prefetch_job_t;
 
 void print_usage(char *argv[]) {
-    printf("Usage: %s [port] [cache_timeout]\n", argv[0]);
+    printf("Usage: %s [-C ca_file] [-H hedge_pct] [-P kib_per_s] "
+           "[-T connect_ms] [-U parents] [-b] [-c cores] [-e size_mb] [-i] "
+           "[-k] [-l jobs] [-m max_active] [-o max_per_origin] [-p] "
+           "[-r backends] [-s siblings] [-u] [-w threads] [-z] [port] "
+           "[cache_timeout]\n",
+           argv[0]);
+    printf("  -C ca_file     Also trust the CAs in ca_file for origin TLS\n");
+    printf("  -H hedge_pct   Send a GET again when the origin is slower than "
+           "usual (its p95), adding at most hedge_pct%% fetches\n");
+    printf("  -P kib_per_s   Learn which URL each client asks for after another "
+           "and prefetch the likely next one, at most kib_per_s KiB/s\n");
+    printf("  -T connect_ms  Deadline for connecting to an origin (default %d)\n",
+           CONNECTION_CONNECT_TIMEOUT_MS);
+    printf("  -U parents     Fetch each cache miss through the parent proxy "
+           "(host:port,...) its key hashes to, skipping failed parents\n");
+    printf("  -b             With -c, hand each connection to the worker of the "
+           "CPU that received it\n");
+    printf("  -c cores       Serve from one pinned worker per core, each with "
+           "its own listener (add -w for a per-core origin pool and DNS "
+           "cache shared by its clients)\n");
+    printf("  -e size_mb     Write a snapshot of the hottest size_mb MB of the "
+           "cache to stdout and exit\n");
+    printf("  -i             Read a snapshot from stdin into the cache and "
+           "exit\n");
+    printf("  -k             With -c, hand each cacheable request to the "
+           "worker that owns its key\n");
+    printf("  -l jobs        Prefetch the images, scripts and stylesheets of "
+           "fetched HTML pages into the cache, at most jobs origins at once\n");
+    printf("  -m max_active  Serve at most max_active clients at once, queue "
+           "the others and shed them (503) once the queue backs up\n");
+    printf("  -o max_per_origin  Fetch from an origin at most max_per_origin "
+           "(up to %d) at once, stop fetching from failing origins for a "
+           "while (serving stale entries or 503)\n",
+           BREAKER_MAX_INFLIGHT);
+    printf("  -p             Pipeline the cache misses among GETs a client "
+           "pipelined to one origin on one origin connection\n");
+    printf("  -r backends    Reverse-proxy mode: serve each Host from its "
+           "group of backends, listed in the backends file\n");
+    printf("  -s siblings    Ask the sibling proxies (host:port,...) over UDP "
+           "for a fresh copy of each cache miss before going to the origin, "
+           "and answer their queries on UDP port\n");
+    printf("  -u             Accept (and with -w, do cache file I/O) through "
+           "io_uring\n");
+    printf("  -w threads     Serve clients from a pool of threads instead of "
+           "forking. Origin connections and DNS lookups are then reused "
+           "across clients, not just across one client's requests\n");
+    printf("  -z             Compress cache entries on disk (gzip)\n");
 }
 
 /**
- * @brief Handle SIGINT and SIGCHLD signal
+ * @brief Handle SIGINT, SIGUSR2 and SIGCHLD signal
  *
  * @param sig Signal number
  */
@@ -61,11 +263,26 @@ void sig_handler(int sig) {
     if (sig == SIGINT) {
         // Stop accepting new connections
         running = 0;
+    } else if (sig == SIGUSR2) {
+        // Start the new binary from the accept loop
+        upgrading = 1;
     } else if (sig == SIGCHLD) {
         // Wait for all children to exit
-        while (waitpid(-1, NULL, WNOHANG) > 0) {
-            num_children--;
+        int   saved_errno = errno;
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (pid != tunnel_pid && pid != checker_pid &&
+                pid != responder_pid)
+                num_children--;
+        }
+        // Let the accept loop hand the freed slots to waiting connections
+        if (admission_wake != -1) {
+            uint64_t one = 1;
+            if (write(admission_wake, &one, sizeof(one)) == -1) {
+                // The counter is already non-zero
+            }
         }
+        errno = saved_errno;
     }
 }
 
@@ -80,17 +297,124 @@ void sig_handler(int sig) {
  * @return int The exit code of the program
  */
 int main(int argc, char *argv[]) {
-    if (argc > 3) {
+    exec_argv = argv;
+
+    // Parse command line options
+    int         opt;
+    const char *options = "C:H:P:T:U:bc:e:ikl:m:o:pr:s:uw:z";
+    while ((opt = getopt(argc, argv, options)) != -1) {
+        switch (opt) {
+        case 'C':
+            tls_ca_file = optarg;
+            break;
+        case 'H':
+            hedge_pct = atoi(optarg);
+            if (hedge_pct < 1 || hedge_pct > 100) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            predict_budget = atol(optarg) * 1024;
+            if (predict_budget < 1) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T': {
+            int connect_ms = atoi(optarg);
+            if (connect_ms < 1) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            connection_set_connect_timeout(connect_ms);
+            break;
+        }
+        case 'U':
+            parents = optarg;
+            break;
+        case 'b':
+            core_steering = 1;
+            break;
+        case 'c':
+            num_cores = atoi(optarg);
+            if (num_cores < 1 || num_cores > CORES_MAX) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            export_mb = atol(optarg);
+            if (export_mb < 1) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            import_only = 1;
+            break;
+        case 'k':
+            core_affinity = 1;
+            break;
+        case 'l':
+            prefetch_jobs = atoi(optarg);
+            if (prefetch_jobs < 1) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            max_active = atoi(optarg);
+            if (max_active < 1) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            max_per_origin = atoi(optarg);
+            if (max_per_origin < 1 || max_per_origin > BREAKER_MAX_INFLIGHT) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            upstream_pipelining = 1;
+            break;
+        case 'r':
+            backends_path = optarg;
+            break;
+        case 's':
+            siblings = optarg;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'w':
+            num_threads = atoi(optarg);
+            if (num_threads < 0 || num_threads > THREADS_MAX) {
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            cache_codec = COMPRESS_GZIP;
+            break;
+        default:
+            print_usage(argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind > 2) {
         print_usage(argv);
         exit(EXIT_FAILURE);
     }
 
     // Parse command line arguments
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    if (argc - optind > 0) {
+        port = atoi(argv[optind]);
     }
-    if (argc > 2) {
-        cache_timeout = atoi(argv[2]);
+    if (argc - optind > 1) {
+        cache_timeout = atoi(argv[optind + 1]);
     }
 
     // Validate command line arguments
@@ -103,6 +427,18 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Snapshots of the cache, to warm a new node instead of serving
+    if (export_mb > 0) {
+        int rv = snapshot_export(cache_path, cache_timeout,
+                                 (size_t)export_mb << 20, stdout);
+        exit(rv == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (import_only) {
+        mkdir(cache_path, 0777);
+        int rv = snapshot_import(cache_path, cache_timeout, stdin, cache_hash);
+        exit(rv == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
     // Initialize the blocklist
     blocklist = blocklist_init(blocklist_path);
     if (blocklist == NULL) {
@@ -113,6 +449,60 @@ int main(int argc, char *argv[]) {
     // Initialize the cache
     mkdir(cache_path, 0777);
 
+    // Initialize origin TLS (shared by every worker)
+    if (tls_init(cache_path, tls_ca_file) != 0) {
+        fprintf(stderr, "Error initializing TLS.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Per-origin limits, shared by every process
+    if (max_per_origin > 0 && breaker_init(max_per_origin) != 0) {
+        fprintf(stderr, "Error initializing the origin limits.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Backend groups and their health, shared by every process
+    if (backends_path != NULL && backend_load(backends_path) != 0) {
+        fprintf(stderr, "Error loading the backends.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Siblings to ask on cache misses
+    if (siblings != NULL && peer_load(siblings) != 0) {
+        fprintf(stderr, "Error loading the siblings.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Parents and which of them are down, shared by every process
+    if (parents != NULL && ring_load(parents) != 0) {
+        fprintf(stderr, "Error loading the parents.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Origin latencies for hedging, shared by every process
+    if (hedge_pct > 0 && hedge_init(hedge_pct) != 0) {
+        fprintf(stderr, "Error initializing hedging.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Prefetch jobs and the model of what clients ask for next, shared by
+    // every process
+    if ((prefetch_jobs > 0 || predict_budget > 0) &&
+        prefetch_init(prefetch_jobs > 0 ? prefetch_jobs : PREDICT_JOBS) != 0) {
+        fprintf(stderr, "Error initializing prefetching.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (predict_budget > 0 && predict_init(predict_budget) != 0) {
+        fprintf(stderr, "Error initializing prediction.\n");
+        exit(EXIT_FAILURE);
+    }
+    // The state of a previous generation not taken over above is dropped
+    shm_forget();
+    // A peer that hangs up (a client gone mid-response, an origin dropping
+    // a pipeline) is found out by a failed send, which must not kill the
+    // process: a worker killed mid-fetch would also never hand back its
+    // origin limit slot
+    signal(SIGPIPE, SIG_IGN);
+
     // Register signal handler
     struct sigaction sa;
     sa.sa_handler = sig_handler;
@@ -128,7 +518,80 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error setting up signal handler.\n");
         exit(-1);
     }
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction(SIGUSR2) failed");
+        fprintf(stderr, "Error setting up signal handler.\n");
+        exit(-1);
+    }
 
+    // Start the tunnel relay (before the listen socket so it never holds it)
+    tunnel_pid = tunnel_relay_start(&tunnel_fd);
+    if (tunnel_pid == -1) {
+        fprintf(stderr, "Error starting the tunnel relay.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (backends_path != NULL) {
+        checker_pid = backend_checker_start(&checker_fd);
+        if (checker_pid == -1) {
+            fprintf(stderr, "Error starting the backend checker.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (siblings != NULL) {
+        responder_pid =
+            peer_responder_start(port, cache_is_fresh, &responder_fd);
+        if (responder_pid == -1) {
+            fprintf(stderr, "Error starting the sibling query responder.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Listen (or keep listening, when started by an upgrade) and let the
+    // previous generation know it can stop accepting
+    int listeners[CORES_MAX];
+    listen_sockets(listeners, num_cores > 0 ? num_cores : 1);
+    upgrade_ready();
+
+    // Serve from one worker per core, or from this process
+    if (num_cores > 0) {
+        serve_cores(listeners);
+    } else {
+        serve(listeners[0]);
+    }
+
+    if (predict_budget > 0) {
+        long predicted, used;
+        predict_stats(&predicted, &used);
+        printf("Prediction: prefetched %ld, used %ld (%ld%%), wasted %ld\n",
+               predicted, used, predicted > 0 ? used * 100 / predicted : 0,
+               predicted - used);
+    }
+
+    // The relay exits once its open tunnels have closed, the checker and the
+    // responder once every process is gone
+    close(tunnel_fd);
+    if (checker_fd != -1) {
+        close(checker_fd);
+    }
+    if (responder_fd != -1) {
+        close(responder_fd);
+    }
+
+    // Free memory
+    printf("Freeing blocklist...\n");
+    blocklist_free(blocklist);
+    tls_free();
+
+    // Exit program
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Create the listening socket
+ *
+ * @return int Listening socket (exits on failure)
+ */
+int listen_socket() {
     // Create socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
@@ -136,10 +599,10 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Set socket options
+    // Set socket options, every per-core worker binds its own listener
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                   sizeof(opt))) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
@@ -156,72 +619,187 @@ int main(int argc, char *argv[]) {
     }
 
     // Listen for connections
-    if (listen(server_fd, 3) == -1) {
+    if (listen(server_fd, LISTEN_BACKLOG) == -1) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    // Handle incoming connections
-    while (running) {
-        // Accept connection
-        int addrlen = sizeof(address);
-        int fd      = accept(server_fd, (struct sockaddr *)&address,
-                             (socklen_t *)&addrlen);
-        if (fd == -1) {
-            // If accept() was interrupted by a signal, try again
-            continue;
-        }
+    return server_fd;
+}
 
-        // Fork process
-        pid_t pid = fork();
-        // pid_t pid = 0;
-        if (pid == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+/**
+ * @brief Create the listening sockets, taking over the ones the previous
+ * generation passed down on an upgrade. Extra inherited listeners are
+ * closed, missing ones are created.
+ *
+ * @param fds Listening sockets (output)
+ * @param n Number of listening sockets
+ */
+void listen_sockets(int *fds, int n) {
+    int   taken = 0;
+    char *env   = getenv(UPGRADE_LISTEN_ENV);
+    if (env != NULL) {
+        char *list = strdup(env);
+        char *saveptr;
+        for (char *fd = strtok_r(list, ",", &saveptr); fd != NULL;
+             fd       = strtok_r(NULL, ",", &saveptr)) {
+            if (taken < n) {
+                fds[taken] = atoi(fd);
+                fcntl(fds[taken++], F_SETFD, FD_CLOEXEC);
+            } else {
+                close(atoi(fd));
+            }
         }
+        free(list);
+        unsetenv(UPGRADE_LISTEN_ENV);
+        printf("Took over %d listeners\n", taken);
+        fflush(stdout);
+    }
+    for (int i = taken; i < n; i++) {
+        fds[i] = listen_socket();
+    }
+}
 
-        // Child process
-        if (pid == 0) {
-            parent = 0;
-
-            // Close server socket
-            close(server_fd);
+/**
+ * @brief Accept and serve client connections until SIGINT, then wait for the
+ * connections in progress
+ *
+ * @param server_fd Listening socket (closed by this function)
+ */
+void serve(int server_fd) {
+    // Accept through io_uring, falling back to accept() on older kernels
+    if (use_uring) {
+        if (uring_init(&accept_ring, URING_ENTRIES) != 0) {
+            perror("io_uring_setup");
+            fprintf(stderr, "io_uring is not available, using accept().\n");
+            use_uring = 0;
+        } else {
+            uring_prep_accept_multishot(uring_get_sqe(&accept_ring),
+                                        server_fd);
+            if (handoff_rx != -1) {
+                uring_prep_poll_multishot(uring_get_sqe(&accept_ring),
+                                          handoff_rx, HANDOFF_TAG);
+            }
+        }
+    }
 
-            // Handle request
-            connection_t connection = {
-                .fd = fd,
-                .ip = {0},
-            };
-            // Populate the IP address field
-            if (inet_ntop(AF_INET, &address.sin_addr, connection.ip,
-                          INET_ADDRSTRLEN) == NULL) {
-                perror("inet_ntop");
+    // Start the worker threads
+    pthread_t threads[THREADS_MAX];
+    if (num_threads > 0) {
+        accept_queue = queue_create(ACCEPT_QUEUE_SIZE);
+        if (accept_queue == NULL) {
+            fprintf(stderr, "Error creating the accept queue.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Leave the signals to the accept loop
+        sigset_t mask, old_mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+        for (int i = 0; i < num_threads; i++) {
+            if (pthread_create(&threads[i], NULL, worker_thread, NULL) != 0) {
+                fprintf(stderr, "Error creating worker thread.\n");
                 exit(EXIT_FAILURE);
             }
-            handle_request(&connection);
-
-            // Close client socket
-            close(fd);
+        }
+        fetch_pool = workpool_create(num_threads);
+        if (fetch_pool == NULL) {
+            fprintf(stderr, "Error creating the fetch pool.\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
 
-            // Free memory
-            blocklist_free(blocklist);
+    // Queue the connections over the limit
+    if (max_active > 0) {
+        admission      = admission_create();
+        admission_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (admission == NULL || admission_wake == -1) {
+            fprintf(stderr, "Error creating the admission queue.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (use_uring) {
+            uring_prep_poll_multishot(uring_get_sqe(&accept_ring),
+                                      admission_wake, WAKE_TAG);
+        }
+    }
 
-            // Exit child process
-            exit(EXIT_SUCCESS);
+    // Handle incoming connections
+    int fds[ACCEPT_BATCH];
+    int batch = 0, next = 0;
+    while (running) {
+        // Accept connection
+        if (next == batch) {
+            // Once the new binary is serving, stop accepting and drain
+            if (upgrading) {
+                upgrading = 0;
+                if (core_index == -1 && upgrade(&server_fd, 1) == 0) {
+                    break;
+                }
+            }
+            // Serve the waiting connections there is room for
+            if (admission != NULL) {
+                admission_run(server_fd);
+            }
+            next  = 0;
+            batch = accept_batch(server_fd, fds, ACCEPT_BATCH);
+            // If accept() was interrupted by a signal, try again
+            continue;
         }
+        int fd = fds[next++];
 
-        // Parent process
-        else {
-            num_children++;
-            // Close client socket
-            close(fd);
+        // Wait for a slot
+        if (admission != NULL) {
+            if (admission_push(admission, fd, timer_now_ms()) != 0) {
+                admission_reject(fd);
+            }
+            continue;
         }
+
+        serve_client(server_fd, fd, fds + next, batch - next);
     }
 
     printf("Stopping the proxy...\n");
+    if (core_index != -1) {
+        printf("Core worker %d: %ld of %ld connections arrived on its CPU\n",
+               core_index, core_local, core_accepted);
+    }
+    if (handoff_rx != -1) {
+        printf("Core worker %d: took %ld requests from other workers\n",
+               core_index, handoff_in);
+    }
 
     // Close server socket
     close(server_fd);
+    for (int i = next; i < batch; i++) {
+        handoff_claim(fds[i], NULL);
+        close(fds[i]);
+    }
+    uring_free(&accept_ring);
+    if (admission != NULL) {
+        int fd;
+        while (admission_head(admission, timer_now_ms(), &fd) != -1) {
+            admission_pop(admission, timer_now_ms());
+            admission_reject(fd);
+        }
+        printf("Admission: shed %ld late connections, kept %ld cache hits\n",
+               admission_shed, admission_kept);
+        admission_free(admission);
+        admission = NULL;
+    }
+
+    // Let the worker threads finish the queued connections
+    if (num_threads > 0) {
+        queue_close(accept_queue);
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        queue_free(accept_queue);
+        workpool_free(fetch_pool);
+        printf("All threads exited (%d)\n", num_threads);
+    }
 
     // Block the SIGCHLD signal
     sigset_t mask;
@@ -238,190 +816,2165 @@ int main(int argc, char *argv[]) {
         num_children--;
     }
     printf("All children exited (%d)\n", num_children);
-
-    // Free memory
-    printf("Freeing blocklist...\n");
-    blocklist_free(blocklist);
-
-    // Exit program
-    return EXIT_SUCCESS;
+    if (admission_wake != -1) {
+        int wake       = admission_wake;
+        admission_wake = -1;
+        close(wake);
+    }
 }
 
 /**
- * @brief Handle incoming request
- * @details This function is responsible for handling incoming requests. It
- * parses the request, checks if the requested URL is blocked, and forwards the
- * request to the server. It then parses the response and forwards it to the
- * client.
+ * @brief Serve an accepted connection from a worker thread or a forked child
  *
- * @param connection The connection to handle
+ * @param server_fd Listening socket (closed in the child)
+ * @param fd Client socket
+ * @param rest Accepted sockets still waiting in this batch (closed in the
+ * child)
+ * @param nrest Number of sockets in rest
  */
-void handle_request(connection_t *connection) {
-    http_message_t *message  = NULL;
-    request_t      *request  = NULL;
-    response_t     *response = NULL;
-
-    // Recv the request from the client
-    message = http_message_recv(connection);
-    if (message == NULL) {
-        fprintf(stderr, "Error: Failed to receive the request\n");
-        return;
-    }
-    request = request_parse(message);
-    if (request == NULL) {
-        fprintf(stderr, "Error: Failed to parse the request\n");
-        response_send_error(connection, 400, "Bad Request");
+void serve_client(int server_fd, int fd, int *rest, int nrest) {
+    // Hand the connection to a worker thread
+    if (num_threads > 0) {
+        threads_active++;
+        if (queue_push(accept_queue, fd) != 0) {
+            fprintf(stderr, "Error: Accept queue is full\n");
+            threads_active--;
+            handoff_claim(fd, NULL);
+            close(fd);
+        }
         return;
     }
 
-    // Check if the request is in the blocklist
-    if (blocklist_check(blocklist, request->host)) {
-        response_send_error(connection, 403, "Forbidden");
-        fprintf(stderr, "Error: Request is in the blocklist\n");
-        request_free(request);
-        return;
+    // Fork process
+    pid_t pid = fork();
+    // pid_t pid = 0;
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
     }
 
-    // connection_keep_alive = request_is_connection_keep_alive(request);
-    // connection_keep_alive |= !http_message_header_compare(
-    //     message, "Proxy-Connection", "Keep-Alive");
-    // fprintf(stderr, "Connection: Keep-Alive = %d\n", connection_keep_alive);
-    http_message_header_set(message, "Connection", "close");
-
-    // Add the proxy headers
-    http_message_header_set(message, "Forwarded", connection->ip);
-    http_message_header_set(message, "Via", "1.1 MatthewTetaProxy");
-    // Remove proxy headers
-    http_message_header_remove(message, "Proxy-Connection");
-    http_message_header_remove(message, "Proxy-Authorization");
-    http_message_header_remove(message, "Proxy-Authenticate");
+    // Child process
+    if (pid == 0) {
+        parent = 0;
 
-    // Send the request to the serve
-    // Get a hash key from the request
-    char key[1024];
-    request_get_key(request, key, 1024);
-    uint8_t hash[16];
-    char    hash_str[33];
-    // Compute the MD5 hash of the request key
-    md5String(key, hash);
-    // Convert the hash to a string for the cache entry path
-    for (int i = 0; i < 16; i++) {
-        sprintf(hash_str + (i * 2), "%02x", hash[i]);
-    }
-    char path[2048], meta_path[2048];
-    snprintf(path, 2048, "%s/%s", cache_path, hash_str);
-    snprintf(meta_path, 2048, "%s/.%s", cache_path, hash_str);
-    printf("Cache path: %s\n", path);
-    // Touch the file
-    int fd = open(path, O_RDONLY | O_CREAT);
-    // if (fd != -1)
-    //     close(fd);
-    // Check if the request is in the cache
-    // fd = open(path, __O_PATH, 0644);
-    // while (fd == -1) {
-    //     printf("Waiting for file to be created...\n");
-    //     fd = open(path, O_RDONLY | O_CREAT | O_EXCL);
-    //     if (fd != 1)
-    //         break;
-    //     sleep(1);
-    // }
-    if (fd == -1) {
-        perror("open");
-        request_free(request);
-        exit(EXIT_FAILURE);
-    }
-    printf("File descriptor: %d\n", fd);
-    if (flock(fd, LOCK_EX) == -1) {
-        perror("flock");
-        exit(EXIT_FAILURE);
-    }
-    // Get a file descriptor for the cached response
-    FILE *f, *f2;
-    f = fdopen(fd, "r");
-    if (f != NULL) {
-        // Check if the cached response is still valid
-        struct stat attr;
-        stat(path, &attr);
-        time_t now = time(NULL);
-        // Check if the file is empty
-        if (attr.st_size == 0) {
-            printf("Cached response is empty\n");
-            // fclose(f);
-            remove(path);
-        } else if (difftime(now, attr.st_ctime) > cache_timeout) {
-            printf("Cached response is stale\n");
-            // Remove the cached response
-            // fclose(f);
-            remove(path);
-        } else {
-            printf("Cached response is valid\n");
-            // Read the response from the cache
-            response = response_read(f);
-            // fclose(f);
-            if (response == NULL) {
-                fprintf(stderr, "Error: Failed to read the cached response\n");
-            }
+        // Close server socket
+        close(server_fd);
+        uring_free(&accept_ring);
+        for (int i = 0; i < nrest; i++) {
+            close(rest[i]);
         }
-    }
-    // If the response is not in the cache, fetch it from the server
-    if (response == NULL) {
-        printf("Fetching response from the server\n");
-        response = response_fetch(request);
-        if (response == NULL) {
-            fprintf(stderr, "Error: Failed to send the request\n");
-            response_send_error(connection, 500, "Internal Server Error");
-            request_free(request);
-            // Unlock the cache entry
-            if (flock(fd, LOCK_UN) == -1) {
-                perror("flock");
-                exit(EXIT_FAILURE);
-            }
-            close(fd);
-            return;
+        if (handoff_rx != -1) {
+            close(handoff_rx);
         }
-        fclose(f);
-        // Cache the response
-        f = fopen(path, "w");
-        if (f == NULL) {
-            fprintf(stderr, "Error: Failed to cache the response\n");
-        } else {
-            fd = fileno(f);
-            f2 = fopen(meta_path, "w");
-            if (f2 == NULL) {
-                fprintf(stderr, "Error: Failed to cache the response\n");
-            } else {
-                fprintf(f2, "%s", key);
-                fclose(f2);
-            }
-            if (0 != response_write(response, f)) {
-                fprintf(stderr, "Error: Failed to cache the response\n");
-                // fclose(f);
-                remove(path);
-            } else {
-                // fclose(f);
+        if (admission != NULL) {
+            int queued;
+            while (admission_head(admission, timer_now_ms(), &queued) != -1) {
+                admission_pop(admission, timer_now_ms());
+                close(queued);
             }
+            close(admission_wake);
+            admission_wake = -1;
+        }
+
+        // Reap pipelined fetch workers automatically
+        signal(SIGCHLD, SIG_IGN);
+
+        // Handle request
+        connection_t connection = {
+            .fd = fd,
+            .ip = {0},
+        };
+        // Populate the IP address field
+        if (peer_ip(fd, connection.ip) != 0) {
+            exit(EXIT_FAILURE);
         }
+        handoff_claim(fd, &connection);
+        handle_connection(&connection);
+
+        // Close client socket
+        close_connection(&connection);
+
+        // Free memory
+        blocklist_free(blocklist);
+
+        // Exit child process
+        exit(EXIT_SUCCESS);
     }
-    // Unlock the cache entry
-    if (flock(fd, LOCK_UN) == -1) {
-        perror("flock");
-        exit(EXIT_FAILURE);
+
+    // Parent process
+    else {
+        num_children++;
+        // Close client socket
+        handoff_claim(fd, NULL);
+        close(fd);
     }
-    close(fd);
+}
 
+/**
+ * @brief Serve waiting connections while there is a free slot, and turn away
+ * the late ones
+ * @details Shedding goes from the oldest connection. A late connection whose
+ * request (as far as it has arrived) is a fresh cache hit is kept: it is
+ * cheap to serve, so it is not made to wait behind origin fetches and may
+ * take one of max_active reserve slots.
+ *
+ * @param server_fd Listening socket
+ */
+void admission_run(int server_fd) {
+    uint64_t now = timer_now_ms();
+    int      fd, late;
+    while ((late = admission_head(admission, now, &fd)) != -1) {
+        if (late && !cache_probe(fd)) {
+            admission_pop(admission, now);
+            admission_reject(fd);
+            continue;
+        }
+        // Late cache hits may use a reserve of as many slots again
+        int active = num_threads > 0 ? threads_active : num_children;
+        if (active >= (late ? 2 * max_active : max_active)) {
+            break;
+        }
+        admission_kept += late;
+        admission_pop(admission, now);
+        serve_client(server_fd, fd, NULL, 0);
+    }
+}
+
+/**
+ * @brief Turn a connection away with 503 and a Retry-After, without blocking
+ * the accept loop
+ *
+ * @param fd Client socket (closed)
+ */
+void admission_reject(int fd) {
+    static const char reply[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                "Retry-After: " ADMISSION_RETRY_AFTER "\r\n"
+                                "Content-Length: 0\r\n"
+                                "Connection: close\r\n\r\n";
+    char              buffer[HTTP_MESSAGE_MAX_HEADER_SIZE];
+    // Read what the request sent so far, closing with unread bytes would
+    // reset the connection before the client sees the reply
+    if (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) == -1 &&
+        errno != EAGAIN) {
+        perror("recv");
+    }
+    if (send(fd, reply, sizeof(reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+        -1) {
+        perror("send");
+    }
+    handoff_claim(fd, NULL);
+    close(fd);
+    admission_shed++;
+}
+
+/**
+ * @brief Check if the request waiting on a connection is a fresh cache hit,
+ * without reading it off the socket
+ *
+ * @param fd Client socket
+ * @return int 1 if it is, 0 if it is not or has not fully arrived yet
+ */
+int cache_probe(int fd) {
+    char    buffer[HTTP_MESSAGE_MAX_HEADER_SIZE];
+    ssize_t len = recv(fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+    char   *end = len > 0 ? memmem(buffer, len, "\r\n\r\n", 4) : NULL;
+    if (end == NULL) {
+        return 0;
+    }
+    size_t header_len = end + 4 - buffer;
+    char  *header     = malloc(header_len + 1);
+    if (header == NULL) {
+        return 0;
+    }
+    memcpy(header, buffer, header_len);
+    header[header_len] = '\0';
+    request_t *request =
+        request_parse(http_message_create_from_buffer(header, header_len));
+    if (request == NULL) {
+        return 0;
+    }
+    char key[1024];
+    request_get_key(request, key, 1024);
+    request_free(request);
+    return key[0] != '\0' && cache_is_fresh(key);
+}
+
+/**
+ * @brief Pin the calling process to a CPU and keep its memory on that CPU's
+ * NUMA node
+ *
+ * @param cpu CPU
+ */
+void core_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+    }
+    // Allocate from the local node of whichever CPU runs the allocation
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1) {
+        perror("set_mempolicy");
+    }
+}
+
+/**
+ * @brief Attach a reuseport program that picks the listener by the CPU that
+ * received the connection: CPU c goes to listener c % n, the one whose
+ * worker is pinned to c when there is a worker per CPU
+ *
+ * @param fd Any listener of the reuseport group
+ * @param n Number of listeners in the group
+ * @return int 0 on success, -1 on failure
+ */
+int steer_attach(int fd, int n) {
+    struct sock_filter code[] = {
+        // A = receiving CPU
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        // A = A % n
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)n},
+        // Return A as the listener index
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {
+        .len    = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) == -1) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Serve from one worker process per core
+ * @details Each worker is pinned to its own CPU and has its own
+ * SO_REUSEPORT listener, so the kernel spreads new connections over the
+ * workers without a shared accept queue. Workers share nothing but the cache
+ * directory: the blocklist and origin TLS context are reloaded after pinning
+ * so they live on the worker's node. The origin pool and DNS cache are per
+ * thread with -w; without it they belong to the process of one client
+ * connection, so a worker only reuses them across that client's requests.
+ * SIGINT is passed on to every worker.
+ * With key affinity every worker also gets a handoff socket, through which
+ * the others pass it the connections whose request key it owns.
+ *
+ * @param listeners Listening socket of every worker, in worker order. The
+ * parent keeps them all open so listener i stays index i of the reuseport
+ * group (closing one would reorder the group) and can pass them on to an
+ * upgrade.
+ */
+void serve_cores(int *listeners) {
+    long  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t pids[CORES_MAX];
+    int   handoff_rxs[CORES_MAX];
+    int   started = 0;
+    cpus          = cpus > 0 ? cpus : 1;
+
+    // One message per handoff: the socket, the header and the bytes after it
+    if (core_affinity) {
+        for (int i = 0; i < num_cores; i++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) ==
+                -1) {
+                perror("socketpair");
+                exit(EXIT_FAILURE);
+            }
+            handoff_rxs[i] = pair[0];
+            handoff_tx[i]  = pair[1];
+        }
+    }
+
+    // Steer by the receiving CPU (the program is per group, so this also
+    // replaces the one of a previous generation)
+    if (core_steering && steer_attach(listeners[0], num_cores) != 0) {
+        fprintf(stderr, "Connections are spread by the kernel hash.\n");
+    }
+
+    // Hold SIGINT, SIGUSR2 and SIGCHLD until the workers are accounted for
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (int i = 0; i < num_cores; i++) {
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            core_index = i;
+            core_pin(i % cpus);
+            blocklist_free(blocklist);
+            blocklist = blocklist_init(blocklist_path);
+            tls_free();
+            if (blocklist == NULL || tls_init(cache_path, tls_ca_file) != 0) {
+                fprintf(stderr, "Error initializing core worker %d.\n", i);
+                exit(EXIT_FAILURE);
+            }
+            if (core_affinity) {
+                for (int j = 0; j < num_cores; j++) {
+                    if (j != i) {
+                        close(handoff_rxs[j]);
+                    }
+                }
+                handoff_rx = handoff_rxs[i];
+                fcntl(handoff_rx, F_SETFL, O_NONBLOCK);
+            }
+            for (int j = 0; j < num_cores; j++) {
+                if (j != i) {
+                    close(listeners[j]);
+                }
+            }
+            serve(listeners[i]);
+            close(tunnel_fd);
+            blocklist_free(blocklist);
+            tls_free();
+            exit(EXIT_SUCCESS);
+        }
+        pids[started++] = pid;
+        num_children++;
+    }
+    printf("Started %d core workers on %ld CPUs\n", started, cpus);
+    if (core_affinity) {
+        for (int i = 0; i < num_cores; i++) {
+            close(handoff_rxs[i]);
+            close(handoff_tx[i]);
+        }
+    }
+
+    // Wait for SIGINT (or for every worker to be gone), or for SIGUSR2 and
+    // the new binary to take over the listeners
+    while (running && num_children > 0) {
+        sigsuspend(&old_mask);
+        if (upgrading) {
+            upgrading = 0;
+            if (upgrade(listeners, num_cores) == 0) {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        kill(pids[i], SIGINT);
+    }
+    while (num_children > 0) {
+        if (wait(NULL) == -1) {
+            break;
+        }
+        num_children--;
+    }
+    printf("All core workers exited\n");
+    for (int i = 0; i < num_cores; i++) {
+        close(listeners[i]);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/**
+ * @brief Start the new binary on the same listening sockets
+ * @details The binary is started the way this one was (same command line),
+ * with only the listeners and the shared segments inherited: their numbers go
+ * in PROXY_LISTEN_FDS and PROXY_SHARED_FDS (see shm.h).
+ * It is forked twice so it is not a child this generation waits for. Once
+ * it is serving it writes its pid to the pipe in PROXY_READY_FD, and this
+ * generation stops accepting and finishes the connections it has. If the new
+ * binary fails before that, the pipe closes and this one keeps serving.
+ *
+ * @param fds Listening sockets
+ * @param n Number of listening sockets
+ * @return int 0 once the new binary is serving, -1 on failure
+ */
+int upgrade(int *fds, int n) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    // Reap the intermediate child here, not in the SIGCHLD handler
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() != 0) {
+            _exit(EXIT_SUCCESS);
+        }
+        // Nothing but the listeners, the shared segments and the pipe
+        // survives the exec
+        if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) == -1) {
+            perror("close_range");
+        }
+        char list[CORES_MAX * 12] = "", fd[16];
+        for (int i = 0; i < n; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+            snprintf(fd, sizeof(fd), i > 0 ? ",%d" : "%d", fds[i]);
+            strcat(list, fd);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        snprintf(fd, sizeof(fd), "%d", ready[1]);
+        setenv(UPGRADE_LISTEN_ENV, list, 1);
+        setenv(UPGRADE_READY_ENV, fd, 1);
+        shm_export();
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execvp(exec_argv[0], exec_argv);
+        perror("execvp");
+        _exit(EXIT_FAILURE);
+    }
+    if (pid != -1) {
+        waitpid(pid, NULL, 0);
+    } else {
+        perror("fork");
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    close(ready[1]);
+
+    // Wait for the new binary to be serving (EOF if it failed)
+    pid_t   new_pid = -1;
+    ssize_t len;
+    do {
+        len = read(ready[0], &new_pid, sizeof(new_pid));
+    } while (len == -1 && errno == EINTR);
+    close(ready[0]);
+    if (len != sizeof(new_pid)) {
+        fprintf(stderr, "Error: The new binary did not start, still serving\n");
+        return -1;
+    }
+    printf("Handed the listeners to pid %d, draining...\n", new_pid);
+    return 0;
+}
+
+/**
+ * @brief Tell the generation that started this one (if any) that this one
+ * is serving, so it can stop accepting
+ */
+void upgrade_ready() {
+    char *env = getenv(UPGRADE_READY_ENV);
+    if (env == NULL) {
+        return;
+    }
+    int fd = atoi(env);
+    unsetenv(UPGRADE_READY_ENV);
+    pid_t pid = getpid();
+    if (write(fd, &pid, sizeof(pid)) != sizeof(pid)) {
+        perror("write");
+    }
+    close(fd);
+}
+
+/**
+ * @brief Serve connections from the accept queue until it is closed
+ *
+ * @param arg Unused
+ * @return void* NULL
+ */
+void *worker_thread(void *arg) {
+    int fd;
+    while (queue_pop(accept_queue, &fd) == 0) {
+        connection_t connection = {.fd = fd};
+        if (peer_ip(fd, connection.ip) != 0) {
+            handoff_claim(fd, NULL);
+            close(fd);
+            threads_active--;
+            continue;
+        }
+        handoff_claim(fd, &connection);
+        handle_connection(&connection);
+        close_connection(&connection);
+        // Free the slot and let the accept loop fill it
+        threads_active--;
+        if (admission_wake != -1) {
+            uint64_t one = 1;
+            if (write(admission_wake, &one, sizeof(one)) == -1) {
+                perror("write");
+            }
+        }
+    }
+    // The origin pool belongs to this thread
+    pool_close_all();
+    return NULL;
+}
+
+/**
+ * @brief Accept the next batch of client connections
+ * @details With io_uring a single multishot accept stays armed. Waiting for
+ * it and re-arming it share one io_uring_enter(), and every socket that was
+ * accepted meanwhile is taken from the completion queue in the same loop
+ * iteration. Otherwise this is one accept(). Connections handed over by other
+ * per-core workers are taken in the same batch, and a slot freed for the
+ * admission queue ends the wait.
+ *
+ * @param server_fd Listening socket
+ * @param fds Accepted sockets (output)
+ * @param max Size of fds
+ * @return int Number of accepted sockets, 0 if interrupted
+ */
+int accept_batch(int server_fd, int *fds, int max) {
+    // Wake up to shed the oldest waiting connection once it turns late. If it
+    // already is, it is a cache hit kept for the next free slot.
+    int wait_ms = admission != NULL
+                      ? admission_wait_ms(admission, timer_now_ms())
+                      : -1;
+    wait_ms     = wait_ms == 0 ? -1 : wait_ms;
+    if (!use_uring) {
+        int n = 0;
+        if (handoff_rx != -1 || admission_wake != -1) {
+            // Negative descriptors are left out of the poll
+            struct pollfd pfds[3] = {
+                {.fd = server_fd, .events = POLLIN},
+                {.fd = handoff_rx, .events = POLLIN},
+                {.fd = admission_wake, .events = POLLIN},
+            };
+            if (poll(pfds, 3, wait_ms) == -1) {
+                return 0;
+            }
+            if (pfds[2].revents != 0) {
+                uint64_t count;
+                if (read(admission_wake, &count, sizeof(count)) == -1) {
+                    perror("read");
+                }
+            }
+            handoff_ready = pfds[1].revents != 0;
+            n             = handoff_take(fds, max - 1);
+            if (pfds[0].revents == 0) {
+                return n;
+            }
+        }
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd == -1) {
+            return n;
+        }
+        core_count(fd);
+        fds[n++] = fd;
+        return n;
+    }
+    static struct __kernel_timespec timeout;
+    static int                      timer_armed = 0;
+    if (wait_ms > 0 && !timer_armed) {
+        timeout.tv_sec  = wait_ms / 1000;
+        timeout.tv_nsec = (wait_ms % 1000) * 1000000L;
+        uring_prep_timeout(uring_get_sqe(&accept_ring), &timeout, TIMER_TAG);
+        timer_armed = 1;
+    }
+    if (uring_peek_cqe(&accept_ring) == NULL &&
+        uring_submit(&accept_ring, handoff_ready ? 0 : 1) == -1) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return 0;
+    }
+    int                  n = 0;
+    struct io_uring_cqe *cqe;
+    while (n < max && (cqe = uring_peek_cqe(&accept_ring)) != NULL) {
+        int           res       = cqe->res;
+        unsigned      flags     = cqe->flags;
+        unsigned long user_data = cqe->user_data;
+        uring_cqe_seen(&accept_ring);
+        if (user_data == TIMER_TAG) {
+            timer_armed = 0;
+            break;
+        }
+        if (user_data == WAKE_TAG) {
+            uint64_t count;
+            if (read(admission_wake, &count, sizeof(count)) == -1 &&
+                errno != EAGAIN) {
+                perror("read");
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                uring_prep_poll_multishot(uring_get_sqe(&accept_ring),
+                                          admission_wake, WAKE_TAG);
+            }
+            // Back to the accept loop to fill the freed slots
+            break;
+        }
+        if (user_data == HANDOFF_TAG) {
+            handoff_ready = 1;
+            if (!(flags & IORING_CQE_F_MORE)) {
+                uring_prep_poll_multishot(uring_get_sqe(&accept_ring),
+                                          handoff_rx, HANDOFF_TAG);
+            }
+            continue;
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            // The kernel stopped the multishot, arm it again with the next
+            // submit
+            uring_prep_accept_multishot(uring_get_sqe(&accept_ring),
+                                        server_fd);
+        }
+        if (res < 0) {
+            fprintf(stderr, "Error: accept: %s\n", strerror(-res));
+            continue;
+        }
+        core_count(res);
+        fds[n++] = res;
+    }
+    // The poll only fires on new handoffs, so take them all before waiting
+    return n + handoff_take(fds + n, max - n);
+}
+
+/**
+ * @brief Get the IP address of a client
+ *
+ * @param fd Client socket
+ * @param ip IP address (output, at least INET_ADDRSTRLEN bytes)
+ * @return int 0 on success, -1 on failure
+ */
+int peer_ip(int fd, char *ip) {
+    struct sockaddr_in address;
+    socklen_t          addrlen = sizeof(address);
+    if (getpeername(fd, (struct sockaddr *)&address, &addrlen) == -1) {
+        perror("getpeername");
+        return -1;
+    }
+    if (inet_ntop(AF_INET, &address.sin_addr, ip, INET_ADDRSTRLEN) == NULL) {
+        perror("inet_ntop");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Count an accepted connection, and whether its packets were handled
+ * on this per-core worker's CPU
+ *
+ * @param fd Accepted socket
+ */
+void core_count(int fd) {
+    if (core_index == -1) {
+        return;
+    }
+    int       cpu = -1;
+    socklen_t len = sizeof(cpu);
+    getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len);
+    core_local += cpu == sched_getcpu();
+    core_accepted++;
+}
+
+/**
+ * @brief Find the per-core worker that owns the key of a request
+ *
+ * @param connection Client connection
+ * @param request Parsed request
+ * @return int Index of the owner, -1 if the request is served here
+ */
+int core_owner(connection_t *connection, request_t *request) {
+    if (!core_affinity || core_index == -1 || connection->ssl != NULL) {
+        return -1;
+    }
+    char key[1024];
+    request_get_key(request, key, 1024);
+    if (key[0] == '\0') {
+        return -1;
+    }
+    uint8_t hash[16];
+    md5String(key, hash);
+    uint32_t h;
+    memcpy(&h, hash, sizeof(h));
+    int owner = h % num_cores;
+    return owner == core_index ? -1 : owner;
+}
+
+/**
+ * @brief Hand a client connection to another per-core worker, along with the
+ * request that was read from it and everything read past that request. The
+ * owner parses the request again and serves the connection from then on.
+ *
+ * @param connection Client connection (left to be closed by the caller)
+ * @param request Parsed request (freed on success)
+ * @param owner Index of the worker to hand the connection to
+ * @return int 0 on success, -1 if the request has to be served here
+ */
+int handoff_send(connection_t *connection, request_t *request, int owner) {
+    char  *header;
+    size_t header_len;
+    http_get_message_buffer(request->message, &header, &header_len);
+    size_t len = header_len + connection->pending_len;
+    if (len > HANDOFF_MAX) {
+        return -1;
+    }
+    char *data = malloc(len);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, header, header_len);
+    memcpy(data + header_len, connection->pending, connection->pending_len);
+    int rv = connection_send_fds(handoff_tx[owner], &connection->fd, 1, data,
+                                 len);
+    free(data);
+    if (rv != 0) {
+        return -1;
+    }
+    request_free(request);
+    return 0;
+}
+
+/**
+ * @brief Take the connections handed over by other per-core workers
+ *
+ * @param fds Handed over sockets (output)
+ * @param max Size of fds
+ * @return int Number of sockets taken
+ */
+int handoff_take(int *fds, int max) {
+    static char data[HANDOFF_MAX];
+    int         n = 0;
+    while (handoff_ready && n < max) {
+        int     fd;
+        ssize_t len = connection_recv_fds(handoff_rx, &fd, 1, data, HANDOFF_MAX);
+        if (len <= 0) {
+            if (len == -1 && errno != EAGAIN) {
+                perror("recvmsg");
+            }
+            handoff_ready = 0;
+            break;
+        }
+        handoff_t *handoff = malloc(sizeof(handoff_t));
+        if (handoff == NULL || (handoff->data = malloc(len)) == NULL) {
+            free(handoff);
+            close(fd);
+            continue;
+        }
+        memcpy(handoff->data, data, len);
+        handoff->fd  = fd;
+        handoff->len = len;
+        pthread_mutex_lock(&handoffs_lock);
+        handoff->next = handoffs;
+        handoffs      = handoff;
+        pthread_mutex_unlock(&handoffs_lock);
+        handoff_in++;
+        fds[n++] = fd;
+    }
+    return n;
+}
+
+/**
+ * @brief Pick up the bytes handed over with a connection, if it was handed
+ * over, so they are read before the socket
+ *
+ * @param fd Client socket
+ * @param connection Connection to push the bytes back onto (NULL to drop
+ * them)
+ */
+void handoff_claim(int fd, connection_t *connection) {
+    if (!core_affinity) {
+        return;
+    }
+    pthread_mutex_lock(&handoffs_lock);
+    handoff_t **link = &handoffs;
+    while (*link != NULL && (*link)->fd != fd) {
+        link = &(*link)->next;
+    }
+    handoff_t *handoff = *link;
+    if (handoff != NULL) {
+        *link = handoff->next;
+    }
+    pthread_mutex_unlock(&handoffs_lock);
+    if (handoff == NULL) {
+        return;
+    }
+    if (connection != NULL) {
+        connection_unread(connection, handoff->data, handoff->len);
+    }
+    free(handoff->data);
+    free(handoff);
+}
+
+/**
+ * @brief Get the cache file I/O ring of this thread, setting it up on first
+ * use. Only worker threads have one: in fork mode every child would pay for
+ * setting up a ring, more than it saves.
+ *
+ * @return uring_t* Ring, NULL if cache file I/O uses plain system calls
+ */
+uring_t *cache_ring_get() {
+    static __thread int failed = 0;
+    if (!use_uring || num_threads == 0 || failed) {
+        return NULL;
+    }
+    if (cache_ring == NULL) {
+        cache_ring = malloc(sizeof(uring_t));
+        if (cache_ring == NULL || uring_init(cache_ring, URING_ENTRIES) != 0 ||
+            uring_register_direct(cache_ring) != 0) {
+            perror("io_uring");
+            if (cache_ring != NULL) {
+                uring_free(cache_ring);
+            }
+            free(cache_ring);
+            cache_ring = NULL;
+            failed     = 1;
+            return NULL;
+        }
+    }
+    return cache_ring;
+}
+
+/**
+ * @brief Read a cache entry with one read through the ring
+ *
+ * @param ring Cache file I/O ring
+ * @param fd Entry file
+ * @param size Entry size
+ * @param codec Storage codec of the body (output)
+ * @return response_t* Response, NULL on failure
+ */
+response_t *cache_read_uring(uring_t *ring, int fd, size_t size, int *codec) {
+    char *buffer = malloc(size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    ssize_t n = uring_read(ring, fd, buffer, size);
+    if (n <= 0) {
+        free(buffer);
+        return NULL;
+    }
+    FILE *f = fmemopen(buffer, n, "r");
+    if (f == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    response_t *response = response_read(f, codec);
+    fclose(f);
+    free(buffer);
+    return response;
+}
+
+/**
+ * @brief Write a cache entry and its meta file in one submission: the entry
+ * goes to fd, the meta file is opened, written and closed by linked ops on
+ * the direct descriptor
+ *
+ * @param ring Cache file I/O ring
+ * @param fd Entry file (empty)
+ * @param response Response to store
+ * @param codec Storage codec
+ * @param meta_path Meta file path
+ * @param entry_key Cache key, the meta file content
+ * @return int 0 on success, -1 on failure
+ */
+int cache_write_uring(uring_t *ring, int fd, response_t *response, int codec,
+                      char *meta_path, char *entry_key) {
+    char  *entry = NULL;
+    size_t entry_len;
+    FILE  *f = open_memstream(&entry, &entry_len);
+    if (f == NULL) {
+        return -1;
+    }
+    if (response_write(response, f, codec) != 0) {
+        fclose(f);
+        free(entry);
+        return -1;
+    }
+    fclose(f);
+
+    struct io_uring_sqe *sqe[4];
+    for (int i = 0; i < 4; i++) {
+        sqe[i] = uring_get_sqe(ring);
+        if (sqe[i] == NULL) {
+            free(entry);
+            return -1;
+        }
+    }
+    uring_prep_rw(sqe[0], IORING_OP_WRITE, fd, entry, entry_len, 0);
+    sqe[0]->user_data = 1;
+    uring_prep_open_direct(sqe[1], meta_path, O_WRONLY | O_CREAT | O_TRUNC,
+                           0644);
+    sqe[1]->flags |= IOSQE_IO_LINK;
+    uring_prep_rw(sqe[2], IORING_OP_WRITE, URING_DIRECT_FILE, entry_key,
+                  strlen(entry_key), 0);
+    sqe[2]->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    uring_prep_close_direct(sqe[3]);
+
+    int rv = uring_submit(ring, 4);
+    while (rv == -1 && errno == EINTR) {
+        rv = uring_submit(ring, 4);
+    }
+    if (rv == -1) {
+        // Nothing was submitted, the buffers are not in use
+        perror("io_uring_enter");
+        free(entry);
+        return -1;
+    }
+    // Only the entry write decides, a missing meta file is just logged
+    int entry_ok = 0;
+    for (int i = 0; i < 4; i++) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (cqe == NULL) {
+            break;
+        }
+        if (cqe->user_data == 1) {
+            entry_ok = cqe->res == (int)entry_len;
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            fprintf(stderr, "Error: Failed to write the cache meta file: %s\n",
+                    strerror(-cqe->res));
+        }
+        uring_cqe_seen(ring);
+    }
+    free(entry);
+    return entry_ok ? 0 : -1;
+}
+
+/**
+ * @brief Run a pipelined request on the fetch pool
+ *
+ * @param arg Job (freed by this function)
+ */
+void pipeline_run(void *arg) {
+    pipeline_job_t *job = arg;
+    handle_request(&job->worker, job->request, job->keep_alive);
+    close(job->worker.fd);
+    free(job);
+}
+
+/**
+ * @brief Start fetching a request in a worker process
+ * @details The worker runs handle_request() and writes the complete response
+ * to one end of a socketpair. The other end is returned so the responses can
+ * be relayed to the client in request order. In thread mode the worker is a
+ * task on the fetch pool instead, as a process forked from a thread would
+ * hold a copy of every other client's socket.
+ *
+ * @param connection Client connection
+ * @param request Parsed request (freed by this function)
+ * @param keep_alive Whether the client connection stays open after this
+ * @return int Read end of the response socket, -1 on failure
+ */
+int pipeline_start(connection_t *connection, request_t *request,
+                   int keep_alive) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        request_free(request);
+        return -1;
+    }
+    if (fetch_pool != NULL) {
+        pipeline_job_t *job = calloc(1, sizeof(pipeline_job_t));
+        if (job == NULL) {
+            fprintf(stderr, "Error: Failed to allocate a pipeline job\n");
+            close(sv[0]);
+            close(sv[1]);
+            request_free(request);
+            return -1;
+        }
+        job->worker.fd  = sv[1];
+        job->request    = request;
+        job->keep_alive = keep_alive;
+        memcpy(job->worker.ip, connection->ip, INET_ADDRSTRLEN);
+        if (workpool_spawn(fetch_pool, pipeline_run, job) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            request_free(request);
+            free(job);
+            return -1;
+        }
+        return sv[0];
+    }
+    // Don't let the worker inherit buffered output
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        request_free(request);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        close(connection->fd);
+        connection_t worker = {.fd = sv[1]};
+        memcpy(worker.ip, connection->ip, INET_ADDRSTRLEN);
+        handle_request(&worker, request, keep_alive);
+        close(sv[1]);
+        blocklist_free(blocklist);
+        exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+    request_free(request);
+    return sv[0];
+}
+
+/**
+ * @brief Relay one worker's response to the client
+ *
+ * @param connection Client connection
+ * @param fd Read end of the worker's response socket (closed by this function)
+ * @return int 0 on success, -1 if the client connection failed
+ */
+int pipeline_finish(connection_t *connection, int fd) {
+    char    buffer[PIPELINE_RELAY_BUFFER];
+    ssize_t n;
+    size_t  total = 0;
+    int     rv    = 0;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+        if (send_to_connection(connection, buffer, n) != n) {
+            rv = -1;
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    if (rv == 0 && total == 0) {
+        // The worker died without answering, keep the responses in order
+        rv = response_send_error(connection, 502, "Bad Gateway");
+    }
+    return rv;
+}
+
+/**
+ * @brief Check if a request can join a burst of GETs for one origin
+ *
+ * @param connection Client connection
+ * @param first First request of the burst
+ * @param request Request to check
+ * @return int 1 if it can, 0 otherwise
+ */
+int pipeline_fits(connection_t *connection, request_t *first,
+                  request_t *request) {
+    char key[1024];
+    request_get_key(request, key, sizeof(key));
+    return key[0] != '\0' && strcmp(request->method, "GET") == 0 &&
+           !request_has_body(request) &&
+           strcasecmp(request->host, first->host) == 0 &&
+           request->port == first->port && request->https == first->https &&
+           !request_is_only_if_cached(request) &&
+           core_owner(connection, request) == -1;
+}
+
+/**
+ * @brief Read the GETs the client has already pipelined behind a GET to the
+ * same origin
+ * @details The first request that does not fit is put back on the connection
+ * for handle_connection() to read again.
+ *
+ * @param connection Client connection
+ * @param burst Requests (burst[0] is set by the caller, the rest is output)
+ * @param max Size of burst
+ * @return int Number of requests in burst
+ */
+int pipeline_gather(connection_t *connection, request_t **burst, int max) {
+    int n = 1;
+    if (!pipeline_fits(connection, burst[0], burst[0])) {
+        return n;
+    }
+    while (n < max && request_is_connection_keep_alive(burst[n - 1]) &&
+           connection_poll(connection, 0) > 0) {
+        connection_set_deadline(connection, HTTP_HEADER_TIMEOUT_MS);
+        http_message_t *message = http_message_recv_header(connection);
+        connection_set_deadline(connection, HTTP_TRANSFER_TIMEOUT_MS);
+        if (message == NULL) {
+            break;
+        }
+        // Keep the header to put it back if the request does not fit
+        char  *header, *copy;
+        size_t header_len;
+        http_get_message_buffer(message, &header, &header_len);
+        copy = malloc(header_len);
+        if (copy == NULL) {
+            http_message_free(message);
+            break;
+        }
+        memcpy(copy, header, header_len);
+        request_t *request = request_parse(message);
+        if (request == NULL || !pipeline_fits(connection, burst[0], request)) {
+            connection_unread(connection, copy, header_len);
+            free(copy);
+            if (request != NULL) {
+                request_free(request);
+            }
+            break;
+        }
+        free(copy);
+        burst[n++] = request;
+    }
+    return n;
+}
+
+/**
+ * @brief Handle a client connection
+ * @details Requests are read from the connection in order. Up to
+ * PIPELINE_DEPTH_MAX of them are fetched concurrently by worker processes
+ * while their responses are relayed back to the client in request order.
+ * The next request is only read ahead while the client has already sent it,
+ * so clients that wait for each response are not stalled. Requests with a
+ * body are handled in this process so the body can be streamed to the origin,
+ * and so is a request with nothing before or behind it in fork mode, which
+ * keeps the origin pool alive across the client's keep-alive requests.
+ * With key affinity, a cacheable request whose key belongs to another per-core
+ * worker is passed to that worker together with the connection. With -p, the
+ * cache misses among GETs pipelined to one origin are first fetched here on
+ * one pipelined origin connection, and the workers answer from the cache.
+ *
+ * @param connection The connection to handle
+ */
+void handle_connection(connection_t *connection) {
+    int pipeline[PIPELINE_DEPTH_MAX];
+    int head = 0, depth = 0;
+    int reading = 1;
+
+    while (reading || depth > 0) {
+        if (reading && depth < PIPELINE_DEPTH_MAX &&
+            (depth == 0 || connection_poll(connection, 0) > 0)) {
+            if (depth == 0) {
+                // Idle client, wait for the next request
+                connection_set_deadline(connection, KEEP_ALIVE_TIMEOUT_MS);
+                if (connection_poll(connection, -1) <= 0) {
+                    reading = 0;
+                    continue;
+                }
+            }
+            // Recv the request from the client, the whole header within one
+            // deadline however slowly it trickles in
+            connection_set_deadline(connection, HTTP_HEADER_TIMEOUT_MS);
+            http_message_t *message = http_message_recv_header(connection);
+            if (message == NULL) {
+                reading = 0;
+                continue;
+            }
+            connection_set_deadline(connection, HTTP_TRANSFER_TIMEOUT_MS);
+            request_t *request = request_parse(message);
+            if (request == NULL) {
+                fprintf(stderr, "Error: Failed to parse the request\n");
+                // Answer everything before the bad request first
+                while (depth > 0) {
+                    pipeline_finish(connection, pipeline[head]);
+                    head = (head + 1) % PIPELINE_DEPTH_MAX;
+                    depth--;
+                }
+                response_send_error(connection, 400, "Bad Request");
+                return;
+            }
+            int owner = core_owner(connection, request);
+            if (owner != -1) {
+                // The owner takes over the connection once everything before
+                // the request has been answered
+                while (depth > 0) {
+                    pipeline_finish(connection, pipeline[head]);
+                    head = (head + 1) % PIPELINE_DEPTH_MAX;
+                    depth--;
+                }
+                if (handoff_send(connection, request, owner) == 0) {
+                    return;
+                }
+            }
+            if (strcmp(request->method, "CONNECT") == 0) {
+                // The connection becomes a tunnel once everything before it
+                // has been answered
+                while (depth > 0) {
+                    pipeline_finish(connection, pipeline[head]);
+                    head = (head + 1) % PIPELINE_DEPTH_MAX;
+                    depth--;
+                }
+                handle_tunnel(connection, request);
+                return;
+            }
+            int keep_alive = request_is_connection_keep_alive(request);
+            if (request_has_body(request)) {
+                // The body is still on the connection, so the request is
+                // handled here once everything before it has been answered
+                while (depth > 0) {
+                    pipeline_finish(connection, pipeline[head]);
+                    head = (head + 1) % PIPELINE_DEPTH_MAX;
+                    depth--;
+                }
+                request->client = connection;
+                if (handle_request(connection, request, keep_alive) != 0) {
+                    return;
+                }
+                reading = keep_alive;
+                continue;
+            }
+            request_t *burst[PIPELINE_DEPTH_MAX] = {request};
+            int        keep[PIPELINE_DEPTH_MAX]  = {keep_alive};
+            int        n                         = 1;
+            if (upstream_pipelining) {
+                n = pipeline_gather(connection, burst,
+                                    PIPELINE_DEPTH_MAX - depth);
+                // Before cache_fill() sets the headers for the origin
+                for (int i = 1; i < n; i++) {
+                    keep[i] = request_is_connection_keep_alive(burst[i]);
+                }
+                cache_fill(connection, burst, n, 2);
+            }
+            if (fetch_pool == NULL && n == 1 && depth == 0 &&
+                connection_poll(connection, 0) == 0) {
+                // Nothing to overlap with: fetch here, so this process's
+                // pooled origin connections and DNS entries serve the
+                // client's next requests instead of dying with a worker
+                if (handle_request(connection, request, keep_alive) != 0) {
+                    return;
+                }
+                reading = keep_alive;
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                keep_alive = keep[i];
+                int fd     = pipeline_start(connection, burst[i], keep_alive);
+                if (fd == -1) {
+                    while (++i < n) {
+                        request_free(burst[i]);
+                    }
+                    keep_alive = 0;
+                    break;
+                }
+                pipeline[(head + depth) % PIPELINE_DEPTH_MAX] = fd;
+                depth++;
+            }
+            reading = keep_alive;
+            continue;
+        }
+        // Relay the oldest response
+        if (pipeline_finish(connection, pipeline[head]) != 0) {
+            reading = 0;
+        }
+        head = (head + 1) % PIPELINE_DEPTH_MAX;
+        depth--;
+    }
+}
+
+/**
+ * @brief Handle a CONNECT request
+ * @details Connects to the target and hands both sockets to the tunnel relay,
+ * which carries the bytes from then on. This process is free to exit as soon
+ * as the handoff is done.
+ *
+ * @param connection The client connection
+ * @param request The parsed CONNECT request (freed by this function)
+ */
+void handle_tunnel(connection_t *connection, request_t *request) {
+    // A reverse proxy only reaches its backends
+    if (backends_path != NULL) {
+        response_send_error(connection, 405, "Method Not Allowed");
+        fprintf(stderr, "Error: No tunnels in reverse-proxy mode\n");
+        request_free(request);
+        return;
+    }
+
+    // Check if the target is in the blocklist
+    if (request->host == NULL || blocklist_check(blocklist, request->host)) {
+        response_send_error(connection, 403, "Forbidden");
+        fprintf(stderr, "Error: Tunnel target is in the blocklist\n");
+        request_free(request);
+        return;
+    }
+
+    int          port   = request->port == -1 ? CONNECT_DEFAULT_PORT
+                                              : request->port;
+    connection_t server = {0};
+    if (connect_to_hostname(request->host, port, &server) != 0) {
+        response_send_error(connection, 502, "Bad Gateway");
+        request_free(request);
+        return;
+    }
+    request_free(request);
+
+    // A 2xx response to CONNECT has no body and no Content-Length
+    char *established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (send_to_connection(connection, established, strlen(established)) < 0) {
+        close_connection(&server);
+        return;
+    }
+    // Forward anything the client sent ahead of our response
+    if (connection->pending_len > 0) {
+        send_to_connection(&server, connection->pending,
+                           connection->pending_len);
+    }
+    if (tunnel_handoff(tunnel_fd, connection->fd, server.fd) != 0) {
+        fprintf(stderr, "Error: Failed to hand off the tunnel\n");
+    }
+    close_connection(&server);
+}
+
+/**
+ * @brief Get the name of the cache entry for a key: the hex MD5 of the key
+ *
+ * @param entry_key Cache key (with the variant, if any)
+ * @param hash_str Entry name (output, 33 bytes)
+ */
+void cache_hash(char *entry_key, char *hash_str) {
+    uint8_t hash[16];
+    // Compute the MD5 hash of the request key
+    md5String(entry_key, hash);
+    // Convert the hash to a string for the cache entry path
+    for (int i = 0; i < 16; i++) {
+        sprintf(hash_str + (i * 2), "%02x", hash[i]);
+    }
+}
+
+/**
+ * @brief Check if the cache holds an unexpired entry for a key, without
+ * locking or reading it
+ *
+ * @param key Cache key from request_get_key()
+ * @return int 1 if it does, 0 otherwise
+ */
+int cache_is_fresh(char *key) {
+    char        hash_str[33], path[2048];
+    struct stat attr;
+    cache_hash(key, hash_str);
+    snprintf(path, sizeof(path), "%s/%s", cache_path, hash_str);
+    return stat(path, &attr) == 0 && attr.st_size > 0 &&
+           difftime(time(NULL), attr.st_mtime) <= cache_timeout;
+}
+
+/**
+ * @brief Read a cache entry and bring its body to the requested coding
+ *
+ * @param f Entry, positioned at its start
+ * @param fd File descriptor of f
+ * @param size Size of the entry
+ * @param encoding Content coding to answer with (COMPRESS_NONE for identity)
+ * @return response_t* Response, NULL on failure
+ */
+response_t *cache_read(FILE *f, int fd, size_t size, int encoding) {
+    response_t *response;
+    int         codec;
+    uring_t    *ring = cache_ring_get();
+    if (ring != NULL) {
+        response = cache_read_uring(ring, fd, size, &codec);
+    } else {
+        response = response_read(f, &codec);
+    }
+    if (response == NULL) {
+        fprintf(stderr, "Error: Failed to read the cached response\n");
+    } else if (codec != COMPRESS_NONE &&
+               (codec == encoding
+                    ? compress_mark_encoded(response, codec)
+                    : compress_decode_body(response, codec)) != 0) {
+        fprintf(stderr, "Error: Failed to decode the cached response\n");
+        response_free(response);
+        response = NULL;
+    }
+    return response;
+}
+
+/**
+ * @brief Fetch a request from its origin, within the per-origin limits
+ *
+ * @param request The request to send
+ * @return response_t* Response, NULL on failure or if refused
+ */
+response_t *origin_fetch(request_t *request) {
+    response_t *response;
+    origin_fetch_many(&request, &response, 1);
+    return response;
+}
+
+/**
+ * @brief Fetch requests from their origin, within the per-origin limits
+ * @details In reverse-proxy mode (-r) the requests go to the backend picked
+ * for their Host. With -U, each request goes to the parent its key belongs
+ * to, in absolute-form, and what a parent fails to answer goes to the next
+ * parent. With -o, a fetch is refused while max_per_origin fetches to the
+ * server are in flight or while its circuit is open. Either way
+ * origin_unavailable is set when there is no server to fetch from, so the
+ * caller can fail fast. A fetch that fails or gets a 5xx counts against the
+ * server. Several requests are sent one after another, or pipelined on one
+ * connection with -p, and count as one fetch.
+ *
+ * @param requests The requests to send, all for the same origin (GETs
+ * without a body if there are several)
+ * @param responses Responses (output), NULL on failure or if refused
+ * @param n Number of requests
+ */
+void origin_fetch_many(request_t **requests, response_t **responses, int n) {
+    origin_unavailable = 0;
+    for (int i = 0; i < n; i++) {
+        responses[i] = NULL;
+    }
+    backend_t *backend = NULL;
+    if (backends_path != NULL) {
+        backend = backend_select(requests[0]->host);
+        if (backend == NULL) {
+            fprintf(stderr, "Error: No healthy backend for %s\n",
+                    requests[0]->host);
+            origin_unavailable = 1;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            requests[i]->next_hop      = backend->host;
+            requests[i]->next_hop_port = backend->port;
+        }
+    }
+    ring_parent_t *parent = NULL;
+    if (parents != NULL && backend == NULL) {
+        parent = parent_route(requests[0]);
+        for (int i = 1; i < n; i++) {
+            if (parent_route(requests[i]) == parent) {
+                continue;
+            }
+            // Fetch each run of requests for one parent together
+            for (int j = 0, k; j < n; j = k) {
+                ring_parent_t *owner = parent_route(requests[j]);
+                for (k = j + 1; k < n && parent_route(requests[k]) == owner;
+                     k++) {
+                }
+                origin_fetch_many(requests + j, responses + j, k - j);
+            }
+            return;
+        }
+    }
+    request_t  *request = requests[0];
+    const char *host    = request->host;
+    int port = request->port != -1 ? request->port
+                                   : (request->https == 1 ? TLS_DEFAULT_PORT
+                                                          : 80);
+    if (request->next_hop != NULL) {
+        host = request->next_hop;
+        port = request->next_hop_port;
+    }
+
+    uint64_t         start = timer_now_ms();
+    breaker_ticket_t ticket;
+    int rv = max_per_origin == 0
+                 ? BREAKER_OK
+                 : breaker_acquire(host, port, timer_now_ms(), &ticket);
+    if (rv != BREAKER_OK) {
+        fprintf(stderr, "Error: %s:%d is %s\n", host, port,
+                rv == BREAKER_BUSY ? "at its fetch limit"
+                                   : "failing, circuit open");
+        origin_unavailable = 1;
+    } else if (n > 1 && upstream_pipelining) {
+        response_fetch_pipelined(requests, responses, n);
+    } else {
+        for (int i = 0; i < n; i++) {
+            responses[i] = response_fetch(requests[i]);
+        }
+    }
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        ok = ok && responses[i] != NULL && responses[i]->status_code < 500;
+    }
+
+    if (max_per_origin > 0 && rv == BREAKER_OK) {
+        rv = breaker_release(&ticket, ok, timer_now_ms());
+        if (rv == BREAKER_OPENED) {
+            fprintf(stderr, "Circuit to %s:%d opened\n", host, port);
+        } else if (rv == BREAKER_CLOSED) {
+            fprintf(stderr, "Circuit to %s:%d closed\n", host, port);
+        }
+    }
+    if (backend != NULL) {
+        // A refused fetch says nothing about the backend
+        backend_release(backend, timer_now_ms() - start,
+                        ok || origin_unavailable);
+    }
+    if (parent != NULL && !origin_unavailable) {
+        int failed = 0;
+        for (int i = 0; i < n; i++) {
+            failed = failed || responses[i] == NULL;
+        }
+        if (failed) {
+            ring_set_down(parent, time(NULL));
+            for (int i = 0; i < n; i++) {
+                // A body can only be sent once
+                if (responses[i] == NULL && !request_has_body(requests[i])) {
+                    origin_fetch_many(&requests[i], &responses[i], 1);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fetch a cache miss from a sibling that holds a fresh copy. The
+ * request goes out only-if-cached, so a sibling whose copy expired meanwhile
+ * answers 504 instead of fetching it from the origin too.
+ *
+ * @param request Request (sent to the sibling in origin form)
+ * @param key Cache key of the request
+ * @return response_t* Response, NULL if no sibling had it
+ */
+response_t *sibling_fetch(request_t *request, char *key) {
+    // Siblings are reached in plain HTTP, which an https request can't take
+    if (request->https == 1) {
+        return NULL;
+    }
+    peer_t *peer = peer_query(key);
+    if (peer == NULL) {
+        return NULL;
+    }
+    char *cache_control =
+        http_message_header_get(request->message, "Cache-Control");
+    if (cache_control != NULL) {
+        cache_control = strdup(cache_control);
+    }
+    http_message_header_set(request->message, "Cache-Control",
+                            "only-if-cached");
+    request->next_hop       = peer->host;
+    request->next_hop_port  = peer->port;
+    request->next_hop_proxy = 1;
+    response_t *response    = response_fetch(request);
+    request->next_hop       = NULL;
+    request->next_hop_port  = -1;
+    request->next_hop_proxy = 0;
+    if (cache_control != NULL) {
+        http_message_header_set(request->message, "Cache-Control",
+                                cache_control);
+        free(cache_control);
+    } else {
+        http_message_header_remove(request->message, "Cache-Control");
+    }
+    if (response != NULL && response->status_code != 200) {
+        response_free(response);
+        response = NULL;
+    }
+    printf("%s response from sibling %s:%d\n",
+           response != NULL ? "Got the" : "No", peer->host, peer->port);
+    return response;
+}
+
+/**
+ * @brief Point a request at the parent its cache key belongs to
+ *
+ * @param request Request to route
+ * @return ring_parent_t* Parent, NULL if the request goes to its origin
+ */
+ring_parent_t *parent_route(request_t *request) {
+    char key[1024];
+    request_get_key(request, key, sizeof(key));
+    // Parents are reached in plain HTTP, which an https request can't take
+    ring_parent_t *parent = NULL;
+    if (key[0] != '\0' && request->https != 1) {
+        parent = ring_lookup(key, time(NULL));
+    }
+    request->next_hop       = parent != NULL ? parent->host : NULL;
+    request->next_hop_port  = parent != NULL ? parent->port : -1;
+    request->next_hop_proxy = parent != NULL;
+    return parent;
+}
+
+/**
+ * @brief Answer a request refused by origin_fetch() with 503 and a
+ * Retry-After
+ *
+ * @param connection Client connection
+ * @param keep_alive Whether the client connection stays open after this
+ * @return int 0 on success, -1 on failure
+ */
+int origin_send_unavailable(connection_t *connection, int keep_alive) {
+    response_t *response = response_create(503, "Service Unavailable");
     if (response == NULL) {
-        fprintf(stderr, "Error: Failed to read the response\n");
-        response_send_error(connection, 500, "Internal Server Error");
-        request_free(request);
+        return -1;
+    }
+    http_message_header_set(response->message, "Retry-After",
+                            ADMISSION_RETRY_AFTER);
+    http_message_header_set(response->message, "Connection",
+                            keep_alive ? "keep-alive" : "close");
+    int rv = response_send(response, connection);
+    response_free(response);
+    return rv;
+}
+
+/**
+ * @brief Answer a request from the cache, fetching and caching it on a miss
+ * @details Compressed variants are cached under their own entry. A variant
+ * miss is filled from the uncompressed entry, so the origin is fetched and
+ * the body compressed once per object, and a response that can not be
+ * compressed never gets a variant entry. With a storage codec the uncompressed
+ * entry holds a compressed body, which is sent unchanged to clients accepting
+ * that codec (no variant is kept for it) and inflated for everyone else.
+ *
+ * @param connection The client connection
+ * @param request The request to answer
+ * @param key Cache key from request_get_key()
+ * @param store Whether a fetched response may be written to the cache
+ * @param encoding Content coding to answer with (COMPRESS_NONE for identity)
+ * @return response_t* Response, NULL on failure
+ */
+response_t *cache_fetch(connection_t *connection, request_t *request, char *key,
+                        int store, int encoding) {
+    response_t *response = NULL;
+    char        hash_str[33];
+    char        entry_key[1100];
+    int         variant = encoding != COMPRESS_NONE && encoding != cache_codec;
+    size_t      stale   = 0; // Size of an expired entry kept as a fallback
+    if (!variant) {
+        snprintf(entry_key, sizeof(entry_key), "%s", key);
+    } else {
+        snprintf(entry_key, sizeof(entry_key), "%s;%s", key,
+                 compress_encoding_name(encoding));
+    }
+    // Without a fresh variant, look at the uncompressed entry first: a
+    // response that can not be compressed has no variant, whose entry would
+    // only be created and removed again on every request
+    response_t *identity = NULL;
+    if (variant && !cache_is_fresh(entry_key)) {
+        identity = cache_fetch(connection, request, key, store, COMPRESS_NONE);
+        if (identity == NULL || !compress_is_eligible(identity)) {
+            return identity;
+        }
+    }
+    cache_hash(entry_key, hash_str);
+    char path[2048], meta_path[2048];
+    snprintf(path, 2048, "%s/%s", cache_path, hash_str);
+    snprintf(meta_path, 2048, "%s/.%s", cache_path, hash_str);
+    printf("Cache path: %s\n", path);
+    // Touch the file
+    int fd = open(path, O_RDONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("open");
+        return identity;
+    }
+    printf("File descriptor: %d\n", fd);
+    if (flock(fd, LOCK_EX) == -1) {
+        perror("flock");
+        exit(EXIT_FAILURE);
+    }
+    // Get a file descriptor for the cached response
+    FILE *f = fdopen(fd, "r");
+    if (f != NULL) {
+        // Check if the cached response is still valid
+        struct stat attr;
+        stat(path, &attr);
+        time_t now = time(NULL);
+        // Check if the file is empty
+        if (attr.st_size == 0) {
+            printf("Cached response is empty\n");
+            remove(path);
+        } else if (difftime(now, attr.st_mtime) > cache_timeout) {
+            printf("Cached response is stale\n");
+            if (max_per_origin > 0) {
+                // Kept in case the origin can not be reached
+                stale = attr.st_size;
+            } else {
+                // Remove the cached response
+                remove(path);
+            }
+        } else {
+            printf("Cached response is valid\n");
+            response = cache_read(f, fd, attr.st_size, encoding);
+        }
+    }
+    // If the response is not in the cache, fetch it from the server
+    if (response == NULL) {
+        if (!variant && request_is_only_if_cached(request)) {
+            // Typically a sibling, which goes to the origin itself
+            printf("Not cached, and only-if-cached\n");
+        } else if (!variant) {
+            if (siblings != NULL) {
+                response = sibling_fetch(request, key);
+            }
+            if (response == NULL) {
+                printf("Fetching response from the server\n");
+                response = origin_fetch(request);
+            }
+        } else {
+            // Build the variant from the uncompressed entry
+            response = identity != NULL ? identity
+                                        : cache_fetch(connection, request, key,
+                                                      store, COMPRESS_NONE);
+            identity = NULL;
+            if (response == NULL || !compress_is_eligible(response) ||
+                compress_response(response, encoding) != 0) {
+                // Not compressible, there is no variant to store
+                store = 0;
+                remove(path);
+            }
+        }
+        if (response != NULL && store) {
+            fclose(f);
+            // Cache the response
+            f = fopen(path, "w");
+            if (f == NULL) {
+                fprintf(stderr, "Error: Failed to cache the response\n");
+                fd = -1;
+            } else {
+                fd        = fileno(f);
+                int codec = COMPRESS_NONE;
+                if (!variant && compress_is_eligible(response)) {
+                    codec = cache_codec;
+                }
+                if (cache_store(f, response, codec, meta_path, entry_key) !=
+                    0) {
+                    fprintf(stderr, "Error: Failed to cache the response\n");
+                    remove(path);
+                }
+            }
+        }
+        // Fetch what a page refers to before the client asks for it
+        if (response != NULL && !variant && store && prefetch_jobs > 0) {
+            cache_prefetch(connection, request, response);
+        }
+        // A client accepting the storage codec gets the response encoded
+        if (response != NULL && !variant && encoding != COMPRESS_NONE &&
+            compress_is_eligible(response)) {
+            compress_response(response, encoding);
+        }
+        // A stale response beats none when the origin is down or refused
+        if (response == NULL && stale > 0) {
+            printf("Serving the stale response\n");
+            response = cache_read(f, fd, stale, encoding);
+            if (response != NULL) {
+                http_message_header_set(response->message, "Warning",
+                                        "110 - \"Response is Stale\"");
+            }
+        }
+    }
+    // Unlock the cache entry
+    if (fd != -1 && flock(fd, LOCK_UN) == -1) {
+        perror("flock");
+        exit(EXIT_FAILURE);
+    }
+    if (f != NULL) {
+        fclose(f);
+    } else if (fd != -1) {
+        close(fd);
+    }
+    // Another process stored the variant meanwhile
+    response_free(identity);
+    return response;
+}
+
+/**
+ * @brief Write a response to a cache entry opened for writing, and its key to
+ * the meta file next to it
+ *
+ * @param f Entry (locked by the caller)
+ * @param response Response to store
+ * @param codec Storage codec of the body
+ * @param meta_path Path of the meta file
+ * @param entry_key Key of the entry
+ * @return int 0 on success, -1 on failure
+ */
+int cache_store(FILE *f, response_t *response, int codec, char *meta_path,
+                char *entry_key) {
+    if (cache_ring_get() != NULL) {
+        return cache_write_uring(cache_ring_get(), fileno(f), response, codec,
+                                 meta_path, entry_key);
+    }
+    FILE *meta = fopen(meta_path, "w");
+    if (meta == NULL) {
+        fprintf(stderr, "Error: Failed to cache the response\n");
+    } else {
+        fprintf(meta, "%s", entry_key);
+        fclose(meta);
+    }
+    if (0 != response_write(response, f, codec) || fflush(f) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fetch the cache misses of a burst of GETs for one origin, pipelined
+ * on one origin connection with -p, and store the responses
+ * @details The requests of a client are then answered from the cache by their
+ * workers as usual. Whatever could not be fetched here is left to the
+ * workers, which fetch it on their own.
+ *
+ * @param connection Client connection
+ * @param burst GETs for the same origin
+ * @param n Number of requests (at most PIPELINE_DEPTH_MAX)
+ * @param min_misses Fetch nothing unless this many requests miss
+ */
+void cache_fill(connection_t *connection, request_t **burst, int n,
+                int min_misses) {
+    request_t  *misses[PIPELINE_DEPTH_MAX];
+    response_t *responses[PIPELINE_DEPTH_MAX];
+    char        keys[PIPELINE_DEPTH_MAX][1024];
+    int         m = 0;
+    if (blocklist_check(blocklist, burst[0]->host) ||
+        (backends_path != NULL && !backend_has_group(burst[0]->host))) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        request_get_key(burst[i], keys[m], sizeof(keys[m]));
+        int repeated = 0;
+        for (int j = 0; j < m; j++) {
+            repeated = repeated || strcmp(keys[j], keys[m]) == 0;
+        }
+        if (keys[m][0] != '\0' && !repeated && !cache_is_fresh(keys[m])) {
+            misses[m++] = burst[i];
+        }
+    }
+    if (m == 0 || m < min_misses) {
+        return;
+    }
+    for (int i = 0; i < m; i++) {
+        request_prepare(connection, misses[i]);
+    }
+    origin_fetch_many(misses, responses, m);
+
+    for (int i = 0; i < m; i++) {
+        if (responses[i] == NULL) {
+            continue;
+        }
+        char hash_str[33], path[2048], meta_path[2048];
+        cache_hash(keys[i], hash_str);
+        snprintf(path, sizeof(path), "%s/%s", cache_path, hash_str);
+        snprintf(meta_path, sizeof(meta_path), "%s/.%s", cache_path, hash_str);
+        int fd = open(path, O_RDONLY | O_CREAT, 0644);
+        if (fd == -1) {
+            perror("open");
+            response_free(responses[i]);
+            continue;
+        }
+        if (flock(fd, LOCK_EX) == -1) {
+            perror("flock");
+            exit(EXIT_FAILURE);
+        }
+        // Another client may have filled the entry meanwhile
+        if (!cache_is_fresh(keys[i])) {
+            int codec = compress_is_eligible(responses[i]) ? cache_codec
+                                                           : COMPRESS_NONE;
+            FILE *f   = fopen(path, "w");
+            if (f == NULL ||
+                cache_store(f, responses[i], codec, meta_path, keys[i]) != 0) {
+                fprintf(stderr, "Error: Failed to cache the response\n");
+                remove(path);
+            }
+            if (f != NULL) {
+                fclose(f);
+            }
+        }
+        if (flock(fd, LOCK_UN) == -1) {
+            perror("flock");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        response_free(responses[i]);
+    }
+}
+
+/**
+ * @brief Prefetch the subresources of an HTML page fetched from its origin
+ * @details The links are grouped by origin and each group is fetched into the
+ * cache by one prefetch job: a process, or a task on the fetch pool in thread
+ * mode. Links prefetched recently are skipped, and so are the groups found
+ * while prefetch_jobs jobs are running.
+ *
+ * @param connection Client connection
+ * @param request Request for the page
+ * @param response The page, as the origin sent it
+ */
+void cache_prefetch(connection_t *connection, request_t *request,
+                    response_t *response) {
+    char *type = http_message_header_get(response->message, "Content-Type");
+    if (response->status_code != 200 || type == NULL ||
+        strncasecmp(type, "text/html", 9) != 0 || request->host == NULL ||
+        http_message_header_get(response->message, "Content-Encoding") !=
+            NULL) {
+        return;
+    }
+    char base[PREFETCH_URL_MAX];
+    request_url(request, base, sizeof(base));
+    char (*links)[PREFETCH_URL_MAX] =
+        malloc(PREFETCH_LINKS_MAX * PREFETCH_URL_MAX);
+    if (links == NULL) {
+        return;
+    }
+    int n = prefetch_scan(http_message_get_body(response->message),
+                          http_message_get_body_len(response->message), base,
+                          links, PREFETCH_LINKS_MAX);
+
+    int    grouped[PREFETCH_LINKS_MAX] = {0};
+    time_t now                         = time(NULL);
+    for (int i = 0; i < n; i++) {
+        if (grouped[i]) {
+            continue;
+        }
+        if (!prefetch_begin()) {
+            break;
+        }
+        prefetch_job_t *job = calloc(1, sizeof(prefetch_job_t));
+        if (job == NULL) {
+            prefetch_end();
+            break;
+        }
+        // scheme://authority of the group
+        char  *authority = strstr(links[i], "://") + 3;
+        size_t len       = authority - links[i] + strcspn(authority, "/?");
+        for (int j = i; j < n; j++) {
+            if (!grouped[j] && strncasecmp(links[j], links[i], len) == 0 &&
+                strchr("/?", links[j][len]) != NULL) {
+                grouped[j] = 1;
+                if (prefetch_claim(links[j], now)) {
+                    strcpy(job->urls[job->n++], links[j]);
+                }
+            }
+        }
+        if (job->n == 0) {
+            prefetch_end();
+            free(job);
+            continue;
+        }
+        prefetch_start(connection, job);
+    }
+    free(links);
+}
+
+/**
+ * @brief Prefetch the URL a client is likely to ask for after the one it
+ * was just answered, if the model is confident enough and the bandwidth
+ * budget allows
+ *
+ * @param connection Client connection
+ * @param request Request just answered
+ * @param response Its response
+ */
+void cache_predict(connection_t *connection, request_t *request,
+                   response_t *response) {
+    if (response->status_code != 200 || request->host == NULL) {
+        return;
+    }
+    char     url[PREDICT_URL_MAX], next[PREDICT_URL_MAX];
+    size_t   next_size;
+    uint64_t now = timer_now_ms();
+    request_url(request, url, sizeof(url));
+    if (!predict_record(connection->ip, url,
+                        http_message_get_body_len(response->message), now,
+                        next, &next_size) ||
+        strlen(next) >= PREFETCH_URL_MAX || !prefetch_begin()) {
+        return;
+    }
+    // Claimed first, so a URL prefetched anyway costs nothing from the budget
+    if (!prefetch_claim(next, time(NULL)) ||
+        !predict_spend(connection->ip, next, next_size, now)) {
+        prefetch_end();
         return;
     }
+    prefetch_job_t *job = calloc(1, sizeof(prefetch_job_t));
+    if (job == NULL) {
+        prefetch_end();
+        return;
+    }
+    strcpy(job->urls[job->n++], next);
+    prefetch_start(connection, job);
+}
+
+/**
+ * @brief Run a prefetch job without holding up the client: as a task on the
+ * fetch pool in thread mode, in a child process otherwise
+ *
+ * @param connection Client connection
+ * @param job Job started with prefetch_begin() (freed by this function)
+ */
+void prefetch_start(connection_t *connection, void *job) {
+    memcpy(((prefetch_job_t *)job)->client.ip, connection->ip,
+           INET_ADDRSTRLEN);
+    if (fetch_pool != NULL) {
+        if (workpool_spawn(fetch_pool, prefetch_run, job) != 0) {
+            prefetch_end();
+            free(job);
+        }
+        return;
+    }
+    // Don't let the job inherit buffered output
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        prefetch_end();
+        free(job);
+        return;
+    }
+    if (pid == 0) {
+        // The response must not wait for this process to let go of the
+        // client
+        close(connection->fd);
+        prefetch_run(job);
+        blocklist_free(blocklist);
+        exit(EXIT_SUCCESS);
+    }
+    free(job);
+}
+
+/**
+ * @brief Fetch the links of a prefetch job into the cache
+ *
+ * @param arg Job (freed by this function)
+ */
+void prefetch_run(void *arg) {
+    prefetch_job_t *job = arg;
+    for (int i = 0; i < job->n; i += PIPELINE_DEPTH_MAX) {
+        request_t *burst[PIPELINE_DEPTH_MAX];
+        int        n = 0;
+        for (int j = i; j < job->n && j < i + PIPELINE_DEPTH_MAX; j++) {
+            // Requested as a client would
+            char  *authority = strstr(job->urls[j], "://") + 3;
+            int    host_len  = strcspn(authority, "/?");
+            size_t size      = strlen(job->urls[j]) + host_len + 64;
+            char  *header    = malloc(size);
+            if (header == NULL) {
+                continue;
+            }
+            int len = snprintf(header, size,
+                               "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+                               job->urls[j], host_len, authority);
+            request_t *request =
+                request_parse(http_message_create_from_buffer(header, len));
+            if (request != NULL) {
+                burst[n++] = request;
+            }
+        }
+        if (n > 0) {
+            cache_fill(&job->client, burst, n, 1);
+        }
+        for (int j = 0; j < n; j++) {
+            request_free(burst[j]);
+        }
+    }
+    prefetch_end();
+    free(job);
+}
+
+/**
+ * @brief Build the absolute URL of a request
+ *
+ * @param request Request
+ * @param url scheme://host[:port]uri (output)
+ * @param size Size of url
+ */
+void request_url(request_t *request, char *url, size_t size) {
+    char port_str[16] = "";
+    if (request->port != -1) {
+        snprintf(port_str, sizeof(port_str), ":%d", request->port);
+    }
+    snprintf(url, size, "%s://%s%s%s", request->https == 1 ? "https" : "http",
+             request->host, port_str, request->uri);
+}
+
+/**
+ * @brief Set the headers of a request for its origin: keep the origin
+ * connection alive, add the proxy headers and remove the client's proxy
+ * headers
+ *
+ * @param connection Client connection
+ * @param request Request to forward
+ */
+void request_prepare(connection_t *connection, request_t *request) {
+    http_message_t *message = request->message;
+    // Origin connections are pooled and reused
+    http_message_header_set(message, "Connection", "keep-alive");
+
+    // Add the proxy headers
+    http_message_header_set(message, "Forwarded", connection->ip);
+    http_message_header_set(message, "Via", "1.1 MatthewTetaProxy");
+    // Remove proxy headers
+    http_message_header_remove(message, "Proxy-Connection");
+    http_message_header_remove(message, "Proxy-Authorization");
+    http_message_header_remove(message, "Proxy-Authenticate");
+}
+
+/**
+ * @brief Handle incoming request
+ * @details This function is responsible for handling incoming requests. It
+ * checks if the requested URL is blocked, and forwards the request to the
+ * server. It then parses the response and forwards it to the client. A
+ * request body that is still pending on the client connection is streamed to
+ * the server as it arrives.
+ *
+ * @param connection The connection to send the response on
+ * @param request The parsed request (freed by this function)
+ * @param keep_alive Whether the client connection stays open after this
+ * @return int 0 on success, -1 if the client connection can not be reused
+ */
+int handle_request(connection_t *connection, request_t *request,
+                   int keep_alive) {
+    response_t *response = NULL;
+
+    // Check if the request is in the blocklist
+    if (blocklist_check(blocklist, request->host)) {
+        response_send_error(connection, 403, "Forbidden");
+        fprintf(stderr, "Error: Request is in the blocklist\n");
+        // An unread body leaves the connection out of sync
+        int rv = request->client != NULL ? -1 : 0;
+        request_free(request);
+        return rv;
+    }
+
+    // A reverse proxy serves only the hosts of its backend groups
+    if (backends_path != NULL && !backend_has_group(request->host)) {
+        response_send_error(connection, 404, "Not Found");
+        fprintf(stderr, "Error: No backend group for %s\n", request->host);
+        int rv = request->client != NULL ? -1 : 0;
+        request_free(request);
+        return rv;
+    }
+
+    request_prepare(connection, request);
+
+    // Send the request to the server, through the cache if it is cacheable
+    int  head = strcmp(request->method, "HEAD") == 0;
+    char key[1024];
+    request_get_key(request, key, 1024);
+    int encoding = compress_negotiate(request);
+    if (key[0] == '\0') {
+        response = origin_fetch(request);
+        if (response != NULL && encoding != COMPRESS_NONE &&
+            compress_is_eligible(response)) {
+            compress_response(response, encoding);
+        }
+    } else {
+        response = cache_fetch(connection, request, key, !head, encoding);
+    }
+
+    if (response == NULL && origin_unavailable) {
+        // Fail fast, the client may retry once the origin recovers
+        int rv = origin_send_unavailable(connection, keep_alive);
+        if (request->client != NULL) {
+            rv = -1;
+        }
+        request_free(request);
+        return rv;
+    }
+    if (response == NULL && request_is_only_if_cached(request)) {
+        response_send_error(connection, 504, "Gateway Timeout");
+        int rv = request->client != NULL ? -1 : 0;
+        request_free(request);
+        return rv;
+    }
+    if (response == NULL) {
+        fprintf(stderr, "Error: Failed to get the response\n");
+        response_send_error(connection, 502, "Bad Gateway");
+        int rv = request->client != NULL ? -1 : 0;
+        request_free(request);
+        return rv;
+    }
+
+    // The uncompressed form of a compressible response also depends on
+    // Accept-Encoding
+    if (compress_is_eligible(response)) {
+        compress_add_vary(response);
+    }
 
     // Send the response to the client
-    response_send(response, connection);
+    http_message_header_set(response->message, "Connection",
+                            keep_alive ? "keep-alive" : "close");
+    if (head) {
+        response_send_head(response, connection);
+    } else {
+        response_send(response, connection);
+    }
+
+    // Fetch what the client is likely to ask for next
+    if (predict_budget > 0 && key[0] != '\0' && !head) {
+        cache_predict(connection, request, response);
+    }
 
     // Free memory
     request_free(request);
     response_free(response);
 
-    return;
+    return 0;
 }
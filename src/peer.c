@@ -0,0 +1,284 @@
+/**
+ * @file peer.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of peer.h
+ * @details A query is one datagram, "PEER/1 Q <id> <key>", sent to every
+ * sibling from a socket of its own, so a late answer to an earlier query
+ * can not be taken for this one. The answer is "PEER/1 H <id>" for a hit or
+ * "PEER/1 M <id>" for a miss. The wait ends at the first hit, once every
+ * sibling missed, or at PEER_TIMEOUT_MS; a lost datagram only costs the
+ * rest of the timeout.
+ *
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // pipe2()
+
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "IP.h"
+#include "timer.h"
+
+static peer_t       peers[PEER_MAX];
+static int          num_peers;
+static __thread int next_id;
+
+// Private functions
+int  peer_add(const char *host, int port, void *arg);
+int  peer_parse(char *message, ssize_t len, char *type, unsigned *id,
+                char **key);
+void peer_answer(int fd, int (*is_fresh)(char *key));
+
+/**
+ * @brief Resolve the siblings. Call before forking.
+ *
+ * @param list Comma-separated host:port of each sibling
+ * @return int 0 on success, -1 on failure
+ */
+int peer_load(const char *list) {
+    int rv = parse_host_list(list, "Sibling", peer_add, NULL);
+    if (rv != 0) {
+        num_peers = 0;
+        return -1;
+    }
+    printf("Peering with %d siblings\n", num_peers);
+    return 0;
+}
+
+/**
+ * @brief Ask every sibling whether it holds a fresh copy of a cache entry,
+ * waiting at most PEER_TIMEOUT_MS for the answers
+ *
+ * @param key Cache key from request_get_key()
+ * @return peer_t* First sibling that has it, NULL if none does
+ */
+peer_t *peer_query(const char *key) {
+    if (num_peers == 0) {
+        return NULL;
+    }
+    char     message[PEER_KEY_MAX + 64];
+    unsigned id  = (unsigned)getpid() << 16 | (++next_id & 0xffff);
+    int      len = snprintf(message, sizeof(message), PEER_MAGIC " Q %u %s",
+                            id, key);
+    if (len >= (int)sizeof(message)) {
+        return NULL;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return NULL;
+    }
+    for (int i = 0; i < num_peers; i++) {
+        sendto(fd, message, len, 0, (struct sockaddr *)&peers[i].addr,
+               sizeof(peers[i].addr));
+    }
+
+    peer_t  *hit      = NULL;
+    int      misses   = 0;
+    uint64_t deadline = timer_now_ms() + PEER_TIMEOUT_MS;
+    while (hit == NULL && misses < num_peers) {
+        uint64_t now = timer_now_ms();
+        if (now >= deadline) {
+            break;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int           rv  = poll(&pfd, 1, deadline - now);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        struct sockaddr_in from;
+        socklen_t          from_len = sizeof(from);
+        char               answer[64];
+        ssize_t            n = recvfrom(fd, answer, sizeof(answer) - 1, 0,
+                                        (struct sockaddr *)&from, &from_len);
+        char               type;
+        unsigned           answer_id;
+        char              *rest;
+        if (n <= 0 || peer_parse(answer, n, &type, &answer_id, &rest) != 0 ||
+            answer_id != id) {
+            continue;
+        }
+        for (int i = 0; i < num_peers; i++) {
+            if (peers[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+                peers[i].addr.sin_port == from.sin_port) {
+                if (type == 'H') {
+                    hit = &peers[i];
+                } else {
+                    misses++;
+                }
+                break;
+            }
+        }
+    }
+    close(fd);
+    return hit;
+}
+
+/**
+ * @brief Fork the process answering the siblings' queries
+ *
+ * @param port UDP port to answer on
+ * @param is_fresh Whether a cache key has a fresh entry
+ * @param responder_fd Descriptor keeping the responder running (output)
+ * @return pid_t Responder process id, -1 on failure
+ */
+pid_t peer_responder_start(int port, int (*is_fresh)(char *key),
+                           int *responder_fd) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // The next generation binds while this one is still answering
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family      = AF_INET,
+                               .sin_port        = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close(fd);
+        return -1;
+    }
+    // The child exits through exit(), keep it from flushing our output again
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        // Like the backend checker, stop only once the proxy is gone
+        signal(SIGINT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+        struct pollfd pfds[2] = {{.fd = fds[0], .events = POLLIN},
+                                 {.fd = fd, .events = POLLIN}};
+        for (;;) {
+            int rv = poll(pfds, 2, -1);
+            if (rv < 0 && errno != EINTR) {
+                break;
+            }
+            if (rv > 0 && pfds[0].revents != 0) {
+                break; // Every writer closed the pipe
+            }
+            if (rv > 0 && pfds[1].revents != 0) {
+                peer_answer(fd, is_fresh);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+    close(fd);
+    close(fds[0]);
+    *responder_fd = fds[1];
+    return pid;
+}
+
+// Private function definitions
+
+/**
+ * @brief Resolve one sibling (parse_host_list())
+ */
+int peer_add(const char *host, int port, void *arg) {
+    (void)arg;
+    if (num_peers == PEER_MAX || strlen(host) >= PEER_HOST_MAX) {
+        fprintf(stderr, "Error: Too many siblings\n");
+        return -1;
+    }
+    char             service[8];
+    struct addrinfo  hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *info;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &info) != 0) {
+        fprintf(stderr, "Error: Could not resolve sibling %s\n", host);
+        return -1;
+    }
+    peer_t *peer = &peers[num_peers++];
+    strcpy(peer->host, host);
+    peer->port = port;
+    memcpy(&peer->addr, info->ai_addr, sizeof(peer->addr));
+    freeaddrinfo(info);
+    return 0;
+}
+
+/**
+ * @brief Parse a query or an answer
+ *
+ * @param message Datagram, with room for a terminating '\0'
+ * @param len Length of the datagram
+ * @param type 'Q', 'H' or 'M' (output)
+ * @param id Query id (output)
+ * @param key Cache key of a query (output)
+ * @return int 0 on success, -1 if it is not a peer message
+ */
+int peer_parse(char *message, ssize_t len, char *type, unsigned *id,
+               char **key) {
+    message[len] = '\0';
+    size_t magic = strlen(PEER_MAGIC);
+    if (strncmp(message, PEER_MAGIC " ", magic + 1) != 0) {
+        return -1;
+    }
+    int end = 0;
+    if (sscanf(message + magic, " %c %u%n", type, id, &end) != 2 ||
+        strchr("QHM", *type) == NULL) {
+        return -1;
+    }
+    *key = message + magic + end;
+    if (**key == ' ') {
+        (*key)++;
+    }
+    return *type == 'Q' && **key == '\0' ? -1 : 0;
+}
+
+/**
+ * @brief Answer one query waiting on the responder socket
+ */
+void peer_answer(int fd, int (*is_fresh)(char *key)) {
+    char               message[PEER_KEY_MAX + 64];
+    struct sockaddr_in from;
+    socklen_t          from_len = sizeof(from);
+    ssize_t            len = recvfrom(fd, message, sizeof(message) - 1, 0,
+                                      (struct sockaddr *)&from, &from_len);
+    char               type;
+    unsigned           id;
+    char              *key;
+    if (len <= 0 || peer_parse(message, len, &type, &id, &key) != 0 ||
+        type != 'Q') {
+        return;
+    }
+    char answer[64];
+    len = snprintf(answer, sizeof(answer), PEER_MAGIC " %c %u",
+                   is_fresh(key) ? 'H' : 'M', id);
+    sendto(fd, answer, len, 0, (struct sockaddr *)&from, from_len);
+}
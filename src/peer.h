@@ -0,0 +1,65 @@
+/**
+ * @file peer.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Sibling cache peering. Before going to the origin on a cache miss,
+ * the proxy asks its sibling proxies over UDP whether they hold a fresh copy
+ * (in the spirit of ICP), and fetches from the first one that says so.
+ * Each proxy answers these queries on the UDP port with the number of its
+ * TCP port, from a responder process that only looks at the cache index.
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#define PEER_MAX        16       // Siblings
+#define PEER_HOST_MAX   256      // Longest sibling host
+#define PEER_KEY_MAX    1024     // Longest cache key queried
+#define PEER_TIMEOUT_MS 20       // A miss waits this long for a sibling's hit
+#define PEER_MAGIC      "PEER/1" // First word of every query and answer
+
+/**
+ * @brief Sibling proxy
+ */
+typedef struct peer {
+    char               host[PEER_HOST_MAX];
+    int                port; // Proxy (TCP) and query (UDP) port
+    struct sockaddr_in addr; // Query address
+} peer_t;
+
+/**
+ * @brief Resolve the siblings. Call before forking.
+ *
+ * @param list Comma-separated host:port of each sibling
+ * @return int 0 on success, -1 on failure
+ */
+int peer_load(const char *list);
+
+/**
+ * @brief Ask every sibling whether it holds a fresh copy of a cache entry,
+ * waiting at most PEER_TIMEOUT_MS for the answers
+ *
+ * @param key Cache key from request_get_key()
+ * @return peer_t* First sibling that has it, NULL if none does
+ */
+peer_t *peer_query(const char *key);
+
+/**
+ * @brief Fork the process answering the siblings' queries
+ *
+ * @param port UDP port to answer on
+ * @param is_fresh Whether a cache key has a fresh entry
+ * @param responder_fd Descriptor keeping the responder running (output)
+ * @return pid_t Responder process id, -1 on failure
+ */
+pid_t peer_responder_start(int port, int (*is_fresh)(char *key),
+                           int *responder_fd);
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * @file pool.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of pool.h
+ * @details The pool is per process, or per thread in thread pool mode. In
+ * fork mode a process serves one client connection, so origin connections
+ * are only reused across that client's requests (the TLS sessions behind
+ * them are shared through the session cache of tls.c). A pooled connection
+ * is checked before it is handed out: an idle origin connection should have
+ * nothing to read, so readable means the origin closed it (or sent garbage)
+ * and it is dropped.
+ *
+ * @version 0.1
+ * @date 2023-05-04
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tls.h"
+
+// Private structs
+
+/**
+ * @brief Idle pooled connection
+ */
+typedef struct pool_entry {
+    char         key[300];   // "host:port:tls"
+    connection_t connection; // Idle connection
+    time_t       idle_since; // When it was returned to the pool
+    int          used;       // Slot holds a connection
+} pool_entry_t;
+
+/**
+ * @brief Pipelining support of an origin
+ */
+typedef struct pool_origin {
+    char key[300];   // "host:port:tls", empty for a free slot
+    int  pipelining; // POOL_PIPELINE_*
+} pool_origin_t;
+
+// Private variables
+static __thread pool_entry_t  pool[POOL_SIZE_MAX];
+static __thread pool_origin_t origins[POOL_ORIGINS_MAX];
+static __thread int           next_origin; // Slot reused when the table is full
+
+// Private functions
+void           pool_key(const char *host, int port, int tls, char *key,
+                        size_t len);
+pool_origin_t *pool_origin(const char *key);
+
+/**
+ * @brief Open a connection to an origin, reusing an idle pooled one if
+ * possible
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether to speak TLS to the origin
+ * @param connection Connection (output)
+ * @param reused Set to 1 if the connection came from the pool (may be NULL)
+ * @return int 0 on success, -1 on failure
+ */
+int pool_connect(const char *host, int port, int tls, connection_t *connection,
+                 int *reused) {
+    char   key[300];
+    time_t now = time(NULL);
+    pool_key(host, port, tls, key, sizeof(key));
+    if (reused != NULL) {
+        *reused = 0;
+    }
+    for (int i = 0; i < POOL_SIZE_MAX; i++) {
+        pool_entry_t *entry = &pool[i];
+        if (!entry->used || strcmp(entry->key, key) != 0) {
+            continue;
+        }
+        entry->used = 0;
+        if (now - entry->idle_since > POOL_IDLE_TIMEOUT_S ||
+            connection_poll(&entry->connection, 0) != 0) {
+            // Expired, or closed by the origin while idle
+            close_connection(&entry->connection);
+            continue;
+        }
+        *connection = entry->connection;
+        if (reused != NULL) {
+            *reused = 1;
+        }
+        return 0;
+    }
+
+    memset(connection, 0, sizeof(connection_t));
+    if (connect_to_hostname((char *)host, port, connection) != 0) {
+        return -1;
+    }
+    if (tls && tls_connect(connection, host, port) != 0) {
+        close_connection(connection);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Return a connection to the pool
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the connection speaks TLS
+ * @param connection Connection (ownership moves to the pool)
+ */
+void pool_release(const char *host, int port, int tls,
+                  connection_t *connection) {
+    // Leftover bytes mean the framing was off, never reuse that
+    if (connection->pending_len > 0 || connection_expired(connection)) {
+        close_connection(connection);
+        return;
+    }
+    // The pooled copy must not be linked into the deadline timers
+    connection_set_deadline(connection, -1);
+    pool_entry_t *slot   = NULL;
+    time_t        oldest = 0;
+    for (int i = 0; i < POOL_SIZE_MAX; i++) {
+        if (!pool[i].used) {
+            slot = &pool[i];
+            break;
+        }
+        if (slot == NULL || pool[i].idle_since < oldest) {
+            slot   = &pool[i];
+            oldest = pool[i].idle_since;
+        }
+    }
+    // Evict the oldest idle connection when the pool is full
+    if (slot->used) {
+        close_connection(&slot->connection);
+    }
+    pool_key(host, port, tls, slot->key, sizeof(slot->key));
+    slot->connection = *connection;
+    slot->idle_since = time(NULL);
+    slot->used       = 1;
+}
+
+/**
+ * @brief Get what is known of an origin's support for pipelined requests
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the origin speaks TLS
+ * @return int POOL_PIPELINE_UNKNOWN, POOL_PIPELINE_YES or POOL_PIPELINE_NO
+ */
+int pool_get_pipelining(const char *host, int port, int tls) {
+    char key[300];
+    pool_key(host, port, tls, key, sizeof(key));
+    pool_origin_t *origin = pool_origin(key);
+    return origin != NULL ? origin->pipelining : POOL_PIPELINE_UNKNOWN;
+}
+
+/**
+ * @brief Remember an origin's support for pipelined requests
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the origin speaks TLS
+ * @param pipelining POOL_PIPELINE_YES or POOL_PIPELINE_NO
+ */
+void pool_set_pipelining(const char *host, int port, int tls, int pipelining) {
+    char key[300];
+    pool_key(host, port, tls, key, sizeof(key));
+    pool_origin_t *origin = pool_origin(key);
+    if (origin == NULL) {
+        // Forget the origin that was added longest ago
+        origin      = &origins[next_origin];
+        next_origin = (next_origin + 1) % POOL_ORIGINS_MAX;
+        strcpy(origin->key, key);
+        origin->pipelining = POOL_PIPELINE_UNKNOWN;
+    }
+    if (origin->pipelining != POOL_PIPELINE_NO) {
+        origin->pipelining = pipelining;
+    }
+}
+
+/**
+ * @brief Close every pooled connection
+ */
+void pool_close_all() {
+    for (int i = 0; i < POOL_SIZE_MAX; i++) {
+        if (pool[i].used) {
+            close_connection(&pool[i].connection);
+            pool[i].used = 0;
+        }
+    }
+}
+
+// Private function definitions
+
+/**
+ * @brief Build the pool key of an origin
+ */
+void pool_key(const char *host, int port, int tls, char *key, size_t len) {
+    snprintf(key, len, "%s:%d:%d", host, port, tls);
+}
+
+/**
+ * @brief Find the pipelining support of an origin
+ *
+ * @return pool_origin_t* Entry, NULL if the origin is not known
+ */
+pool_origin_t *pool_origin(const char *key) {
+    for (int i = 0; i < POOL_ORIGINS_MAX; i++) {
+        if (strcmp(origins[i].key, key) == 0) {
+            return &origins[i];
+        }
+    }
+    return NULL;
+}
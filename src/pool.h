@@ -0,0 +1,79 @@
+/**
+ * @file pool.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Pool of idle keep-alive connections to origin servers. Plain and TLS
+ * connections are kept separately so a TLS session is reused without another
+ * handshake.
+ * @version 0.1
+ * @date 2023-05-04
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "connection.h"
+
+#define POOL_SIZE_MAX       16 // Idle connections kept per process/thread
+#define POOL_IDLE_TIMEOUT_S 30 // Idle connections older than this are closed
+#define POOL_ORIGINS_MAX    64 // Origins whose pipelining support is remembered
+
+#define POOL_PIPELINE_UNKNOWN 0 // Not known yet whether the origin pipelines
+#define POOL_PIPELINE_YES     1 // The origin keeps connections alive
+#define POOL_PIPELINE_NO      2 // The origin broke a pipeline
+
+/**
+ * @brief Open a connection to an origin, reusing an idle pooled one if
+ * possible
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether to speak TLS to the origin
+ * @param connection Connection (output)
+ * @param reused Set to 1 if the connection came from the pool (may be NULL)
+ * @return int 0 on success, -1 on failure
+ */
+int pool_connect(const char *host, int port, int tls, connection_t *connection,
+                 int *reused);
+
+/**
+ * @brief Return a connection to the pool. The connection is closed instead if
+ * the pool is full.
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the connection speaks TLS
+ * @param connection Connection (ownership moves to the pool)
+ */
+void pool_release(const char *host, int port, int tls,
+                  connection_t *connection);
+
+/**
+ * @brief Get what is known of an origin's support for pipelined requests
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the origin speaks TLS
+ * @return int POOL_PIPELINE_UNKNOWN, POOL_PIPELINE_YES or POOL_PIPELINE_NO
+ */
+int pool_get_pipelining(const char *host, int port, int tls);
+
+/**
+ * @brief Remember an origin's support for pipelined requests. Once an origin
+ * is marked POOL_PIPELINE_NO it stays so.
+ *
+ * @param host Origin hostname
+ * @param port Origin port
+ * @param tls Whether the origin speaks TLS
+ * @param pipelining POOL_PIPELINE_YES or POOL_PIPELINE_NO
+ */
+void pool_set_pipelining(const char *host, int port, int tls, int pipelining);
+
+/**
+ * @brief Close every pooled connection
+ */
+void pool_close_all();
+
+#endif
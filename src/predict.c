@@ -0,0 +1,289 @@
+/**
+ * @file predict.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of predict.h
+ * @details The URLs and the clients are direct-mapped tables of hashes: a
+ * URL taking the slot of another one starts over with no successors. Each
+ * slot has a busy flag taken with a CAS, and a process finding it taken
+ * skips the update, so a few transitions go uncounted under contention
+ * instead of anyone waiting. The budget is a token bucket holding at most
+ * one second of bytes, charged with the size the predicted URL had when it
+ * was last served.
+ *
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "predict.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hash.h"
+#include "shm.h"
+
+/**
+ * @brief URL asked for after another one, and how often
+ */
+typedef struct predict_successor {
+    uint64_t key; // URL hash
+    int      count;
+} predict_successor_t;
+
+/**
+ * @brief URL of the model and its successors
+ */
+typedef struct predict_node {
+    _Atomic int         busy;
+    uint64_t            key;   // URL hash, 0 for a free slot
+    size_t              size;  // Size of the response last served
+    int                 total; // Transitions counted from this URL
+    predict_successor_t successors[PREDICT_SUCCESSORS];
+    char                url[PREDICT_URL_MAX];
+} predict_node_t;
+
+/**
+ * @brief Last request of a client
+ */
+typedef struct predict_client {
+    _Atomic int busy;
+    uint64_t    key;     // Address hash
+    uint64_t    last;    // URL hash of the last request
+    uint64_t    last_ms; // When it was answered
+    uint64_t    pending; // URL hash prefetched for the next request, or 0
+} predict_client_t;
+
+/**
+ * @brief Shared state of every process
+ */
+typedef struct predict_table {
+    long             budget; // Bytes per second
+    _Atomic long     tokens; // Bytes left to prefetch
+    _Atomic uint64_t refilled_ms;
+    _Atomic long     predicted;
+    _Atomic long     used;
+    predict_client_t clients[PREDICT_CLIENTS];
+    predict_node_t   nodes[PREDICT_NODES];
+} predict_table_t;
+
+static predict_table_t *table;
+
+// Private functions
+int  predict_lock(_Atomic int *busy);
+void predict_unlock(_Atomic int *busy);
+void predict_count(predict_node_t *node, uint64_t key);
+
+/**
+ * @brief Set up the shared tables. Call before forking.
+ *
+ * @param budget Bytes per second prefetched on predictions
+ * @return int 0 on success, -1 on failure
+ */
+int predict_init(long budget) {
+    table = shm_map("predict", sizeof(predict_table_t));
+    if (table == NULL) {
+        return -1;
+    }
+    table->budget = budget;
+    return 0;
+}
+
+/**
+ * @brief Record a request a client got an answer for, and predict the URL
+ * the client asks for next
+ *
+ * @param client Client address
+ * @param url Absolute URL of the request
+ * @param size Size of the response
+ * @param now_ms Current time (timer_now_ms())
+ * @param next Most likely next URL, PREDICT_URL_MAX bytes (output)
+ * @param next_size Size of its response when it was last served (output)
+ * @return int 1 if the next URL is likely enough to prefetch, 0 otherwise
+ */
+int predict_record(const char *client, const char *url, size_t size,
+                   uint64_t now_ms, char *next, size_t *next_size) {
+    if (table == NULL || strlen(url) >= PREDICT_URL_MAX) {
+        return 0;
+    }
+    uint64_t key = hash_string(url);
+
+    // The client's previous request, if this one follows it closely enough
+    uint64_t          prev = 0;
+    uint64_t          addr = hash_string(client);
+    predict_client_t *c    = &table->clients[addr % PREDICT_CLIENTS];
+    if (predict_lock(&c->busy)) {
+        if (c->key == addr) {
+            if (c->pending != 0 && c->pending == key) {
+                atomic_fetch_add(&table->used, 1);
+            }
+            if (now_ms - c->last_ms <= PREDICT_WINDOW_MS && c->last != key) {
+                prev = c->last;
+            }
+        } else {
+            c->key = addr;
+        }
+        c->pending = 0;
+        c->last    = key;
+        c->last_ms = now_ms;
+        predict_unlock(&c->busy);
+    }
+
+    // The URL itself and its most likely successor
+    uint64_t        best = 0;
+    predict_node_t *node = &table->nodes[key % PREDICT_NODES];
+    if (predict_lock(&node->busy)) {
+        if (node->key != key) {
+            node->key   = key;
+            node->total = 0;
+            memset(node->successors, 0, sizeof(node->successors));
+            strcpy(node->url, url);
+        }
+        node->size = size;
+        for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+            predict_successor_t *s = &node->successors[i];
+            if (node->total >= PREDICT_MIN_SAMPLES && s->count > 0 &&
+                s->count * 100 >= node->total * PREDICT_CONFIDENCE) {
+                best = s->key;
+            }
+        }
+        predict_unlock(&node->busy);
+    }
+
+    // The transition from the previous request
+    if (prev != 0) {
+        node = &table->nodes[prev % PREDICT_NODES];
+        if (predict_lock(&node->busy)) {
+            if (node->key == prev) {
+                predict_count(node, key);
+            }
+            predict_unlock(&node->busy);
+        }
+    }
+
+    if (best == 0) {
+        return 0;
+    }
+    int rv = 0;
+    node   = &table->nodes[best % PREDICT_NODES];
+    if (predict_lock(&node->busy)) {
+        if (node->key == best) {
+            strcpy(next, node->url);
+            *next_size = node->size;
+            rv         = 1;
+        }
+        predict_unlock(&node->busy);
+    }
+    return rv;
+}
+
+/**
+ * @brief Take a predicted URL's size out of the bandwidth budget and count
+ * the prediction
+ *
+ * @param client Client the URL was predicted for
+ * @param next URL from predict_record()
+ * @param size Size from predict_record()
+ * @param now_ms Current time (timer_now_ms())
+ * @return int 1 if the URL may be prefetched, 0 if the budget is spent
+ */
+int predict_spend(const char *client, const char *next, size_t size,
+                  uint64_t now_ms) {
+    if (table == NULL) {
+        return 0;
+    }
+    // Refill for the time since the last refill, one second at most
+    uint64_t last = atomic_load(&table->refilled_ms);
+    if (now_ms > last &&
+        atomic_compare_exchange_strong(&table->refilled_ms, &last, now_ms)) {
+        uint64_t elapsed = now_ms - last < 1000 ? now_ms - last : 1000;
+        long     tokens  = atomic_load(&table->tokens);
+        long     refill  = table->budget * (long)elapsed / 1000;
+        if (tokens + refill > table->budget) {
+            refill = table->budget - tokens;
+        }
+        atomic_fetch_add(&table->tokens, refill);
+    }
+    if (atomic_fetch_sub(&table->tokens, (long)size) < (long)size) {
+        atomic_fetch_add(&table->tokens, (long)size);
+        return 0;
+    }
+
+    uint64_t          addr = hash_string(client);
+    predict_client_t *c    = &table->clients[addr % PREDICT_CLIENTS];
+    if (predict_lock(&c->busy)) {
+        if (c->key == addr) {
+            c->pending = hash_string(next);
+        }
+        predict_unlock(&c->busy);
+    }
+    atomic_fetch_add(&table->predicted, 1);
+    return 1;
+}
+
+/**
+ * @brief Get the counts of prefetched predictions. A prediction is used when
+ * the client it was made for asks for that URL next, and wasted otherwise.
+ *
+ * @param predicted URLs prefetched on predictions (output)
+ * @param used Of those, the ones their client asked for next (output)
+ */
+void predict_stats(long *predicted, long *used) {
+    *predicted = table != NULL ? atomic_load(&table->predicted) : 0;
+    *used      = table != NULL ? atomic_load(&table->used) : 0;
+}
+
+// Private function definitions
+
+/**
+ * @brief Take a slot's busy flag without waiting
+ *
+ * @return int 1 if taken, 0 if another process holds it
+ */
+int predict_lock(_Atomic int *busy) {
+    int expected = 0;
+    return atomic_compare_exchange_strong(busy, &expected, 1);
+}
+
+/**
+ * @brief Let go of a slot's busy flag
+ */
+void predict_unlock(_Atomic int *busy) { atomic_store(busy, 0); }
+
+/**
+ * @brief Count a transition from a URL. A new successor takes the place of
+ * the least frequent one, and the counts halve every PREDICT_AGE_AT
+ * transitions so the model follows a change of habits.
+ *
+ * @param node URL the transition starts from (held)
+ * @param key URL hash the transition goes to
+ */
+void predict_count(predict_node_t *node, uint64_t key) {
+    predict_successor_t *slot = &node->successors[0];
+    for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+        predict_successor_t *s = &node->successors[i];
+        if (s->key == key && s->count > 0) {
+            slot = s;
+            break;
+        }
+        if (s->count < slot->count) {
+            slot = s;
+        }
+    }
+    if (slot->key != key || slot->count == 0) {
+        slot->key   = key;
+        slot->count = 0;
+    }
+    slot->count++;
+    node->total++;
+    if (node->total >= PREDICT_AGE_AT) {
+        node->total /= 2;
+        for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+            node->successors[i].count /= 2;
+        }
+    }
+}
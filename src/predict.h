@@ -0,0 +1,79 @@
+/**
+ * @file predict.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Predictive prefetching. A first-order Markov model learns which URL
+ * a client asks for within PREDICT_WINDOW_MS of another one (the next page
+ * of a listing, the neighbouring tile of a map, ...), so the proxy can fetch
+ * the likely next URL into the cache while the client is still busy with
+ * the current one. The model, the per-client history, the bandwidth budget
+ * and the hit counts are kept in shared memory so every forked child sees
+ * them.
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PREDICT_NODES       1024 // URLs the model remembers
+#define PREDICT_SUCCESSORS  4    // Successors counted per URL
+#define PREDICT_CLIENTS     256  // Clients whose last request is remembered
+#define PREDICT_URL_MAX     1024 // Longest URL in the model
+#define PREDICT_WINDOW_MS   2000 // B follows A if asked for within this
+#define PREDICT_MIN_SAMPLES 4    // Transitions from A seen before predicting
+#define PREDICT_CONFIDENCE  60   // Percent of A's transitions that go to B
+#define PREDICT_AGE_AT      256  // Counts of a URL halve when its total hits
+#define PREDICT_JOBS        4    // Prefetch jobs at once when only predicting
+
+/**
+ * @brief Set up the shared tables. Call before forking.
+ *
+ * @param budget Bytes per second prefetched on predictions
+ * @return int 0 on success, -1 on failure
+ */
+int predict_init(long budget);
+
+/**
+ * @brief Record a request a client got an answer for, and predict the URL
+ * the client asks for next
+ *
+ * @param client Client address
+ * @param url Absolute URL of the request
+ * @param size Size of the response
+ * @param now_ms Current time (timer_now_ms())
+ * @param next Most likely next URL, PREDICT_URL_MAX bytes (output)
+ * @param next_size Size of its response when it was last served (output)
+ * @return int 1 if the next URL is likely enough to prefetch, 0 otherwise
+ */
+int predict_record(const char *client, const char *url, size_t size,
+                   uint64_t now_ms, char *next, size_t *next_size);
+
+/**
+ * @brief Take a predicted URL's size out of the bandwidth budget and count
+ * the prediction
+ *
+ * @param client Client the URL was predicted for
+ * @param next URL from predict_record()
+ * @param size Size from predict_record()
+ * @param now_ms Current time (timer_now_ms())
+ * @return int 1 if the URL may be prefetched, 0 if the budget is spent
+ */
+int predict_spend(const char *client, const char *next, size_t size,
+                  uint64_t now_ms);
+
+/**
+ * @brief Get the counts of prefetched predictions. A prediction is used when
+ * the client it was made for asks for that URL next, and wasted otherwise.
+ *
+ * @param predicted URLs prefetched on predictions (output)
+ * @param used Of those, the ones their client asked for next (output)
+ */
+void predict_stats(long *predicted, long *used);
+
+#endif
@@ -0,0 +1,427 @@
+/**
+ * @file prefetch.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of prefetch.h
+ * @details The scanner looks at each tag once: it collects the tag's href,
+ * src and rel attributes and decides at the closing '>' which of them is a
+ * subresource. The recently prefetched links are a direct-mapped table of
+ * URL hashes, so a link that collides with another one may be prefetched
+ * twice, which the cache check makes harmless.
+ *
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // memmem()
+
+#include "prefetch.h"
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hash.h"
+#include "shm.h"
+
+#define PREFETCH_SEGMENTS_MAX 64 // Path segments of a resolved link
+
+/**
+ * @brief Recently prefetched link
+ */
+typedef struct prefetch_seen {
+    _Atomic uint64_t key; // URL hash, 0 for a free slot
+    _Atomic time_t   at;  // When it was claimed
+} prefetch_seen_t;
+
+/**
+ * @brief Shared state of every process
+ */
+typedef struct prefetch_table {
+    _Atomic int     active; // Jobs running
+    prefetch_seen_t seen[PREFETCH_SEEN];
+} prefetch_table_t;
+
+static prefetch_table_t *table;
+static int               prefetch_max_jobs;
+
+// Private functions
+const char *prefetch_skip_raw(const char *p, const char *end, const char *name,
+                              size_t name_len);
+int         prefetch_add(char (*links)[PREFETCH_URL_MAX], int n,
+                         const char *base, const char *link, size_t len);
+int         prefetch_normalize(char *url);
+
+/**
+ * @brief Set up the shared table. Call before forking.
+ *
+ * @param max_jobs Prefetch jobs allowed to run at once
+ * @return int 0 on success, -1 on failure
+ */
+int prefetch_init(int max_jobs) {
+    table = shm_map("prefetch", sizeof(prefetch_table_t));
+    if (table == NULL) {
+        return -1;
+    }
+    prefetch_max_jobs = max_jobs;
+    return 0;
+}
+
+/**
+ * @brief Find the subresources an HTML page refers to
+ *
+ * @param html Page
+ * @param len Length of the page
+ * @param base Absolute URL of the page
+ * @param links Absolute http and https URLs, each once (output)
+ * @param max Size of links
+ * @return int Number of links
+ */
+int prefetch_scan(const char *html, size_t len, const char *base,
+                  char (*links)[PREFETCH_URL_MAX], int max) {
+    char page[PREFETCH_URL_MAX];
+    if (strlen(base) >= sizeof(page)) {
+        return 0;
+    }
+    strcpy(page, base);
+
+    const char *p   = html;
+    const char *end = html + len;
+    int         n   = 0;
+    while (n < max && (p = memchr(p, '<', end - p)) != NULL) {
+        p++;
+        if (end - p >= 3 && memcmp(p, "!--", 3) == 0) {
+            p = memmem(p + 3, end - p - 3, "-->", 3);
+            if (p == NULL) {
+                break;
+            }
+            continue;
+        }
+        // Tag name, closing tags and declarations have none
+        const char *name = p;
+        while (p < end && isalnum((unsigned char)*p)) {
+            p++;
+        }
+        size_t name_len = p - name;
+        if (name_len == 0) {
+            continue;
+        }
+
+        // Attributes up to the end of the tag
+        const char *href = NULL, *src = NULL, *rel = NULL;
+        size_t      href_len = 0, src_len = 0, rel_len = 0;
+        while (p < end && *p != '>') {
+            if (isspace((unsigned char)*p) || *p == '/') {
+                p++;
+                continue;
+            }
+            const char *attr = p;
+            while (p < end && !isspace((unsigned char)*p) && *p != '=' &&
+                   *p != '>' && *p != '/') {
+                p++;
+            }
+            size_t attr_len = p - attr;
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (p == end || *p != '=') {
+                continue; // No value
+            }
+            p++;
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            const char *value = p;
+            size_t      value_len;
+            if (p < end && (*p == '"' || *p == '\'')) {
+                const char *close = memchr(p + 1, *p, end - p - 1);
+                if (close == NULL) {
+                    return n;
+                }
+                value     = p + 1;
+                value_len = close - value;
+                p         = close + 1;
+            } else {
+                while (p < end && !isspace((unsigned char)*p) && *p != '>') {
+                    p++;
+                }
+                value_len = p - value;
+            }
+            if (attr_len == 4 && strncasecmp(attr, "href", 4) == 0) {
+                href     = value;
+                href_len = value_len;
+            } else if (attr_len == 3 && strncasecmp(attr, "src", 3) == 0) {
+                src     = value;
+                src_len = value_len;
+            } else if (attr_len == 3 && strncasecmp(attr, "rel", 3) == 0) {
+                rel     = value;
+                rel_len = value_len;
+            }
+        }
+
+        if (name_len == 4 && strncasecmp(name, "base", 4) == 0) {
+            char url[PREFETCH_URL_MAX];
+            if (href != NULL &&
+                prefetch_resolve(page, href, href_len, url, sizeof(url)) ==
+                    0) {
+                strcpy(page, url);
+            }
+        } else if (name_len == 4 && strncasecmp(name, "link", 4) == 0) {
+            char kind[64] = "";
+            if (rel != NULL && rel_len < sizeof(kind)) {
+                memcpy(kind, rel, rel_len);
+                kind[rel_len] = '\0';
+            }
+            // Stylesheets, icons and preloads, not links to other pages
+            if (href != NULL && (strcasestr(kind, "stylesheet") != NULL ||
+                                 strcasestr(kind, "icon") != NULL ||
+                                 strcasestr(kind, "preload") != NULL)) {
+                n = prefetch_add(links, n, page, href, href_len);
+            }
+        } else if (src != NULL) {
+            n = prefetch_add(links, n, page, src, src_len);
+        }
+
+        // The contents of script and style elements are not markup
+        if ((name_len == 6 && strncasecmp(name, "script", 6) == 0) ||
+            (name_len == 5 && strncasecmp(name, "style", 5) == 0)) {
+            p = prefetch_skip_raw(p, end, name, name_len);
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Resolve a link against the URL of the page it is on
+ *
+ * @param base Absolute URL of the page
+ * @param link Link as it appears in the page
+ * @param len Length of link
+ * @param url Absolute URL without fragment (output)
+ * @param size Size of url
+ * @return int 0 on success, -1 if the link is not an http or https URL or
+ * is too long
+ */
+int prefetch_resolve(const char *base, const char *link, size_t len, char *url,
+                     size_t size) {
+    // Trim the link, drop its fragment and decode &amp;
+    char   ref[PREFETCH_URL_MAX];
+    size_t ref_len = 0;
+    while (len > 0 && isspace((unsigned char)*link)) {
+        link++;
+        len--;
+    }
+    while (len > 0 && isspace((unsigned char)link[len - 1])) {
+        len--;
+    }
+    for (size_t i = 0; i < len && link[i] != '#'; i++) {
+        if (ref_len + 1 >= sizeof(ref)) {
+            return -1;
+        }
+        ref[ref_len++] = link[i];
+        if (link[i] == '&' && len - i >= 5 &&
+            strncasecmp(link + i, "&amp;", 5) == 0) {
+            i += 4;
+        }
+    }
+    ref[ref_len] = '\0';
+    if (ref_len == 0) {
+        return -1; // The page itself
+    }
+
+    // A scheme makes the link absolute
+    size_t scheme_len = strspn(ref, "abcdefghijklmnopqrstuvwxyz"
+                                    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+.-");
+    const char *authority = strstr(base, "://");
+    if (authority == NULL) {
+        return -1;
+    }
+    authority += 3;
+    const char *path = authority + strcspn(authority, "/?");
+    int         rv;
+    if (scheme_len > 0 && ref[scheme_len] == ':') {
+        if (strncasecmp(ref, "http:", 5) != 0 &&
+            strncasecmp(ref, "https:", 6) != 0) {
+            return -1; // mailto:, javascript:, data:, ...
+        }
+        rv = snprintf(url, size, "%s", ref);
+    } else if (ref[0] == '/' && ref[1] == '/') {
+        rv = snprintf(url, size, "%.*s%s", (int)(authority - base - 2), base,
+                      ref);
+    } else if (ref[0] == '/') {
+        rv = snprintf(url, size, "%.*s%s", (int)(path - base), base, ref);
+    } else if (ref[0] == '?') {
+        rv = snprintf(url, size, "%.*s%s",
+                      (int)(path - base + strcspn(path, "?")), base, ref);
+    } else {
+        // Relative to the directory of the page
+        size_t dir = path - base;
+        for (const char *c = path; *c != '\0' && *c != '?'; c++) {
+            if (*c == '/') {
+                dir = c + 1 - base;
+            }
+        }
+        if (dir == (size_t)(path - base)) {
+            rv = snprintf(url, size, "%.*s/%s", (int)dir, base, ref);
+        } else {
+            rv = snprintf(url, size, "%.*s%s", (int)dir, base, ref);
+        }
+    }
+    if (rv < 0 || (size_t)rv >= size) {
+        return -1;
+    }
+    return prefetch_normalize(url);
+}
+
+/**
+ * @brief Claim a link for prefetching, unless it was claimed within the
+ * last PREFETCH_SEEN_S seconds
+ *
+ * @param url Absolute URL
+ * @param now Current time
+ * @return int 1 if claimed, 0 if recently prefetched or prefetching is off
+ */
+int prefetch_claim(const char *url, time_t now) {
+    if (table == NULL) {
+        return 0;
+    }
+    uint64_t         key   = hash_string(url);
+    prefetch_seen_t *slot  = &table->seen[key % PREFETCH_SEEN];
+    uint64_t         found = atomic_load(&slot->key);
+    if (found == key) {
+        time_t at = atomic_load(&slot->at);
+        return now - at >= PREFETCH_SEEN_S &&
+               atomic_compare_exchange_strong(&slot->at, &at, now);
+    }
+    // Another link loses its slot
+    if (!atomic_compare_exchange_strong(&slot->key, &found, key)) {
+        return 0;
+    }
+    atomic_store(&slot->at, now);
+    return 1;
+}
+
+/**
+ * @brief Start a prefetch job if fewer than max_jobs are running
+ *
+ * @return int 1 if the job may run, 0 otherwise
+ */
+int prefetch_begin() {
+    if (table == NULL) {
+        return 0;
+    }
+    if (atomic_fetch_add(&table->active, 1) >= prefetch_max_jobs) {
+        atomic_fetch_sub(&table->active, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief End a prefetch job started with prefetch_begin()
+ */
+void prefetch_end() {
+    if (table != NULL) {
+        atomic_fetch_sub(&table->active, 1);
+    }
+}
+
+// Private function definitions
+
+/**
+ * @brief Skip the contents of a script or style element
+ *
+ * @return const char* Position of its closing tag, end if there is none
+ */
+const char *prefetch_skip_raw(const char *p, const char *end, const char *name,
+                              size_t name_len) {
+    while ((p = memchr(p, '<', end - p)) != NULL) {
+        if ((size_t)(end - p) > name_len + 1 && p[1] == '/' &&
+            strncasecmp(p + 2, name, name_len) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return end;
+}
+
+/**
+ * @brief Resolve a link and add it to the links unless it is already there
+ *
+ * @return int New number of links
+ */
+int prefetch_add(char (*links)[PREFETCH_URL_MAX], int n, const char *base,
+                 const char *link, size_t len) {
+    char url[PREFETCH_URL_MAX];
+    if (prefetch_resolve(base, link, len, url, sizeof(url)) != 0) {
+        return n;
+    }
+    for (int i = 0; i < n; i++) {
+        if (strcmp(links[i], url) == 0) {
+            return n;
+        }
+    }
+    strcpy(links[n], url);
+    return n + 1;
+}
+
+/**
+ * @brief Remove the "." and ".." segments from the path of an absolute URL
+ *
+ * @return int 0 on success, -1 if the path has too many segments
+ */
+int prefetch_normalize(char *url) {
+    char *path = strstr(url, "://");
+    if (path == NULL) {
+        return -1;
+    }
+    path += 3 + strcspn(path + 3, "/?");
+    if (*path != '/') {
+        return 0;
+    }
+    char   out[PREFETCH_URL_MAX];
+    size_t starts[PREFETCH_SEGMENTS_MAX]; // Where each kept segment starts
+    size_t len = 0;
+    int    depth = 0;
+    char  *query = path + strcspn(path, "?");
+    for (char *p = path; p < query;) {
+        char  *segment = p + 1;
+        char  *next    = segment + strcspn(segment, "/?");
+        size_t seg_len = next - segment;
+        int    last    = next == query;
+        if (seg_len == 1 && segment[0] == '.') {
+            if (last) {
+                out[len++] = '/';
+            }
+        } else if (seg_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (depth > 0) {
+                len = starts[--depth];
+            }
+            if (last) {
+                out[len++] = '/';
+            }
+        } else {
+            if (depth == PREFETCH_SEGMENTS_MAX) {
+                return -1;
+            }
+            starts[depth++] = len;
+            out[len++]      = '/';
+            memcpy(out + len, segment, seg_len);
+            len += seg_len;
+        }
+        p = next;
+    }
+    if (len == 0) {
+        out[len++] = '/';
+    }
+    // Never longer than the path it replaces
+    memmove(path + len, query, strlen(query) + 1);
+    memcpy(path, out, len);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file prefetch.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Link prefetching. The subresources an HTML page refers to (images,
+ * scripts, stylesheets, ...) are found by a single pass over the page, and
+ * the proxy fetches them into the cache before the browser asks for them.
+ * The number of prefetch jobs running at once and the links recently
+ * prefetched are kept in shared memory so every forked child sees them.
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define PREFETCH_LINKS_MAX 32   // Links prefetched per page
+#define PREFETCH_URL_MAX   1024 // Longest link prefetched
+#define PREFETCH_SEEN      1024 // Recently prefetched links remembered
+#define PREFETCH_SEEN_S    10   // A link is not prefetched again within this
+
+/**
+ * @brief Set up the shared table. Call before forking.
+ *
+ * @param max_jobs Prefetch jobs allowed to run at once
+ * @return int 0 on success, -1 on failure
+ */
+int prefetch_init(int max_jobs);
+
+/**
+ * @brief Find the subresources an HTML page refers to: the src of any
+ * element and the href of stylesheet, icon and preload links. A <base href>
+ * changes the base of the links after it. Comments and the contents of
+ * script and style elements are skipped.
+ *
+ * @param html Page
+ * @param len Length of the page
+ * @param base Absolute URL of the page
+ * @param links Absolute http and https URLs, each once (output)
+ * @param max Size of links
+ * @return int Number of links
+ */
+int prefetch_scan(const char *html, size_t len, const char *base,
+                  char (*links)[PREFETCH_URL_MAX], int max);
+
+/**
+ * @brief Resolve a link against the URL of the page it is on, following
+ * RFC 3986 (without its less common forms). Character references other
+ * than &amp; are not decoded.
+ *
+ * @param base Absolute URL of the page
+ * @param link Link as it appears in the page
+ * @param len Length of link
+ * @param url Absolute URL without fragment (output)
+ * @param size Size of url
+ * @return int 0 on success, -1 if the link is not an http or https URL or
+ * is too long
+ */
+int prefetch_resolve(const char *base, const char *link, size_t len, char *url,
+                     size_t size);
+
+/**
+ * @brief Claim a link for prefetching, unless it was claimed within the
+ * last PREFETCH_SEEN_S seconds
+ *
+ * @param url Absolute URL
+ * @param now Current time
+ * @return int 1 if claimed, 0 if recently prefetched or prefetching is off
+ */
+int prefetch_claim(const char *url, time_t now);
+
+/**
+ * @brief Start a prefetch job if fewer than max_jobs are running
+ *
+ * @return int 1 if the job may run, 0 otherwise
+ */
+int prefetch_begin();
+
+/**
+ * @brief End a prefetch job started with prefetch_begin()
+ */
+void prefetch_end();
+
+#endif
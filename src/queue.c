@@ -0,0 +1,232 @@
+/**
+ * @file queue.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of queue.h
+ * @details Producers and consumers each claim a position with one
+ * compare-and-swap on their own counter and then own the cell at that
+ * position, so the only shared write per operation is that counter. A
+ * consumer that finds the queue empty registers as a sleeper, checks again
+ * and then waits on the push counter; a producer only makes the futex
+ * syscall when it sees a sleeper. Both sides use sequentially consistent
+ * operations for that handshake, so a push is never missed.
+ *
+ * @version 0.1
+ * @date 2023-05-07
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "queue.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Private functions
+void queue_futex_wait(_Atomic uint32_t *word, uint32_t value);
+void queue_futex_wake(_Atomic uint32_t *word, int count);
+
+/**
+ * @brief Create a queue
+ *
+ * @param capacity Capacity (rounded up to a power of two)
+ * @return queue_t* Queue, NULL on failure
+ */
+queue_t *queue_create(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->cells = calloc(size, sizeof(queue_cell_t));
+    if (queue->cells == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->pushes, 0);
+    atomic_init(&queue->sleepers, 0);
+    atomic_init(&queue->closed, 0);
+    return queue;
+}
+
+/**
+ * @brief Add a value without blocking
+ *
+ * @param queue Queue
+ * @param value Value
+ * @return int 0 on success, -1 if the queue is full
+ */
+int queue_try_push(queue_t *queue, int value) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t        seq =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // Free cell, claim the position
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                cell->value = value;
+                atomic_store_explicit(&cell->sequence, pos + 1,
+                                      memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            // The consumer of the previous lap has not taken it yet
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos,
+                                       memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Take the oldest value without blocking
+ *
+ * @param queue Queue
+ * @param value Value (output)
+ * @return int 0 on success, -1 if the queue is empty
+ */
+int queue_try_pop(queue_t *queue, int *value) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t        seq =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // Filled cell, claim the position
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->dequeue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *value = cell->value;
+                // Free the cell for the producer of the next lap
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1,
+                                      memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos,
+                                       memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Add a value and wake a blocked consumer
+ *
+ * @param queue Queue
+ * @param value Value
+ * @return int 0 on success, -1 if the queue is full
+ */
+int queue_push(queue_t *queue, int value) {
+    if (queue_try_push(queue, value) != 0) {
+        return -1;
+    }
+    atomic_fetch_add(&queue->pushes, 1);
+    if (atomic_load(&queue->sleepers) > 0) {
+        queue_futex_wake(&queue->pushes, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Take the oldest value, waiting while the queue is empty
+ *
+ * @param queue Queue
+ * @param value Value (output)
+ * @return int 0 on success, -1 once the queue is closed and drained
+ */
+int queue_pop(queue_t *queue, int *value) {
+    for (;;) {
+        if (queue_try_pop(queue, value) == 0) {
+            return 0;
+        }
+        if (atomic_load(&queue->closed)) {
+            return -1;
+        }
+        // A value is often only a moment away, give the producers a chance
+        // before paying for a sleep and a wake-up
+        for (int spin = 0; spin < QUEUE_SPIN; spin++) {
+            sched_yield();
+            if (queue_try_pop(queue, value) == 0) {
+                return 0;
+            }
+        }
+        // Take a snapshot of the push counter, then check once more: a push
+        // after this point changes the counter and the wait returns at once
+        uint32_t pushes = atomic_load(&queue->pushes);
+        atomic_fetch_add(&queue->sleepers, 1);
+        if (queue_try_pop(queue, value) == 0) {
+            atomic_fetch_sub(&queue->sleepers, 1);
+            return 0;
+        }
+        if (!atomic_load(&queue->closed)) {
+            queue_futex_wait(&queue->pushes, pushes);
+        }
+        atomic_fetch_sub(&queue->sleepers, 1);
+    }
+}
+
+/**
+ * @brief Close a queue and wake every blocked consumer
+ *
+ * @param queue Queue
+ */
+void queue_close(queue_t *queue) {
+    atomic_store(&queue->closed, 1);
+    atomic_fetch_add(&queue->pushes, 1);
+    queue_futex_wake(&queue->pushes, INT_MAX);
+}
+
+/**
+ * @brief Free a queue (no thread may be using it)
+ *
+ * @param queue Queue
+ */
+void queue_free(queue_t *queue) {
+    if (queue == NULL) {
+        return;
+    }
+    free(queue->cells);
+    free(queue);
+}
+
+// Private function definitions
+
+/**
+ * @brief Sleep while the futex word still holds value
+ */
+void queue_futex_wait(_Atomic uint32_t *word, uint32_t value) {
+    // EAGAIN (the word changed) and EINTR both mean "check again"
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, value, NULL, NULL,
+            0);
+}
+
+/**
+ * @brief Wake up to count threads sleeping on the futex word
+ */
+void queue_futex_wake(_Atomic uint32_t *word, int count) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL,
+            0);
+}
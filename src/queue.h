@@ -0,0 +1,106 @@
+/**
+ * @file queue.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Bounded lock-free multi-producer/multi-consumer queue of ints (file
+ * descriptors), after Dmitry Vyukov's array queue. Consumers can block on an
+ * empty queue: they yield a few times, then sleep on a futex, and producers
+ * only make the wake-up syscall when someone is actually asleep.
+ * @version 0.1
+ * @date 2023-05-07
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QUEUE_CACHE_LINE 64 // Keeps producer and consumer counters apart
+#define QUEUE_SPIN       16 // Yields before a consumer goes to sleep
+
+/**
+ * @brief Queue cell. The sequence number says whose turn it is: equal to the
+ * position when free for a producer, position + 1 once it holds a value.
+ */
+typedef struct queue_cell {
+    _Atomic size_t sequence;
+    int            value;
+} queue_cell_t;
+
+/**
+ * @brief Queue
+ */
+typedef struct queue {
+    queue_cell_t *cells;
+    size_t        mask; // Capacity - 1
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t enqueue_pos;
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t dequeue_pos;
+    _Alignas(QUEUE_CACHE_LINE) _Atomic uint32_t pushes; // Futex word
+    _Atomic int sleepers;                                // Blocked consumers
+    _Atomic int closed;
+} queue_t;
+
+/**
+ * @brief Create a queue
+ *
+ * @param capacity Capacity (rounded up to a power of two)
+ * @return queue_t* Queue, NULL on failure
+ */
+queue_t *queue_create(size_t capacity);
+
+/**
+ * @brief Add a value without blocking
+ *
+ * @param queue Queue
+ * @param value Value
+ * @return int 0 on success, -1 if the queue is full
+ */
+int queue_try_push(queue_t *queue, int value);
+
+/**
+ * @brief Take the oldest value without blocking
+ *
+ * @param queue Queue
+ * @param value Value (output)
+ * @return int 0 on success, -1 if the queue is empty
+ */
+int queue_try_pop(queue_t *queue, int *value);
+
+/**
+ * @brief Add a value and wake a blocked consumer
+ *
+ * @param queue Queue
+ * @param value Value
+ * @return int 0 on success, -1 if the queue is full
+ */
+int queue_push(queue_t *queue, int value);
+
+/**
+ * @brief Take the oldest value, waiting while the queue is empty
+ *
+ * @param queue Queue
+ * @param value Value (output)
+ * @return int 0 on success, -1 once the queue is closed and drained
+ */
+int queue_pop(queue_t *queue, int *value);
+
+/**
+ * @brief Close a queue and wake every blocked consumer. Values already in
+ * the queue can still be popped.
+ *
+ * @param queue Queue
+ */
+void queue_close(queue_t *queue);
+
+/**
+ * @brief Free a queue (no thread may be using it)
+ *
+ * @param queue Queue
+ */
+void queue_free(queue_t *queue);
+
+#endif
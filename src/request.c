@@ -6,18 +6,22 @@
  * @date 2023-04-14
  */
 
+#define _GNU_SOURCE // strcasestr()
+
 #include "request.h"
 
 #include <ctype.h>
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "response.h"
 
 // Private function prototypes
 int        request_header_parse(request_t *request);
 request_t *request_new();
+int        request_is_cacheable_(request_t *request, const char *method);
 
 request_t *request_recv(connection_t *connection) {
     request_t *request = request_new();
@@ -48,19 +52,39 @@ request_t *request_recv(connection_t *connection) {
  * @return int 0 on success, -1 on failure
  */
 int request_send(request_t *request, connection_t *connection) {
-    // Prepare the request line
-    char request_line[1024];
-    memset(request_line, 0, 1024);
+    // Prepare the request line, in absolute-form for a parent or sibling
+    // proxy, which needs it to tell the origin
+    char origin[1024] = "";
+    if (request->next_hop_proxy) {
+        if (request->port != -1) {
+            snprintf(origin, sizeof(origin), "http://%s:%d", request->host,
+                     request->port);
+        } else {
+            snprintf(origin, sizeof(origin), "http://%s", request->host);
+        }
+    }
+    char request_line[2048];
+    memset(request_line, 0, sizeof(request_line));
     if (request->query != NULL) {
-        sprintf(request_line, "%s %s?%s %s\r\n", request->method, request->uri,
-                request->query, request->version);
+        snprintf(request_line, sizeof(request_line), "%s %s%s?%s %s\r\n",
+                 request->method, origin, request->uri, request->query,
+                 request->version);
     } else {
-        sprintf(request_line, "%s %s %s\r\n", request->method, request->uri,
-                request->version);
+        snprintf(request_line, sizeof(request_line), "%s %s%s %s\r\n",
+                 request->method, origin, request->uri, request->version);
     }
     // sprintf(request_line, "%s %s %s\r\n", request->method, request->uri,
     // request->version); fprintf(stderr, "REQUEST_LINE: %s\n", request_line);
     http_message_set_header_line(request->message, request_line);
+    // The proxy answers Expect itself once the origin is reachable
+    int expect_continue = 0;
+    if (request->client != NULL) {
+        char *expect = http_message_header_get(request->message, "Expect");
+        if (expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+            expect_continue = 1;
+        }
+        http_message_header_remove(request->message, "Expect");
+    }
     // Prepare the host header
     char host[1024];
     memset(host, 0, 1024);
@@ -97,6 +121,24 @@ int request_send(request_t *request, connection_t *connection) {
     http_message_header_set(request->message, "Host", host);
     // Send the request
     int status = http_message_send(request->message, connection);
+    if (status != 0 || request->client == NULL ||
+        !request_has_body(request)) {
+        return status;
+    }
+    // Stream the body straight from the client
+    if (expect_continue) {
+        char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (send_to_connection(request->client, cont, strlen(cont)) < 0) {
+            return -1;
+        }
+    }
+    status = http_message_stream_body(request->message, request->client,
+                                      connection);
+    // Part of a failed body may be left on the client connection, which
+    // stays marked so the caller closes it
+    if (status == 0) {
+        request->client = NULL;
+    }
     return status;
 }
 
@@ -119,6 +161,9 @@ void request_free(request_t *request) {
     if (request->version != NULL) {
         free(request->version);
     }
+    if (request->query != NULL) {
+        free(request->query);
+    }
     free(request);
 }
 
@@ -217,7 +262,7 @@ int request_header_parse(request_t *request) {
             free(request->host);
         }
         request->host  = strndup(host, strlen(host));
-        char *port_str = strchr(host, ':');
+        char *port_str = strchr(request->host, ':');
         if (port_str != NULL) {
             request->port = atoi(port_str + 1);
             *port_str     = '\0';
@@ -410,22 +455,25 @@ int request_header_parse(request_t *request) {
 
 /**
  * Returns 1 if the request is a keep-alive connection, 0 otherwise.
+ * HTTP/1.1 connections are persistent unless the client asks to close them.
  */
 int request_is_connection_keep_alive(request_t *request) {
     http_message_t *message = request->message;
     // Check for the connection header
-    if (http_message_header_get(message, "Connection") == NULL) {
-        // // Set the connection header to close
-        // http_message_header_set(message, "Connection", "close");
-        return 0;
-    } else {
-        // Check if the connection header is keep-alive
-        if (strcmp(http_message_header_get(message, "Connection"),
-                   "keep-alive") == 0) {
+    char *connection = http_message_header_get(message, "Connection");
+    if (connection == NULL) {
+        connection = http_message_header_get(message, "Proxy-Connection");
+    }
+    if (connection != NULL) {
+        if (strcasecmp(connection, "close") == 0) {
+            return 0;
+        }
+        if (strcasecmp(connection, "keep-alive") == 0) {
             return 1;
         }
     }
-    return 0;
+    return request->version != NULL &&
+           strcmp(request->version, "HTTP/1.1") == 0;
 }
 
 /**
@@ -450,17 +498,32 @@ request_t *request_parse(http_message_t *message) {
 
 // Private function definitions
 request_t *request_new() {
-    request_t *request = malloc(sizeof(request_t));
-    request->message   = NULL;
-    request->uri       = NULL;
-    request->host      = NULL;
-    request->method    = NULL;
-    request->version   = NULL;
-    request->https     = -1;
-    request->port      = -1;
+    request_t *request     = malloc(sizeof(request_t));
+    request->message       = NULL;
+    request->uri           = NULL;
+    request->host          = NULL;
+    request->method        = NULL;
+    request->version       = NULL;
+    request->query         = NULL;
+    request->client        = NULL;
+    request->https         = -1;
+    request->port          = -1;
+    request->next_hop       = NULL;
+    request->next_hop_port  = -1;
+    request->next_hop_proxy = 0;
     return request;
 }
 
+/**
+ * @brief Check if a request carries a body
+ *
+ * @param request Request to check
+ * @return int 1 if the request has a body, 0 otherwise
+ */
+int request_has_body(request_t *request) {
+    return http_message_has_body(request->message);
+}
+
 /**
  * @brief Determine if a request is cacheable
  *
@@ -468,8 +531,12 @@ request_t *request_new() {
  * @return int 1 if cacheable, 0 otherwise
  */
 int request_is_cacheable(request_t *request) {
+    return request_is_cacheable_(request, request->method);
+}
+/** @param method Method to check the request as */
+int request_is_cacheable_(request_t *request, const char *method) {
     // Check if the request is cacheable
-    if (request->method == NULL || strcmp(request->method, "GET") != 0) {
+    if (method == NULL || strcmp(method, "GET") != 0) {
         return 0;
     }
     if (request->version == NULL) {
@@ -496,8 +563,23 @@ int request_is_cacheable(request_t *request) {
 }
 
 /**
- * @brief Get a key to hash the request on. Return NULL if the request is not
- * cacheable.
+ * @brief Check if a request may only be answered from the cache
+ * (Cache-Control: only-if-cached)
+ *
+ * @param request Request to check
+ * @return int 1 if it may, 0 otherwise
+ */
+int request_is_only_if_cached(request_t *request) {
+    char *cache_control =
+        http_message_header_get(request->message, "Cache-Control");
+    return cache_control != NULL &&
+           strcasestr(cache_control, "only-if-cached") != NULL;
+}
+
+/**
+ * @brief Get a key to hash the request on. The key is empty if the request
+ * can not be answered from the cache. HEAD requests share the key of the
+ * matching GET.
  *
  * @param request Request to hash
  * @param key Output key
@@ -505,8 +587,14 @@ int request_is_cacheable(request_t *request) {
  */
 void request_get_key(request_t *request, char *key, size_t len) {
     *key = '\0';
-    if (request_is_cacheable(request)) {
-        // Create the key
-        snprintf(key, len, "%s%s", request->host, request->uri);
+    char *method = request->method;
+    if (method != NULL && strcmp(method, "HEAD") == 0) {
+        // Look the HEAD up as if it were a GET
+        method = "GET";
+    }
+    if (request_is_cacheable_(request, method)) {
+        // Create the key (https objects are kept apart from http ones)
+        snprintf(key, len, "%s%s%s", request->https == 1 ? "https://" : "",
+                 request->host, request->uri);
     }
 }
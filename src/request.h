@@ -22,7 +22,8 @@
 // #define REQUEST_REGEX_PATH "([^ \\?]*)?"
 
 #define REQUEST_REGEX_WHITESPACE     "[ \t]+"
-#define REQUEST_REGEX_METHOD         "(GET)"
+#define REQUEST_REGEX_METHOD                                                   \
+    "(GET|HEAD|POST|PUT|DELETE|OPTIONS|PATCH|TRACE|CONNECT)"
 #define REQUEST_REGEX_PROTOCOL       "(http[s]?://)?"
 #define REQUEST_REGEX_HOSTNAME       "([^/:\\?]+)?"
 #define REQUEST_REGEX_PORT           "(:([0-9]+))?"
@@ -56,14 +57,18 @@
  *
  */
 typedef struct request {
-    http_message_t *message; // HTTP message
-    int             https;   // HTTPS request
-    int             port;    // Request port
-    char           *host;    // Request host
-    char           *method;  // Request method
-    char           *uri;     // Request URI
-    char           *query;   // Request query string
-    char           *version; // Request version
+    http_message_t *message;       // HTTP message
+    int             https;         // HTTPS request
+    int             port;          // Request port
+    char           *host;          // Request host
+    char           *method;        // Request method
+    char           *uri;           // Request URI
+    char           *query;         // Request query string
+    char           *version;       // Request version
+    connection_t   *client;        // Connection the body is still pending on
+    const char     *next_hop;       // Server to send it to (NULL: the origin)
+    int             next_hop_port;  // Port of next_hop
+    int             next_hop_proxy; // next_hop is a proxy (absolute-form)
 } request_t;
 
 /**
@@ -76,7 +81,10 @@ request_t *request_recv(connection_t *connection);
 
 /**
  * @brief Send a request to the server. Prepares the http_message_t with the
- * header line, host header.
+ * header line, host header. A body pending on request->client is streamed
+ * after it; client is cleared once the whole body went out, and left set if
+ * it failed, since the client connection is then out of sync and must be
+ * closed.
  *
  * @param request Request to send
  * @param connection Connection
@@ -99,8 +107,9 @@ void request_free(request_t *request);
 int request_is_connection_keep_alive(request_t *request);
 
 /**
- * @brief Get a key to hash the request on. Return NULL if the request is not
- * cacheable.
+ * @brief Get a key to hash the request on. The key is empty if the request
+ * can not be answered from the cache. HEAD requests share the key of the
+ * matching GET.
  *
  * @param request
  * @param key Output key
@@ -116,6 +125,14 @@ void request_get_key(request_t *request, char *key, size_t len);
  */
 request_t *request_parse(http_message_t *message);
 
+/**
+ * @brief Check if a request carries a body
+ *
+ * @param request Request to check
+ * @return int 1 if the request has a body, 0 otherwise
+ */
+int request_has_body(request_t *request);
+
 /**
  * @brief Determine if a request is cacheable
  *
@@ -124,4 +141,13 @@ request_t *request_parse(http_message_t *message);
  */
 int request_is_cacheable(request_t *request);
 
+/**
+ * @brief Check if a request may only be answered from the cache
+ * (Cache-Control: only-if-cached)
+ *
+ * @param request Request to check
+ * @return int 1 if it may, 0 otherwise
+ */
+int request_is_only_if_cached(request_t *request);
+
 #endif
@@ -15,64 +15,344 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/sendfile.h>
 #include <unistd.h>
 
+#include "compress.h"
 #include "connection.h"
+#include "hedge.h"
 #include "http.h"
+#include "pool.h"
 #include "request.h"
+#include "tls.h"
+
+/**
+ * @brief Check if a response to a request carries a body
+ *
+ * @param response Response (header only)
+ * @param request Request the response answers
+ * @return int 1 if a body follows the header, 0 otherwise
+ */
+int response_has_body(response_t *response, request_t *request) {
+    if (request != NULL && strcmp(request->method, "HEAD") == 0) {
+        return 0;
+    }
+    int status = response->status_code;
+    return !((status >= 100 && status < 200) || status == 204 || status == 304);
+}
 
 /**
  * @brief Receive a response from the connection
  *
  * @param connection Connection to receive from
+ * @param request Request the response answers (may be NULL)
  * @return response_t* Response. Must be freed. NULL on failure.
  */
-response_t *response_recv(connection_t *connection) {
-    // Get the response
-    response_t *response = malloc(sizeof(response_t));
-    memset(response, 0, sizeof(response_t));
-    http_message_t *response_message = http_message_recv(connection);
-    if (response_message == NULL) {
-        fprintf(stderr, "Could not get response message\n");
-        free(response);
-        return NULL;
+response_t *response_recv(connection_t *connection, request_t *request) {
+    for (;;) {
+        // Get the response
+        http_message_t *response_message = http_message_recv_header(connection);
+        if (response_message == NULL) {
+            fprintf(stderr, "Could not get response message\n");
+            return NULL;
+        }
+        char *header_line = http_message_get_header_line(response_message);
+        fprintf(stderr, "<-- %s\n", header_line);
+        response_t *response = response_parse(response_message);
+        if (response == NULL) {
+            return NULL;
+        }
+        // Interim responses are consumed here, the client only sees the final
+        // one
+        if (response->status_code >= 100 && response->status_code < 200 &&
+            response->status_code != 101) {
+            response_free(response);
+            continue;
+        }
+        if (!response_has_body(response, request)) {
+            return response;
+        }
+        int rv;
+        if (http_message_header_get(response->message, "Content-Length") ==
+                NULL &&
+            !http_message_is_chunked(response->message)) {
+            // The body runs until the origin closes the connection
+            rv = http_message_recv_until_close(response->message, connection);
+            http_message_header_set(response->message, "Connection", "close");
+        } else {
+            rv = http_message_recv_body(response->message, connection);
+        }
+        if (rv != 0) {
+            response_free(response);
+            return NULL;
+        }
+        return response;
     }
-    response->message = response_message;
-    char *header_line = http_message_get_header_line(response_message);
-    fprintf(stderr, "<-- %s\n", header_line);
-    response_header_parse(response);
+}
 
-    return response;
+/**
+ * @brief Check if an origin connection can carry another request after this
+ * response
+ *
+ * @param response Response received on the connection
+ * @return int 1 if reusable, 0 otherwise
+ */
+int response_is_reusable(response_t *response) {
+    char *connection = http_message_header_get(response->message, "Connection");
+    if (connection != NULL) {
+        return strcasecmp(connection, "close") != 0;
+    }
+    // HTTP/1.0 origins close unless they say otherwise
+    return response->version != NULL &&
+           strcmp(response->version, "HTTP/1.1") == 0;
+}
+
+/**
+ * @brief Get the server to connect to for a request: the next hop if there is
+ * one, the origin otherwise
+ *
+ * @param request Request
+ * @param host Server host (output)
+ * @param port Server port (output)
+ * @param tls Whether the server speaks TLS (output)
+ */
+void response_server(request_t *request, const char **host, int *port,
+                     int *tls) {
+    *host = request->host;
+    *tls  = request->https == 1;
+    *port = request->port != -1 ? request->port
+                                : (*tls ? TLS_DEFAULT_PORT : 80);
+    if (request->next_hop != NULL) {
+        *host = request->next_hop;
+        *tls  = 0;
+        *port = request->next_hop_port;
+    }
+}
+
+/**
+ * @brief Send the request again on a second connection and keep whichever
+ * connection answers first. The other one is closed, which cancels its
+ * request.
+ *
+ * @param request Request already sent on server
+ * @param host Server host
+ * @param port Server port
+ * @param tls Whether the server speaks TLS
+ * @param server Connection of the first request, replaced by the second
+ * connection if that one wins
+ * @param reused Whether server came from the pool (updated with it)
+ * @return int 1 if a connection is readable, 0 on timeout, -1 on error
+ */
+int response_hedge(request_t *request, const char *host, int port, int tls,
+                   connection_t *server, int *reused) {
+    connection_t hedge;
+    int          hedge_reused;
+    if (pool_connect(host, port, tls, &hedge, &hedge_reused) != 0) {
+        return connection_poll(server, -1);
+    }
+    connection_set_deadline(&hedge, HTTP_TRANSFER_TIMEOUT_MS);
+    if (request_send(request, &hedge) != 0) {
+        close_connection(&hedge);
+        return connection_poll(server, -1);
+    }
+    connection_set_deadline(&hedge, HTTP_FIRST_BYTE_TIMEOUT_MS);
+
+    connection_t *both[2] = {server, &hedge};
+    int           ready;
+    int           rv = connection_poll_any(both, 2, -1, &ready);
+    if (rv <= 0 || ready == 0) {
+        close_connection(&hedge);
+        return rv;
+    }
+    fprintf(stderr, "Hedged request to %s answered first\n", host);
+    close_connection(server);
+    // The copy must not be linked into the deadline timers
+    connection_set_deadline(&hedge, -1);
+    *server = hedge;
+    *reused = hedge_reused;
+    return rv;
+}
+
+/**
+ * @brief Wait for the first byte of the response to a request. A replayable
+ * request the origin has not answered within its usual (95th percentile)
+ * first-byte latency is hedged, budget permitting.
+ *
+ * @param request Request sent on server
+ * @param host Server host
+ * @param port Server port
+ * @param tls Whether the server speaks TLS
+ * @param server Connection the request was sent on (may be replaced)
+ * @param reused Whether server came from the pool (updated with it)
+ * @param replayable Whether the request may be sent twice
+ * @return int 1 if readable, 0 on timeout, -1 on error
+ */
+int response_wait(request_t *request, const char *host, int port, int tls,
+                  connection_t *server, int *reused, int replayable) {
+    uint64_t sent  = timer_now_ms();
+    int      delay = replayable ? hedge_delay_ms(host, port) : -1;
+    int      rv    = connection_poll(server, delay);
+    if (rv == 0 && delay >= 0 && !connection_expired(server)) {
+        if (hedge_take()) {
+            rv = response_hedge(request, host, port, tls, server, reused);
+        } else {
+            rv = connection_poll(server, -1);
+        }
+    }
+    if (rv > 0) {
+        hedge_record(host, port, timer_now_ms() - sent);
+    }
+    return rv;
 }
 
 /**
  * @brief Send the request to the server and get the response
+ * @details Idle pooled origin connections (plain or TLS) are reused. If a
+ * pooled connection turns out to be dead, a GET or HEAD is retried once on a
+ * fresh connection. A GET or HEAD may also be hedged (see response_wait()).
  *
  * @param request Request to send
- * @param response_dest File to write response to
  * @return response_t* Response from server
  */
 response_t *response_fetch(request_t *request) {
-    // Open a connection to the server
-    connection_t server_connection = {0};
+    const char *host;
+    int         port, tls;
+    response_server(request, &host, &port, &tls);
+    // A streamed body can not be sent twice
+    int replayable = request->client == NULL &&
+                     (strcmp(request->method, "GET") == 0 ||
+                      strcmp(request->method, "HEAD") == 0);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Open a connection to the server
+        connection_t server_connection;
+        int          reused;
+        if (0 != pool_connect(host, port, tls, &server_connection, &reused)) {
+            fprintf(stderr, "Could not connect to server\n");
+            return NULL;
+        }
 
-    if (0 !=
-        connect_to_hostname(request->host, request->port, &server_connection)) {
-        fprintf(stderr, "Could not connect to server\n");
-        return NULL;
-    }
+        // Send the message and get the response, each phase with its own
+        // deadline
+        response_t *response = NULL;
+        connection_set_deadline(&server_connection, HTTP_TRANSFER_TIMEOUT_MS);
+        if (request_send(request, &server_connection) != 0) {
+            fprintf(stderr, "Could not send request to server\n");
+        } else {
+            connection_set_deadline(&server_connection,
+                                    HTTP_FIRST_BYTE_TIMEOUT_MS);
+            if (response_wait(request, host, port, tls, &server_connection,
+                              &reused, replayable) <= 0) {
+                fprintf(stderr, "Error: No response from %s\n", host);
+            } else {
+                connection_set_deadline(&server_connection,
+                                        HTTP_TRANSFER_TIMEOUT_MS);
+                response = response_recv(&server_connection, request);
+            }
+        }
+        if (response == NULL) {
+            close_connection(&server_connection);
+            if (reused && replayable) {
+                continue;
+            }
+            return NULL;
+        }
 
-    // Send the message
-    request_send(request, &server_connection);
+        // Keep the connection for the next request if the origin allows it
+        if (response_is_reusable(response)) {
+            pool_release(host, port, tls, &server_connection);
+        } else {
+            close_connection(&server_connection);
+        }
+        return response;
+    }
+    return NULL;
+}
 
-    // Get the response
-    response_t *response = response_recv(&server_connection);
+/**
+ * @brief Fetch several GETs from the same server, pipelined on one connection
+ * @details Until the server has answered a request with a keep-alive
+ * HTTP/1.1 response, requests go one at a time. Then up to
+ * RESPONSE_PIPELINE_DEPTH requests are kept in flight and the responses are
+ * read back in order. A server that says it closes the connection gets the
+ * remaining requests on a new one. A server that drops the connection
+ * without saying so is not pipelined to again, and the requests it left
+ * unanswered are sent one at a time.
+ *
+ * @param requests GET requests without a body, all for the same server
+ * @param responses Responses (output), NULL where a request failed
+ * @param n Number of requests
+ */
+void response_fetch_pipelined(request_t **requests, response_t **responses,
+                              int n) {
+    const char *host;
+    int         port, tls;
+    response_server(requests[0], &host, &port, &tls);
+    for (int i = 0; i < n; i++) {
+        responses[i] = NULL;
+    }
 
-    // Close the connection
-    close_connection(&server_connection);
+    int done = 0;
+    while (done < n) {
+        int pipelining = pool_get_pipelining(host, port, tls);
+        if (pipelining != POOL_PIPELINE_YES) {
+            responses[done] = response_fetch(requests[done]);
+            if (responses[done] != NULL && pipelining == POOL_PIPELINE_UNKNOWN &&
+                response_is_reusable(responses[done])) {
+                pool_set_pipelining(host, port, tls, POOL_PIPELINE_YES);
+            }
+            done++;
+            continue;
+        }
 
-    return response;
+        connection_t server_connection;
+        int          reused;
+        if (0 != pool_connect(host, port, tls, &server_connection, &reused)) {
+            fprintf(stderr, "Could not connect to server\n");
+            return;
+        }
+        int sent = done, received = done, closing = 0;
+        while (received < n && !closing) {
+            // Keep the pipeline full
+            connection_set_deadline(&server_connection,
+                                    HTTP_TRANSFER_TIMEOUT_MS);
+            while (sent < n && sent - received < RESPONSE_PIPELINE_DEPTH &&
+                   request_send(requests[sent], &server_connection) == 0) {
+                sent++;
+            }
+            if (sent == received) {
+                break;
+            }
+            connection_set_deadline(&server_connection,
+                                    HTTP_FIRST_BYTE_TIMEOUT_MS);
+            if (connection_poll(&server_connection, -1) <= 0) {
+                break;
+            }
+            connection_set_deadline(&server_connection,
+                                    HTTP_TRANSFER_TIMEOUT_MS);
+            response_t *response =
+                response_recv(&server_connection, requests[received]);
+            if (response == NULL) {
+                break;
+            }
+            responses[received++] = response;
+            closing               = !response_is_reusable(response);
+        }
+        if (received == n && !closing) {
+            pool_release(host, port, tls, &server_connection);
+        } else {
+            close_connection(&server_connection);
+        }
+        // A dead pooled connection is no fault of pipelining, try a new one
+        if (received < n && !closing && !(reused && received == done)) {
+            fprintf(stderr,
+                    "Error: %s dropped the pipeline after %d of %d "
+                    "requests\n",
+                    host, received - done, sent - done);
+            pool_set_pipelining(host, port, tls, POOL_PIPELINE_NO);
+        }
+        done = received;
+    }
 }
 
 /**
@@ -103,6 +383,26 @@ int response_send(response_t *response, connection_t *connection) {
     return rv;
 }
 
+/**
+ * @brief Send only the status line and headers of a response (for HEAD)
+ *
+ * @param response Response to send
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int response_send_head(response_t *response, connection_t *connection) {
+    if (response == NULL || connection == NULL) {
+        fprintf(stderr, "Invalid arguments\n");
+        return -1;
+    }
+    char header_line[4096];
+    snprintf(header_line, 4096, "%s %d %s\r\n", response->version,
+             response->status_code, response->reason);
+    fprintf(stderr, "--> %s\n", header_line);
+    http_message_set_header_line(response->message, header_line);
+    return http_message_send_header(response->message, connection);
+}
+
 /**
  * @brief Parse a response
  *
@@ -282,17 +582,30 @@ int response_send_error(connection_t *connection, int status_code,
 }
 
 /**
- * @brief Write a response to a file
+ * @brief Write a response to a file as a cache entry. The entry starts with a
+ * line naming the storage codec; with a codec other than COMPRESS_NONE the
+ * headers are stored as is and only the body is compressed.
  *
  * @param response Response to write
  * @param f File to write to
+ * @param codec Storage codec (COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_DEFLATE)
  * @return int 0 on success, -1 on failure
  */
-int response_write(response_t *response, FILE *file) {
+int response_write(response_t *response, FILE *file, int codec) {
+    const char *name = compress_encoding_name(codec);
+    if (fprintf(file, "%s %s\n", RESPONSE_ENTRY_MAGIC,
+                name != NULL ? name : "identity") < 0) {
+        perror("Failed to write file");
+        return -1;
+    }
     // Before parsing the response (further), cache it
     char  *buffer = NULL;
     size_t size;
     http_get_message_buffer(response->message, &buffer, &size);
+    if (name != NULL) {
+        // Header as is, then the compressed body
+        size -= http_message_get_body_len(response->message);
+    }
     // Write the data to the file
     size_t ntot = 0;
     while (ntot < size) {
@@ -303,16 +616,21 @@ int response_write(response_t *response, FILE *file) {
         }
         ntot += n;
     }
+    if (name != NULL) {
+        return compress_write_body(response, file, codec);
+    }
     return 0;
 }
 
 /**
- * @brief Read a response from a file
+ * @brief Read a response from a cache entry. A compressed body is left
+ * compressed, see compress_decode_body() and compress_mark_encoded().
  *
  * @param f File to read from
+ * @param codec Storage codec of the body (output)
  * @return response_t* Response
  */
-response_t *response_read(FILE *file) {
+response_t *response_read(FILE *file, int *codec) {
     char  *data = NULL;
     size_t size = 0;
     // Determine the file size
@@ -320,6 +638,24 @@ response_t *response_read(FILE *file) {
     size = ftell(file);
     fseek(file, 0, SEEK_SET);
 
+    // Entry header (entries written before it existed are plain messages)
+    char line[64];
+    *codec = COMPRESS_NONE;
+    if (fgets(line, sizeof(line), file) != NULL &&
+        strncmp(line, RESPONSE_ENTRY_MAGIC " ",
+                strlen(RESPONSE_ENTRY_MAGIC) + 1) == 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        *codec =
+            compress_encoding_parse(line + strlen(RESPONSE_ENTRY_MAGIC) + 1);
+        if (*codec == -1) {
+            fprintf(stderr, "Error: Unknown cache entry codec: %s\n", line);
+            return NULL;
+        }
+        size -= ftell(file);
+    } else {
+        fseek(file, 0, SEEK_SET);
+    }
+
     // Allocate or reallocate a buffer for the file contents
     data = malloc(size);
     if (!data) {
@@ -15,7 +15,9 @@
 #include "http.h"
 #include "request.h"
 
+#define RESPONSE_ENTRY_MAGIC  "CACHE-ENTRY/1" // First line of a cache entry
 #define RESPONSE_STATUS_REGEX "(HTTP/[0-9]+\\.[0-9]+)?\\s+([0-9]+)\\s+(.*)"
+#define RESPONSE_PIPELINE_DEPTH 4 // Requests in flight on a pipelined connection
 
 /**
  * @brief Response structure
@@ -36,6 +38,17 @@ typedef struct response {
  */
 response_t *response_fetch(request_t *request);
 
+/**
+ * @brief Fetch several GETs from the same server, pipelined on one connection
+ * once the server is known to keep connections alive
+ *
+ * @param requests GET requests without a body, all for the same server
+ * @param responses Responses (output), NULL where a request failed
+ * @param n Number of requests
+ */
+void response_fetch_pipelined(request_t **requests, response_t **responses,
+                              int n);
+
 /**
  * @brief Create a response
  *
@@ -75,6 +88,15 @@ int response_set_body_f(response_t *response, FILE *f);
  */
 int response_send(response_t *response, connection_t *connection);
 
+/**
+ * @brief Send only the status line and headers of a response (for HEAD)
+ *
+ * @param response Response to send
+ * @param connection Connection
+ * @return int 0 on success, -1 on failure
+ */
+int response_send_head(response_t *response, connection_t *connection);
+
 /**
  * @brief Free a response
  *
@@ -112,20 +134,25 @@ int response_send_error(connection_t *connection, int status_code,
                         char *reason);
 
 /**
- * @brief Write a response to a file
+ * @brief Write a response to a file as a cache entry. The entry starts with a
+ * line naming the storage codec; with a codec other than COMPRESS_NONE the
+ * headers are stored as is and only the body is compressed.
  *
  * @param response Response to write
  * @param f File to write to
+ * @param codec Storage codec (COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_DEFLATE)
  * @return int 0 on success, -1 on failure
  */
-int response_write(response_t *response, FILE *f);
+int response_write(response_t *response, FILE *f, int codec);
 
 /**
- * @brief Read a response from a file
+ * @brief Read a response from a cache entry. A compressed body is left
+ * compressed, see compress_decode_body() and compress_mark_encoded().
  *
  * @param f File to read from
+ * @param codec Storage codec of the body (output)
  * @return response_t* Response
  */
-response_t *response_read(FILE *f);
+response_t *response_read(FILE *f, int *codec);
 
 #endif
@@ -0,0 +1,185 @@
+/**
+ * @file ring.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of ring.h
+ * @details Each parent is hashed onto the ring RING_VNODES times, as
+ * "host:port#i", so the keys spread evenly even over a few parents. The
+ * points are sorted once at load time and a lookup is a binary search. The
+ * hash is hash_string() (FNV-1a) followed by the splitmix64 finalizer, since
+ * FNV alone leaves similar strings close together on the ring.
+ *
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "IP.h"
+#include "hash.h"
+#include "shm.h"
+
+/**
+ * @brief Point of a parent on the ring
+ */
+typedef struct ring_point {
+    uint64_t hash;
+    int      parent;
+} ring_point_t;
+
+static ring_parent_t *parents; // Shared, for the down states
+static int            num_parents;
+static ring_point_t   points[RING_PARENTS_MAX * RING_VNODES];
+static int            num_points;
+
+// Private functions
+int      ring_add(const char *host, int port, void *arg);
+uint64_t ring_hash(const char *s);
+int      ring_compare(const void *a, const void *b);
+
+/**
+ * @brief Put the parents on the ring. Call before forking.
+ *
+ * @param list Comma-separated host:port of each parent
+ * @return int 0 on success, -1 on failure
+ */
+int ring_load(const char *list) {
+    // The list may have changed since the previous generation, whose down
+    // states are only copied from
+    size_t         size     = RING_PARENTS_MAX * sizeof(ring_parent_t);
+    ring_parent_t *previous = NULL;
+    if (parents == NULL) {
+        previous = shm_previous("parents", size);
+        parents  = shm_map("parents", size);
+        if (parents == NULL) {
+            if (previous != NULL) {
+                munmap(previous, size);
+            }
+            return -1;
+        }
+    }
+    num_parents = 0;
+    num_points  = 0;
+    int rv      = parse_host_list(list, "Parent", ring_add, previous);
+    if (previous != NULL) {
+        munmap(previous, size);
+    }
+    if (rv != 0 || num_parents == 0) {
+        num_parents = 0;
+        num_points  = 0;
+        return -1;
+    }
+    qsort(points, num_points, sizeof(ring_point_t), ring_compare);
+    printf("Routing cache misses over %d parents\n", num_parents);
+    // Or every forked child prints it again
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * @brief Find the parent a cache key belongs to: the first parent clockwise
+ * from the key's hash that is not down
+ *
+ * @param key Cache key from request_get_key()
+ * @param now Current time
+ * @return ring_parent_t* Parent, NULL if every parent is down
+ */
+ring_parent_t *ring_lookup(const char *key, time_t now) {
+    if (num_points == 0) {
+        return NULL;
+    }
+    // First point at or after the hash
+    uint64_t hash = ring_hash(key);
+    int      low = 0, high = num_points;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (points[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int i = 0; i < num_points; i++) {
+        ring_parent_t *parent =
+            &parents[points[(low + i) % num_points].parent];
+        if (atomic_load(&parent->down_until) <= now) {
+            return parent;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Skip a parent for RING_RETRY_S seconds after it failed
+ *
+ * @param parent Parent from ring_lookup()
+ * @param now Current time
+ */
+void ring_set_down(ring_parent_t *parent, time_t now) {
+    if (atomic_exchange(&parent->down_until, now + RING_RETRY_S) <= now) {
+        fprintf(stderr, "Parent %s:%d is down\n", parent->host, parent->port);
+    }
+}
+
+// Private function definitions
+
+/**
+ * @brief Put one parent on the ring (parse_host_list()), down if it was in
+ * the previous generation's parents (arg, NULL if there are none)
+ */
+int ring_add(const char *host, int port, void *arg) {
+    ring_parent_t *previous = arg;
+    if (num_parents == RING_PARENTS_MAX || strlen(host) >= RING_HOST_MAX) {
+        fprintf(stderr, "Error: Too many parents\n");
+        return -1;
+    }
+    ring_parent_t *parent = &parents[num_parents];
+    strcpy(parent->host, host);
+    parent->port = port;
+    atomic_store(&parent->down_until, 0);
+    for (int i = 0; previous != NULL && i < RING_PARENTS_MAX; i++) {
+        if (previous[i].port == port && strcmp(previous[i].host, host) == 0) {
+            atomic_store(&parent->down_until, previous[i].down_until);
+            break;
+        }
+    }
+    for (int i = 0; i < RING_VNODES; i++) {
+        char point[RING_HOST_MAX + 32];
+        snprintf(point, sizeof(point), "%s:%d#%d", parent->host, parent->port,
+                 i);
+        points[num_points].hash   = ring_hash(point);
+        points[num_points].parent = num_parents;
+        num_points++;
+    }
+    num_parents++;
+    return 0;
+}
+
+/**
+ * @brief Hash a string onto the ring
+ */
+uint64_t ring_hash(const char *s) {
+    uint64_t hash = hash_string(s);
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @brief Order points by hash (qsort())
+ */
+int ring_compare(const void *a, const void *b) {
+    uint64_t x = ((const ring_point_t *)a)->hash;
+    uint64_t y = ((const ring_point_t *)b)->hash;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file ring.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Parent proxies on a consistent-hash ring. Each cache key belongs to
+ * one parent, so every object is fetched and stored by one parent of the
+ * tier, and adding or removing one of N parents moves only about 1/N of the
+ * keys. A parent that fails is skipped for a while and its keys go to the
+ * next parents on the ring. Which parents are down is kept in shared memory
+ * so every forked child skips them.
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RING_PARENTS_MAX 32  // Parents
+#define RING_HOST_MAX    256 // Longest parent host
+#define RING_VNODES      160 // Points of each parent on the ring
+#define RING_RETRY_S     10  // A failed parent is skipped this long
+
+/**
+ * @brief Parent proxy
+ */
+typedef struct ring_parent {
+    char           host[RING_HOST_MAX];
+    int            port;
+    _Atomic time_t down_until; // Skipped until then after a failure
+} ring_parent_t;
+
+/**
+ * @brief Put the parents on the ring. Call before forking.
+ *
+ * @param list Comma-separated host:port of each parent
+ * @return int 0 on success, -1 on failure
+ */
+int ring_load(const char *list);
+
+/**
+ * @brief Find the parent a cache key belongs to: the first parent clockwise
+ * from the key's hash that is not down
+ *
+ * @param key Cache key from request_get_key()
+ * @param now Current time
+ * @return ring_parent_t* Parent, NULL if every parent is down
+ */
+ring_parent_t *ring_lookup(const char *key, time_t now);
+
+/**
+ * @brief Skip a parent for RING_RETRY_S seconds after it failed
+ *
+ * @param parent Parent from ring_lookup()
+ * @param now Current time
+ */
+void ring_set_down(ring_parent_t *parent, time_t now);
+
+#endif
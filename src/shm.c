@@ -0,0 +1,225 @@
+/**
+ * @file shm.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of shm.h
+ * @details SHM_ENV lists the segments as "name:fd" separated by commas. It is
+ * read on the first call, and the segments listed are kept open until they
+ * are taken over or shm_forget() closes them. Without memfd_create() a
+ * segment is anonymous and simply starts from zero after an upgrade.
+ *
+ * @version 0.1
+ * @date 2023-05-17
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Named segment descriptor
+ */
+typedef struct shm_segment {
+    char name[SHM_NAME_MAX];
+    int  fd;
+} shm_segment_t;
+
+static shm_segment_t inherited[SHM_SEGMENTS_MAX]; // Passed down (fd -1 once
+                                                  // taken or closed)
+static int           num_inherited = -1;          // -1 until SHM_ENV is read
+static int           num_taken;
+static shm_segment_t segments[SHM_SEGMENTS_MAX]; // Mapped, to pass down
+static int           num_segments;
+
+// Private functions
+int   shm_take(const char *name);
+void *shm_map_fd(int fd, size_t size);
+
+/**
+ * @brief Map a shared segment, taking over the one of the same name and size
+ * the previous generation passed down, if any. Call before forking.
+ *
+ * @param name Name of the segment
+ * @param size Size of the segment
+ * @return void* Segment, NULL on failure
+ */
+void *shm_map(const char *name, size_t size) {
+    if (num_segments == SHM_SEGMENTS_MAX) {
+        fprintf(stderr, "Error: Too many shared segments\n");
+        return NULL;
+    }
+    struct stat st;
+    int         fd = shm_take(name);
+    if (fd != -1 && (fstat(fd, &st) == -1 || (size_t)st.st_size != size)) {
+        fprintf(stderr, "Error: The %s segment changed size, starting over\n",
+                name);
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1) {
+        num_taken++;
+    } else {
+        fd = memfd_create(name, MFD_CLOEXEC);
+        if (fd == -1) {
+            // Still shared with the children, just not across an upgrade
+            perror("memfd_create");
+            void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                return NULL;
+            }
+            return map;
+        }
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+            close(fd);
+            return NULL;
+        }
+    }
+    void *map = shm_map_fd(fd, size);
+    if (map == NULL) {
+        close(fd);
+        return NULL;
+    }
+    snprintf(segments[num_segments].name, SHM_NAME_MAX, "%s", name);
+    segments[num_segments++].fd = fd;
+    return map;
+}
+
+/**
+ * @brief Map the segment of a name the previous generation passed down, for a
+ * table whose layout depends on the configuration to copy its state from. A
+ * later shm_map() of the name creates a new segment.
+ *
+ * @param name Name of the segment
+ * @param size Size of the segment
+ * @return void* Segment to munmap() once copied, NULL if there is none
+ */
+void *shm_previous(const char *name, size_t size) {
+    struct stat st;
+    int         fd = shm_take(name);
+    if (fd == -1) {
+        return NULL;
+    }
+    void *map = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+        map = shm_map_fd(fd, size);
+        num_taken += map != NULL;
+    } else {
+        fprintf(stderr, "Error: The %s segment changed size, starting over\n",
+                name);
+    }
+    close(fd);
+    return map;
+}
+
+/**
+ * @brief Close the segments passed down that were not taken over. Call once
+ * every segment is mapped.
+ */
+void shm_forget() {
+    if (num_inherited == -1) {
+        shm_take(NULL);
+    }
+    for (int i = 0; i < num_inherited; i++) {
+        if (inherited[i].fd != -1) {
+            close(inherited[i].fd);
+            inherited[i].fd = -1;
+        }
+    }
+    if (num_inherited > 0) {
+        printf("Took over %d of %d shared segments\n", num_taken,
+               num_inherited);
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief Let the segments survive an exec and list them in SHM_ENV. Call in
+ * the child that starts the new binary.
+ */
+void shm_export() {
+    char list[SHM_SEGMENTS_MAX * (SHM_NAME_MAX + 12)] = "", segment[64];
+    for (int i = 0; i < num_segments; i++) {
+        fcntl(segments[i].fd, F_SETFD, 0);
+        snprintf(segment, sizeof(segment), i > 0 ? ",%s:%d" : "%s:%d",
+                 segments[i].name, segments[i].fd);
+        strcat(list, segment);
+    }
+    setenv(SHM_ENV, list, 1);
+}
+
+// Private function definitions
+
+/**
+ * @brief Take the descriptor of a segment passed down, reading SHM_ENV first
+ * if it was not yet
+ *
+ * @param name Name of the segment, NULL only to read SHM_ENV
+ * @return int Descriptor (the caller owns it), -1 if there is none
+ */
+int shm_take(const char *name) {
+    if (num_inherited == -1) {
+        num_inherited = 0;
+        char *env     = getenv(SHM_ENV);
+        if (env != NULL) {
+            char *list = strdup(env);
+            char *saveptr;
+            for (char *item = strtok_r(list, ",", &saveptr); item != NULL;
+                 item       = strtok_r(NULL, ",", &saveptr)) {
+                char *colon = strrchr(item, ':');
+                if (colon == NULL) {
+                    continue;
+                }
+                int fd = atoi(colon + 1);
+                *colon = '\0';
+                if (num_inherited == SHM_SEGMENTS_MAX) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                snprintf(inherited[num_inherited].name, SHM_NAME_MAX, "%s",
+                         item);
+                inherited[num_inherited++].fd = fd;
+            }
+            free(list);
+            unsetenv(SHM_ENV);
+        }
+    }
+    for (int i = 0; name != NULL && i < num_inherited; i++) {
+        if (inherited[i].fd != -1 && strcmp(inherited[i].name, name) == 0) {
+            int fd          = inherited[i].fd;
+            inherited[i].fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Map a segment descriptor
+ *
+ * @param fd Descriptor
+ * @param size Size of the segment
+ * @return void* Segment, NULL on failure
+ */
+void *shm_map_fd(int fd, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return map;
+}
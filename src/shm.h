@@ -0,0 +1,60 @@
+/**
+ * @file shm.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Shared memory segments that outlive an upgrade: each is a named
+ * memfd, whose descriptor is passed to the new binary in PROXY_SHARED_FDS
+ * like the listeners, so the per-origin limits, latencies, backend health,
+ * parent states and predictions carry over instead of starting from zero.
+ * @version 0.1
+ * @date 2023-05-17
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+
+#define SHM_ENV          "PROXY_SHARED_FDS" // Segments passed on exec
+#define SHM_SEGMENTS_MAX 16
+#define SHM_NAME_MAX     32
+
+/**
+ * @brief Map a shared segment, taking over the one of the same name and size
+ * the previous generation passed down, if any. Call before forking.
+ * @details The segment is then shared with the previous generation while it
+ * drains. A segment whose size changed (a new binary with another layout) is
+ * created again, zeroed.
+ *
+ * @param name Name of the segment
+ * @param size Size of the segment
+ * @return void* Segment, NULL on failure
+ */
+void *shm_map(const char *name, size_t size);
+
+/**
+ * @brief Map the segment of a name the previous generation passed down, for a
+ * table whose layout depends on the configuration to copy its state from. A
+ * later shm_map() of the name creates a new segment.
+ *
+ * @param name Name of the segment
+ * @param size Size of the segment
+ * @return void* Segment to munmap() once copied, NULL if there is none
+ */
+void *shm_previous(const char *name, size_t size);
+
+/**
+ * @brief Close the segments passed down that were not taken over. Call once
+ * every segment is mapped.
+ */
+void shm_forget();
+
+/**
+ * @brief Let the segments survive an exec and list them in SHM_ENV. Call in
+ * the child that starts the new binary.
+ */
+void shm_export();
+
+#endif
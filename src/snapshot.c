@@ -0,0 +1,339 @@
+/**
+ * @file snapshot.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of snapshot.h
+ * @details A snapshot is the line SNAPSHOT_MAGIC, then for each entry a line
+ * "<age> <key length> <entry length>" followed by the key and the entry as
+ * stored (headers and body, in the storage codec), and the line "END". How
+ * hot an entry is comes from its access time. The export reads the chosen
+ * entries in inode order, which is close to their order on disk, and the
+ * import writes each entry with one write() and syncs the file system once
+ * at the end, so both are mostly sequential I/O.
+ *
+ * An entry's age is counted from its modification time, which the proxy's
+ * writes keep current. The import sets it back by the age the entry had on
+ * the exporting node, so an imported entry expires when the original does
+ * instead of starting its timeout over.
+ *
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // syncfs()
+
+#include "snapshot.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Cache entry considered for a snapshot
+ */
+typedef struct snapshot_entry {
+    char   name[33]; // Hash of the key
+    ino_t  ino;
+    time_t read_at; // Access time
+    size_t size;
+} snapshot_entry_t;
+
+// Private functions
+int snapshot_is_entry(const char *name);
+int snapshot_compare_heat(const void *a, const void *b);
+int snapshot_compare_inode(const void *a, const void *b);
+int snapshot_read_all(int fd, char *buf, size_t len);
+int snapshot_write_file(const char *path, const char *data, size_t len);
+
+/**
+ * @brief Write the hottest unexpired entries of a cache to a snapshot, most
+ * recently read first, up to a total size. Each entry is read under a shared
+ * lock, so it is never caught half written.
+ *
+ * @param dir Cache directory
+ * @param timeout Cache timeout (seconds)
+ * @param max_bytes Total size of the entries taken
+ * @param out Snapshot stream
+ * @return int Number of entries written, -1 on failure
+ */
+int snapshot_export(const char *dir, int timeout, size_t max_bytes, FILE *out) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    snapshot_entry_t *entries = NULL;
+    size_t            n = 0, cap = 0;
+    time_t            now = time(NULL);
+    struct dirent    *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat attr;
+        if (!snapshot_is_entry(de->d_name) ||
+            fstatat(dirfd(d), de->d_name, &attr, 0) != 0 ||
+            attr.st_size == 0 || difftime(now, attr.st_mtime) > timeout) {
+            continue;
+        }
+        if (n == cap) {
+            cap                    = cap == 0 ? 1024 : cap * 2;
+            snapshot_entry_t *grown = realloc(entries, cap * sizeof(*entries));
+            if (grown == NULL) {
+                perror("realloc");
+                free(entries);
+                closedir(d);
+                return -1;
+            }
+            entries = grown;
+        }
+        strcpy(entries[n].name, de->d_name);
+        entries[n].ino     = attr.st_ino;
+        entries[n].read_at = attr.st_atime;
+        entries[n].size    = attr.st_size;
+        n++;
+    }
+    closedir(d);
+
+    // The hottest entries that fit, read in disk order
+    qsort(entries, n, sizeof(*entries), snapshot_compare_heat);
+    size_t taken = 0, total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (total + entries[i].size <= max_bytes) {
+            total += entries[i].size;
+            entries[taken++] = entries[i];
+        }
+    }
+    qsort(entries, taken, sizeof(*entries), snapshot_compare_inode);
+
+    setvbuf(out, NULL, _IOFBF, SNAPSHOT_BUFFER);
+    fprintf(out, SNAPSHOT_MAGIC "\n");
+    char  *body      = NULL;
+    size_t body_size = 0;
+    int    written   = 0;
+    total            = 0;
+    for (size_t i = 0; i < taken; i++) {
+        char path[2048], meta_path[2048];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+        snprintf(meta_path, sizeof(meta_path), "%s/.%s", dir, entries[i].name);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            continue; // Removed since
+        }
+        // The proxy writes the key and the entry under an exclusive lock
+        if (flock(fd, LOCK_SH) == -1) {
+            perror("flock");
+            close(fd);
+            continue;
+        }
+        char        key[SNAPSHOT_KEY_MAX];
+        size_t      key_len = 0;
+        FILE       *meta    = fopen(meta_path, "r");
+        struct stat attr;
+        if (meta != NULL) {
+            key_len = fread(key, 1, sizeof(key) - 1, meta);
+            fclose(meta);
+        }
+        if (key_len > 0 && fstat(fd, &attr) == 0 && attr.st_size > 0 &&
+            difftime(now, attr.st_mtime) <= timeout) {
+            if ((size_t)attr.st_size > body_size) {
+                free(body);
+                body      = malloc(attr.st_size);
+                body_size = body != NULL ? attr.st_size : 0;
+            }
+            if (body_size >= (size_t)attr.st_size &&
+                snapshot_read_all(fd, body, attr.st_size) == 0) {
+                fprintf(out, "%ld %zu %zu\n", (long)(now - attr.st_mtime),
+                        key_len, (size_t)attr.st_size);
+                fwrite(key, 1, key_len, out);
+                fwrite(body, 1, attr.st_size, out);
+                total += attr.st_size;
+                written++;
+            }
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    free(body);
+    free(entries);
+    fprintf(out, "END\n");
+    if (fflush(out) != 0 || ferror(out)) {
+        fprintf(stderr, "Error: Failed to write the snapshot\n");
+        return -1;
+    }
+    fprintf(stderr, "Exported %d cache entries (%zu bytes)\n", written, total);
+    return written;
+}
+
+/**
+ * @brief Read a snapshot into a cache. Entries that would already be expired
+ * here, or that the cache holds unexpired, are skipped. Each entry appears
+ * whole, under the name hashed from its key, and keeps its age.
+ *
+ * @param dir Cache directory
+ * @param timeout Cache timeout (seconds)
+ * @param in Snapshot stream
+ * @param hash Name of the entry of a key (cache_hash())
+ * @return int Number of entries stored, -1 on failure
+ */
+int snapshot_import(const char *dir, int timeout, FILE *in,
+                    void (*hash)(char *key, char *hash_str)) {
+    setvbuf(in, NULL, _IOFBF, SNAPSHOT_BUFFER);
+    char line[128];
+    if (fgets(line, sizeof(line), in) == NULL ||
+        strcmp(line, SNAPSHOT_MAGIC "\n") != 0) {
+        fprintf(stderr, "Error: Not a cache snapshot\n");
+        return -1;
+    }
+    time_t now    = time(NULL);
+    int    stored = 0, skipped = 0, rv = -1;
+    char  *body      = NULL;
+    size_t body_size = 0;
+    for (;;) {
+        if (fgets(line, sizeof(line), in) == NULL) {
+            fprintf(stderr, "Error: The snapshot is truncated\n");
+            break;
+        }
+        if (strcmp(line, "END\n") == 0) {
+            rv = 0;
+            break;
+        }
+        long   age;
+        size_t key_len, size;
+        if (sscanf(line, "%ld %zu %zu", &age, &key_len, &size) != 3 ||
+            key_len == 0 || key_len >= SNAPSHOT_KEY_MAX) {
+            fprintf(stderr, "Error: Bad snapshot entry\n");
+            break;
+        }
+        if (size > body_size) {
+            free(body);
+            body_size = size;
+            body      = malloc(body_size);
+            if (body == NULL) {
+                perror("malloc");
+                break;
+            }
+        }
+        char key[SNAPSHOT_KEY_MAX];
+        if (fread(key, 1, key_len, in) != key_len ||
+            fread(body, 1, size, in) != size) {
+            fprintf(stderr, "Error: The snapshot is truncated\n");
+            break;
+        }
+        key[key_len] = '\0';
+
+        char hash_str[33], path[2048], meta_path[2048], tmp_path[2048];
+        hash(key, hash_str);
+        snprintf(path, sizeof(path), "%s/%s", dir, hash_str);
+        snprintf(meta_path, sizeof(meta_path), "%s/.%s", dir, hash_str);
+        snprintf(tmp_path, sizeof(tmp_path), "%s/.import-%s", dir, hash_str);
+        struct stat attr;
+        if (age >= timeout ||
+            (stat(path, &attr) == 0 && attr.st_size > 0 &&
+             difftime(now, attr.st_mtime) <= timeout)) {
+            skipped++;
+            continue;
+        }
+        // Written aside, aged and renamed, so the entry appears whole
+        struct timespec times[2] = {{.tv_nsec = UTIME_NOW},
+                                    {.tv_sec = now - age}};
+        if (snapshot_write_file(meta_path, key, key_len) != 0 ||
+            snapshot_write_file(tmp_path, body, size) != 0 ||
+            utimensat(AT_FDCWD, tmp_path, times, 0) != 0 ||
+            rename(tmp_path, path) != 0) {
+            fprintf(stderr, "Error: Failed to store %s\n", key);
+            unlink(tmp_path);
+            continue;
+        }
+        stored++;
+    }
+    free(body);
+
+    // One sync of the file system instead of one per entry
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        syncfs(fd);
+        close(fd);
+    }
+    fprintf(stderr, "Imported %d cache entries, skipped %d\n", stored,
+            skipped);
+    return rv == 0 ? stored : -1;
+}
+
+// Private function definitions
+
+/**
+ * @brief Check if a file name is that of a cache entry (an MD5 in hex)
+ */
+int snapshot_is_entry(const char *name) {
+    int i = 0;
+    while (i < 32 && isxdigit((unsigned char)name[i])) {
+        i++;
+    }
+    return i == 32 && name[i] == '\0';
+}
+
+/**
+ * @brief Order entries most recently read first (qsort())
+ */
+int snapshot_compare_heat(const void *a, const void *b) {
+    time_t x = ((const snapshot_entry_t *)a)->read_at;
+    time_t y = ((const snapshot_entry_t *)b)->read_at;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Order entries by inode number (qsort())
+ */
+int snapshot_compare_inode(const void *a, const void *b) {
+    ino_t x = ((const snapshot_entry_t *)a)->ino;
+    ino_t y = ((const snapshot_entry_t *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Read a whole file from its start
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int snapshot_read_all(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Create or replace a file with the given contents
+ *
+ * @return int 0 on success, -1 on failure
+ */
+int snapshot_write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n <= 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    return close(fd);
+}
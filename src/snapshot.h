@@ -0,0 +1,55 @@
+/**
+ * @file snapshot.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Cache snapshots, to warm a new node from a running one. The hottest
+ * entries of a cache directory are written as one stream (each entry with
+ * its key, from the meta file), which another node reads back into its own
+ * cache directory:
+ *
+ *     ./main -e 4096 | ssh new-node 'cd proxy && ./main -i'
+ *
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SNAPSHOT_MAGIC   "PROXY-SNAPSHOT/1" // First line of a snapshot
+#define SNAPSHOT_KEY_MAX 1100               // Longest entry key
+#define SNAPSHOT_BUFFER  (1 << 20)          // Stream buffer size
+
+/**
+ * @brief Write the hottest unexpired entries of a cache to a snapshot, most
+ * recently read first, up to a total size. Each entry is read under a shared
+ * lock, so it is never caught half written.
+ *
+ * @param dir Cache directory
+ * @param timeout Cache timeout (seconds)
+ * @param max_bytes Total size of the entries taken
+ * @param out Snapshot stream
+ * @return int Number of entries written, -1 on failure
+ */
+int snapshot_export(const char *dir, int timeout, size_t max_bytes, FILE *out);
+
+/**
+ * @brief Read a snapshot into a cache. Entries that would already be expired
+ * here, or that the cache holds unexpired, are skipped. Each entry appears
+ * whole, under the name hashed from its key, and keeps its age.
+ *
+ * @param dir Cache directory
+ * @param timeout Cache timeout (seconds)
+ * @param in Snapshot stream
+ * @param hash Name of the entry of a key (cache_hash())
+ * @return int Number of entries stored, -1 on failure
+ */
+int snapshot_import(const char *dir, int timeout, FILE *in,
+                    void (*hash)(char *key, char *hash_str));
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * @file timer.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of timer.h
+ * @details A timer due within 64 ticks sits in the level 0 slot of its expiry
+ * tick. Later timers sit in a coarser level, in the slot for the expiry time
+ * at that level's resolution. Whenever the level 0 index wraps, the next
+ * level 1 slot is cascaded: its timers are re-inserted and land in level 0
+ * (or a lower level). Higher levels are cascaded the same way when their
+ * lower neighbour wraps. Timers further out than the wheel covers are parked
+ * in the last slot of the top level and re-inserted when it comes around.
+ *
+ * @version 0.1
+ * @date 2023-05-06
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "timer.h"
+
+#include <time.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Private functions
+void timer_insert(timer_wheel_t *wheel, timer_node_t *timer);
+void timer_cascade(timer_wheel_t *wheel, int level);
+
+/**
+ * @brief Get the current monotonic time
+ *
+ * @return uint64_t Time in milliseconds
+ */
+uint64_t timer_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Initialize a timer wheel
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    wheel->now   = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            timer_node_t *head = &wheel->slots[level][slot];
+            head->prev = head->next = head;
+        }
+    }
+}
+
+/**
+ * @brief Arm (or re-arm) a timer
+ *
+ * @param wheel Timer wheel
+ * @param timer Timer
+ * @param expires Expiry time (ms)
+ * @param callback Expiry callback
+ * @param arg Callback argument
+ */
+void timer_arm(timer_wheel_t *wheel, timer_node_t *timer, uint64_t expires,
+               timer_callback_t callback, void *arg) {
+    timer_cancel(wheel, timer);
+    timer->expires  = expires;
+    timer->callback = callback;
+    timer->arg      = arg;
+    timer_insert(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * @brief Disarm a timer (no-op if it is not armed)
+ *
+ * @param wheel Timer wheel
+ * @param timer Timer
+ */
+void timer_cancel(timer_wheel_t *wheel, timer_node_t *timer) {
+    if (timer->next == NULL) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    wheel->count--;
+}
+
+/**
+ * @brief Check if a timer is armed
+ *
+ * @param timer Timer
+ * @return int 1 if armed, 0 otherwise
+ */
+int timer_is_armed(timer_node_t *timer) { return timer->next != NULL; }
+
+/**
+ * @brief Run the callbacks of every timer that expired up to now
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ * @return int Number of timers that expired
+ */
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now) {
+    int expired = 0;
+    while (wheel->now <= now) {
+        if (wheel->count == 0) {
+            // Nothing to cascade or run, skip ahead
+            wheel->now = now + 1;
+            break;
+        }
+        int index = wheel->now & TIMER_WHEEL_MASK;
+        if (index == 0) {
+            // Level 0 wrapped, pull the next slot of each wrapped level down
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                timer_cascade(wheel, level);
+                if (((wheel->now >> (TIMER_WHEEL_BITS * level)) &
+                     TIMER_WHEEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+        timer_node_t *head = &wheel->slots[0][index];
+        while (head->next != head) {
+            timer_node_t *timer = head->next;
+            timer_cancel(wheel, timer);
+            timer->callback(timer, timer->arg);
+            expired++;
+        }
+        wheel->now++;
+    }
+    return expired;
+}
+
+/**
+ * @brief Get how long the wheel can sleep before it has to be advanced
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ * @return int Milliseconds, -1 if no timer is armed
+ */
+int timer_wheel_timeout(timer_wheel_t *wheel, uint64_t now) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    // Scan level 0 up to the next cascade, nothing else can expire sooner. A
+    // cascade that is due right away has to run before level 0 is complete.
+    uint64_t tick = wheel->now;
+    if ((tick & TIMER_WHEEL_MASK) != 0) {
+        timer_node_t *head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+        while (head->next == head && (++tick & TIMER_WHEEL_MASK) != 0) {
+            head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+        }
+    }
+    return tick > now ? (int)(tick - now) : 0;
+}
+
+// Private function definitions
+
+/**
+ * @brief Put an armed timer in the slot for its expiry time
+ */
+void timer_insert(timer_wheel_t *wheel, timer_node_t *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel->now) {
+        // Already due, run it on the next tick
+        expires = wheel->now;
+    }
+    uint64_t delta = expires - wheel->now;
+    int      level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >> (TIMER_WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS) != 0) {
+        // Out of range, park it as far out as the wheel reaches
+        expires = wheel->now +
+                  ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    timer_node_t *head =
+        &wheel->slots[level]
+                     [(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->next      = head;
+    timer->prev      = head->prev;
+    head->prev->next = timer;
+    head->prev       = timer;
+}
+
+/**
+ * @brief Re-insert the timers of the current slot of a level
+ */
+void timer_cascade(timer_wheel_t *wheel, int level) {
+    int index =
+        (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_node_t *head = &wheel->slots[level][index];
+    if (head->next == head) {
+        return;
+    }
+    // Detach the list first, timers may land back in this slot
+    timer_node_t *timer = head->next;
+    head->prev->next    = NULL;
+    head->prev = head->next = head;
+    while (timer != NULL) {
+        timer_node_t *next = timer->next;
+        timer_insert(wheel, timer);
+        timer = next;
+    }
+}
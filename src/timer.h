@@ -0,0 +1,114 @@
+/**
+ * @file timer.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Hierarchical timer wheel. Arming and cancelling a timer are O(1) and
+ * advancing the wheel costs O(expired) plus an occasional cascade, however
+ * many timers are armed.
+ * @version 0.1
+ * @date 2023-05-06
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS   6 // 64 slots per level
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // 1 ms ticks, 64^4 ms (~4.6 hours) of range
+
+typedef struct timer_node timer_node_t;
+
+/**
+ * @brief Called when a timer expires. The timer is disarmed first, so the
+ * callback may arm it again.
+ */
+typedef void (*timer_callback_t)(timer_node_t *timer, void *arg);
+
+/**
+ * @brief Timer, embedded in the object it times (zero it before first use)
+ */
+struct timer_node {
+    timer_node_t    *prev, *next; // Slot list (next is NULL when disarmed)
+    uint64_t         expires;     // Expiry time (ms)
+    timer_callback_t callback;    // Expiry callback
+    void            *arg;         // Callback argument
+};
+
+/**
+ * @brief Timer wheel
+ */
+typedef struct timer_wheel {
+    uint64_t     now;   // Next tick to process (ms)
+    size_t       count; // Armed timers
+    timer_node_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads
+} timer_wheel_t;
+
+/**
+ * @brief Get the current monotonic time
+ *
+ * @return uint64_t Time in milliseconds
+ */
+uint64_t timer_now_ms();
+
+/**
+ * @brief Initialize a timer wheel
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * @brief Arm (or re-arm) a timer
+ *
+ * @param wheel Timer wheel
+ * @param timer Timer
+ * @param expires Expiry time (ms)
+ * @param callback Expiry callback
+ * @param arg Callback argument
+ */
+void timer_arm(timer_wheel_t *wheel, timer_node_t *timer, uint64_t expires,
+               timer_callback_t callback, void *arg);
+
+/**
+ * @brief Disarm a timer (no-op if it is not armed)
+ *
+ * @param wheel Timer wheel
+ * @param timer Timer
+ */
+void timer_cancel(timer_wheel_t *wheel, timer_node_t *timer);
+
+/**
+ * @brief Check if a timer is armed
+ *
+ * @param timer Timer
+ * @return int 1 if armed, 0 otherwise
+ */
+int timer_is_armed(timer_node_t *timer);
+
+/**
+ * @brief Run the callbacks of every timer that expired up to now
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ * @return int Number of timers that expired
+ */
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * @brief Get how long the wheel can sleep before it has to be advanced. The
+ * result never overshoots the next expiry but may fall short of it, when a
+ * cascade is due first.
+ *
+ * @param wheel Timer wheel
+ * @param now Current time (ms)
+ * @return int Milliseconds, -1 if no timer is armed
+ */
+int timer_wheel_timeout(timer_wheel_t *wheel, uint64_t now);
+
+#endif
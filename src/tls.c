@@ -0,0 +1,217 @@
+/**
+ * @file tls.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of tls.h
+ * @details Each worker is a separate process, so OpenSSL's in-memory session
+ * cache would be lost after every request. Instead, new sessions (including
+ * TLS 1.3 tickets, which arrive after the handshake) are serialized to one
+ * file per origin in the session directory and written atomically with a
+ * rename. The next connection to that origin, from any worker, offers the
+ * stored session and gets an abbreviated handshake.
+ *
+ * @version 0.1
+ * @date 2023-05-04
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Private variables
+static SSL_CTX *tls_ctx = NULL;
+static char     tls_session_dir[1024];
+static int      tls_key_index = -1; // SSL ex_data slot for the origin key
+
+// Private functions
+int  tls_session_new(SSL *ssl, SSL_SESSION *session);
+void tls_session_path(const char *key, char *path, size_t len);
+
+/**
+ * @brief Free the origin key stored with an SSL object
+ */
+void tls_key_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+                  long argl, void *argp) {
+    free(ptr);
+}
+
+/**
+ * @brief Initialize the TLS client context
+ *
+ * @param cache_dir Directory the session cache is kept in
+ * @param ca_file Extra CA certificates to trust (may be NULL)
+ * @return int 0 on success, -1 on failure
+ */
+int tls_init(const char *cache_dir, const char *ca_file) {
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (tls_ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    if (SSL_CTX_set_default_verify_paths(tls_ctx) != 1) {
+        fprintf(stderr, "Warning: Failed to load the default CA paths\n");
+    }
+    if (ca_file != NULL &&
+        SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL) != 1) {
+        fprintf(stderr, "Error: Failed to load CA file %s\n", ca_file);
+        ERR_print_errors_fp(stderr);
+        tls_free();
+        return -1;
+    }
+    // Sessions only live in the shared on-disk cache
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT |
+                                                SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(tls_ctx, tls_session_new);
+    tls_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, tls_key_free);
+
+    snprintf(tls_session_dir, sizeof(tls_session_dir), "%s/%s", cache_dir,
+             TLS_SESSION_DIR);
+    mkdir(cache_dir, 0777);
+    mkdir(tls_session_dir, 0700);
+    return 0;
+}
+
+/**
+ * @brief Start TLS on a connected socket
+ *
+ * @param connection Connection returned by connect_to_hostname()
+ * @param host Origin hostname
+ * @param port Origin port
+ * @return int 0 on success, -1 on failure (the connection is left open)
+ */
+int tls_connect(connection_t *connection, const char *host, int port) {
+    if (tls_ctx == NULL) {
+        fprintf(stderr, "Error: TLS is not initialized\n");
+        return -1;
+    }
+    SSL *ssl = SSL_new(tls_ctx);
+    if (ssl == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_set_fd(ssl, connection->fd);
+
+    // Verify the certificate against the name (or address) we connected to
+    unsigned char addr[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, host, addr) == 1 ||
+        inet_pton(AF_INET6, host, addr) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    } else {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+
+    // Offer a cached session for this origin
+    char *key = malloc(strlen(host) + 8);
+    sprintf(key, "%s:%d", host, port);
+    SSL_set_ex_data(ssl, tls_key_index, key);
+    char path[2048];
+    tls_session_path(key, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        unsigned char buffer[TLS_SESSION_MAX_SIZE];
+        size_t        len = fread(buffer, 1, sizeof(buffer), f);
+        fclose(f);
+        const unsigned char *p       = buffer;
+        SSL_SESSION         *session = d2i_SSL_SESSION(NULL, &p, len);
+        if (session != NULL) {
+            if (SSL_SESSION_is_resumable(session)) {
+                SSL_set_session(ssl, session);
+            }
+            SSL_SESSION_free(session);
+        }
+    }
+
+    if (SSL_connect(ssl) != 1) {
+        fprintf(stderr, "Error: TLS handshake with %s failed\n", key);
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    fprintf(stderr, "TLS to %s (%s, %s)\n", key, SSL_get_version(ssl),
+            SSL_session_reused(ssl) ? "resumed" : "full handshake");
+    connection->ssl = ssl;
+    return 0;
+}
+
+/**
+ * @brief Check if the last handshake on a connection resumed a session
+ *
+ * @param connection TLS connection
+ * @return int 1 if resumed, 0 otherwise
+ */
+int tls_session_reused(connection_t *connection) {
+    return connection->ssl != NULL && SSL_session_reused(connection->ssl);
+}
+
+/**
+ * @brief Free the TLS client context
+ */
+void tls_free() {
+    if (tls_ctx != NULL) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+    }
+}
+
+// Private function definitions
+
+/**
+ * @brief Store a new session for the origin of an SSL object
+ *
+ * @return int 0 (OpenSSL keeps ownership of the session)
+ */
+int tls_session_new(SSL *ssl, SSL_SESSION *session) {
+    const char *key = SSL_get_ex_data(ssl, tls_key_index);
+    if (key == NULL) {
+        return 0;
+    }
+    int len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0 || len > TLS_SESSION_MAX_SIZE) {
+        return 0;
+    }
+    unsigned char  buffer[TLS_SESSION_MAX_SIZE];
+    unsigned char *p = buffer;
+    i2d_SSL_SESSION(session, &p);
+
+    // Write a private file and rename it into place so readers never see a
+    // partial session
+    char path[2048], tmp_path[2100];
+    tls_session_path(key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        return 0;
+    }
+    size_t n = fwrite(buffer, 1, len, f);
+    if (fclose(f) != 0 || n != (size_t)len || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the session cache file for an origin key
+ */
+void tls_session_path(const char *key, char *path, size_t len) {
+    snprintf(path, len, "%s/%s", tls_session_dir, key);
+    // Keep the key inside the session directory
+    for (char *c = path + strlen(tls_session_dir) + 1; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/**
+ * @file tls.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief TLS to origin servers (OpenSSL). Sessions are cached per origin on
+ * disk so every forked worker can resume them instead of doing a full
+ * handshake.
+ * @version 0.1
+ * @date 2023-05-04
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include "connection.h"
+
+#define TLS_DEFAULT_PORT     443
+#define TLS_SESSION_DIR      ".tls" // Session cache directory (in the cache)
+#define TLS_SESSION_MAX_SIZE 8192   // Largest serialized session accepted
+
+/**
+ * @brief Initialize the TLS client context. Must be called before forking so
+ * the context is shared by every worker.
+ *
+ * @param cache_dir Directory the session cache is kept in
+ * @param ca_file Extra CA certificates to trust (may be NULL)
+ * @return int 0 on success, -1 on failure
+ */
+int tls_init(const char *cache_dir, const char *ca_file);
+
+/**
+ * @brief Start TLS on a connected socket. A cached session for the origin is
+ * offered for resumption, and the server name is verified.
+ *
+ * @param connection Connection returned by connect_to_hostname()
+ * @param host Origin hostname (SNI, verification and session cache key)
+ * @param port Origin port
+ * @return int 0 on success, -1 on failure (the connection is left open)
+ */
+int tls_connect(connection_t *connection, const char *host, int port);
+
+/**
+ * @brief Check if the last handshake on a connection resumed a session
+ *
+ * @param connection TLS connection
+ * @return int 1 if resumed, 0 otherwise
+ */
+int tls_session_reused(connection_t *connection);
+
+/**
+ * @brief Free the TLS client context
+ */
+void tls_free();
+
+#endif
@@ -0,0 +1,364 @@
+/**
+ * @file tunnel.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of tunnel.h
+ * @details The relay process owns every established tunnel. Each direction of
+ * a tunnel has its own pipe; bytes are spliced from the source socket into the
+ * pipe and from the pipe into the destination socket without being copied
+ * into user space. When one side finishes sending, the other side's write
+ * half is shut down so half-closed connections keep working.
+ *
+ * @version 0.1
+ * @date 2023-05-02
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#define _GNU_SOURCE // splice(), F_SETPIPE_SZ
+
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+// Private structs
+typedef struct tunnel tunnel_t;
+
+/**
+ * @brief One socket of a tunnel (registered with epoll)
+ */
+typedef struct tunnel_end {
+    tunnel_t *tunnel;  // Owning tunnel
+    int       side;    // 0 for the client, 1 for the origin
+    int       hung_up; // Closed both ways, no longer watched
+} tunnel_end_t;
+
+/**
+ * @brief One direction of a tunnel (fd[i] -> fd[!i])
+ */
+typedef struct tunnel_dir {
+    int    pipe[2];  // Pipe holding bytes in flight
+    size_t buffered; // Bytes in the pipe
+    int    eof;      // Source has finished sending
+    int    done;     // Destination write half has been shut down
+} tunnel_dir_t;
+
+struct tunnel {
+    int          fd[2];       // Client and origin sockets
+    tunnel_end_t end[2];      // epoll data for each socket
+    tunnel_dir_t dir[2];      // dir[0]: client -> origin, dir[1]: reverse
+    time_t       last_active; // Last time any bytes moved
+    tunnel_t    *prev, *next; // List of open tunnels
+};
+
+// Private variables
+static volatile int tunnel_running = 1;
+static tunnel_end_t tunnel_stale; // Marks events of tunnels closed this round
+
+// Private functions
+void tunnel_relay_run(int relay_fd);
+int  tunnel_pump(tunnel_t *tunnel, int i);
+void tunnel_watch(int epfd, tunnel_t *tunnel);
+void tunnel_close(int epfd, tunnel_t *tunnel, tunnel_t **list);
+
+/**
+ * @brief Stop the relay on SIGTERM
+ */
+void tunnel_sig_handler(int sig) { tunnel_running = 0; }
+
+/**
+ * @brief Fork the tunnel relay process
+ *
+ * @param relay_fd Socket used to hand tunnels to the relay (output)
+ * @return pid_t Relay process id, -1 on failure
+ */
+pid_t tunnel_relay_start(int *relay_fd) {
+    int sv[2];
+    // SEQPACKET keeps each handoff atomic with many senders and reports EOF
+    // once every sender has gone away
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[1]);
+        // Ctrl-C goes to the whole process group, keep tunnels open until
+        // the proxy stops handing them over
+        signal(SIGINT, SIG_IGN);
+        // A peer that resets is one failed tunnel, not the end of the relay
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, tunnel_sig_handler);
+        tunnel_relay_run(sv[0]);
+        exit(EXIT_SUCCESS);
+    }
+    close(sv[0]);
+    *relay_fd = sv[1];
+    return pid;
+}
+
+/**
+ * @brief Hand an established tunnel to the relay process
+ *
+ * @param relay_fd Socket returned by tunnel_relay_start()
+ * @param client_fd Client side of the tunnel
+ * @param server_fd Origin side of the tunnel
+ * @return int 0 on success, -1 on failure
+ */
+int tunnel_handoff(int relay_fd, int client_fd, int server_fd) {
+    int fds[2] = {client_fd, server_fd};
+    return connection_send_fds(relay_fd, fds, 2, NULL, 0);
+}
+
+/**
+ * @brief Create a tunnel from a pair of connected sockets
+ *
+ * @return tunnel_t* Tunnel, NULL on failure (sockets are left open)
+ */
+tunnel_t *tunnel_create(int client_fd, int server_fd) {
+    tunnel_t *tunnel = malloc(sizeof(tunnel_t));
+    if (tunnel == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(tunnel, 0, sizeof(tunnel_t));
+    tunnel->fd[0] = client_fd;
+    tunnel->fd[1] = server_fd;
+    for (int i = 0; i < 2; i++) {
+        tunnel->end[i].tunnel = tunnel;
+        tunnel->end[i].side   = i;
+        fcntl(tunnel->fd[i], F_SETFL,
+              fcntl(tunnel->fd[i], F_GETFL) | O_NONBLOCK);
+        if (pipe2(tunnel->dir[i].pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe2");
+            if (i == 1) {
+                close(tunnel->dir[0].pipe[0]);
+                close(tunnel->dir[0].pipe[1]);
+            }
+            free(tunnel);
+            return NULL;
+        }
+        fcntl(tunnel->dir[i].pipe[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+    }
+    tunnel->last_active = time(NULL);
+    return tunnel;
+}
+
+/**
+ * @brief Relay loop. Runs until SIGTERM, or until the proxy has exited and
+ * every tunnel has closed.
+ *
+ * @param relay_fd Socket tunnels are handed over on
+ */
+void tunnel_relay_run(int relay_fd) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, relay_fd, &ev);
+
+    tunnel_t          *list      = NULL;
+    int                accepting = 1;
+    time_t             last_scan = time(NULL);
+    struct epoll_event events[TUNNEL_EPOLL_EVENTS];
+    while (tunnel_running && (accepting || list != NULL)) {
+        int n = epoll_wait(epfd, events, TUNNEL_EPOLL_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                // A new tunnel is being handed over
+                int     fds[2];
+                ssize_t rv = connection_recv_fds(relay_fd, fds, 2, NULL, 0);
+                if (rv <= 0) {
+                    if (rv == 0) {
+                        // Every sender is gone
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, relay_fd, NULL);
+                        accepting = 0;
+                    }
+                    continue;
+                }
+                tunnel_t *tunnel = tunnel_create(fds[0], fds[1]);
+                if (tunnel == NULL) {
+                    close(fds[0]);
+                    close(fds[1]);
+                    continue;
+                }
+                for (int side = 0; side < 2; side++) {
+                    struct epoll_event tev = {.events   = 0,
+                                              .data.ptr = &tunnel->end[side]};
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, tunnel->fd[side], &tev);
+                }
+                tunnel->next = list;
+                if (list != NULL)
+                    list->prev = tunnel;
+                list = tunnel;
+                tunnel_watch(epfd, tunnel);
+                continue;
+            }
+            tunnel_end_t *end = events[i].data.ptr;
+            if (end == &tunnel_stale) {
+                continue;
+            }
+            tunnel_t *tunnel = end->tunnel;
+            int       rv     = tunnel_pump(tunnel, 0);
+            rv |= tunnel_pump(tunnel, 1);
+            // A hang-up after this side's write half was shut down is the
+            // peer closing too. What it sent may still be queued behind a
+            // slow reader, so stop watching it (EPOLLHUP would fire in a
+            // loop) and let the other side's events drain it. Any other
+            // hang-up is a reset.
+            int hup = (events[i].events & EPOLLHUP) != 0;
+            if (hup && tunnel->dir[!end->side].done) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, tunnel->fd[end->side], NULL);
+                end->hung_up = 1;
+                hup          = 0;
+            }
+            if (rv != 0 || hup || (events[i].events & EPOLLERR) ||
+                (tunnel->dir[0].done && tunnel->dir[1].done)) {
+                tunnel_close(epfd, tunnel, &list);
+                // Later events may still point at this tunnel
+                for (int j = i + 1; j < n; j++) {
+                    tunnel_end_t *other = events[j].data.ptr;
+                    if (other != NULL && other->tunnel == tunnel)
+                        events[j].data.ptr = &tunnel_stale;
+                }
+                continue;
+            }
+            tunnel_watch(epfd, tunnel);
+        }
+        // Expire idle tunnels
+        time_t now = time(NULL);
+        if (now != last_scan) {
+            last_scan        = now;
+            tunnel_t *tunnel = list;
+            while (tunnel != NULL) {
+                tunnel_t *next = tunnel->next;
+                if (now - tunnel->last_active > TUNNEL_IDLE_TIMEOUT_S) {
+                    fprintf(stderr, "Tunnel idle timeout\n");
+                    tunnel_close(epfd, tunnel, &list);
+                }
+                tunnel = next;
+            }
+        }
+    }
+    while (list != NULL) {
+        tunnel_close(epfd, list, &list);
+    }
+    close(epfd);
+    close(relay_fd);
+}
+
+/**
+ * @brief Move as many bytes as possible in one direction of a tunnel
+ *
+ * @param tunnel Tunnel
+ * @param i Direction (0: client -> origin, 1: origin -> client)
+ * @return int 0 on success, -1 if the tunnel failed
+ */
+int tunnel_pump(tunnel_t *tunnel, int i) {
+    tunnel_dir_t *dir      = &tunnel->dir[i];
+    int           src      = tunnel->fd[i];
+    int           dst      = tunnel->fd[!i];
+    int           progress = 1;
+    ssize_t       n;
+    while (progress) {
+        progress = 0;
+        if (!dir->eof && dir->buffered < TUNNEL_PIPE_SIZE) {
+            n = splice(src, NULL, dir->pipe[1], NULL,
+                       TUNNEL_PIPE_SIZE - dir->buffered,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                dir->buffered += n;
+                progress = 1;
+            } else if (n == 0) {
+                dir->eof = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        if (dir->buffered > 0) {
+            n = splice(dir->pipe[0], NULL, dst, NULL, dir->buffered,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                dir->buffered -= n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        if (progress) {
+            tunnel->last_active = time(NULL);
+        }
+    }
+    // Pass the half-close along once everything has been delivered
+    if (dir->eof && dir->buffered == 0 && !dir->done) {
+        shutdown(dst, SHUT_WR);
+        dir->done = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Update the epoll interest of both sockets of a tunnel
+ */
+void tunnel_watch(int epfd, tunnel_t *tunnel) {
+    for (int side = 0; side < 2; side++) {
+        if (tunnel->end[side].hung_up) {
+            continue;
+        }
+        struct epoll_event ev = {.events = 0, .data.ptr = &tunnel->end[side]};
+        // Readable while this side can still fill its pipe
+        if (!tunnel->dir[side].eof &&
+            tunnel->dir[side].buffered < TUNNEL_PIPE_SIZE)
+            ev.events |= EPOLLIN;
+        // Writable while the other side's pipe holds bytes for us
+        if (tunnel->dir[!side].buffered > 0)
+            ev.events |= EPOLLOUT;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, tunnel->fd[side], &ev);
+    }
+}
+
+/**
+ * @brief Close a tunnel and remove it from the list
+ */
+void tunnel_close(int epfd, tunnel_t *tunnel, tunnel_t **list) {
+    for (int i = 0; i < 2; i++) {
+        if (!tunnel->end[i].hung_up) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, tunnel->fd[i], NULL);
+        }
+        close(tunnel->fd[i]);
+        close(tunnel->dir[i].pipe[0]);
+        close(tunnel->dir[i].pipe[1]);
+    }
+    if (tunnel->prev != NULL)
+        tunnel->prev->next = tunnel->next;
+    else
+        *list = tunnel->next;
+    if (tunnel->next != NULL)
+        tunnel->next->prev = tunnel->prev;
+    free(tunnel);
+}
@@ -0,0 +1,42 @@
+/**
+ * @file tunnel.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief CONNECT tunnels. Established tunnels are handed to a single relay
+ * process that moves bytes in both directions with splice() so a tunnel does
+ * not hold a forked child for its whole lifetime.
+ * @version 0.1
+ * @date 2023-05-02
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <sys/types.h>
+
+#define TUNNEL_IDLE_TIMEOUT_S 300   // Close tunnels idle for this long
+#define TUNNEL_PIPE_SIZE      65536 // Bytes buffered per direction
+#define TUNNEL_EPOLL_EVENTS   64    // Events handled per epoll_wait()
+
+/**
+ * @brief Fork the tunnel relay process
+ *
+ * @param relay_fd Socket used to hand tunnels to the relay (output)
+ * @return pid_t Relay process id, -1 on failure
+ */
+pid_t tunnel_relay_start(int *relay_fd);
+
+/**
+ * @brief Hand an established tunnel to the relay process. The caller keeps
+ * its own copies of the descriptors and should close them afterwards.
+ *
+ * @param relay_fd Socket returned by tunnel_relay_start()
+ * @param client_fd Client side of the tunnel
+ * @param server_fd Origin side of the tunnel
+ * @return int 0 on success, -1 on failure
+ */
+int tunnel_handoff(int relay_fd, int client_fd, int server_fd);
+
+#endif
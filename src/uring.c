@@ -0,0 +1,336 @@
+/**
+ * @file uring.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of uring.h
+ * @details The submission and completion rings share one mapping
+ * (IORING_FEAT_SINGLE_MMAP, kernel 5.4+); older kernels are reported as not
+ * supported. Entries are only made visible to the kernel by uring_submit(),
+ * so everything prepared in one loop iteration goes in with a single
+ * io_uring_enter() that also waits for the completions.
+ *
+ * @version 0.1
+ * @date 2023-05-09
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Private functions
+int uring_enter(int fd, unsigned to_submit, unsigned wait_nr);
+
+/**
+ * @brief Set up a ring
+ *
+ * @param ring Ring
+ * @param entries Submission queue entries
+ * @return int 0 on success, -1 if io_uring is not available
+ */
+int uring_init(uring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes     = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_len);
+        close(fd);
+        return -1;
+    }
+    char *ptr        = ring->ring_ptr;
+    ring->sq_head    = (unsigned *)(ptr + params.sq_off.head);
+    ring->sq_tail    = (unsigned *)(ptr + params.sq_off.tail);
+    ring->sq_mask    = (unsigned *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)(ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local   = *ring->sq_tail;
+    ring->cq_head    = (unsigned *)(ptr + params.cq_off.head);
+    ring->cq_tail    = (unsigned *)(ptr + params.cq_off.tail);
+    ring->cq_mask    = (unsigned *)(ptr + params.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+    ring->fd         = fd;
+    return 0;
+}
+
+/**
+ * @brief Tear down a ring (no-op if it was never set up)
+ *
+ * @param ring Ring
+ */
+void uring_free(uring_t *ring) {
+    if (ring->fd == -1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->ring_ptr, ring->ring_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * @brief Get a cleared submission entry to prepare
+ *
+ * @param ring Ring
+ * @return struct io_uring_sqe* Entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head,
+                                         memory_order_acquire);
+    if (ring->sq_local - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned             index = ring->sq_local & *ring->sq_mask;
+    struct io_uring_sqe *sqe   = &ring->sqes[index];
+    ring->sq_array[index]      = index;
+    ring->sq_local++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/**
+ * @brief Submit every prepared entry and wait for completions
+ *
+ * @param ring Ring
+ * @param wait_nr Completions to wait for (0 to only submit)
+ * @return int Number of entries submitted, -1 on failure (errno is set)
+ */
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    unsigned tail      = *ring->sq_tail;
+    unsigned to_submit = ring->sq_local - tail;
+    // Publish the entries before the kernel can see the new tail
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, ring->sq_local,
+                          memory_order_release);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    return uring_enter(ring->fd, to_submit, wait_nr);
+}
+
+/**
+ * @brief Get the oldest completion without waiting
+ *
+ * @param ring Ring
+ * @return struct io_uring_cqe* Completion, NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail,
+                                         memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * @brief Release the completion returned by uring_peek_cqe()
+ *
+ * @param ring Ring
+ */
+void uring_cqe_seen(uring_t *ring) {
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, *ring->cq_head + 1,
+                          memory_order_release);
+}
+
+/**
+ * @brief Register a one-slot direct descriptor table
+ *
+ * @param ring Ring
+ * @return int 0 on success, -1 on failure
+ */
+int uring_register_direct(uring_t *ring) {
+    if (ring->direct) {
+        return 0;
+    }
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr    = URING_DIRECT_FILE + 1;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2, &reg,
+                sizeof(reg)) == -1) {
+        return -1;
+    }
+    ring->direct = 1;
+    return 0;
+}
+
+/**
+ * @brief Prepare a multishot accept
+ *
+ * @param sqe Entry
+ * @param fd Listening socket
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * @brief Prepare a multishot poll for readability
+ *
+ * @param sqe Entry
+ * @param fd File descriptor
+ * @param user_data Tag of the completions
+ */
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               unsigned long user_data) {
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = user_data;
+}
+
+/**
+ * @brief Prepare a timeout
+ *
+ * @param sqe Entry
+ * @param ts Relative timeout (must stay valid until submitted)
+ * @param user_data Tag of the completion
+ */
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned long user_data) {
+    sqe->opcode    = IORING_OP_TIMEOUT;
+    sqe->fd        = -1;
+    sqe->addr      = (unsigned long)ts;
+    sqe->len       = 1;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepare a read or a write
+ *
+ * @param sqe Entry
+ * @param op IORING_OP_READ or IORING_OP_WRITE
+ * @param fd File descriptor (direct slot with IOSQE_FIXED_FILE)
+ * @param buffer Buffer
+ * @param len Buffer length
+ * @param offset File offset
+ */
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buffer,
+                   unsigned len, off_t offset) {
+    sqe->opcode = op;
+    sqe->fd     = fd;
+    sqe->addr   = (unsigned long)buffer;
+    sqe->len    = len;
+    sqe->off    = offset;
+}
+
+/**
+ * @brief Prepare an open into the direct descriptor slot
+ *
+ * @param sqe Entry
+ * @param path Path
+ * @param flags open() flags
+ * @param mode Mode of a created file
+ */
+void uring_prep_open_direct(struct io_uring_sqe *sqe, const char *path,
+                            int flags, mode_t mode) {
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = (unsigned long)path;
+    sqe->len        = mode;
+    sqe->open_flags = flags;
+    sqe->file_index = URING_DIRECT_FILE + 1;
+}
+
+/**
+ * @brief Prepare a close of the direct descriptor slot
+ *
+ * @param sqe Entry
+ */
+void uring_prep_close_direct(struct io_uring_sqe *sqe) {
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->file_index = URING_DIRECT_FILE + 1;
+}
+
+/**
+ * @brief Read a whole file region through the ring
+ *
+ * @param ring Ring
+ * @param fd File descriptor
+ * @param buffer Buffer
+ * @param len Bytes to read
+ * @return ssize_t Bytes read (short at end of file), -1 on failure
+ */
+ssize_t uring_read(uring_t *ring, int fd, void *buffer, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (sqe == NULL) {
+            return -1;
+        }
+        uring_prep_rw(sqe, IORING_OP_READ, fd, (char *)buffer + total,
+                      len - total, total);
+        // The read is in flight once submitted, a signal must not cut the
+        // wait short
+        int rv = uring_submit(ring, 1);
+        while (rv == -1 && errno == EINTR) {
+            rv = uring_submit(ring, 1);
+        }
+        if (rv == -1) {
+            return -1;
+        }
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (cqe == NULL) {
+            return -1;
+        }
+        int res = cqe->res;
+        uring_cqe_seen(ring);
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+        if (res == 0) {
+            break;
+        }
+        total += res;
+    }
+    return total;
+}
+
+// Private function definitions
+
+/**
+ * @brief io_uring_enter(), waiting for wait_nr completions if not zero
+ */
+int uring_enter(int fd, unsigned to_submit, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, NULL, 0);
+}
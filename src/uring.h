@@ -0,0 +1,178 @@
+/**
+ * @file uring.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Minimal io_uring wrapper on the raw system calls: ring setup,
+ * submission and completion, plus the few operations the proxy uses (multishot
+ * accept, linked file ops on a direct descriptor). uring_init() fails on
+ * kernels without io_uring (or with it disabled) so callers can fall back to
+ * plain system calls.
+ * @version 0.1
+ * @date 2023-05-09
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES     64 // Submission queue entries per ring
+#define URING_DIRECT_FILE 0  // Direct descriptor slot for linked file ops
+
+/**
+ * @brief Ring
+ */
+typedef struct uring {
+    int                  fd;       // Ring descriptor, -1 when not set up
+    unsigned            *sq_head;  // Shared submission ring
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned             sq_local; // Tail of the prepared, unsubmitted entries
+    unsigned             sq_entries;
+    unsigned            *cq_head;  // Shared completion ring
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *ring_ptr; // Rings mapping
+    size_t               ring_len;
+    size_t               sqes_len;
+    int                  direct;   // Direct descriptor table registered
+} uring_t;
+
+/**
+ * @brief Set up a ring
+ *
+ * @param ring Ring
+ * @param entries Submission queue entries
+ * @return int 0 on success, -1 if io_uring is not available
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/**
+ * @brief Tear down a ring (no-op if it was never set up)
+ *
+ * @param ring Ring
+ */
+void uring_free(uring_t *ring);
+
+/**
+ * @brief Get a cleared submission entry to prepare
+ *
+ * @param ring Ring
+ * @return struct io_uring_sqe* Entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * @brief Submit every prepared entry and wait for completions, in one
+ * system call
+ *
+ * @param ring Ring
+ * @param wait_nr Completions to wait for (0 to only submit)
+ * @return int Number of entries submitted, -1 on failure (errno is set)
+ */
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+/**
+ * @brief Get the oldest completion without waiting
+ *
+ * @param ring Ring
+ * @return struct io_uring_cqe* Completion, NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * @brief Release the completion returned by uring_peek_cqe()
+ *
+ * @param ring Ring
+ */
+void uring_cqe_seen(uring_t *ring);
+
+/**
+ * @brief Register a one-slot direct descriptor table, so an open can be
+ * linked to the operations on the file it opens
+ *
+ * @param ring Ring
+ * @return int 0 on success, -1 on failure
+ */
+int uring_register_direct(uring_t *ring);
+
+/**
+ * @brief Prepare a multishot accept: one completion per accepted socket until
+ * a completion arrives without IORING_CQE_F_MORE
+ *
+ * @param sqe Entry
+ * @param fd Listening socket
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+
+/**
+ * @brief Prepare a multishot poll: one completion each time fd becomes
+ * readable until a completion arrives without IORING_CQE_F_MORE
+ *
+ * @param sqe Entry
+ * @param fd File descriptor
+ * @param user_data Tag of the completions
+ */
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               unsigned long user_data);
+
+/**
+ * @brief Prepare a timeout, completing with -ETIME once it expires
+ *
+ * @param sqe Entry
+ * @param ts Relative timeout (must stay valid until submitted)
+ * @param user_data Tag of the completion
+ */
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned long user_data);
+
+/**
+ * @brief Prepare a read or a write
+ *
+ * @param sqe Entry
+ * @param op IORING_OP_READ or IORING_OP_WRITE
+ * @param fd File descriptor (direct slot with IOSQE_FIXED_FILE)
+ * @param buffer Buffer
+ * @param len Buffer length
+ * @param offset File offset
+ */
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buffer,
+                   unsigned len, off_t offset);
+
+/**
+ * @brief Prepare an open into the direct descriptor slot
+ *
+ * @param sqe Entry
+ * @param path Path
+ * @param flags open() flags
+ * @param mode Mode of a created file
+ */
+void uring_prep_open_direct(struct io_uring_sqe *sqe, const char *path,
+                            int flags, mode_t mode);
+
+/**
+ * @brief Prepare a close of the direct descriptor slot
+ *
+ * @param sqe Entry
+ */
+void uring_prep_close_direct(struct io_uring_sqe *sqe);
+
+/**
+ * @brief Read a whole file region through the ring
+ *
+ * @param ring Ring
+ * @param fd File descriptor
+ * @param buffer Buffer
+ * @param len Bytes to read
+ * @return ssize_t Bytes read (short at end of file), -1 on failure
+ */
+ssize_t uring_read(uring_t *ring, int fd, void *buffer, size_t len);
+
+#endif
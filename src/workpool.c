@@ -0,0 +1,403 @@
+/**
+ * @file workpool.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ *
+ * @brief Implementation of workpool.h
+ * @details The deques follow Chase and Lev with the C11 orderings of Le et
+ * al. The owner pops the newest task (it is likely still in cache) and thieves
+ * take the oldest one, so owner and thieves only race for the last task. A
+ * worker looks for work in its own deque, then the injection list, then in
+ * the deques of the other workers starting from a random one. Sleeping uses
+ * the same handshake as the accept queue: a worker registers as a sleeper,
+ * looks for work once more and waits on the submit counter, and submitters
+ * only wake someone when a sleeper is registered. A full deque never refuses
+ * a task, it is run on the spot instead.
+ *
+ * @version 0.1
+ * @date 2023-05-08
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "workpool.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define WORKPOOL_MASK (WORKPOOL_DEQUE_SIZE - 1)
+
+// Task states
+#define TASK_PENDING 0
+#define TASK_DONE    1
+#define TASK_WAITED  2 // Pending, someone sleeps on it
+
+// Private variables
+static __thread workpool_t *current_pool  = NULL; // Pool of this worker
+static __thread int         current_index = -1;   // Deque of this worker
+static __thread uint32_t    steal_seed    = 0;
+
+// Private functions
+void            *workpool_worker(void *arg);
+int              deque_push(workpool_deque_t *deque, workpool_task_t *task);
+workpool_task_t *deque_take(workpool_deque_t *deque);
+workpool_task_t *deque_steal(workpool_deque_t *deque);
+workpool_task_t *workpool_find(workpool_t *pool, int index);
+void             workpool_run(workpool_task_t *task);
+void             workpool_notify(workpool_t *pool);
+void             workpool_futex_wait(_Atomic uint32_t *word, uint32_t value);
+void             workpool_futex_wake(_Atomic uint32_t *word, int count);
+
+/**
+ * @brief Create a pool and start its workers
+ *
+ * @param num_threads Number of worker threads
+ * @return workpool_t* Pool, NULL on failure
+ */
+workpool_t *workpool_create(int num_threads) {
+    if (num_threads < 1 || num_threads > WORKPOOL_THREADS_MAX) {
+        fprintf(stderr, "Error: Invalid number of pool threads %d\n",
+                num_threads);
+        return NULL;
+    }
+    workpool_t *pool = calloc(1, sizeof(workpool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+    pool->threads     = calloc(num_threads, sizeof(pthread_t));
+    pool->deques =
+        aligned_alloc(64, num_threads * sizeof(workpool_deque_t));
+    if (pool->threads == NULL || pool->deques == NULL) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pool->deques[i].pool = pool;
+        atomic_init(&pool->deques[i].top, 0);
+        atomic_init(&pool->deques[i].bottom, 0);
+    }
+    pthread_mutex_init(&pool->inject_lock, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, workpool_worker,
+                           &pool->deques[i]) != 0) {
+            fprintf(stderr, "Error: Failed to start pool thread %d\n", i);
+            pool->num_threads = i;
+            workpool_free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * @brief Submit a task owned by the caller
+ *
+ * @param pool Pool
+ * @param task Task (fn and arg set, the rest zeroed)
+ */
+void workpool_submit(workpool_t *pool, workpool_task_t *task) {
+    atomic_store_explicit(&task->state, TASK_PENDING, memory_order_relaxed);
+    if (current_pool == pool) {
+        if (deque_push(&pool->deques[current_index], task) != 0) {
+            // Deque is full, this worker does it now
+            workpool_run(task);
+            return;
+        }
+    } else {
+        task->next = NULL;
+        pthread_mutex_lock(&pool->inject_lock);
+        if (pool->inject_tail == NULL) {
+            pool->inject_head = task;
+        } else {
+            pool->inject_tail->next = task;
+        }
+        pool->inject_tail = task;
+        atomic_fetch_add(&pool->inject_count, 1);
+        pthread_mutex_unlock(&pool->inject_lock);
+    }
+    workpool_notify(pool);
+}
+
+/**
+ * @brief Run fn(arg) on the pool without waiting for it
+ *
+ * @param pool Pool
+ * @param fn Task function
+ * @param arg Task argument
+ * @return int 0 on success, -1 on failure
+ */
+int workpool_spawn(workpool_t *pool, workpool_fn_t fn, void *arg) {
+    workpool_task_t *task = calloc(1, sizeof(workpool_task_t));
+    if (task == NULL) {
+        fprintf(stderr, "Error: Failed to allocate a task\n");
+        return -1;
+    }
+    task->fn       = fn;
+    task->arg      = arg;
+    task->detached = 1;
+    workpool_submit(pool, task);
+    return 0;
+}
+
+/**
+ * @brief Wait for a submitted task
+ *
+ * @param pool Pool
+ * @param task Task
+ */
+void workpool_wait(workpool_t *pool, workpool_task_t *task) {
+    if (current_pool == pool) {
+        // Keep busy, most likely with the task itself
+        while (atomic_load_explicit(&task->state, memory_order_acquire) !=
+               TASK_DONE) {
+            workpool_task_t *other = workpool_find(pool, current_index);
+            if (other != NULL) {
+                workpool_run(other);
+            } else {
+                sched_yield();
+            }
+        }
+        return;
+    }
+    uint32_t state = TASK_PENDING;
+    for (;;) {
+        if (state == TASK_DONE) {
+            return;
+        }
+        if (state == TASK_PENDING &&
+            !atomic_compare_exchange_strong(&task->state, &state,
+                                            TASK_WAITED)) {
+            continue;
+        }
+        workpool_futex_wait(&task->state, TASK_WAITED);
+        state = atomic_load(&task->state);
+    }
+}
+
+/**
+ * @brief Run the remaining tasks, stop the workers and free the pool
+ *
+ * @param pool Pool
+ */
+void workpool_free(workpool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    atomic_store(&pool->stopping, 1);
+    atomic_fetch_add(&pool->submits, 1);
+    workpool_futex_wake(&pool->submits, INT_MAX);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->inject_lock);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
+
+// Private function definitions
+
+/**
+ * @brief Worker thread: run tasks until the pool stops and no work is left
+ */
+void *workpool_worker(void *arg) {
+    workpool_deque_t *deque = arg;
+    workpool_t       *pool  = deque->pool;
+    current_pool            = pool;
+    current_index           = deque - pool->deques;
+    steal_seed              = 2654435761u * (current_index + 1);
+    int idle                = 0;
+    for (;;) {
+        workpool_task_t *task = workpool_find(pool, current_index);
+        if (task != NULL) {
+            workpool_run(task);
+            idle = 0;
+            continue;
+        }
+        if (atomic_load(&pool->stopping)) {
+            break;
+        }
+        if (idle++ < WORKPOOL_SPIN) {
+            sched_yield();
+            continue;
+        }
+        // Take a snapshot of the submit counter, then look once more: a
+        // submit after this point changes the counter and the wait returns
+        uint32_t submits = atomic_load(&pool->submits);
+        atomic_fetch_add(&pool->sleepers, 1);
+        task = workpool_find(pool, current_index);
+        if (task == NULL && !atomic_load(&pool->stopping)) {
+            workpool_futex_wait(&pool->submits, submits);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        if (task != NULL) {
+            workpool_run(task);
+        }
+        idle = 0;
+    }
+    current_pool  = NULL;
+    current_index = -1;
+    return NULL;
+}
+
+/**
+ * @brief Push a task at the bottom of a deque (owner only)
+ *
+ * @return int 0 on success, -1 if the deque is full
+ */
+int deque_push(workpool_deque_t *deque, workpool_task_t *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= WORKPOOL_DEQUE_SIZE) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->tasks[bottom & WORKPOOL_MASK], task,
+                          memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Pop the newest task from the bottom of a deque (owner only)
+ *
+ * @return workpool_task_t* Task, NULL if the deque is empty
+ */
+workpool_task_t *deque_take(workpool_deque_t *deque) {
+    int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t          top  = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    workpool_task_t *task = NULL;
+    if (top <= bottom) {
+        task = atomic_load_explicit(&deque->tasks[bottom & WORKPOOL_MASK],
+                                    memory_order_relaxed);
+        if (top == bottom) {
+            // Last task, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(
+                    &deque->top, &top, top + 1, memory_order_seq_cst,
+                    memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1,
+                                  memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * @brief Take the oldest task from the top of a deque (any thread)
+ *
+ * @return workpool_task_t* Task, NULL if the deque is empty or the race for
+ * the task was lost
+ */
+workpool_task_t *deque_steal(workpool_deque_t *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    workpool_task_t *task = atomic_load_explicit(
+        &deque->tasks[top & WORKPOOL_MASK], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * @brief Find a task for a worker: its own deque, the injection list, then
+ * the other deques from a random victim on
+ */
+workpool_task_t *workpool_find(workpool_t *pool, int index) {
+    workpool_task_t *task = deque_take(&pool->deques[index]);
+    if (task != NULL) {
+        return task;
+    }
+    if (atomic_load(&pool->inject_count) > 0) {
+        pthread_mutex_lock(&pool->inject_lock);
+        task = pool->inject_head;
+        if (task != NULL) {
+            pool->inject_head = task->next;
+            if (pool->inject_head == NULL) {
+                pool->inject_tail = NULL;
+            }
+            atomic_fetch_sub(&pool->inject_count, 1);
+        }
+        pthread_mutex_unlock(&pool->inject_lock);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    // xorshift32
+    steal_seed ^= steal_seed << 13;
+    steal_seed ^= steal_seed >> 17;
+    steal_seed ^= steal_seed << 5;
+    int start = steal_seed % pool->num_threads;
+    for (int i = 0; i < pool->num_threads; i++) {
+        int victim = (start + i) % pool->num_threads;
+        if (victim == index) {
+            continue;
+        }
+        task = deque_steal(&pool->deques[victim]);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run a task and mark it done
+ */
+void workpool_run(workpool_task_t *task) {
+    task->fn(task->arg);
+    if (task->detached) {
+        free(task);
+        return;
+    }
+    // The owner may free the task as soon as it sees it done
+    if (atomic_exchange(&task->state, TASK_DONE) == TASK_WAITED) {
+        workpool_futex_wake(&task->state, INT_MAX);
+    }
+}
+
+/**
+ * @brief Wake a sleeping worker after a submit
+ */
+void workpool_notify(workpool_t *pool) {
+    atomic_fetch_add(&pool->submits, 1);
+    if (atomic_load(&pool->sleepers) > 0) {
+        workpool_futex_wake(&pool->submits, 1);
+    }
+}
+
+/**
+ * @brief Sleep while the futex word still holds value
+ */
+void workpool_futex_wait(_Atomic uint32_t *word, uint32_t value) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, value, NULL, NULL,
+            0);
+}
+
+/**
+ * @brief Wake up to count threads sleeping on the futex word
+ */
+void workpool_futex_wake(_Atomic uint32_t *word, int count) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL,
+            0);
+}
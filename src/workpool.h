@@ -0,0 +1,107 @@
+/**
+ * @file workpool.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Work-stealing thread pool. Every worker owns a Chase-Lev deque: it
+ * pushes and pops tasks at the bottom while idle workers steal from the top of
+ * a randomly picked victim. Tasks submitted from outside the pool go through a
+ * shared injection list.
+ * @version 0.1
+ * @date 2023-05-08
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define WORKPOOL_DEQUE_SIZE  1024 // Tasks per worker deque (power of two)
+#define WORKPOOL_THREADS_MAX 256  // Max worker threads
+#define WORKPOOL_SPIN        16   // Idle rounds before a worker goes to sleep
+
+typedef void (*workpool_fn_t)(void *arg);
+
+/**
+ * @brief Task, owned by the submitter until it is done (zero it before use)
+ */
+typedef struct workpool_task {
+    workpool_fn_t         fn;       // Task function
+    void                 *arg;      // Task argument
+    int                   detached; // Freed by the pool once it has run
+    _Atomic uint32_t      state;    // Pending, done, or pending with a waiter
+    struct workpool_task *next;     // Injection list
+} workpool_task_t;
+
+/**
+ * @brief Worker deque
+ */
+typedef struct workpool_deque {
+    struct workpool *pool;               // Pool of the owner
+    _Alignas(64) _Atomic int64_t top;    // Thieves take from here
+    _Alignas(64) _Atomic int64_t bottom; // The owner works here
+    _Atomic(workpool_task_t *) tasks[WORKPOOL_DEQUE_SIZE];
+} workpool_deque_t;
+
+/**
+ * @brief Thread pool
+ */
+typedef struct workpool {
+    int               num_threads;
+    pthread_t        *threads;
+    workpool_deque_t *deques;       // One per worker
+    pthread_mutex_t   inject_lock;  // Guards the injection list
+    workpool_task_t  *inject_head;  // Tasks submitted from outside the pool
+    workpool_task_t  *inject_tail;
+    _Atomic int       inject_count;
+    _Atomic uint32_t  submits;      // Futex word
+    _Atomic int       sleepers;     // Sleeping workers
+    _Atomic int       stopping;
+} workpool_t;
+
+/**
+ * @brief Create a pool and start its workers
+ *
+ * @param num_threads Number of worker threads
+ * @return workpool_t* Pool, NULL on failure
+ */
+workpool_t *workpool_create(int num_threads);
+
+/**
+ * @brief Submit a task owned by the caller, who waits for it with
+ * workpool_wait(). A task submitted from a worker goes on its own deque.
+ *
+ * @param pool Pool
+ * @param task Task (fn and arg set, the rest zeroed)
+ */
+void workpool_submit(workpool_t *pool, workpool_task_t *task);
+
+/**
+ * @brief Run fn(arg) on the pool without waiting for it
+ *
+ * @param pool Pool
+ * @param fn Task function
+ * @param arg Task argument
+ * @return int 0 on success, -1 on failure
+ */
+int workpool_spawn(workpool_t *pool, workpool_fn_t fn, void *arg);
+
+/**
+ * @brief Wait for a submitted task. A worker runs other tasks meanwhile.
+ *
+ * @param pool Pool
+ * @param task Task
+ */
+void workpool_wait(workpool_t *pool, workpool_task_t *task);
+
+/**
+ * @brief Run the remaining tasks, stop the workers and free the pool
+ *
+ * @param pool Pool
+ */
+void workpool_free(workpool_t *pool);
+
+#endif
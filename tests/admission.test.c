@@ -0,0 +1,80 @@
+/**
+ * @file admission.test.c
+ * @brief Test the admission queue: connections leave in order, a full queue
+ * refuses more, and the late threshold follows the queue delay: the interval
+ * while the queue drains, the target once a whole interval had a standing
+ * queue, and the interval again after the queue ran empty.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-10
+ *
+ */
+
+#include "admission.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+int main() {
+    admission_t *admission = admission_create();
+    uint64_t     now       = 1000;
+    int          fd;
+
+    // FIFO order and capacity
+    for (int i = 0; i < ADMISSION_QUEUE_SIZE; i++) {
+        expect(admission_push(admission, i, now), 0, "push");
+    }
+    expect(admission_push(admission, -1, now), -1, "push to a full queue");
+    for (int i = 0; i < ADMISSION_QUEUE_SIZE; i++) {
+        admission_head(admission, now, &fd);
+        expect(fd, i, "order");
+        admission_pop(admission, now);
+    }
+    expect(admission_head(admission, now, &fd), -1, "head of an empty queue");
+
+    // Draining normally: late only after a whole interval
+    admission_push(admission, 1, now);
+    expect(admission_head(admission, now + ADMISSION_TARGET_MS + 1, &fd), 0,
+           "late after the target without a standing queue");
+    expect(admission_head(admission, now + ADMISSION_INTERVAL_MS + 1, &fd), 1,
+           "late after the interval");
+    expect(admission_wait_ms(admission, now + ADMISSION_INTERVAL_MS + 1), 0,
+           "wait for a late head");
+
+    // Every connection of the next window waits longer than the target
+    now += ADMISSION_INTERVAL_MS + 1;
+    admission_pop(admission, now);
+    for (int i = 0; i < 10; i++) {
+        admission_push(admission, i, now);
+    }
+    for (int i = 0; i < 5; i++) {
+        now += ADMISSION_INTERVAL_MS / 4;
+        admission_head(admission, now, &fd);
+        admission_pop(admission, now);
+    }
+    // The window rolled over with a standing queue: the target applies
+    now += ADMISSION_INTERVAL_MS;
+    admission_push(admission, 99, now);
+    for (int i = 0; i < 5; i++) {
+        admission_pop(admission, now);
+    }
+    expect(admission_head(admission, now + ADMISSION_TARGET_MS + 1, &fd), 1,
+           "late after the target with a standing queue");
+    expect(admission_wait_ms(admission, now), ADMISSION_TARGET_MS + 1,
+           "wait for the target");
+
+    // The queue ran empty: back to the interval after the next window
+    admission_pop(admission, now);
+    admission_push(admission, 100, now);
+    admission_pop(admission, now);
+    now += ADMISSION_INTERVAL_MS + 1;
+    admission_push(admission, 101, now);
+    expect(admission_head(admission, now + ADMISSION_TARGET_MS + 1, &fd), 0,
+           "late after the target once the queue drained");
+
+    admission_free(admission);
+    return test_report();
+}
@@ -0,0 +1,70 @@
+/**
+ * @file backend.test.c
+ * @brief Test the backend groups: Host lookup with the default group, the
+ * choice of the backend with the lowest latency times outstanding requests,
+ * and failed requests taking a backend out of the rotation.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ */
+
+#include "backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+int main() {
+    char  path[] = "/tmp/backend.test.XXXXXX";
+    int   fd     = mkstemp(path);
+    FILE *f      = fdopen(fd, "w");
+    fprintf(f, "# Groups\n\nwww.example.com a:8001 b:8002\n* c\n");
+    fclose(f);
+    expect(backend_load(path), 0, "load");
+    unlink(path);
+
+    // Groups
+    expect(backend_has_group("WWW.example.com"), 1, "host");
+    expect(backend_has_group("other.example.com"), 1, "default group");
+    backend_t *backend = backend_select("other.example.com");
+    expect(strcmp(backend->host, "c") == 0 && backend->port == 80, 1,
+           "default port");
+    backend_release(backend, 1, 1);
+
+    // The slower backend only gets requests once the faster one is busy
+    backend_t *a = backend_select("www.example.com");
+    backend_t *b = backend_select("www.example.com");
+    expect(a != b, 1, "spread over idle backends");
+    backend_release(strcmp(a->host, "a") == 0 ? a : b, 2, 1);
+    backend_release(strcmp(a->host, "b") == 0 ? a : b, 20, 1);
+    for (int i = 0; i < 5; i++) {
+        backend = backend_select("www.example.com");
+        expect(strcmp(backend->host, "a"), 0, "faster backend");
+        backend_release(backend, 2, 1);
+    }
+    backend_t *held[10];
+    int        slower = 0;
+    for (int i = 0; i < 10; i++) {
+        held[i] = backend_select("www.example.com");
+        slower += strcmp(held[i]->host, "b") == 0;
+    }
+    expect(slower, 1, "slower backend when busy");
+    for (int i = 0; i < 10; i++) {
+        backend_release(held[i], 2, 1);
+    }
+
+    // Failures in a row take a backend out
+    for (int i = 0; i < BACKEND_FAILURES_MAX; i++) {
+        backend = backend_select("other.example.com");
+        expect(backend != NULL, 1, "healthy");
+        backend_release(backend, 1, 0);
+    }
+    expect(backend_select("other.example.com") == NULL, 1, "taken out");
+
+    return test_report();
+}
@@ -0,0 +1,106 @@
+/**
+ * @file breaker.test.c
+ * @brief Test the per-origin limits: fetches beyond the in-flight limit are
+ * refused, consecutive failures open the circuit, an open circuit refuses
+ * fetches until a single probe is let through, and the probe's outcome opens
+ * or closes the circuit again. Fetches and probes lost with a dead process
+ * do not hold the origin for good.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-11
+ *
+ */
+
+#include "breaker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+
+int main() {
+    breaker_ticket_t tickets[3], probe;
+    uint64_t         now = 100000;
+
+    if (breaker_init(2) != 0) {
+        return 1;
+    }
+
+    // In-flight limit, per origin
+    expect(breaker_acquire("a", 80, now, &tickets[0]), BREAKER_OK, "first");
+    expect(breaker_acquire("a", 80, now, &tickets[1]), BREAKER_OK, "second");
+    expect(breaker_acquire("a", 80, now, &tickets[2]), BREAKER_BUSY,
+           "over the limit");
+    expect(breaker_acquire("a", 443, now, &tickets[2]), BREAKER_OK,
+           "other port");
+    breaker_release(&tickets[2], 1, now);
+    breaker_release(&tickets[1], 1, now);
+    expect(breaker_acquire("a", 80, now, &tickets[1]), BREAKER_OK,
+           "after a release");
+    breaker_release(&tickets[1], 1, now);
+    breaker_release(&tickets[0], 1, now);
+
+    // A process that dies mid-fetch does not keep its slot
+    pid_t pid = fork();
+    if (pid == 0) {
+        breaker_acquire("a", 80, now, &tickets[0]);
+        breaker_acquire("a", 80, now, &tickets[1]);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    expect(breaker_acquire("a", 80, now, &tickets[0]), BREAKER_OK,
+           "slot of a dead process");
+    expect(breaker_acquire("a", 80, now, &tickets[1]), BREAKER_OK,
+           "both slots");
+    expect(breaker_acquire("a", 80, now, &tickets[2]), BREAKER_BUSY,
+           "live slots kept");
+    breaker_release(&tickets[1], 1, now);
+    breaker_release(&tickets[0], 1, now);
+
+    // Consecutive failures open the circuit
+    for (int i = 1; i <= BREAKER_CONSECUTIVE; i++) {
+        expect(breaker_acquire("b", 80, now, &tickets[0]), BREAKER_OK,
+               "failing fetch");
+        expect(breaker_release(&tickets[0], 0, now),
+               i == BREAKER_CONSECUTIVE ? BREAKER_OPENED : 0, "failure");
+    }
+    expect(breaker_acquire("b", 80, now + BREAKER_OPEN_MS - 1, &tickets[0]),
+           BREAKER_OPEN, "open");
+
+    // One probe once the circuit was open long enough; a failed probe
+    // opens it again
+    now += BREAKER_OPEN_MS;
+    expect(breaker_acquire("b", 80, now, &probe), BREAKER_OK, "probe");
+    expect(breaker_acquire("b", 80, now, &tickets[0]), BREAKER_OPEN,
+           "during the probe");
+    expect(breaker_release(&probe, 0, now), BREAKER_OPENED, "failed probe");
+    expect(breaker_acquire("b", 80, now + 1, &tickets[0]), BREAKER_OPEN,
+           "open again");
+
+    // A probe that never comes back is replaced after BREAKER_OPEN_MS
+    now += BREAKER_OPEN_MS;
+    expect(breaker_acquire("b", 80, now, &probe), BREAKER_OK, "lost probe");
+    expect(breaker_acquire("b", 80, now + BREAKER_OPEN_MS - 1, &probe),
+           BREAKER_OPEN, "probe still out");
+
+    // A successful probe closes it
+    now += BREAKER_OPEN_MS;
+    expect(breaker_acquire("b", 80, now, &probe), BREAKER_OK, "second probe");
+    expect(breaker_release(&probe, 1, now), BREAKER_CLOSED, "probe succeeded");
+    expect(breaker_acquire("b", 80, now, &tickets[0]), BREAKER_OK, "closed");
+    breaker_release(&tickets[0], 1, now);
+
+    // Failure rate over a window, without failures in a row
+    now += BREAKER_WINDOW_MS;
+    int opened = 0;
+    for (int i = 0; i < 2 * BREAKER_MIN_FETCHES && !opened; i++) {
+        breaker_acquire("c", 80, now, &tickets[0]);
+        opened = breaker_release(&tickets[0], i % 2, now) == BREAKER_OPENED;
+    }
+    expect(opened, 1, "failure rate");
+
+    return test_report();
+}
@@ -0,0 +1,194 @@
+/**
+ * @file compress.test.c
+ * @brief Test response compression: the coding picked from Accept-Encoding
+ * q-values, which responses are eligible, and that gzip and deflate bodies
+ * (compressed for the client or in a cache entry) inflate back to the
+ * original.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define BODY_SIZE 20000
+
+/**
+ * @brief Pick the coding for a request with the given Accept-Encoding
+ */
+int negotiate(const char *accept) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "GET http://a.test/ HTTP/1.1\r\nHost: a.test\r\n%s%s%s\r\n",
+             accept != NULL ? "Accept-Encoding: " : "",
+             accept != NULL ? accept : "", accept != NULL ? "\r\n" : "");
+    http_message_t *message =
+        http_message_create_from_buffer(strdup(buf), strlen(buf));
+    request_t *request = request_parse(message);
+    int encoding = compress_negotiate(request);
+    request_free(request);
+    return encoding;
+}
+
+/**
+ * @brief Build a 200 response with extra headers and a body
+ */
+response_t *make_response(const char *headers, const char *body, size_t len) {
+    char  *buf = malloc(256 + len);
+    size_t n   = sprintf(buf, "HTTP/1.1 200 OK\r\n%s", headers);
+    n += sprintf(buf + n, "Content-Length: %zu\r\n\r\n", len);
+    memcpy(buf + n, body, len);
+    return response_parse(http_message_create_from_buffer(buf, n + len));
+}
+
+/**
+ * @brief Check if a response's body is the given one
+ */
+int body_is(response_t *response, const char *body, size_t len) {
+    http_message_t *message = response->message;
+    return http_message_get_body_len(message) == len &&
+           memcmp(http_message_get_body(message), body, len) == 0;
+}
+
+/**
+ * @brief Read a cache entry from the start of a file
+ */
+response_t *read_entry(FILE *f, int *codec) {
+    rewind(f);
+    return response_read(f, codec);
+}
+
+int main() {
+    // Negotiation
+    expect(negotiate(NULL), COMPRESS_NONE, "no Accept-Encoding");
+    expect(negotiate("gzip, deflate"), COMPRESS_GZIP, "gzip wins ties");
+    expect(negotiate("deflate"), COMPRESS_DEFLATE, "deflate only");
+    expect(negotiate("gzip;q=0.5, deflate"), COMPRESS_DEFLATE, "higher q");
+    expect(negotiate("gzip;q=0, deflate;q=0"), COMPRESS_NONE, "q=0 refuses");
+    expect(negotiate("GZIP;Q=1.0"), COMPRESS_GZIP, "case");
+    expect(negotiate("br, identity"), COMPRESS_NONE, "unknown codings");
+    expect(negotiate("xgzip, deflate;q=0.1"), COMPRESS_DEFLATE,
+           "whole tokens only");
+    expect(compress_encoding_parse("Gzip"), COMPRESS_GZIP, "parse gzip");
+    expect(compress_encoding_parse("identity"), COMPRESS_NONE,
+           "parse identity");
+    expect(compress_encoding_parse("br"), -1, "parse unknown");
+
+    // Eligibility
+    char body[BODY_SIZE];
+    for (int i = 0; i < BODY_SIZE; i++) {
+        body[i] = "compressible text "[i % 18];
+    }
+    const char *headers[] = {
+        "Content-Type: text/html; charset=utf-8\r\n",
+        "Content-Type: application/json\r\n",
+        "Content-Type: image/png\r\n",
+        "Content-Type: text/plain\r\nContent-Encoding: gzip\r\n",
+        "Content-Type: text/plain\r\nCache-Control: no-transform\r\n",
+        "",
+    };
+    int eligible[] = {1, 1, 0, 0, 0, 0};
+    for (int i = 0; i < 6; i++) {
+        response_t *response = make_response(headers[i], body, BODY_SIZE);
+        expect(compress_is_eligible(response), eligible[i], headers[i]);
+        response_free(response);
+    }
+    response_t *small = make_response(headers[0], body, COMPRESS_MIN_SIZE - 1);
+    expect(compress_is_eligible(small), 0, "small body");
+    response_free(small);
+
+    for (int encoding = COMPRESS_GZIP; encoding <= COMPRESS_DEFLATE;
+         encoding++) {
+        const char *name = compress_encoding_name(encoding);
+
+        // Compressed for the client, inflated back
+        response_t *response = make_response(headers[0], body, BODY_SIZE);
+        expect(compress_response(response, encoding), 0, "compress");
+        expect(http_message_get_body_len(response->message) < BODY_SIZE / 10,
+               1, "compressed size");
+        expect(strcmp(http_message_header_get(response->message,
+                                              "Content-Encoding"),
+                      name),
+               0, "Content-Encoding");
+        expect(compress_decode_body(response, encoding), 0, "decode");
+        expect(body_is(response, body, BODY_SIZE), 1, "round trip");
+        response_free(response);
+
+        // Cache entry with the original headers and a compressed body
+        response = make_response(headers[0], body, BODY_SIZE);
+        FILE *f  = tmpfile();
+        expect(response_write(response, f, encoding), 0, "write entry");
+        expect(ftell(f) < BODY_SIZE / 10, 1, "entry size");
+        response_free(response);
+        int         codec;
+        response_t *stored = read_entry(f, &codec);
+        expect(codec, encoding, "entry codec");
+        expect(strcmp(http_message_header_get(stored->message,
+                                              "Content-Length"),
+                      "20000"),
+               0, "stored Content-Length");
+        response_t *sent = read_entry(f, &codec);
+        expect(compress_decode_body(stored, encoding), 0, "decode entry");
+        expect(body_is(stored, body, BODY_SIZE), 1, "entry round trip");
+        size_t len = http_message_get_body_len(sent->message);
+        char  *raw = malloc(len);
+        memcpy(raw, http_message_get_body(sent->message), len);
+        expect(compress_mark_encoded(sent, encoding), 0, "mark encoded");
+        expect(body_is(sent, raw, len), 1, "sent as stored");
+        expect(strcmp(http_message_header_get(sent->message,
+                                              "Content-Encoding"),
+                      name),
+               0, "entry Content-Encoding");
+        free(raw);
+        response_free(stored);
+        response_free(sent);
+        fclose(f);
+    }
+
+    // Uncompressed, older and unknown entries
+    int         codec;
+    response_t *response = make_response(headers[0], body, BODY_SIZE);
+    FILE       *f        = tmpfile();
+    expect(response_write(response, f, COMPRESS_NONE), 0, "write plain");
+    response_free(response);
+    response = read_entry(f, &codec);
+    expect(codec, COMPRESS_NONE, "plain codec");
+    expect(body_is(response, body, BODY_SIZE), 1, "plain entry");
+    response_free(response);
+    fclose(f);
+    f = tmpfile();
+    fputs("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", f);
+    response = read_entry(f, &codec);
+    expect(codec == COMPRESS_NONE && body_is(response, "ok", 2), 1,
+           "entry without a codec line");
+    response_free(response);
+    fclose(f);
+    f = tmpfile();
+    fputs(RESPONSE_ENTRY_MAGIC " br\nHTTP/1.1 200 OK\r\n\r\n", f);
+    expect(read_entry(f, &codec) == NULL, 1, "unknown codec");
+    fclose(f);
+
+    // A corrupt body fails to inflate
+    response_t *corrupt = make_response(headers[0], body, 100);
+    expect(compress_decode_body(corrupt, COMPRESS_GZIP), -1, "corrupt body");
+    response_free(corrupt);
+
+    // Vary
+    response_t *vary = make_response("Vary: Cookie\r\n", "", 0);
+    compress_add_vary(vary);
+    compress_add_vary(vary);
+    expect(strcmp(http_message_header_get(vary->message, "Vary"),
+                  "Cookie, Accept-Encoding"),
+           0, "Vary");
+    response_free(vary);
+
+    return test_report();
+}
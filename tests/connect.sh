@@ -0,0 +1,4 @@
+
+export https_proxy=http://127.0.0.1:8008
+# wget https://www.google.com/
+wget https://www.colorado.edu/
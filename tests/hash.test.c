@@ -0,0 +1,61 @@
+/**
+ * @file hash.test.c
+ * @brief Test the shared hashing: hashes are stable and never 0, and keys
+ * claim their own slot in an open-addressed table, probing past colliding
+ * keys, until the table is full.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#include "hash.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_SLOTS 4
+
+/**
+ * @brief Table entry, keyed like the per-origin tables
+ */
+typedef struct entry {
+    _Atomic uint64_t key;
+    int              value;
+} entry_t;
+
+int main() {
+    entry_t table[TEST_SLOTS] = {0};
+
+    // Hashes
+    expect(hash_string("a") == hash_string("a"), 1, "stable");
+    expect(hash_string("a") != hash_string("b"), 1, "strings differ");
+    expect(hash_string("") != 0, 1, "never 0");
+    expect(hash_origin("a", 80) != hash_origin("a", 443), 1, "ports differ");
+    expect(hash_origin("a", 80) == hash_origin("a", 80), 1, "origin stable");
+
+    // Slots
+    expect(hash_slot(NULL, TEST_SLOTS, sizeof(entry_t), 1) == NULL, 1,
+           "no table");
+    entry_t *first = hash_slot(table, TEST_SLOTS, sizeof(entry_t), 1);
+    expect(first == &table[1], 1, "slot of the hash");
+    first->value = 7;
+    expect(hash_slot(table, TEST_SLOTS, sizeof(entry_t), 1) == first, 1,
+           "same key, same slot");
+    entry_t *collision =
+        hash_slot(table, TEST_SLOTS, sizeof(entry_t), 1 + TEST_SLOTS);
+    expect(collision == &table[2], 1, "probed past a collision");
+    hash_slot(table, TEST_SLOTS, sizeof(entry_t), 3);
+    hash_slot(table, TEST_SLOTS, sizeof(entry_t), 4);
+    expect(hash_slot(table, TEST_SLOTS, sizeof(entry_t), 6) == NULL, 1,
+           "full");
+    expect(((entry_t *)hash_slot(table, TEST_SLOTS, sizeof(entry_t), 1))
+               ->value,
+           7, "kept in a full table");
+
+    return test_report();
+}
@@ -0,0 +1,64 @@
+/**
+ * @file hedge.test.c
+ * @brief Test hedging: no delay until enough latencies are known, the delay
+ * follows the origin's 95th percentile (within a bucket), and the budget
+ * allows hedging only a percentage of the fetches.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ */
+
+#include "hedge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+int main() {
+    expect(hedge_delay_ms("a", 80), -1, "before init");
+    expect(hedge_take(), 0, "budget before init");
+    if (hedge_init(5) != 0) {
+        return 1;
+    }
+
+    // Too few samples
+    for (int i = 0; i < HEDGE_MIN_SAMPLES - 1; i++) {
+        hedge_record("a", 80, 10);
+    }
+    expect(hedge_delay_ms("a", 80), -1, "too few samples");
+    hedge_record("a", 80, 10);
+    int delay = hedge_delay_ms("a", 80);
+    expect(delay > 10 && delay <= 12, 1, "delay after the bucket of 10 ms");
+
+    // 96 fast and 4 slow fetches: the 95th percentile is still fast
+    for (int i = 0; i < 76; i++) {
+        hedge_record("b", 80, 100);
+    }
+    for (int i = 0; i < 4; i++) {
+        hedge_record("b", 80, 1000);
+    }
+    for (int i = 0; i < 20; i++) {
+        hedge_record("b", 80, 100);
+    }
+    delay = hedge_delay_ms("b", 80);
+    expect(delay > 100 && delay <= 128, 1, "p95 below the slow fetches");
+    // 10 slow out of 110: now it is slow
+    for (int i = 0; i < 6; i++) {
+        hedge_record("b", 80, 1000);
+    }
+    delay = hedge_delay_ms("b", 80);
+    expect(delay > 1000 && delay <= 1280, 1, "p95 among the slow fetches");
+    expect(hedge_delay_ms("b", 443), -1, "other port");
+
+    // 5% of the 130 fetches recorded so far
+    int hedges = 0;
+    while (hedge_take()) {
+        hedges++;
+    }
+    expect(hedges, 7, "hedges within the budget");
+
+    return test_report();
+}
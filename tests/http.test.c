@@ -0,0 +1,246 @@
+/**
+ * @file http.test.c
+ * @brief Test request bodies: a Content-Length or chunked body is streamed
+ * from the client to the origin and the next pipelined request stays on the
+ * client connection, Expect: 100-continue is answered by the proxy and not
+ * forwarded, body lengths past 2 GB survive sending the header, a parent or
+ * sibling proxy gets the request line in absolute-form, and chunked
+ * responses or request bodies with a malformed or oversized chunk are
+ * refused, leaving the client connection marked to be closed.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "request.h"
+#include "test.h"
+
+/**
+ * @brief Read whatever is queued on a socket (up to len - 1 bytes)
+ */
+char *drain(int fd, char *buf, size_t len) {
+    ssize_t n = recv(fd, buf, len - 1, MSG_DONTWAIT);
+    buf[n > 0 ? n : 0] = '\0';
+    return buf;
+}
+
+/**
+ * @brief Send a request written by a client through request_send()
+ *
+ * @param client Socket the client writes to
+ * @param proxy Client connection of the proxy
+ * @param origin Origin connection of the proxy
+ * @param data What the client sends
+ * @return int request_send() status, -1 if the request was not parsed
+ */
+int forward(int client, connection_t *proxy, connection_t *origin,
+            const char *data) {
+    send(client, data, strlen(data), 0);
+    request_t *request = request_parse(http_message_recv_header(proxy));
+    if (request == NULL) {
+        return -1;
+    }
+    request->client = proxy;
+    int status      = request_send(request, origin);
+    request_free(request);
+    return status;
+}
+
+/**
+ * @brief Receive a chunked response from an origin on a new connection
+ *
+ * @param body What the origin sends after the header (the chunks)
+ * @param len Length of body
+ * @return int 0 if the body decodes to "hello", -2 if it decodes to
+ * something else, -1 if it is refused
+ */
+int recv_chunked(const char *body, size_t len) {
+    const char *header = "HTTP/1.1 200 OK\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n";
+    int         o[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, o) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    send(o[1], header, strlen(header), 0);
+    send(o[1], body, len, 0);
+    connection_t    origin  = {.fd = o[0]};
+    http_message_t *message = http_message_recv_header(&origin);
+    int             status  = -1;
+    if (message != NULL) {
+        status = http_message_recv_body(message, &origin);
+        if (status == 0 && (http_message_get_body_len(message) != 5 ||
+                            memcmp(http_message_get_body(message), "hello",
+                                   5) != 0)) {
+            status = -2;
+        }
+        http_message_free(message);
+    }
+    close_connection(&origin);
+    close(o[1]);
+    return status;
+}
+
+/**
+ * @brief Stream a chunked request body that should be refused
+ *
+ * @param chunks Body the client sends
+ * @return int 1 if the request failed with the client connection still
+ * marked, 0 otherwise
+ */
+int stream_refused(const char *chunks) {
+    const char *header = "POST http://a.test/up HTTP/1.1\r\nHost: a.test\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n";
+    int         c[2], o[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, c) == -1 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, o) == -1) {
+        perror("socketpair");
+        return 0;
+    }
+    send(c[0], header, strlen(header), 0);
+    send(c[0], chunks, strlen(chunks), 0);
+    connection_t proxy   = {.fd = c[1]};
+    connection_t origin  = {.fd = o[0]};
+    request_t   *request = request_parse(http_message_recv_header(&proxy));
+    int          refused = 0;
+    if (request != NULL) {
+        request->client = &proxy;
+        refused         = request_send(request, &origin) == -1 &&
+                  request->client == &proxy;
+        request_free(request);
+    }
+    close_connection(&proxy);
+    close_connection(&origin);
+    close(c[0]);
+    close(o[1]);
+    return refused;
+}
+
+int main() {
+    int c[2], o[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, c) == -1 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, o) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+    connection_t proxy  = {.fd = c[1]};
+    connection_t origin = {.fd = o[0]};
+    char         buf[4096];
+
+    // Content-Length body, then a pipelined request
+    expect(forward(c[0], &proxy, &origin,
+                   "POST http://a.test/up HTTP/1.1\r\nHost: a.test\r\n"
+                   "Content-Length: 5\r\n\r\nhello"
+                   "GET http://a.test/next HTTP/1.1\r\nHost: a.test\r\n\r\n"),
+           0, "sent");
+    drain(o[1], buf, sizeof(buf));
+    expect(strncmp(buf, "POST /up HTTP/1.1\r\n", 19), 0, "request line");
+    expect(strstr(buf, "\r\n\r\nhello") != NULL, 1, "body streamed");
+    expect(strstr(buf, "GET") == NULL, 1, "stops at the body");
+    http_message_t *next = http_message_recv_header(&proxy);
+    expect(next != NULL &&
+               strcmp(http_message_get_header_line(next),
+                      "GET http://a.test/next HTTP/1.1") == 0,
+           1, "next request kept");
+    http_message_free(next);
+
+    // Chunked body
+    expect(forward(c[0], &proxy, &origin,
+                   "PUT http://a.test/up HTTP/1.1\r\nHost: a.test\r\n"
+                   "Transfer-Encoding: chunked\r\n\r\n"
+                   "3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n"),
+           0, "sent chunked");
+    drain(o[1], buf, sizeof(buf));
+    expect(strstr(buf, "\r\n\r\n3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n") != NULL, 1,
+           "chunks streamed");
+
+    // Expect: 100-continue is answered before the body is read
+    expect(forward(c[0], &proxy, &origin,
+                   "POST http://a.test/up HTTP/1.1\r\nHost: a.test\r\n"
+                   "Expect: 100-continue\r\nContent-Length: 2\r\n\r\nok"),
+           0, "sent with Expect");
+    expect(strcmp(drain(c[0], buf, sizeof(buf)),
+                  "HTTP/1.1 100 Continue\r\n\r\n"),
+           0, "100 Continue");
+    drain(o[1], buf, sizeof(buf));
+    expect(strstr(buf, "Expect") == NULL, 1, "Expect not forwarded");
+    expect(strstr(buf, "\r\n\r\nok") != NULL, 1, "body after 100");
+
+    // Malformed or oversized chunks in a request body
+    expect(stream_refused("zz\r\nGET http://a.test/smuggled HTTP/1.1\r\n"
+                          "Host: a.test\r\n\r\n"),
+           1, "malformed chunk size streamed");
+    expect(stream_refused("ffffffffffffffff\r\nabc\r\n0\r\n\r\n"), 1,
+           "oversized chunk streamed");
+    expect(stream_refused("3\r\nabcX\r\n0\r\n\r\n"), 1,
+           "chunk without its CRLF streamed");
+
+    // Lengths past 2 GB
+    const char *big3 =
+        "POST http://a.test/big HTTP/1.1\r\nHost: a.test\r\n"
+        "Content-Length: 3000000000\r\n\r\n";
+    send(c[0], big3, strlen(big3), 0);
+    http_message_t *big = http_message_recv_header(&proxy);
+    expect(big != NULL, 1, "3 GB body accepted");
+    if (big != NULL) {
+        expect(http_message_send(big, &origin), 0, "3 GB header sent");
+        expect(http_message_get_body_len(big), 3000000000LL, "3 GB length");
+        drain(o[1], buf, sizeof(buf));
+        expect(strstr(buf, "Content-Length: 3000000000\r\n") != NULL, 1,
+               "3 GB length forwarded");
+        http_message_free(big);
+    }
+    const char *big5 =
+        "POST http://a.test/big HTTP/1.1\r\nHost: a.test\r\n"
+        "Content-Length: 5000000000\r\n\r\n";
+    send(c[0], big5, strlen(big5), 0);
+    expect(http_message_recv_header(&proxy) == NULL, 1, "5 GB body refused");
+
+    // Absolute-form for a proxy
+    const char *get = "GET http://a.test:8080/p?q=1 HTTP/1.1\r\n"
+                      "Host: a.test:8080\r\n\r\n";
+    send(c[0], get, strlen(get), 0);
+    request_t *request = request_parse(http_message_recv_header(&proxy));
+    expect(request != NULL, 1, "proxied request parsed");
+    if (request != NULL) {
+        request->next_hop_proxy = 1;
+        expect(request_send(request, &origin), 0, "sent to a proxy");
+        drain(o[1], buf, sizeof(buf));
+        size_t line = strstr(get, "\r\n") + 2 - get;
+        expect(strncmp(buf, get, line), 0, "absolute-form");
+        request_free(request);
+    }
+
+    // Chunked responses
+    const char *chunks = "3;ext=1\r\nhel\r\n2\r\nlo\r\n0\r\n\r\n";
+    expect(recv_chunked(chunks, strlen(chunks)), 0, "chunks decoded");
+    const char *bad = "zz\r\nhello\r\n0\r\n\r\n";
+    expect(recv_chunked(bad, strlen(bad)), -1, "malformed chunk size");
+    const char *garbage = "5 x\r\nhello\r\n0\r\n\r\n";
+    expect(recv_chunked(garbage, strlen(garbage)), -1,
+           "garbage after the size");
+    const char *unframed = "5\r\nhelloXX0\r\n\r\n";
+    expect(recv_chunked(unframed, strlen(unframed)), -1,
+           "chunk without its CRLF");
+    char   huge[70100];
+    size_t huge_len = sprintf(huge, "10\r\n0123456789abcdef\r\n"
+                                    "fffffffffffffff0\r\n");
+    memset(huge + huge_len, 'x', 70000);
+    expect(recv_chunked(huge, huge_len + 70000), -1, "oversized chunk");
+
+    close(c[0]);
+    close(c[1]);
+    close(o[0]);
+    close(o[1]);
+    return test_report();
+}
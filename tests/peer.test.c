@@ -0,0 +1,57 @@
+/**
+ * @file peer.test.c
+ * @brief Test sibling peering on loopback: a sibling with a fresh copy is
+ * found, a miss is known as soon as every sibling answered, and a sibling
+ * that does not answer costs at most the timeout.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ */
+
+#include "peer.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "timer.h"
+
+int is_fresh(char *key) { return strcmp(key, "a.test/hit") == 0; }
+
+int main() {
+    expect(peer_query("a.test/hit") == NULL, 1, "no siblings");
+
+    // One sibling answering, one that is not there
+    int   responder_fd;
+    pid_t pid = peer_responder_start(18931, is_fresh, &responder_fd);
+    if (pid == -1) {
+        return 1;
+    }
+    expect(peer_load("127.0.0.1:18931"), 0, "load");
+    peer_t *peer = peer_query("a.test/hit");
+    expect(peer != NULL && peer->port == 18931, 1, "hit");
+
+    uint64_t start = timer_now_ms();
+    expect(peer_query("a.test/miss") == NULL, 1, "miss");
+    expect(timer_now_ms() - start < PEER_TIMEOUT_MS, 1, "miss without waiting");
+
+    expect(peer_load("127.0.0.1:18932"), 0, "load another");
+    expect(peer_query("a.test/hit") != NULL, 1, "hit with a sibling down");
+    start = timer_now_ms();
+    expect(peer_query("a.test/miss") == NULL, 1, "miss with a sibling down");
+    expect(timer_now_ms() - start >= PEER_TIMEOUT_MS, 1, "waited the timeout");
+
+    expect(peer_load("127.0.0.1"), -1, "no port");
+
+    // The responder stops once the proxy is gone
+    close(responder_fd);
+    expect(waitpid(pid, NULL, 0), pid, "responder exited");
+
+    return test_report();
+}
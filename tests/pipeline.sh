@@ -0,0 +1,48 @@
+
+# Requests/sec of one client as its pipeline depth grows: the same number of
+# cache misses sent over connections carrying depth pipelined GETs each, and
+# every response must come back
+# Needs an origin on 127.0.0.1:8124 serving a.txt, and nc
+# Usage: ./pipeline.sh [max_depth] [requests]
+max=${1:-16}
+requests=${2:-256}
+port=8008
+origin=127.0.0.1:8124
+
+cd ..
+[ -f blocklist ] || touch blocklist
+./main $port >/dev/null 2>&1 &
+proxy=$!
+sleep 1
+run=$$
+failed=0
+echo "depth  req/s"
+depth=1
+while [ $depth -le $max ]; do
+    out=$(mktemp)
+    start=$(date +%s.%N)
+    i=0
+    while [ $i -lt $requests ]; do
+        # One connection: depth GETs written at once, the last one closing it
+        n=$((requests - i < depth ? requests - i : depth))
+        j=0
+        while [ $j -lt $n ]; do
+            [ $j -eq $((n - 1)) ] && close='Connection: close\r\n' || close=
+            # A new query string per request, so each one is a cache miss
+            printf "GET http://$origin/a.txt?$run-$depth-$((i + j)) HTTP/1.1\r\nHost: $origin\r\n$close\r\n"
+            j=$((j + 1))
+        done | nc 127.0.0.1 $port >>$out
+        i=$((i + n))
+    done
+    end=$(date +%s.%N)
+    got=$(grep -c '^HTTP/1.1 200' $out)
+    rm -f $out
+    [ $got -eq $requests ] || failed=1
+    echo "$depth $start $end $requests $got" |
+        awk '{ printf "%5d  %5.0f%s\n", $1, $4 / ($3 - $2),
+               $5 == $4 ? "" : "  (" $5 " of " $4 " responses)" }'
+    depth=$((depth * 2))
+done
+kill -INT $proxy
+wait $proxy
+[ $failed -eq 0 ]
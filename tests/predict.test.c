@@ -0,0 +1,86 @@
+/**
+ * @file predict.test.c
+ * @brief Test predictive prefetching: learning which URL follows another,
+ * the confidence and time window needed to predict it, the bandwidth budget
+ * and the count of used predictions.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ */
+
+#include "predict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+int main() {
+    char     next[PREDICT_URL_MAX];
+    size_t   size;
+    uint64_t now = 1000000;
+    const char *a = "http://a.test/page/1", *b = "http://a.test/page/2",
+               *c = "http://a.test/other";
+
+    expect(predict_record("10.0.0.1", a, 100, now, next, &size), 0,
+           "record before init");
+    if (predict_init(1000) != 0) {
+        return 1;
+    }
+
+    // A is followed by B, but not often enough yet
+    for (int i = 0; i < PREDICT_MIN_SAMPLES - 1; i++) {
+        expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 0,
+               "too few samples");
+        predict_record("10.0.0.1", b, 300, now += 10, next, &size);
+    }
+    // Too late to count as following A
+    predict_record("10.0.0.1", a, 100, now += 10, next, &size);
+    predict_record("10.0.0.1", b, 300, now += PREDICT_WINDOW_MS + 1, next,
+                   &size);
+    expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 0,
+           "outside the window");
+    // Another client's requests don't follow this client's
+    predict_record("10.0.0.2", b, 300, now += 10, next, &size);
+    expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 0,
+           "other client");
+    predict_record("10.0.0.1", b, 300, now += 10, next, &size);
+    expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 1,
+           "enough samples");
+    expect(strcmp(next, b), 0, "next URL");
+    expect((int)size, 300, "next size");
+
+    // Confidence drops once A is as often followed by C
+    for (int i = 0; i < PREDICT_MIN_SAMPLES; i++) {
+        predict_record("10.0.0.1", c, 100, now += 10, next, &size);
+        predict_record("10.0.0.1", a, 100, now += 10, next, &size);
+    }
+    expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 0,
+           "low confidence");
+    for (int i = 0; i < 2 * PREDICT_MIN_SAMPLES; i++) {
+        predict_record("10.0.0.1", b, 300, now += 10, next, &size);
+        predict_record("10.0.0.1", a, 100, now += 10, next, &size);
+    }
+    expect(predict_record("10.0.0.1", a, 100, now += 10, next, &size), 1,
+           "confident again");
+
+    // Budget of 1000 bytes per second
+    expect(predict_spend("10.0.0.1", b, 600, now), 1, "within budget");
+    expect(predict_spend("10.0.0.1", b, 600, now), 0, "budget spent");
+    expect(predict_spend("10.0.0.1", b, 600, now + 500), 1, "refilled");
+
+    // The prediction for this client was used, the next one is wasted
+    long predicted, used;
+    predict_record("10.0.0.1", b, 300, now += 10, next, &size);
+    predict_record("10.0.0.1", a, 100, now += 10, next, &size);
+    predict_spend("10.0.0.1", b, 100, now += 1000);
+    predict_record("10.0.0.1", c, 100, now += 10, next, &size);
+    predict_stats(&predicted, &used);
+    expect(predicted, 3, "predicted");
+    expect(used, 1, "used");
+
+    return test_report();
+}
@@ -0,0 +1,93 @@
+/**
+ * @file prefetch.test.c
+ * @brief Test link prefetching: resolving relative links, finding the
+ * subresources of a page, and the limits on jobs and repeated links.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ */
+
+#include "prefetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+void expect_url(const char *base, const char *link, const char *want) {
+    char url[PREFETCH_URL_MAX];
+    int  rv = prefetch_resolve(base, link, strlen(link), url, sizeof(url));
+    if (want == NULL ? rv != -1 : rv != 0 || strcmp(url, want) != 0) {
+        fprintf(stderr, "%s + %s: got %s, expected %s\n", base, link,
+                rv == 0 ? url : "(none)", want == NULL ? "(none)" : want);
+        errors++;
+    }
+}
+
+int main() {
+    const char *base = "http://a.test:8080/dir/page.html?x=1";
+    expect_url(base, "img.png", "http://a.test:8080/dir/img.png");
+    expect_url(base, "./css/../img.png#top", "http://a.test:8080/dir/img.png");
+    expect_url(base, "../../../img.png", "http://a.test:8080/img.png");
+    expect_url(base, "/s.js?v=1&amp;w=2", "http://a.test:8080/s.js?v=1&w=2");
+    expect_url(base, "?y=2", "http://a.test:8080/dir/page.html?y=2");
+    expect_url(base, "//cdn.test/lib.js", "http://cdn.test/lib.js");
+    expect_url(base, " HTTPS://b.test/ ", "HTTPS://b.test/");
+    expect_url("http://a.test", "img.png", "http://a.test/img.png");
+    expect_url(base, "#top", NULL);
+    expect_url(base, "mailto:me@a.test", NULL);
+    expect_url(base, "data:image/png;base64,AAAA", NULL);
+
+    const char *html =
+        "<!DOCTYPE html><html><head>\n"
+        "<link rel=\"stylesheet\" href=\"style.css\">\n"
+        "<link href='/favicon.ico' rel='shortcut icon'>\n"
+        "<link rel=canonical href=page.html>\n"
+        "<!-- <img src=\"commented.png\"> -->\n"
+        "<script src=\"app.js\"></script>\n"
+        "<script>if (a<b) document.write('<img src=\"x.png\">');</script>\n"
+        "</head><body>\n"
+        "<a href=\"other.html\"><IMG SRC = logo.png alt=\"a > b\"></a>\n"
+        "<img src=\"logo.png\"><base href=\"http://c.test/\">\n"
+        "<img data-src=\"lazy.png\" src=\"photo.jpg\"/>\n"
+        "</body></html>\n";
+    char links[PREFETCH_LINKS_MAX][PREFETCH_URL_MAX];
+    int  n = prefetch_scan(html, strlen(html), base, links, PREFETCH_LINKS_MAX);
+    const char *want[] = {
+        "http://a.test:8080/dir/style.css",
+        "http://a.test:8080/favicon.ico",
+        "http://a.test:8080/dir/app.js",
+        "http://a.test:8080/dir/logo.png",
+        "http://c.test/photo.jpg",
+    };
+    expect(n, 5, "links found");
+    for (int i = 0; i < n && i < 5; i++) {
+        if (strcmp(links[i], want[i]) != 0) {
+            fprintf(stderr, "link %d: got %s, expected %s\n", i, links[i],
+                    want[i]);
+            errors++;
+        }
+    }
+    expect(prefetch_scan(html, strlen(html), base, links, 2), 2, "max links");
+
+    // Limits
+    expect(prefetch_begin(), 0, "job before init");
+    expect(prefetch_claim("http://a.test/", 100), 0, "claim before init");
+    if (prefetch_init(2) != 0) {
+        return 1;
+    }
+    expect(prefetch_begin(), 1, "first job");
+    expect(prefetch_begin(), 1, "second job");
+    expect(prefetch_begin(), 0, "third job");
+    prefetch_end();
+    expect(prefetch_begin(), 1, "job after one ended");
+    expect(prefetch_claim("http://a.test/", 100), 1, "claim");
+    expect(prefetch_claim("http://a.test/", 101), 0, "claimed again");
+    expect(prefetch_claim("http://a.test/", 100 + PREFETCH_SEEN_S), 1,
+           "claimed again later");
+
+    return test_report();
+}
@@ -0,0 +1,215 @@
+/**
+ * @file queue.test.c
+ * @brief Test the MPMC queue: several producers and consumers hand over every
+ * value exactly once, a closed queue wakes its blocked consumers. Then
+ * benchmark the handoff from one producer (the accept loop) to 1-8 blocking
+ * consumers against a mutex and condition variable queue.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-07
+ *
+ */
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEST_PRODUCERS 4
+#define TEST_CONSUMERS 4
+#define TEST_VALUES    400000 // Per producer
+#define TEST_CAPACITY  1024
+#define BENCH_VALUES   400000
+
+static queue_t       *queue;
+static unsigned char *seen;
+static int            errors;
+
+/**
+ * @brief Mutex and condition variable queue, the baseline
+ */
+typedef struct locked_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    int             values[TEST_CAPACITY];
+    size_t          head, len;
+    int             closed;
+} locked_queue_t;
+
+static locked_queue_t locked = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+int locked_push(int value) {
+    pthread_mutex_lock(&locked.lock);
+    if (locked.len == TEST_CAPACITY) {
+        pthread_mutex_unlock(&locked.lock);
+        return -1;
+    }
+    locked.values[(locked.head + locked.len++) % TEST_CAPACITY] = value;
+    pthread_cond_signal(&locked.not_empty);
+    pthread_mutex_unlock(&locked.lock);
+    return 0;
+}
+
+int locked_pop(int *value) {
+    pthread_mutex_lock(&locked.lock);
+    while (locked.len == 0 && !locked.closed) {
+        pthread_cond_wait(&locked.not_empty, &locked.lock);
+    }
+    if (locked.len == 0) {
+        pthread_mutex_unlock(&locked.lock);
+        return -1;
+    }
+    *value      = locked.values[locked.head];
+    locked.head = (locked.head + 1) % TEST_CAPACITY;
+    locked.len--;
+    pthread_mutex_unlock(&locked.lock);
+    return 0;
+}
+
+void locked_close() {
+    pthread_mutex_lock(&locked.lock);
+    locked.closed = 1;
+    pthread_cond_broadcast(&locked.not_empty);
+    pthread_mutex_unlock(&locked.lock);
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void *producer(void *arg) {
+    int base = (int)(size_t)arg * TEST_VALUES;
+    for (int i = 0; i < TEST_VALUES; i++) {
+        while (queue_push(queue, base + i) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void *consumer(void *arg) {
+    long long *sum = arg;
+    int        value;
+    while (queue_pop(queue, &value) == 0) {
+        if (value < 0 || value >= TEST_PRODUCERS * TEST_VALUES ||
+            seen[value]++ != 0) {
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+        }
+        *sum += value;
+    }
+    return NULL;
+}
+
+void *bench_consumer(void *arg) {
+    int value;
+    if (arg == NULL) {
+        while (queue_pop(queue, &value) == 0) {
+        }
+    } else {
+        while (locked_pop(&value) == 0) {
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Time BENCH_VALUES handoffs to the given number of consumers
+ *
+ * @return double Nanoseconds per handoff
+ */
+double bench(int consumers, int use_lock) {
+    pthread_t threads[8];
+    queue = queue_create(TEST_CAPACITY);
+    memset(&locked.values, 0, sizeof(locked.values));
+    locked.head = locked.len = locked.closed = 0;
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, bench_consumer,
+                       use_lock ? (void *)1 : NULL);
+    }
+    double start = now_ns();
+    for (int i = 0; i < BENCH_VALUES; i++) {
+        while ((use_lock ? locked_push(i) : queue_push(queue, i)) != 0) {
+            sched_yield();
+        }
+    }
+    if (use_lock) {
+        locked_close();
+    } else {
+        queue_close(queue);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+    queue_free(queue);
+    return elapsed / BENCH_VALUES;
+}
+
+int main() {
+    pthread_t threads[TEST_PRODUCERS + TEST_CONSUMERS];
+    long long sums[TEST_CONSUMERS] = {0};
+    seen  = calloc(TEST_PRODUCERS * TEST_VALUES, 1);
+    queue = queue_create(TEST_CAPACITY);
+
+    // Every value pushed comes out exactly once
+    for (int i = 0; i < TEST_CONSUMERS; i++) {
+        pthread_create(&threads[TEST_PRODUCERS + i], NULL, consumer, &sums[i]);
+    }
+    for (int i = 0; i < TEST_PRODUCERS; i++) {
+        pthread_create(&threads[i], NULL, producer, (void *)(size_t)i);
+    }
+    for (int i = 0; i < TEST_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    queue_close(queue);
+    long long sum = 0;
+    for (int i = 0; i < TEST_CONSUMERS; i++) {
+        pthread_join(threads[TEST_PRODUCERS + i], NULL);
+        sum += sums[i];
+    }
+    long long n = (long long)TEST_PRODUCERS * TEST_VALUES;
+    if (sum != n * (n - 1) / 2) {
+        fprintf(stderr, "Wrong sum %lld, expected %lld\n", sum, n * (n - 1) / 2);
+        errors++;
+    }
+    int value;
+    if (queue_try_pop(queue, &value) == 0 || queue_pop(queue, &value) == 0) {
+        fprintf(stderr, "Closed and drained queue returned a value\n");
+        errors++;
+    }
+    queue_free(queue);
+    free(seen);
+
+    // A full queue refuses the push
+    queue = queue_create(4);
+    for (int i = 0; i < 4; i++) {
+        queue_try_push(queue, i);
+    }
+    if (queue_try_push(queue, 4) == 0) {
+        fprintf(stderr, "Full queue accepted a value\n");
+        errors++;
+    }
+    queue_free(queue);
+
+    // Handoff cost and scaling with the number of consumers
+    printf("consumers  lock-free ns/op  mutex ns/op\n");
+    for (int consumers = 1; consumers <= 8; consumers *= 2) {
+        double lock_free = bench(consumers, 0);
+        double mutex     = bench(consumers, 1);
+        printf("%9d  %15.1f  %11.1f\n", consumers, lock_free, mutex);
+    }
+
+    printf("%d errors\n", errors);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
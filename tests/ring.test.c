@@ -0,0 +1,104 @@
+/**
+ * @file ring.test.c
+ * @brief Test the consistent-hash ring of parents: keys spread evenly,
+ * adding a parent moves only the keys it takes over, and the keys of a
+ * parent that is down go to the others until it comes back, also after an
+ * upgrade.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shm.h"
+#include "test.h"
+
+#define KEYS 20000
+
+/**
+ * @brief Map every test key to the port of its parent
+ */
+void map_keys(int *ports, time_t now) {
+    char key[64];
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "www.example.com/objects/%d.png", i);
+        ring_parent_t *parent = ring_lookup(key, now);
+        ports[i]              = parent != NULL ? parent->port : -1;
+    }
+}
+
+int main() {
+    static int before[KEYS], after[KEYS];
+
+    // The previous generation had a:8001 down until 50
+    ring_parent_t previous[RING_PARENTS_MAX] = {{"a", 8001, 50}};
+    int           fd = memfd_create("parents", 0);
+    char          env[32];
+    expect(write(fd, previous, sizeof(previous)), sizeof(previous),
+           "previous parents");
+    snprintf(env, sizeof(env), "parents:%d", fd);
+    setenv(SHM_ENV, env, 1);
+
+    expect(ring_lookup("www.example.com/", 100) == NULL, 1, "no parents");
+    expect(ring_load("a:8001"), 0, "load one");
+    expect(ring_lookup("www.example.com/", 10) == NULL, 1, "still down");
+    expect(ring_lookup("www.example.com/", 100)->port, 8001, "only parent");
+    expect(ring_load("a"), -1, "no port");
+
+    // Keys spread evenly
+    expect(ring_load("a:8001,b:8002,c:8003,d:8004"), 0, "load");
+    map_keys(before, 100);
+    int counts[4] = {0};
+    for (int i = 0; i < KEYS; i++) {
+        counts[before[i] - 8001]++;
+    }
+    for (int i = 0; i < 4; i++) {
+        expect(counts[i] > KEYS / 4 * 3 / 4 && counts[i] < KEYS / 4 * 5 / 4, 1,
+               "balanced");
+    }
+
+    // A fifth parent takes about a fifth of the keys, from every parent
+    expect(ring_load("a:8001,b:8002,c:8003,d:8004,e:8005"), 0, "load five");
+    map_keys(after, 100);
+    int moved = 0, elsewhere = 0;
+    for (int i = 0; i < KEYS; i++) {
+        moved += after[i] != before[i];
+        elsewhere += after[i] != before[i] && after[i] != 8005;
+    }
+    expect(moved > KEYS / 5 * 3 / 4 && moved < KEYS / 5 * 5 / 4, 1,
+           "about 1/N moved");
+    expect(elsewhere, 0, "moved only to the new parent");
+
+    // The keys of a parent that is down go to the others
+    ring_parent_t *e = ring_lookup("www.example.com/objects/0.png", 100);
+    for (int i = 0; i < KEYS && e->port != 8005; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "www.example.com/objects/%d.png", i);
+        e = ring_lookup(key, 100);
+    }
+    ring_set_down(e, 100);
+    map_keys(before, 101);
+    moved = elsewhere = 0;
+    for (int i = 0; i < KEYS; i++) {
+        moved += before[i] != after[i];
+        elsewhere += before[i] == 8005 || (after[i] != 8005 &&
+                                           before[i] != after[i]);
+    }
+    expect(moved > 0, 1, "keys of the down parent moved");
+    expect(elsewhere, 0, "only keys of the down parent moved");
+    map_keys(before, 100 + RING_RETRY_S);
+    expect(memcmp(before, after, sizeof(after)), 0, "back after the retry");
+
+    return test_report();
+}
@@ -0,0 +1,28 @@
+
+# Requests/sec per core as per-core workers are added (-c 1, 2, 4, ...)
+# Needs an origin on 127.0.0.1:8124 serving a.txt, and curl 7.66+ (-Z)
+# Usage: ./scaling.sh [max_cores] [requests] [concurrency]
+max=${1:-$(nproc)}
+requests=${2:-5000}
+concurrency=${3:-64}
+port=8008
+
+cd ..
+[ -f blocklist ] || touch blocklist
+echo "cores  req/s  req/s/core"
+cores=1
+while [ $cores -le $max ]; do
+    ./main -c $cores $port >/dev/null 2>&1 &
+    sleep 1
+    # Warm the cache, then time cache hits
+    curl -s -x 127.0.0.1:$port http://127.0.0.1:8124/a.txt >/dev/null
+    start=$(date +%s.%N)
+    curl -s -Z --parallel-max $concurrency -x 127.0.0.1:$port \
+        "http://127.0.0.1:8124/a.txt#[1-$requests]" >/dev/null 2>&1
+    end=$(date +%s.%N)
+    kill -INT $!
+    wait $!
+    echo "$cores $start $end $requests" |
+        awk '{ rps = $4 / ($3 - $2); printf "%5d  %5.0f  %10.0f\n", $1, rps, rps / $1 }'
+    cores=$((cores * 2))
+done
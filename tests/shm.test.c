@@ -0,0 +1,86 @@
+/**
+ * @file shm.test.c
+ * @brief Test the segments passed down on an upgrade: a segment of the same
+ * name and size is taken over with its contents, one whose size changed
+ * starts from zero, one only copied from is left to a new segment, and the
+ * segments mapped are exported for the next binary.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-17
+ *
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_SIZE 4096
+
+/**
+ * @brief Create a segment the way a previous generation would have
+ *
+ * @param value First int of the segment
+ * @return int Descriptor
+ */
+int previous_segment(int value) {
+    int fd = memfd_create("test", 0);
+    if (fd == -1 || ftruncate(fd, TEST_SIZE) == -1 ||
+        pwrite(fd, &value, sizeof(value), 0) != sizeof(value)) {
+        perror("memfd_create");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int main() {
+    char env[128];
+    int  kept = previous_segment(7), resized = previous_segment(8),
+        copied = previous_segment(9), unused = previous_segment(10);
+    snprintf(env, sizeof(env), "kept:%d,resized:%d,copied:%d,unused:%d", kept,
+             resized, copied, unused);
+    setenv(SHM_ENV, env, 1);
+
+    int *map = shm_map("kept", TEST_SIZE);
+    expect(map != NULL && map[0] == 7, 1, "taken over");
+    map = shm_map("resized", TEST_SIZE * 2);
+    expect(map != NULL && map[0] == 0, 1, "resized starts over");
+    int *previous = shm_previous("copied", TEST_SIZE);
+    expect(previous != NULL && previous[0] == 9, 1, "previous");
+    expect(fcntl(copied, F_GETFD) == -1, 1, "previous closed");
+    munmap(previous, TEST_SIZE);
+    map = shm_map("copied", TEST_SIZE);
+    expect(map != NULL && map[0] == 0, 1, "new after previous");
+    map[0] = 11;
+    expect(shm_previous("missing", TEST_SIZE) == NULL, 1, "missing");
+    expect(getenv(SHM_ENV) == NULL, 1, "environment read once");
+
+    shm_forget();
+    expect(fcntl(unused, F_GETFD) == -1, 1, "unused closed");
+    expect(fcntl(kept, F_GETFD), FD_CLOEXEC, "kept until exec");
+
+    // Exported, in the order mapped
+    shm_export();
+    char *list = getenv(SHM_ENV);
+    expect(list != NULL, 1, "exported");
+    int fds[3] = {-1, -1, -1};
+    expect(list != NULL && sscanf(list, "kept:%d,resized:%d,copied:%d",
+                                  &fds[0], &fds[1], &fds[2]) == 3,
+           1, "export list");
+    expect(fds[0], kept, "same descriptor");
+    expect(fcntl(fds[0], F_GETFD), 0, "survives exec");
+    int value = 0;
+    expect(pread(fds[2], &value, sizeof(value), 0), sizeof(value), "read");
+    expect(value, 11, "new segment exported");
+
+    return test_report();
+}
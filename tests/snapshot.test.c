@@ -0,0 +1,138 @@
+/**
+ * @file snapshot.test.c
+ * @brief Test cache snapshots: the hottest entries that fit are exported
+ * with their keys, an import recreates them under the same names with the
+ * age they had, entries that would be expired are left out, and unexpired
+ * entries already in the cache are kept.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "md5.h"
+#include "test.h"
+
+void hash(char *key, char *hash_str) {
+    uint8_t digest[16];
+    md5String(key, digest);
+    for (int i = 0; i < 16; i++) {
+        sprintf(hash_str + i * 2, "%02x", digest[i]);
+    }
+}
+
+/**
+ * @brief Store an entry as the proxy does, written at written_at and last
+ * read at read_at
+ */
+void store(const char *dir, char *key, const char *entry, time_t written_at,
+           time_t read_at) {
+    char hash_str[33], path[256];
+    hash(key, hash_str);
+    snprintf(path, sizeof(path), "%s/.%s", dir, hash_str);
+    FILE *f = fopen(path, "w");
+    fputs(key, f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/%s", dir, hash_str);
+    f = fopen(path, "w");
+    fputs(entry, f);
+    fclose(f);
+    struct timespec times[2] = {{.tv_sec = read_at}, {.tv_sec = written_at}};
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+/**
+ * @brief Get the age of the entry of a key in seconds, -1 if there is none
+ */
+long age(const char *dir, char *key) {
+    char        hash_str[33], path[256];
+    struct stat attr;
+    hash(key, hash_str);
+    snprintf(path, sizeof(path), "%s/%s", dir, hash_str);
+    return stat(path, &attr) == 0 ? (long)(time(NULL) - attr.st_mtime) : -1;
+}
+
+/**
+ * @brief Read the entry of a key, "" if there is none
+ */
+const char *load(const char *dir, char *key) {
+    static char entry[64];
+    char        hash_str[33], path[256];
+    hash(key, hash_str);
+    snprintf(path, sizeof(path), "%s/%s", dir, hash_str);
+    FILE *f  = fopen(path, "r");
+    entry[0] = '\0';
+    if (f != NULL) {
+        entry[fread(entry, 1, sizeof(entry) - 1, f)] = '\0';
+        fclose(f);
+    }
+    return entry;
+}
+
+int main() {
+    char from[] = "/tmp/snapshot.test.XXXXXX";
+    char to[]   = "/tmp/snapshot.test.XXXXXX";
+    if (mkdtemp(from) == NULL || mkdtemp(to) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    time_t now = time(NULL);
+    store(from, "a.test/hot", "hot entry", now - 3000, now);
+    store(from, "a.test/warm", "warm entry", now, now - 60);
+    store(from, "a.test/cold", "cold entry", now, now - 3600);
+    store(from, "a.test/empty", "", now, now);
+    char tls_dir[256];
+    snprintf(tls_dir, sizeof(tls_dir), "%s/.tls", from);
+    mkdir(tls_dir, 0700);
+
+    // The two hottest entries fit
+    char   *data;
+    size_t  len;
+    FILE   *out = open_memstream(&data, &len);
+    expect(snapshot_export(from, 3600, 20, out), 2, "exported");
+    fclose(out);
+
+    // Left out: entries that would be expired here
+    FILE *in = fmemopen(data, len, "r");
+    expect(snapshot_import(to, 60, in, hash), 1, "imported one");
+    fclose(in);
+    expect(strcmp(load(to, "a.test/hot"), ""), 0, "expired entry left out");
+
+    // Kept: an entry already in the cache
+    store(to, "a.test/warm", "newer entry", now, now);
+    in = fmemopen(data, len, "r");
+    expect(snapshot_import(to, 3600, in, hash), 1, "imported");
+    fclose(in);
+    expect(strcmp(load(to, "a.test/hot"), "hot entry"), 0, "hot entry");
+    expect(age(to, "a.test/hot") >= 3000 && age(to, "a.test/hot") < 3600, 1,
+           "age kept");
+    expect(strcmp(load(to, "a.test/warm"), "newer entry"), 0, "kept entry");
+    expect(strcmp(load(to, "a.test/cold"), ""), 0, "cold entry left out");
+
+    // Truncated or foreign streams
+    in = fmemopen(data, len - 4, "r");
+    expect(snapshot_import(to, 3600, in, hash), -1, "truncated");
+    fclose(in);
+    in = fmemopen("GET / HTTP/1.1\r\n", 16, "r");
+    expect(snapshot_import(to, 3600, in, hash), -1, "not a snapshot");
+    fclose(in);
+    free(data);
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s %s", from, to);
+    expect(system(command), 0, "clean up");
+
+    return test_report();
+}
@@ -0,0 +1,29 @@
+
+# Per-core workers with and without CPU steering (-c N vs -b -c N): mean
+# request latency and how many connections arrived on the accepting worker's CPU
+# Needs an origin on 127.0.0.1:8124 serving a.txt, and curl 7.66+ (-Z)
+# Usage: ./steering.sh [cores] [requests] [concurrency]
+cores=${1:-$(nproc)}
+requests=${2:-2000}
+concurrency=${3:-32}
+port=8008
+
+cd ..
+[ -f blocklist ] || touch blocklist
+log=$(mktemp)
+echo "mode      ms/req  local/accepted"
+for mode in "" "-b"; do
+    ./main $mode -c $cores $port >$log 2>&1 &
+    sleep 1
+    curl -s -x 127.0.0.1:$port http://127.0.0.1:8124/a.txt >/dev/null
+    ms=$(curl -s -Z --parallel-max $concurrency -x 127.0.0.1:$port \
+        -w "%{time_total}\n" -o /dev/null \
+        "http://127.0.0.1:8124/a.txt#[1-$requests]" 2>/dev/null |
+        awk '{ t += $1; n++ } END { if (n) printf "%.3f", t * 1000 / n }')
+    kill -INT $!
+    wait $!
+    sleep 1
+    local=$(awk '/arrived on its CPU/ { l += $4; a += $6 } END { print l "/" a }' $log)
+    printf "%-8s  %6s  %s\n" "${mode:-none}" "$ms" "$local"
+done
+rm -f $log
@@ -0,0 +1,44 @@
+/**
+ * @file test.h
+ * @brief Checks shared by the unit tests: every failed expectation is
+ * printed and counted, and test_report() prints the verdict.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+static int errors;
+
+/**
+ * @brief Count an error unless got equals want
+ *
+ * @param got Value computed
+ * @param want Value expected
+ * @param what What was checked
+ */
+static inline void expect(long long got, long long want, const char *what) {
+    if (got != want) {
+        fprintf(stderr, "%s: got %lld, expected %lld\n", what, got, want);
+        errors++;
+    }
+}
+
+/**
+ * @brief Print the number of errors and the verdict
+ *
+ * @return int Exit status of the test
+ */
+static inline int test_report(void) {
+    printf("%d errors\n", errors);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * @file timer.test.c
+ * @brief Test the timer wheel: timers spread over every level fire exactly on
+ * their expiry tick, cancelled timers never fire and re-armed timers fire at
+ * their new time.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-06
+ *
+ */
+
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_TIMERS 200000
+#define TEST_RANGE  (3 * 60 * 60 * 1000) // Up to 3 hours out
+
+static timer_node_t timers[TEST_TIMERS];
+static uint64_t     fired_at[TEST_TIMERS];
+static uint64_t     clock_ms;
+static int          errors;
+
+void on_expire(timer_node_t *timer, void *arg) {
+    (void)timer;
+    size_t i = (size_t)arg;
+    if (fired_at[i] != 0) {
+        fprintf(stderr, "Timer %zu fired twice\n", i);
+        errors++;
+    }
+    fired_at[i] = clock_ms;
+}
+
+int main() {
+    timer_wheel_t *wheel = malloc(sizeof(timer_wheel_t));
+    clock_ms             = 1000;
+    timer_wheel_init(wheel, clock_ms);
+    srand(42);
+    memset(timers, 0, sizeof(timers));
+
+    // Arm every timer, cancel one in ten and re-arm one in ten
+    for (size_t i = 0; i < TEST_TIMERS; i++) {
+        uint64_t expires = clock_ms + 1 + (uint64_t)rand() % TEST_RANGE;
+        timer_arm(wheel, &timers[i], expires, on_expire, (void *)i);
+    }
+    for (size_t i = 0; i < TEST_TIMERS; i += 10) {
+        timer_cancel(wheel, &timers[i]);
+    }
+    for (size_t i = 5; i < TEST_TIMERS; i += 10) {
+        uint64_t expires = clock_ms + 1 + (uint64_t)rand() % 1000;
+        timer_arm(wheel, &timers[i], expires, on_expire, (void *)i);
+    }
+    if (wheel->count != TEST_TIMERS - TEST_TIMERS / 10) {
+        fprintf(stderr, "Wrong timer count %zu\n", wheel->count);
+        errors++;
+    }
+
+    // Advance in uneven steps, sleeping as long as the wheel allows
+    while (clock_ms <= 1000 + TEST_RANGE + 1) {
+        int timeout = timer_wheel_timeout(wheel, clock_ms);
+        if (timeout < 0) {
+            break;
+        }
+        clock_ms += timeout > 0 ? timeout : 1;
+        timer_wheel_advance(wheel, clock_ms);
+    }
+
+    for (size_t i = 0; i < TEST_TIMERS; i++) {
+        if (i % 10 == 0) {
+            if (fired_at[i] != 0) {
+                fprintf(stderr, "Cancelled timer %zu fired\n", i);
+                errors++;
+            }
+        } else if (fired_at[i] != timers[i].expires) {
+            fprintf(stderr, "Timer %zu expected at %lu fired at %lu\n", i,
+                    (unsigned long)timers[i].expires,
+                    (unsigned long)fired_at[i]);
+            if (++errors > 10) {
+                break;
+            }
+        }
+    }
+    printf("%d timers left, %d errors\n", (int)wheel->count, errors);
+    free(wheel);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
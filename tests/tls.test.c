@@ -0,0 +1,209 @@
+/**
+ * @file tls.test.c
+ * @brief Test origin TLS against a loopback server with a self-signed
+ * certificate: the first connection does a full handshake, the next ones
+ * must resume the session from the on-disk cache, also from a forked process
+ * as in fork mode. A server that stops answering must hit the deadline
+ * instead of hanging the reader.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-04
+ *
+ */
+
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_CONNECTIONS 3   // The last one from a forked process
+#define TEST_STALL_MS    200 // Deadline of the stalled connection
+
+static SSL_CTX *server_ctx;
+static int      server_fd;
+
+/**
+ * @brief Create a self-signed certificate for 127.0.0.1 and write it to
+ * cert_path so the client can trust it
+ */
+int make_server_ctx(const char *cert_path) {
+    EVP_PKEY *key  = EVP_RSA_gen(2048);
+    X509     *cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_EXTENSION *ext =
+        X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, "IP:127.0.0.1");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    X509_sign(cert, key, EVP_sha256());
+
+    FILE *f = fopen(cert_path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    PEM_write_X509(f, cert);
+    fclose(f);
+
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server_ctx, cert);
+    SSL_CTX_use_PrivateKey(server_ctx, key);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+/**
+ * @brief Answer each connection with one line, except the extra last one,
+ * which gets no reply until the client gives up
+ */
+void *serve(void *arg) {
+    (void)arg;
+    for (int i = 0; i <= TEST_CONNECTIONS; i++) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        SSL *ssl = SSL_new(server_ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            char buf[64];
+            if (SSL_read(ssl, buf, sizeof(buf)) > 0) {
+                if (i == TEST_CONNECTIONS) {
+                    while (SSL_read(ssl, buf, sizeof(buf)) > 0) {
+                    }
+                } else {
+                    SSL_write(ssl, "pong\n", 5);
+                }
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connect to the server, exchange a line and check that only the
+ * first connection does a full handshake
+ *
+ * @return int 0 on success, 1 on failure
+ */
+int ping(int port, int i) {
+    connection_t connection;
+    memset(&connection, 0, sizeof(connection));
+    if (connect_to_hostname("127.0.0.1", port, &connection) != 0 ||
+        tls_connect(&connection, "127.0.0.1", port) != 0) {
+        fprintf(stderr, "Error: Connection %d failed\n", i);
+        return 1;
+    }
+    int reused = tls_session_reused(&connection);
+    // TLS 1.3 tickets arrive after the handshake, read the reply so the
+    // session reaches the cache before closing
+    char    buf[64];
+    ssize_t n;
+    send_to_connection(&connection, "ping\n", 5);
+    n = recv_from_connection(&connection, buf, sizeof(buf) - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    printf("Connection %d: %s, reply %s", i,
+           reused ? "resumed" : "full handshake", buf);
+    close_connection(&connection);
+    return strcmp(buf, "pong\n") != 0 || reused != (i > 0);
+}
+
+/**
+ * @brief Connect to the stalled server and check that the read gives up at
+ * the deadline
+ *
+ * @return int 0 on success, 1 on failure
+ */
+int stall(int port) {
+    connection_t connection;
+    memset(&connection, 0, sizeof(connection));
+    if (connect_to_hostname("127.0.0.1", port, &connection) != 0 ||
+        tls_connect(&connection, "127.0.0.1", port) != 0) {
+        fprintf(stderr, "Error: Stalled connection failed\n");
+        return 1;
+    }
+    char buf[64];
+    connection_set_deadline(&connection, TEST_STALL_MS);
+    send_to_connection(&connection, "ping\n", 5);
+    ssize_t n = recv_from_connection(&connection, buf, sizeof(buf));
+    int     expired = connection_expired(&connection);
+    printf("Stalled connection: read %s\n",
+           n < 0 && expired ? "timed out" : "did not time out");
+    connection_set_deadline(&connection, -1);
+    close_connection(&connection);
+    return n >= 0 || !expired;
+}
+
+int main() {
+    char cache_dir[] = "/tmp/tls.test.XXXXXX";
+    char cert_path[64];
+    if (mkdtemp(cache_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(cert_path, sizeof(cert_path), "%s/cert.pem", cache_dir);
+    if (make_server_ctx(cert_path) != 0) {
+        fprintf(stderr, "Error: Failed to create the test certificate\n");
+        return 1;
+    }
+
+    // Loopback server on an ephemeral port
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t          len  = sizeof(addr);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    server_fd               = socket(AF_INET, SOCK_STREAM, 0);
+    bind(server_fd, (struct sockaddr *)&addr, sizeof(addr));
+    listen(server_fd, TEST_CONNECTIONS + 1);
+    getsockname(server_fd, (struct sockaddr *)&addr, &len);
+    int       port = ntohs(addr.sin_port);
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, NULL);
+
+    if (tls_init(cache_dir, cert_path) != 0) {
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < TEST_CONNECTIONS - 1; i++) {
+        failed |= ping(port, i);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        exit(ping(port, TEST_CONNECTIONS - 1));
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        failed = 1;
+    }
+    failed |= stall(port);
+    pthread_join(thread, NULL);
+    close(server_fd);
+    tls_free();
+    SSL_CTX_free(server_ctx);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
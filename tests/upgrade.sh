@@ -0,0 +1,28 @@
+
+# Upgrade the running proxy (SIGUSR2) while clients keep connecting, and count
+# the requests that failed across the handover
+# Needs an origin on 127.0.0.1:8124 serving a.txt
+# Usage: ./upgrade.sh [proxy options...]
+port=8008
+requests=500
+
+cd ..
+[ -f blocklist ] || touch blocklist
+./main "$@" $port >/dev/null 2>&1 &
+old=$!
+sleep 1
+failed=0
+i=0
+while [ $i -lt $requests ]; do
+    curl -s -f -o /dev/null -x 127.0.0.1:$port http://127.0.0.1:8124/a.txt ||
+        failed=$((failed + 1))
+    # Upgrade halfway through
+    [ $i -eq $((requests / 2)) ] && kill -USR2 $old
+    i=$((i + 1))
+done
+wait $old
+new=$(pgrep -o -x main)
+echo "old generation $old exited, new generation ${new:-missing}"
+echo "$failed of $requests requests failed"
+[ -n "$new" ] && kill -INT $new
+[ $failed -eq 0 ] && [ -n "$new" ]
@@ -0,0 +1,131 @@
+/**
+ * @file workpool.test.c
+ * @brief Test the work-stealing pool: a recursive task tree (tasks submitting
+ * and waiting for subtasks) adds up right and detached tasks all run. Then
+ * measure how hashing many cache-entry sized blocks scales from 1 to 64
+ * threads.
+ *
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @version 0.1
+ * @date 2023-05-08
+ *
+ */
+
+#include "md5.h"
+#include "workpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEST_FIB        24    // fib(24) = 46368 leaves, ~75k tasks
+#define TEST_DETACHED   10000 // Fire-and-forget tasks
+#define BENCH_BLOCKS    2048  // Blocks hashed per run
+#define BENCH_BLOCK_LEN 16384 // Bytes per block
+
+static workpool_t *pool;
+static int         errors;
+
+typedef struct fib_job {
+    int  n;
+    long result;
+} fib_job_t;
+
+void fib(void *arg) {
+    fib_job_t *job = arg;
+    if (job->n < 2) {
+        job->result = job->n;
+        return;
+    }
+    fib_job_t       left = {.n = job->n - 1}, right = {.n = job->n - 2};
+    workpool_task_t task = {.fn = fib, .arg = &left};
+    workpool_submit(pool, &task);
+    fib(&right);
+    workpool_wait(pool, &task);
+    job->result = left.result + right.result;
+}
+
+void count(void *arg) { __atomic_fetch_add((int *)arg, 1, __ATOMIC_RELAXED); }
+
+static uint8_t *blocks;
+static uint8_t  digests[BENCH_BLOCKS][16];
+
+void hash_block(void *arg) {
+    size_t     i = (size_t)arg;
+    MD5Context ctx;
+    md5Init(&ctx);
+    md5Update(&ctx, blocks + i * BENCH_BLOCK_LEN, BENCH_BLOCK_LEN);
+    md5Finalize(&ctx);
+    memcpy(digests[i], ctx.digest, 16);
+}
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    // Nested tasks, waited for from inside the pool
+    pool = workpool_create(4);
+    fib_job_t       root = {.n = TEST_FIB};
+    workpool_task_t task = {.fn = fib, .arg = &root};
+    workpool_submit(pool, &task);
+    workpool_wait(pool, &task);
+    if (root.result != 46368) {
+        fprintf(stderr, "fib(%d) = %ld, expected 46368\n", TEST_FIB,
+                root.result);
+        errors++;
+    }
+
+    // Detached tasks are all run before the pool goes away
+    int ran = 0;
+    for (int i = 0; i < TEST_DETACHED; i++) {
+        workpool_spawn(pool, count, &ran);
+    }
+    workpool_free(pool);
+    if (ran != TEST_DETACHED) {
+        fprintf(stderr, "%d of %d detached tasks ran\n", ran, TEST_DETACHED);
+        errors++;
+    }
+
+    // Scaling with the number of threads
+    blocks = malloc((size_t)BENCH_BLOCKS * BENCH_BLOCK_LEN);
+    for (size_t i = 0; i < (size_t)BENCH_BLOCKS * BENCH_BLOCK_LEN; i++) {
+        blocks[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+    workpool_task_t *tasks = calloc(BENCH_BLOCKS, sizeof(workpool_task_t));
+    uint8_t          first[16];
+    double           base = 0;
+    printf("threads  seconds  MB/s     speedup\n");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        pool         = workpool_create(threads);
+        double start = now_s();
+        for (size_t i = 0; i < BENCH_BLOCKS; i++) {
+            tasks[i] = (workpool_task_t){.fn = hash_block, .arg = (void *)i};
+            workpool_submit(pool, &tasks[i]);
+        }
+        for (size_t i = 0; i < BENCH_BLOCKS; i++) {
+            workpool_wait(pool, &tasks[i]);
+        }
+        double elapsed = now_s() - start;
+        workpool_free(pool);
+        if (threads == 1) {
+            base = elapsed;
+            memcpy(first, digests[BENCH_BLOCKS - 1], 16);
+        } else if (memcmp(first, digests[BENCH_BLOCKS - 1], 16) != 0) {
+            fprintf(stderr, "Digest differs with %d threads\n", threads);
+            errors++;
+        }
+        printf("%7d  %7.3f  %7.1f  %7.2f\n", threads, elapsed,
+               BENCH_BLOCKS * (BENCH_BLOCK_LEN / 1e6) / elapsed,
+               base / elapsed);
+    }
+    free(tasks);
+    free(blocks);
+
+    printf("%d errors\n", errors);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}